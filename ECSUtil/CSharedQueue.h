@@ -293,4 +293,290 @@ namespace ecs_sdk
 		}
 	};
 
+	/////////////////////////////////////////////////////////
+	// Bounded lock-free multi-producer/multi-consumer queue
+	//
+	// Ring buffer variant of CSharedQueue (Vyukov sequence-per-cell algorithm).
+	// Push and pop never take the queue lock and never allocate. The capacity is
+	// fixed at construction (rounded up to a power of 2).
+	// Since the ring has no stable elements, there is no front() or iterators:
+	// pop_front returns the element. Events linked with CSharedQueueEvent are
+	// triggered in batches: on the empty/non-empty transitions and then once
+	// every dwSignalBatch operations, so the event list is not scanned on every push and pop.
+	// Because of the batching, a consumer waiting on a linked event must wait with a timeout
+	// and check the queue again. pop_front_wait never misses a push.
+	template<class T> class CSharedRingQueue : public CSharedQueueEventBase
+	{
+	public:
+		typedef bool(*TEST_ABORT_CB)(void* pContext);
+	private:
+		struct RING_CELL
+		{
+			volatile LONGLONG llSequence;		// sequence number of the element that can be stored (or read) here next
+			T Value;
+			RING_CELL()
+				: llSequence(0)
+			{}
+		};
+		std::unique_ptr<RING_CELL[]> pRing;
+		LONGLONG llMask;						// capacity - 1
+		DWORD dwSignalBatch;					// trigger linked events once per this many operations
+		char Pad0[64];
+		volatile LONGLONG llEnqueuePos;			// next position to push. kept on its own cache line
+		char Pad1[64 - sizeof(LONGLONG)];
+		volatile LONGLONG llDequeuePos;			// next position to pop. kept on its own cache line
+		char Pad2[64 - sizeof(LONGLONG)];
+		volatile LONG lPushSinceSignal;			// pushes since the last push trigger
+		volatile LONG lPopSinceSignal;			// pops since the last pop trigger
+		volatile LONG lWaitingProducers;		// number of threads waiting in WaitForQueue
+		volatile LONG lWaitingConsumers;		// number of threads waiting in pop_front_wait
+		CEvent evNotFull;						// set on pop if there are waiting producers
+		CEvent evNotEmpty;						// set on push if there are waiting consumers
+
+		bool TryPush(T& rec)
+		{
+			LONGLONG llPos = ReadAcquire64(&llEnqueuePos);
+			for (;;)
+			{
+				RING_CELL& Cell = pRing[(size_t)(llPos & llMask)];
+				LONGLONG llDiff = ReadAcquire64(&Cell.llSequence) - llPos;
+				if (llDiff == 0)
+				{
+					LONGLONG llPrev = InterlockedCompareExchange64(&llEnqueuePos, llPos + 1, llPos);
+					if (llPrev == llPos)
+					{
+						Cell.Value = std::move(rec);
+						WriteRelease64(&Cell.llSequence, llPos + 1);
+						return true;
+					}
+					llPos = llPrev;
+				}
+				else if (llDiff < 0)
+					return false;						// full
+				else
+					llPos = ReadAcquire64(&llEnqueuePos);
+			}
+		}
+
+		bool TryPop(T& rec)
+		{
+			LONGLONG llPos = ReadAcquire64(&llDequeuePos);
+			for (;;)
+			{
+				RING_CELL& Cell = pRing[(size_t)(llPos & llMask)];
+				LONGLONG llDiff = ReadAcquire64(&Cell.llSequence) - (llPos + 1);
+				if (llDiff == 0)
+				{
+					LONGLONG llPrev = InterlockedCompareExchange64(&llDequeuePos, llPos + 1, llPos);
+					if (llPrev == llPos)
+					{
+						rec = std::move(Cell.Value);
+						Cell.Value = T();				// release anything still held by the cell
+						WriteRelease64(&Cell.llSequence, llPos + llMask + 1);
+						return true;
+					}
+					llPos = llPrev;
+				}
+				else if (llDiff < 0)
+					return false;						// empty
+				else
+					llPos = ReadAcquire64(&llDequeuePos);
+			}
+		}
+
+		// after a successful push, trigger the linked events if the queue was empty
+		// or if a full batch of pushes has gone by without a trigger
+		void SignalPush(DWORD dwCountBefore)
+		{
+			// full barrier: either the waiting consumer sees the new element or this sees the consumer
+			if (InterlockedCompareExchange(&lWaitingConsumers, 0, 0) > 0)
+				VERIFY(evNotEmpty.SetEvent());
+			if ((dwCountBefore == 0) || ((DWORD)InterlockedIncrement(&lPushSinceSignal) >= dwSignalBatch))
+			{
+				(void)InterlockedExchange(&lPushSinceSignal, 0);
+				TriggerEvent(dwCountBefore, TRIGGEREVENTS_PUSH);
+			}
+		}
+
+		void SignalPop(DWORD dwCountBefore)
+		{
+			if (ReadAcquire(&lWaitingProducers) > 0)
+				VERIFY(evNotFull.SetEvent());
+			if ((dwCountBefore <= 1) || ((DWORD)InterlockedIncrement(&lPopSinceSignal) >= dwSignalBatch))
+			{
+				(void)InterlockedExchange(&lPopSinceSignal, 0);
+				TriggerEvent(dwCountBefore, TRIGGEREVENTS_POP);
+			}
+		}
+
+		// wait for the queue to go to or below dwMaxQueueSize and for there to be room in the ring
+		// returns false if pTestAbort says to give up
+		bool WaitForQueue(unsigned int dwMaxQueueSize, TEST_ABORT_CB pTestAbort, void* pContext)
+		{
+			bool bRet = true;
+			(void)InterlockedIncrement(&lWaitingProducers);
+			for (;;)
+			{
+				DWORD dwCount = GetCount();
+				if ((dwCount < GetCapacity()) && ((dwMaxQueueSize == 0) || (dwCount <= dwMaxQueueSize)))
+					break;
+				if (pTestAbort != nullptr)					// check if we are supposed to shut down
+					if (pTestAbort(pContext))
+					{
+						bRet = false;
+						break;
+					}
+				CSingleLock lockNotFull(&evNotFull);
+				(void)lockNotFull.Lock(SECONDS(1));
+				if (lockNotFull.IsLocked())
+					VERIFY(lockNotFull.Unlock());
+			}
+			// evNotFull is auto-reset: pass the wakeup on to the next waiting producer
+			if (InterlockedDecrement(&lWaitingProducers) > 0)
+				VERIFY(evNotFull.SetEvent());
+			return bRet;
+		}
+
+		bool PushInternal(T& rec, unsigned int dwMaxQueueSize, TEST_ABORT_CB pTestAbort, void* pContext)
+		{
+			for (;;)
+			{
+				if ((dwMaxQueueSize > 0) && (GetCount() > dwMaxQueueSize))
+					if (!WaitForQueue(dwMaxQueueSize, pTestAbort, pContext))
+						return false;
+				DWORD dwCountBefore = GetCount();
+				if (TryPush(rec))
+				{
+					SignalPush(dwCountBefore);
+					return true;
+				}
+				// ring is full. if the count says otherwise, a consumer is part way through a pop
+				if (GetCount() < GetCapacity())
+					(void)SwitchToThread();
+				else if (!WaitForQueue(dwMaxQueueSize, pTestAbort, pContext))
+					return false;
+			}
+		}
+
+	public:
+		CSharedRingQueue(DWORD dwCapacity = 1024, DWORD dwSignalBatchParam = 16)
+			: llMask(0)
+			, dwSignalBatch((dwSignalBatchParam == 0) ? 1 : dwSignalBatchParam)
+			, llEnqueuePos(0)
+			, llDequeuePos(0)
+			, lPushSinceSignal(0)
+			, lPopSinceSignal(0)
+			, lWaitingProducers(0)
+			, lWaitingConsumers(0)
+		{
+			LONGLONG llCapacity = 2;
+			while (llCapacity < (LONGLONG)dwCapacity)
+				llCapacity <<= 1;
+			llMask = llCapacity - 1;
+			pRing.reset(new RING_CELL[(size_t)llCapacity]);
+			for (LONGLONG i = 0; i < llCapacity; i++)
+				pRing[(size_t)i].llSequence = i;
+		};
+
+		virtual ~CSharedRingQueue()
+		{
+		};
+
+		CSharedRingQueue(const CSharedRingQueue&) = delete;
+		CSharedRingQueue& operator=(const CSharedRingQueue&) = delete;
+
+		DWORD GetCapacity() const
+		{
+			return (DWORD)(llMask + 1);
+		}
+
+		// the count is a snapshot. other threads may be pushing or popping
+		DWORD GetCount() const
+		{
+			LONGLONG llDequeue = ReadAcquire64(const_cast<volatile LONGLONG*>(&llDequeuePos));
+			LONGLONG llEnqueue = ReadAcquire64(const_cast<volatile LONGLONG*>(&llEnqueuePos));
+			return (llEnqueue > llDequeue) ? (DWORD)(llEnqueue - llDequeue) : 0;
+		};
+
+		size_t size() const
+		{
+			return GetCount();
+		};
+
+		bool empty() const
+		{
+			return GetCount() == 0;
+		};
+
+		// push_back
+		// if dwMaxQueueSize != 0, wait for the queue to get to or below dwMaxQueueSize first
+		// if the ring is full, wait for room
+		// returns false (and nothing is pushed) only if pTestAbort aborted the wait
+		bool push_back(const T& rec, unsigned int dwMaxQueueSize = 0, TEST_ABORT_CB pTestAbort = nullptr, void* pContext = nullptr)
+		{
+			T Copy(rec);
+			return PushInternal(Copy, dwMaxQueueSize, pTestAbort, pContext);
+		}
+
+		bool push_back(T&& rec, unsigned int dwMaxQueueSize = 0, TEST_ABORT_CB pTestAbort = nullptr, void* pContext = nullptr)
+		{
+			return PushInternal(rec, dwMaxQueueSize, pTestAbort, pContext);
+		}
+
+		// try_push_back
+		// never waits. returns false if the ring is full
+		bool try_push_back(T&& rec)
+		{
+			DWORD dwCountBefore = GetCount();
+			if (!TryPush(rec))
+				return false;
+			SignalPush(dwCountBefore);
+			return true;
+		}
+
+		// pop_front
+		// returns false if the queue is empty
+		bool pop_front(T& rec)
+		{
+			DWORD dwCountBefore = GetCount();
+			if (!TryPop(rec))
+				return false;
+			SignalPop(dwCountBefore);
+			return true;
+		}
+
+		// pop_front_wait
+		// wait up to dwTimeout ms for an element. returns false if there still isn't one
+		bool pop_front_wait(T& rec, DWORD dwTimeout)
+		{
+			if (pop_front(rec))
+				return true;
+			(void)InterlockedIncrement(&lWaitingConsumers);
+			// check again now that producers can see this thread waiting
+			bool bRet = pop_front(rec);
+			if (!bRet && (dwTimeout != 0))
+			{
+				CSingleLock lockNotEmpty(&evNotEmpty);
+				(void)lockNotEmpty.Lock(dwTimeout);
+				if (lockNotEmpty.IsLocked())
+					VERIFY(lockNotEmpty.Unlock());
+				bRet = pop_front(rec);
+			}
+			// evNotEmpty is auto-reset: pass the wakeup on if another consumer is waiting and there is more
+			if ((InterlockedDecrement(&lWaitingConsumers) > 0) && !empty())
+				VERIFY(evNotEmpty.SetEvent());
+			return bRet;
+		}
+
+		void clear()
+		{
+			T rec;
+			while (TryPop(rec))
+				;
+			if (ReadAcquire(&lWaitingProducers) > 0)
+				VERIFY(evNotFull.SetEvent());
+			TriggerEvent(GetCount(), TRIGGEREVENTS_EMPTY);
+		}
+	};
+
 } // end namespace ecs_sdk
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2017 - 2022, Dell Technologies, Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "stdafx.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <nmmintrin.h>
+#endif
+#include "CrcChecksum.h"
+
+namespace ecs_sdk
+{
+
+	// both CRCs are reflected, start with all ones and XOR the output with all ones
+	const ULONGLONG CRC32C_POLY = 0x82F63B78ULL;					// 0x1EDC6F41 reflected
+	const ULONGLONG CRC32C_MASK = 0xFFFFFFFFULL;
+	const ULONGLONG CRC64NVME_POLY = 0x9A6C9329AC4BC9B5ULL;			// 0xAD93D23594C93659 reflected
+	const ULONGLONG CRC64NVME_MASK = 0xFFFFFFFFFFFFFFFFULL;
+
+	// slice-by-8 tables and the x^(2^n) table used to combine CRCs
+	// x^(2^n) mod p(x) is not periodic in the width of the CRC (for CRC32C, x^(2^31) = x, so the period is 31),
+	// so both tables have an entry for every bit of a 64 bit length
+	struct CRC_TABLES
+	{
+		UINT Crc32c[8][256];
+		ULONGLONG Crc64[8][256];
+		ULONGLONG Crc32cX2n[64];
+		ULONGLONG Crc64X2n[64];
+		bool bHardwareCRC32C;
+
+		CRC_TABLES();
+	};
+
+	// MultModP
+	// multiply a(x) by b(x) modulo p(x). the polynomials are reflected so bit (uWidth - 1) is x^0
+	// a must not be zero
+	static ULONGLONG MultModP(ULONGLONG a, ULONGLONG b, ULONGLONG ullPoly, UINT uWidth)
+	{
+		ULONGLONG m = 1ULL << (uWidth - 1);
+		ULONGLONG p = 0ULL;
+		for (;;)
+		{
+			if (a & m)
+			{
+				p ^= b;
+				if ((a & (m - 1)) == 0)
+					break;
+			}
+			m >>= 1;
+			b = (b & 1) ? ((b >> 1) ^ ullPoly) : (b >> 1);
+		}
+		return p;
+	}
+
+	// X2nModP
+	// return x^(n * 2^k) modulo p(x)
+	// pX2nTable has 64 entries. n is a byte count and k is 3 (bits), so k never gets past 63 for any real length
+	static ULONGLONG X2nModP(ULONGLONG n, UINT k, const ULONGLONG *pX2nTable, ULONGLONG ullPoly, UINT uWidth)
+	{
+		ULONGLONG p = 1ULL << (uWidth - 1);			// x^0
+		while (n != 0ULL)
+		{
+			if (n & 1)
+				p = MultModP(pX2nTable[k & 63], p, ullPoly, uWidth);
+			n >>= 1;
+			k++;
+		}
+		return p;
+	}
+
+	CRC_TABLES::CRC_TABLES()
+		: bHardwareCRC32C(false)
+	{
+		for (UINT n = 0; n < 256; n++)
+		{
+			ULONGLONG c32 = n, c64 = n;
+			for (UINT k = 0; k < 8; k++)
+			{
+				c32 = (c32 & 1) ? ((c32 >> 1) ^ CRC32C_POLY) : (c32 >> 1);
+				c64 = (c64 & 1) ? ((c64 >> 1) ^ CRC64NVME_POLY) : (c64 >> 1);
+			}
+			Crc32c[0][n] = (UINT)c32;
+			Crc64[0][n] = c64;
+		}
+		for (UINT n = 0; n < 256; n++)
+		{
+			for (UINT k = 1; k < 8; k++)
+			{
+				Crc32c[k][n] = (Crc32c[k - 1][n] >> 8) ^ Crc32c[0][Crc32c[k - 1][n] & 0xff];
+				Crc64[k][n] = (Crc64[k - 1][n] >> 8) ^ Crc64[0][Crc64[k - 1][n] & 0xff];
+			}
+		}
+		// x^1, x^2, x^4, x^8, ...
+		ULONGLONG p = 1ULL << 30;
+		Crc32cX2n[0] = p;
+		for (UINT n = 1; n < _countof(Crc32cX2n); n++)
+			Crc32cX2n[n] = p = MultModP(p, p, CRC32C_POLY, 32);
+		p = 1ULL << 62;
+		Crc64X2n[0] = p;
+		for (UINT n = 1; n < _countof(Crc64X2n); n++)
+			Crc64X2n[n] = p = MultModP(p, p, CRC64NVME_POLY, 64);
+#if defined(_M_X64) || defined(_M_IX86)
+		int CpuInfo[4];
+		__cpuid(CpuInfo, 1);
+		bHardwareCRC32C = (CpuInfo[2] & (1 << 20)) != 0;		// SSE 4.2
+#endif
+	}
+
+	static const CRC_TABLES CrcTables;
+
+	// Crc32cSoftware
+	// slice-by-8. ullCrc is the running CRC (without the output XOR)
+	static ULONGLONG Crc32cSoftware(ULONGLONG ullCrc, const BYTE *pData, size_t uLen)
+	{
+		UINT uCrc = (UINT)ullCrc;
+		while (uLen >= 8)
+		{
+			UINT uLow, uHigh;
+			memcpy(&uLow, pData, sizeof(uLow));
+			memcpy(&uHigh, pData + 4, sizeof(uHigh));
+			uLow ^= uCrc;
+			uCrc = CrcTables.Crc32c[7][uLow & 0xff] ^ CrcTables.Crc32c[6][(uLow >> 8) & 0xff]
+				^ CrcTables.Crc32c[5][(uLow >> 16) & 0xff] ^ CrcTables.Crc32c[4][uLow >> 24]
+				^ CrcTables.Crc32c[3][uHigh & 0xff] ^ CrcTables.Crc32c[2][(uHigh >> 8) & 0xff]
+				^ CrcTables.Crc32c[1][(uHigh >> 16) & 0xff] ^ CrcTables.Crc32c[0][uHigh >> 24];
+			pData += 8;
+			uLen -= 8;
+		}
+		while (uLen-- > 0)
+			uCrc = CrcTables.Crc32c[0][(uCrc ^ *pData++) & 0xff] ^ (uCrc >> 8);
+		return uCrc;
+	}
+
+#if defined(_M_X64) || defined(_M_IX86)
+	// Crc32cHardware
+	// SSE 4.2 CRC32 instruction. ullCrc is the running CRC (without the output XOR)
+	static ULONGLONG Crc32cHardware(ULONGLONG ullCrc, const BYTE *pData, size_t uLen)
+	{
+		// get to an 8 byte boundary
+		while ((uLen > 0) && (((ULONG_PTR)pData & 7) != 0))
+		{
+			ullCrc = _mm_crc32_u8((UINT)ullCrc, *pData++);
+			uLen--;
+		}
+#ifdef _M_X64
+		while (uLen >= 8)
+		{
+			ullCrc = _mm_crc32_u64(ullCrc, *(const unsigned __int64 *)pData);
+			pData += 8;
+			uLen -= 8;
+		}
+#endif
+		while (uLen >= 4)
+		{
+			ullCrc = _mm_crc32_u32((UINT)ullCrc, *(const UINT *)pData);
+			pData += 4;
+			uLen -= 4;
+		}
+		while (uLen-- > 0)
+			ullCrc = _mm_crc32_u8((UINT)ullCrc, *pData++);
+		return ullCrc;
+	}
+#endif
+
+	// Crc64Software
+	// slice-by-8. ullCrc is the running CRC (without the output XOR)
+	static ULONGLONG Crc64Software(ULONGLONG ullCrc, const BYTE *pData, size_t uLen)
+	{
+		while (uLen >= 8)
+		{
+			ULONGLONG ullWord;
+			memcpy(&ullWord, pData, sizeof(ullWord));
+			ullWord ^= ullCrc;
+			ullCrc = CrcTables.Crc64[7][ullWord & 0xff] ^ CrcTables.Crc64[6][(ullWord >> 8) & 0xff]
+				^ CrcTables.Crc64[5][(ullWord >> 16) & 0xff] ^ CrcTables.Crc64[4][(ullWord >> 24) & 0xff]
+				^ CrcTables.Crc64[3][(ullWord >> 32) & 0xff] ^ CrcTables.Crc64[2][(ullWord >> 40) & 0xff]
+				^ CrcTables.Crc64[1][(ullWord >> 48) & 0xff] ^ CrcTables.Crc64[0][ullWord >> 56];
+			pData += 8;
+			uLen -= 8;
+		}
+		while (uLen-- > 0)
+			ullCrc = CrcTables.Crc64[0][(ullCrc ^ *pData++) & 0xff] ^ (ullCrc >> 8);
+		return ullCrc;
+	}
+
+	CCrcChecksum::CCrcChecksum(E_CHECKSUM_TYPE CrcTypeParam)
+		: CrcType(CrcTypeParam)
+		, ullCrc(0ULL)
+		, ullLength(0ULL)
+	{
+		ASSERT(CrcType != E_CHECKSUM_TYPE::MD5);
+	}
+
+	void CCrcChecksum::Reset(void)
+	{
+		ullCrc = 0ULL;					// CRC of no data
+		ullLength = 0ULL;
+	}
+
+	void CCrcChecksum::Reset(E_CHECKSUM_TYPE CrcTypeParam)
+	{
+		ASSERT(CrcTypeParam != E_CHECKSUM_TYPE::MD5);
+		CrcType = CrcTypeParam;
+		Reset();
+	}
+
+	void CCrcChecksum::AddData(const BYTE *pData, size_t uLen)
+	{
+		if (uLen == 0)
+			return;
+		if (CrcType == E_CHECKSUM_TYPE::CRC64NVME)
+			ullCrc = Crc64Software(ullCrc ^ CRC64NVME_MASK, pData, uLen) ^ CRC64NVME_MASK;
+		else
+		{
+#if defined(_M_X64) || defined(_M_IX86)
+			if (CrcTables.bHardwareCRC32C)
+				ullCrc = Crc32cHardware(ullCrc ^ CRC32C_MASK, pData, uLen) ^ CRC32C_MASK;
+			else
+#endif
+				ullCrc = Crc32cSoftware(ullCrc ^ CRC32C_MASK, pData, uLen) ^ CRC32C_MASK;
+		}
+		ullLength += uLen;
+	}
+
+	void CCrcChecksum::AddData(const CBuffer& DataBuf)
+	{
+		AddData(DataBuf.GetData(), DataBuf.GetBufSize());
+	}
+
+	// Combine
+	// CRC(A + B) = CRC(A) * x^(8 * len(B)) mod p(x) + CRC(B)
+	void CCrcChecksum::Combine(const CCrcChecksum& Next)
+	{
+		ASSERT(Next.CrcType == CrcType);
+		if (Next.ullLength == 0ULL)
+			return;
+		if (CrcType == E_CHECKSUM_TYPE::CRC64NVME)
+		{
+			if (ullCrc != 0ULL)
+				ullCrc = MultModP(X2nModP(Next.ullLength, 3, CrcTables.Crc64X2n, CRC64NVME_POLY, 64), ullCrc, CRC64NVME_POLY, 64);
+		}
+		else
+		{
+			if (ullCrc != 0ULL)
+				ullCrc = MultModP(X2nModP(Next.ullLength, 3, CrcTables.Crc32cX2n, CRC32C_POLY, 32), ullCrc, CRC32C_POLY, 32);
+		}
+		ullCrc ^= Next.ullCrc;
+		ullLength += Next.ullLength;
+	}
+
+	void CCrcChecksum::SetCrc(ULONGLONG ullCrcParam, ULONGLONG ullLengthParam)
+	{
+		ullCrc = (CrcType == E_CHECKSUM_TYPE::CRC64NVME) ? ullCrcParam : (ullCrcParam & CRC32C_MASK);
+		ullLength = ullLengthParam;
+	}
+
+	// SetHashData
+	// load a CRC saved with GetHashData. returns false if it is the wrong size for this CRC type
+	bool CCrcChecksum::SetHashData(const CBuffer& Hash, ULONGLONG ullLengthParam)
+	{
+		DWORD dwSize = (CrcType == E_CHECKSUM_TYPE::CRC64NVME) ? 8 : 4;
+		if (Hash.GetBufSize() != dwSize)
+			return false;
+		ULONGLONG ullValue = 0ULL;
+		for (DWORD i = 0; i < dwSize; i++)
+			ullValue = (ullValue << 8) | Hash.GetData()[i];
+		SetCrc(ullValue, ullLengthParam);
+		return true;
+	}
+
+	void CCrcChecksum::GetHashData(CBuffer& Hash) const
+	{
+		DWORD dwSize = (CrcType == E_CHECKSUM_TYPE::CRC64NVME) ? 8 : 4;
+		Hash.SetBufSize(dwSize);
+		for (DWORD i = 0; i < dwSize; i++)
+			Hash.GetData()[i] = (BYTE)(ullCrc >> ((dwSize - 1 - i) * 8));
+	}
+
+	CString CCrcChecksum::EncodeBase64(void) const
+	{
+		CBuffer Hash;
+		GetHashData(Hash);
+		return Hash.EncodeBase64();
+	}
+
+	LPCTSTR CCrcChecksum::GetHeaderName(void) const
+	{
+		return (CrcType == E_CHECKSUM_TYPE::CRC64NVME) ? _T("x-amz-checksum-crc64nvme") : _T("x-amz-checksum-crc32c");
+	}
+
+	LPCTSTR CCrcChecksum::GetAlgorithmName(void) const
+	{
+		return (CrcType == E_CHECKSUM_TYPE::CRC64NVME) ? _T("CRC64NVME") : _T("CRC32C");
+	}
+
+	bool CCrcChecksum::IfHardwareCRC32C(void)
+	{
+		return CrcTables.bHardwareCRC32C;
+	}
+
+} // end namespace ecs_sdk
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2017 - 2022, Dell Technologies, Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#pragma once
+
+#include "exportdef.h"
+#include "cbuffer.h"
+
+namespace ecs_sdk
+{
+
+	// integrity checksum used for uploads and downloads
+	enum class E_CHECKSUM_TYPE : unsigned char
+	{
+		MD5,					// Content-MD5 / ETag (CCngAES_GCM)
+		CRC32C,					// x-amz-checksum-crc32c
+		CRC64NVME,				// x-amz-checksum-crc64nvme
+	};
+
+	// CCrcChecksum
+	// CRC32C (Castagnoli) and CRC64/NVME as used by the S3 x-amz-checksum-* headers
+	// CRC32C uses the SSE 4.2 CRC32 instruction if the CPU has it, otherwise both use slice-by-8 tables
+	// the CRC of a whole object can be built from the CRCs of its parts (Combine), so parts can be
+	// checksummed separately, in any order, and put together at the end
+	class ECSUTIL_EXT_CLASS CCrcChecksum
+	{
+	private:
+		E_CHECKSUM_TYPE CrcType;		// CRC32C or CRC64NVME
+		ULONGLONG ullCrc;				// CRC of the data so far (final form, with the output XOR applied)
+		ULONGLONG ullLength;			// number of bytes in the CRC
+
+	public:
+		explicit CCrcChecksum(E_CHECKSUM_TYPE CrcTypeParam = E_CHECKSUM_TYPE::CRC32C);
+
+		// start over with no data. optionally switch the CRC type
+		void Reset(void);
+		void Reset(E_CHECKSUM_TYPE CrcTypeParam);
+
+		// add data to the CRC
+		void AddData(const BYTE *pData, size_t uLen);
+		void AddData(const CBuffer& DataBuf);
+
+		// append the CRC of the data that immediately follows this data
+		void Combine(const CCrcChecksum& Next);
+
+		// set the CRC directly, such as a part CRC that was saved earlier
+		void SetCrc(ULONGLONG ullCrcParam, ULONGLONG ullLengthParam);
+		bool SetHashData(const CBuffer& Hash, ULONGLONG ullLengthParam);
+
+		ULONGLONG GetCrc(void) const
+		{
+			return ullCrc;
+		}
+		ULONGLONG GetLength(void) const
+		{
+			return ullLength;
+		}
+		E_CHECKSUM_TYPE GetType(void) const
+		{
+			return CrcType;
+		}
+
+		// CRC in network byte order (4 bytes for CRC32C, 8 bytes for CRC64NVME)
+		void GetHashData(CBuffer& Hash) const;
+		// base64 of the CRC in network byte order. this is the format of the x-amz-checksum-* headers
+		CString EncodeBase64(void) const;
+		// x-amz-checksum-crc32c or x-amz-checksum-crc64nvme
+		LPCTSTR GetHeaderName(void) const;
+		// CRC32C or CRC64NVME (for x-amz-checksum-algorithm)
+		LPCTSTR GetAlgorithmName(void) const;
+
+		// true if CRC32C is done using the CPU CRC32 instruction
+		static bool IfHardwareCRC32C(void);
+	};
+
+} // end namespace ecs_sdk
@@ -25,6 +25,7 @@
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
+#include <random>
 #include <VersionHelpers.h>
 #include "generic_defs.H"
 #include "XmlLiteUtil.h"
@@ -32,6 +33,7 @@
 #include "UriUtils.h"
 #include "NTERRTXT.H"
 #include "ECSConnection.h"
+#include "S3V4Canonical.h"
 #include "GetAllThreads.h"
 
 #pragma comment(lib, "Winhttp.lib")
@@ -45,16 +47,19 @@ namespace ecs_sdk
 #define ECS_CONN_WINHTTP_CALLBACK_FLAGS (WINHTTP_CALLBACK_FLAG_ALL_COMPLETIONS | WINHTTP_CALLBACK_FLAG_SECURE_FAILURE | WINHTTP_CALLBACK_FLAG_HANDLES)
 
 bool CECSConnection::bInitialized = false;						// starts out false. If false, timeouts are very short. must call SetInitialized to get regular timeouts
+CECSConnection::THROTTLE_REC CECSConnection::ProcessThrottle;		// limit for all CECSConnection objects together
 std::map<CString, CECSConnection::THROTTLE_REC> CECSConnection::ThrottleMap;	// global map used by all CECSConnection objects
-CCriticalSection CECSConnection::csThrottleMap;				// critical section protecting ThrottleMap
-std::list<CECSConnection *> CECSConnection::ECSConnectionList;			// list of all CECSConnection objects (protected by csThrottleMap)
-CECSConnection::CThrottleTimerThread CECSConnection::TimerThread;	// throttle timer thread
+std::map<CString, CECSConnection::THROTTLE_REC> CECSConnection::BucketThrottleMap;	// key is host name/bucket
+CSimpleRWLock CECSConnection::rwlThrottleMap;					// lock protecting ThrottleMap and BucketThrottleMap
+bool CECSConnection::bThrottleFairShare = false;				// process, host and bucket limits are shared by weight
+CCriticalSection CECSConnection::csECSConnectionList;			// critical section protecting ECSConnectionList
+std::list<CECSConnection *> CECSConnection::ECSConnectionList;			// list of all CECSConnection objects (protected by csECSConnectionList)
 DWORD CECSConnection::dwGlobalHttpsProtocol = 0;
 DWORD CECSConnection::dwS3BucketListingMax = 1000;					// maxiumum number of items to return on a bucket listing (S3). Default = 1000 (cannot be larger than 1000)
 
-CCriticalSection CECSConnection::csBadIPMap;
-std::map<CECSConnection::BAD_IP_KEY,CECSConnection::BAD_IP_ENTRY> CECSConnection::BadIPMap;		// protected by csBadIPMap
-std::map<CString,UINT> CECSConnection::LoadBalMap;										// protected by csBadIPMap
+CSimpleRWLock CECSConnection::rwlNodeHealth;
+std::map<CString,std::shared_ptr<CECSConnection::HOST_HEALTH>> CECSConnection::NodeHealthMap;	// protected by rwlNodeHealth
+CECSConnection::E_NODE_SELECT CECSConnection::NodeSelect = CECSConnection::E_NODE_SELECT::PowerOfTwo;
 std::list<CECSConnection::XML_DIR_LISTING_CONTEXT *> CECSConnection::DirListList;	// listing of current dir listing operations
 CCriticalSection CECSConnection::csDirListList;				// critical section protecting DirListList
 CCriticalSection CECSConnection::csSessionMap;
@@ -70,6 +75,8 @@ std::list<CECSConnection::GLOBAL_PERF_POINTERS> CECSConnection::GlobalPerfList;
 DWORD CECSConnection::dwMaxRetryCount(MaxRetryCount);				// max retries for HTTP command
 DWORD CECSConnection::dwPauseBetweenRetries(500);					// pause between retries (millisec)
 DWORD CECSConnection::dwPauseAfter500Error(500);					// pause between retries after HTTP 500 error (millisec)
+std::shared_ptr<CBackoffRetryPolicy> CECSConnection::pDefaultRetryPolicy(std::make_shared<CBackoffRetryPolicy>());
+DWORD CECSConnection::dwCopyPartThreads(DefaultCopyPartThreads);	// max multipart copy parts (CopyS3) in flight at the same time
 
 static LPCWSTR SystemMDInit[] =
 {
@@ -422,77 +429,74 @@ bool CECSConnection::WaitStreamSend(STREAM_CONTEXT *pStreamSend, const CSharedQu
 	return false;
 }
 
-CECSConnection::CThrottleTimerThread::CThrottleTimerThread()
+// ClearRewind
+// start of a new request. forget anything sent before
+void CECSConnection::STREAM_CONTEXT::ClearRewind(void)
 {
-	ZeroFT(ftLast);
+	RewindList.clear();
+	ullRewindSize = 0ULL;
+	bRewindOverflow = false;
+	(void)InterlockedExchange(&lRewindEntries, 0);
 }
 
-CECSConnection::CThrottleTimerThread::~CThrottleTimerThread()
+// SaveRewind
+// an entry has been sent. hang on to it in case the request needs to be retried
+void CECSConnection::STREAM_CONTEXT::SaveRewind(const STREAM_DATA_ENTRY& Entry)
 {
-	KillThreadWait();
-};
-
-void CECSConnection::CThrottleTimerThread::DoWork()
-{
-	if (dwEventRet != WAIT_TIMEOUT)
+	if ((ullRewindMax == 0ULL) || bRewindOverflow)
 		return;
-	FILETIME ftNow;
+	ullRewindSize += Entry.Data.GetBufSize();
+	if (ullRewindSize > ullRewindMax)
+	{
+		// too much data. it can't be retried any more, so don't hold on to the memory
+		RewindList.clear();
+		ullRewindSize = 0ULL;
+		bRewindOverflow = true;
+		(void)InterlockedExchange(&lRewindEntries, 0);
+		return;
+	}
+	RewindList.push_back(Entry);
+	(void)InterlockedIncrement(&lRewindEntries);
+}
 
-	GetSystemTimeAsFileTime(&ftNow);
-	ULARGE_INTEGER LastTime;
-	if (IfFTZero(ftLast))
-		LastTime.QuadPart = FT_SECONDS(1);
+// PushReceive
+// queue received data for the consumer: on pReceiveRing if it is set, otherwise on StreamData
+void CECSConnection::STREAM_CONTEXT::PushReceive(const STREAM_DATA_ENTRY& Entry, unsigned int dwMaxQueueSize, CSharedQueue<STREAM_DATA_ENTRY>::TEST_ABORT_CB pTestAbort, void *pContext)
+{
+	if (pReceiveRing != nullptr)
+		(void)pReceiveRing->push_back(Entry, dwMaxQueueSize, pTestAbort, pContext);
 	else
-		LastTime.QuadPart = FTtoULarge(ftNow).QuadPart - FTtoULarge(ftLast).QuadPart;
-	ftLast = ftNow;
-	std::map<CString,CECSConnection::THROTTLE_REC>::iterator itMap;
-	CSingleLock lock(&csThrottleMap, true);
-	for (itMap=CECSConnection::ThrottleMap.begin() ; itMap!=CECSConnection::ThrottleMap.end() ; ++itMap)
+		StreamData.push_back(Entry, dwMaxQueueSize, pTestAbort, pContext);
+}
+
+// Rewind
+// put everything that was sent back at the front of the queue so it can be sent again
+// returns false if the sent data wasn't all saved
+bool CECSConnection::STREAM_CONTEXT::Rewind(void)
+{
+	if (!IfRewindable())
+		return false;
 	{
-		if (itMap->second.Upload.iBytesSec != 0)
-		{
-			int iBytesSec = (int)((itMap->second.Upload.iBytesSec * LastTime.QuadPart)/FT_SECONDS(1));
-			itMap->second.Upload.iBytesCurInterval += iBytesSec;		// add it in case the current count was negative, which indicates that in the previous second someone sent too many bytes, we'll make up for it now
-			if (itMap->second.Upload.iBytesCurInterval > iBytesSec)
-				itMap->second.Upload.iBytesCurInterval = iBytesSec;
-		}
-		else
-			itMap->second.Upload.iBytesCurInterval = 0;
-		if (itMap->second.Download.iBytesSec != 0)
-		{
-			int iBytesSec = (int)((itMap->second.Download.iBytesSec * LastTime.QuadPart)/FT_SECONDS(1));
-			itMap->second.Download.iBytesCurInterval += iBytesSec;		// add it in case the current count was negative, which indicates that in the previous second someone sent too many bytes, we'll make up for it now
-			if (itMap->second.Download.iBytesCurInterval > iBytesSec)
-				itMap->second.Download.iBytesCurInterval = iBytesSec;
-		}
-		else
-			itMap->second.Download.iBytesCurInterval = 0;
-		// now notify any current objects waiting for this moment
-		std::list<CECSConnection *>::iterator itList;
-		for (itList = CECSConnection::ECSConnectionList.begin() ; itList != CECSConnection::ECSConnectionList.end() ; ++itList)
-		{
-			if ((*itList)->sHost == itMap->first)
-			{
-				CSimpleRWLockAcquire lockStateMap(&(*itList)->StateList.rwlStateMap, false);
-				std::map<DWORD,std::shared_ptr<CECSConnectionState>>::iterator itStateMap;
-				for (itStateMap = (*itList)->StateList.StateMap.begin(); itStateMap != (*itList)->StateList.StateMap.end(); ++itStateMap)
-					VERIFY(itStateMap->second->evThrottle.SetEvent());
-			}
-		}
+		CRWLockAcquire lockQueue(&StreamData.GetLock(), true);			// write lock
+		for (std::deque<STREAM_DATA_ENTRY>::reverse_iterator itRewind = RewindList.rbegin(); itRewind != RewindList.rend(); ++itRewind)
+			StreamData.push_front(*itRewind);
 	}
+	RewindList.clear();
+	ullRewindSize = 0ULL;
+	(void)InterlockedExchange(&lRewindEntries, 0);
+	return true;
 }
 
-bool CECSConnection::CThrottleTimerThread::InitInstance()
+// used where a class method can't be used
+static bool ThrottleAbortCB(void *pContext)
 {
-	SetCycleTime(SECONDS(1));
-	ZeroFT(ftLast);
-	return true;		// return FALSE to abort the thread
+	return ((CECSConnection *)pContext)->TestAbort();
 }
 
 CECSConnection::CECSConnection()
 {
 	ZeroFT(ftS3V4SigningKey);
-	CSingleLock lock(&csThrottleMap, true);
+	CSingleLock lock(&csECSConnectionList, true);
 	ECSConnectionList.push_back(this);
 }
 
@@ -543,14 +547,14 @@ void CECSConnection::SetHttpsProtocol(DWORD dwHttpsProtocolParam)
 CECSConnection::~CECSConnection()
 {
 	CloseAll();
-	CSingleLock lock(&csThrottleMap, true);
+	CSingleLock lock(&csECSConnectionList, true);
 	ECSConnectionList.remove(this);
 }
 
 CECSConnection::CECSConnection(const CECSConnection& Rec)
 {
 	*this = Rec;
-	CSingleLock lock(&csThrottleMap, true);
+	CSingleLock lock(&csECSConnectionList, true);
 	ECSConnectionList.push_back(this);
 }
 
@@ -904,6 +908,8 @@ void CECSConnection::CreateS3SigningKey(
 //		<CanonicalHeaders>\n
 //		<SignedHeaders>\n
 //		<HashedPayload>
+// the canonical request and string to sign are built by a per-thread CS3V4Canonical, which reuses its buffers
+// so signing doesn't allocate, other than the returned strings
 CString CECSConnection::signRequestS3v4(
 	const CString& secretStr,
 	const CString& method,
@@ -918,137 +924,37 @@ CString CECSConnection::signRequestS3v4(
 	CString& sPreviousSignature,
 	const SYSTEMTIME& stRequestTime)
 {
+	static thread_local CS3V4Canonical V4Canonical;
 	CString sAuthorization;
 	try
 	{
 		// first get a hash of the payload
-		CCngAES_GCM DataHash;
-		CBuffer Hash;
-		CString sPayloadHash;
+		LPCSTR pszPayloadHash = "";
 		switch (PayloadType)
 		{
 		case E_S3_V4_PAYLOAD::Signed:
 		{
-			CBuffer PayloadHash;
-			DataHash.CreateHash(BCRYPT_SHA256_ALGORITHM);
-			if ((pData != nullptr) && (dwDataLen != 0))
-				DataHash.AddHashData((const BYTE *)pData, dwDataLen);
-			else
-				DataHash.AddHashData((const BYTE *)"", 0);
-			DataHash.GetHashData(PayloadHash);
-			sPayloadHash = BinaryToHexString(PayloadHash);
-			AddHeader(_T("x-amz-content-sha256"), sPayloadHash);
+			pszPayloadHash = V4Canonical.HashPayload(pData, dwDataLen);
+			AddHeader(_T("x-amz-content-sha256"), CString(pszPayloadHash));
 		}
 		break;
 		case E_S3_V4_PAYLOAD::Chunked:
 		{
 			AddHeader(_T("x-amz-decoded-content-length"), FmtNum(ullTotalPayloadLen));
 			AddHeader(_T("content-encoding"), _T("aws-chunked"));
-			sPayloadHash = _T("STREAMING-AWS4-HMAC-SHA256-PAYLOAD");
-			AddHeader(_T("x-amz-content-sha256"), sPayloadHash);
+			pszPayloadHash = "STREAMING-AWS4-HMAC-SHA256-PAYLOAD";
+			AddHeader(_T("x-amz-content-sha256"), _T("STREAMING-AWS4-HMAC-SHA256-PAYLOAD"));
 		}
 		break;
 		case E_S3_V4_PAYLOAD::Unsigned:
 		{
-			sPayloadHash = _T("UNSIGNED-PAYLOAD");
+			pszPayloadHash = "UNSIGNED-PAYLOAD";
 		}
 		break;
 		default:
 			ASSERT(false);
 			break;
 		}
-		// split out the query string before the UriDecode because the resource may have a '?'
-		CString sTempResource, sFullQuery;
-		int iQuery = resource.Find(_T("?"));
-		if (iQuery >= 0)
-		{
-			sFullQuery = resource.Mid(iQuery + 1);
-			sTempResource = resource.Left(iQuery);
-		}
-		else
-			sTempResource = resource;
-		// make sure the resource is encoded for v4
-		sTempResource = UriEncode(UriDecode(sTempResource), E_URI_ENCODE::V4Auth);
-
-		//		<HTTPMethod>\n
-		CString sCanonical(method);
-		sCanonical.MakeUpper();
-		sCanonical += _T("\n");
-		//		<CanonicalURI>\n
-		if (sTempResource.IsEmpty())
-			sTempResource = _T("/");
-		sCanonical += sTempResource + _T("\n");
-		//		<CanonicalQueryString>
-		if (!sFullQuery.IsEmpty())
-		{
-			CString sQuery;
-			// each query separated by '&'
-			// each query of form: var=value
-			int iPosQuery = 0;
-			std::map<CString, CString> QueryMap;
-			for (;;)
-			{
-				sQuery = sFullQuery.Tokenize(_T("&"), iPosQuery);
-				if (sQuery.IsEmpty())
-					break;
-				int iEquals = sQuery.Find(_T('='));
-				std::pair<std::map<CString, CString>::iterator, bool> ret;
-				if (iEquals >= 0)
-					ret = QueryMap.insert(std::make_pair(UriEncode(UriDecode(sQuery.Left(iEquals)), E_URI_ENCODE::V4AuthSlash), UriEncode(UriDecode(sQuery.Mid(iEquals + 1)), E_URI_ENCODE::V4AuthSlash)));
-				else
-					ret = QueryMap.insert(std::make_pair(UriEncode(UriDecode(sQuery), E_URI_ENCODE::V4AuthSlash), _T("")));
-				ASSERT(ret.second);
-			}
-			for (std::map<CString, CString>::const_iterator itMap = QueryMap.begin(); itMap != QueryMap.end(); ++itMap)
-			{
-				if (itMap != QueryMap.begin())
-					sCanonical += _T("&");
-				sCanonical += itMap->first + _T("=") + itMap->second;
-			}
-		}
-		sCanonical += _T("\n");
-		//		<CanonicalHeaders>\n
-		//		<SignedHeaders>\n
-		CString sSignedHeaders;
-		for (std::map<CString, HEADER_STRUCT>::const_iterator itMap = headers.begin(); itMap != headers.end(); ++itMap)
-		{
-			CString sLabel(itMap->first), sValue(itMap->second.sContents);
-			sLabel.Trim();
-			sValue.Trim();
-			// now get rid of multiple spaces
-			int iBlank;
-			while ((iBlank = sValue.Find(_T("  "))) >= 0)
-				(void)sValue.Delete(iBlank);
-			// the 'range' header seems to be very odd when using V4 auth
-			// on AWS it seems put just "range:" in the canoical list, instead of putting the byte range
-			// on ECS it just seems to always fail if it is included (range:bytes 0-43) for reading the IV in an encrypted object
-			if (sLabel == _T("range"))
-				continue;
-			if (!sSignedHeaders.IsEmpty())
-				sSignedHeaders += _T(";");
-			sSignedHeaders += sLabel;
-			sCanonical += sLabel + _T(":") + sValue + _T("\n");
-		}
-		sCanonical += _T("\n") + sSignedHeaders + _T("\n");
-		//		<HashedPayload>
-		sCanonical += sPayloadHash;
-		// create StringToSign
-		//	"AWS4-HMAC-SHA256" + \n" +
-		//	timeStampISO8601Format + "\n" +
-		//	<Scope> +"\n" +
-		//	Hex(SHA256Hash(<CanonicalRequest>))
-		CString sStringToSign(_T("AWS4-HMAC-SHA256\n")), sStr;
-//		sStringToSign += GetCanonicalTime(&stRequestTime) + _T("\n");
-		sStringToSign += FormatISO8601Date(stRequestTime, false, false, true) + _T("\n");
-		sStr.Format(_T("%04d%02d%02d/%s/s3/aws4_request\n"), stRequestTime.wYear, stRequestTime.wMonth, stRequestTime.wDay, (LPCTSTR)sS3Region);
-		sStringToSign += sStr;
-		DataHash.CreateHash(BCRYPT_SHA256_ALGORITHM);
-		CAnsiString AnsiCanonical;
-		AnsiCanonical.Set(sCanonical, -1, CP_UTF8);
-		AnsiCanonical.SetBufSize((DWORD)strlen(AnsiCanonical));
-		DataHash.AddHashData(AnsiCanonical);
-		DataHash.GetHashData(Hash);
-		sStringToSign += BinaryToHexString(Hash);
 		// check if we have a signing key already created for this host
 		{
 			CSimpleRWLockAcquire lockRead(&lwrS3V4SigningKey, false);				// get read lock
@@ -1067,19 +973,14 @@ CString CECSConnection::signRequestS3v4(
 		if (S3SigningKey.IsEmpty())
 			CreateS3SigningKey(secretStr, stRequestTime, S3SigningKey);
 
-		// sign the sStringToSign
-		CAnsiString StringToSign(sStringToSign);
-		StringToSign.SetBufSize((DWORD)strlen(StringToSign));
-		CBuffer Signature;
-		DataHash.CreateHash(BCRYPT_SHA256_ALGORITHM, S3SigningKey);
-		DataHash.AddHashData(StringToSign);
-		DataHash.GetHashData(Signature);
+		// build the canonical request and the string to sign, and sign it
+		V4Canonical.Sign(method, resource, headers, pszPayloadHash, stRequestTime, sS3Region, S3SigningKey.GetData(), S3SigningKey.GetBufSize());
 
-		CString sSignature(BinaryToHexString(Signature));
+		CString sSignature(V4Canonical.GetSignature());
 		sPreviousSignature = sSignature;
 		// format date into yyyyMMdd for the Authorization header
 		sAuthorization.Format(_T("AWS4-HMAC-SHA256 Credential=%s/%04u%02u%02u/%s/s3/aws4_request,SignedHeaders=%s,Signature=%s"),
-			(LPCTSTR)sS3KeyID, stRequestTime.wYear, stRequestTime.wMonth, stRequestTime.wDay, (LPCTSTR)sS3Region, (LPCTSTR)sSignedHeaders, (LPCTSTR)sSignature);
+			(LPCTSTR)sS3KeyID, stRequestTime.wYear, stRequestTime.wMonth, stRequestTime.wDay, (LPCTSTR)sS3Region, (LPCTSTR)CString(V4Canonical.GetSignedHeaders()), (LPCTSTR)sSignature);
 	}
 	catch (const CErrorInfo& E)
 	{
@@ -1355,133 +1256,412 @@ LPCTSTR CECSConnection::GetCurrentServerIP(void)
 	return State.Ref->IPListLocal[State.Ref->iIPList];
 }
 
+const UINT NODE_OPEN_MAX_SHIFT = 3;					// an open circuit stays open at most dwBadIPAddrAge * 2^3
+
+// GetNodeHealth
+// look up the health entries of the host and each IP in IPListLocal
+// creates any that don't exist yet
+void CECSConnection::GetNodeHealth(void)
+{
+	CStateRef State(this);
+	State.Ref->NodeHealthLocal.clear();
+	State.Ref->pProbeNode = nullptr;
+	CSimpleRWLockAcquire lock(&rwlNodeHealth);			// read lock
+	for (bool bWrite = false; ; bWrite = true)
+	{
+		if (bWrite)
+		{
+			lock.Unlock();
+			lock.Lock(true);							// write lock
+		}
+		std::map<CString, std::shared_ptr<HOST_HEALTH>>::iterator itHost = NodeHealthMap.find(sHost);
+		if (itHost == NodeHealthMap.end())
+		{
+			if (!bWrite)
+				continue;
+			itHost = NodeHealthMap.insert(std::make_pair(sHost, std::make_shared<HOST_HEALTH>())).first;
+		}
+		State.Ref->pHostHealth = itHost->second;
+		State.Ref->NodeHealthLocal.reserve(State.Ref->IPListLocal.size());
+		std::deque<CString>::const_iterator itIP;
+		for (itIP = State.Ref->IPListLocal.begin(); itIP != State.Ref->IPListLocal.end(); ++itIP)
+		{
+			std::map<CString, std::shared_ptr<NODE_HEALTH>>::iterator itNode = itHost->second->NodeMap.find(*itIP);
+			if (itNode == itHost->second->NodeMap.end())
+			{
+				if (!bWrite)
+					break;
+				itNode = itHost->second->NodeMap.insert(std::make_pair(*itIP, std::make_shared<NODE_HEALTH>())).first;
+				itNode->second->sHost = sHost;
+				itNode->second->sIP = *itIP;
+			}
+			State.Ref->NodeHealthLocal.push_back(itNode->second);
+		}
+		if (itIP == State.Ref->IPListLocal.end())
+			break;
+		State.Ref->NodeHealthLocal.clear();
+	}
+}
+
+// FindNodeHealth
+// find the health entry for an IP used by the current request
+CECSConnection::NODE_HEALTH *CECSConnection::FindNodeHealth(const CString& sIP)
+{
+	CStateRef State(this);
+	for (UINT i = 0; (i < State.Ref->IPListLocal.size()) && (i < State.Ref->NodeHealthLocal.size()); i++)
+	{
+		if (State.Ref->IPListLocal[i] == sIP)
+			return State.Ref->NodeHealthLocal[i].get();
+	}
+	return nullptr;
+}
+
+// IfNodeAvailable
+// false if the circuit of this node is open (or half open and being probed)
+bool CECSConnection::IfNodeAvailable(const CString& sHostParam, const CString& sIP)
+{
+	CSimpleRWLockAcquire lock(&rwlNodeHealth);			// read lock
+	std::map<CString, std::shared_ptr<HOST_HEALTH>>::const_iterator itHost = NodeHealthMap.find(sHostParam);
+	if (itHost == NodeHealthMap.end())
+		return true;
+	std::map<CString, std::shared_ptr<NODE_HEALTH>>::const_iterator itNode = itHost->second->NodeMap.find(sIP);
+	if (itNode == itHost->second->NodeMap.end())
+		return true;
+	return InterlockedCompareExchange(&itNode->second->lState, 0, 0) == (LONG)E_NODE_STATE::Closed;
+}
+
+// NodeOpen
+// open the circuit of a node that failed (or a probe that failed)
+// if it is already open, just record the error
+void CECSConnection::NodeOpen(NODE_HEALTH& Node, const CS3ErrorInfo *pErrorInfo)
+{
+	if (dwBadIPAddrAge == 0)
+		dwBadIPAddrAge = MINUTES(12);
+	if (pErrorInfo != nullptr)
+	{
+		CSingleLock lock(&Node.csError, true);
+		GetSystemTimeAsFileTime(&Node.ftError);
+		Node.ErrorInfo = *pErrorInfo;
+	}
+	for (;;)
+	{
+		LONG lState = InterlockedCompareExchange(&Node.lState, 0, 0);
+		if (lState == (LONG)E_NODE_STATE::Open)
+			return;
+		// set the retry time first so nobody can see it open with an old retry time
+		LONG lTrips = InterlockedIncrement(&Node.lTrips);
+		ULONGLONG ullOpenTime = (ULONGLONG)dwBadIPAddrAge << __min((UINT)(lTrips - 1), NODE_OPEN_MAX_SHIFT);
+		(void)InterlockedExchange64(&Node.llRetryTime, (LONGLONG)(GetTickCount64() + ullOpenTime));
+		if (InterlockedCompareExchange(&Node.lState, (LONG)E_NODE_STATE::Open, lState) == lState)
+		{
+			if ((lState == (LONG)E_NODE_STATE::Closed) && (pErrorInfo != nullptr))
+			{
+				LogMessage(pErrorInfo->sFile, pErrorInfo->dwLine, _T("Server (%1) error caused a failover to a different connection: %2\r\nConnection that failed: %3\r\nConnection that is now in use: %4"),
+					pErrorInfo->Error.dwError, (LPCTSTR)GetHost(), (LPCTSTR)pErrorInfo->Format(), (LPCTSTR)Node.sIP, GetCurrentServerIP());
+			}
+			return;
+		}
+		(void)InterlockedDecrement(&Node.lTrips);			// somebody else changed the state. try again
+	}
+}
+
+// NodeClose
+// the node answered. put it back in rotation
+// lTrips is left alone. it is reset by AgeNodeHealth once the node has stayed healthy for a while
+void CECSConnection::NodeClose(NODE_HEALTH& Node)
+{
+	LONG lState = InterlockedExchange(&Node.lState, (LONG)E_NODE_STATE::Closed);
+	if (lState != (LONG)E_NODE_STATE::Closed)
+		(void)InterlockedExchange64(&Node.llClosedTime, (LONGLONG)GetTickCount64());
+}
+
+// AgeNodeHealth
+// called from the garbage collect thread
+// forget the trips of nodes that have been healthy for the longest open time
+void CECSConnection::AgeNodeHealth(void)
+{
+	const ULONGLONG NODE_HEALTH_AGE = (ULONGLONG)MINUTES(12) << NODE_OPEN_MAX_SHIFT;
+	ULONGLONG ullNow = GetTickCount64();
+	{
+		CSimpleRWLockAcquire lock(&rwlNodeHealth);			// read lock
+		for (std::map<CString, std::shared_ptr<HOST_HEALTH>>::const_iterator itHost = NodeHealthMap.begin(); itHost != NodeHealthMap.end(); ++itHost)
+		{
+			for (std::map<CString, std::shared_ptr<NODE_HEALTH>>::const_iterator itNode = itHost->second->NodeMap.begin(); itNode != itHost->second->NodeMap.end(); ++itNode)
+			{
+				NODE_HEALTH& Node = *itNode->second;
+				if ((InterlockedCompareExchange(&Node.lState, 0, 0) == (LONG)E_NODE_STATE::Closed)
+					&& (InterlockedCompareExchange(&Node.lTrips, 0, 0) != 0)
+					&& (ullNow > ((ULONGLONG)InterlockedCompareExchange64(&Node.llClosedTime, 0LL, 0LL) + NODE_HEALTH_AGE)))
+					(void)InterlockedExchange(&Node.lTrips, 0);
+			}
+		}
+	}
+}
+
 // GetNextECSIP
 // pick from one of the ip addrs going to this host
+// nodes with an open circuit are skipped, unless bFailOpen is set (they are all open)
+// if an open circuit is due for a probe, this request becomes the probe
 // returns false if there are no available IPs for this host
-bool CECSConnection::GetNextECSIP(std::map<CString,BAD_IP_ENTRY>& IPUsed)
+bool CECSConnection::GetNextECSIP(std::map<CString,BAD_IP_ENTRY>& IPUsed, bool bFailOpen)
 {
 	CStateRef State(this);
-	if (dwBadIPAddrAge == 0)
-	{
-		dwBadIPAddrAge = MINUTES(12);
+	if (State.Ref->IPListLocal.empty() || !State.Ref->pHostHealth || (State.Ref->NodeHealthLocal.size() != State.Ref->IPListLocal.size()))
+		return false;
+	State.Ref->pProbeNode = nullptr;
+	UINT uStart = (UINT)InterlockedIncrement(&State.Ref->pHostHealth->lRoundRobin) % State.Ref->IPListLocal.size();
+	ULONGLONG ullNow = GetTickCount64();
+
+	// collect the addresses whose circuit is closed, starting at the round robin position
+	std::vector<UINT> CandidateList;
+	CandidateList.reserve(State.Ref->IPListLocal.size());
+	for (UINT i = 0; i < State.Ref->IPListLocal.size(); i++)
+	{
+		UINT iIP = (uStart + i) % State.Ref->IPListLocal.size();
+		NODE_HEALTH& Node = *State.Ref->NodeHealthLocal[iIP];
+		LONG lState = InterlockedCompareExchange(&Node.lState, 0, 0);
+		if (lState == (LONG)E_NODE_STATE::Closed)
+			CandidateList.push_back(iIP);
+		else if ((lState == (LONG)E_NODE_STATE::Open)
+			&& (ullNow >= (ULONGLONG)InterlockedCompareExchange64(&Node.llRetryTime, 0LL, 0LL))
+			&& (IPUsed.find(State.Ref->IPListLocal[iIP]) == IPUsed.end())
+			&& (InterlockedCompareExchange(&Node.lState, (LONG)E_NODE_STATE::HalfOpen, lState) == lState))
+		{
+			// only one request gets to probe it
+			State.Ref->pProbeNode = &Node;
+			State.Ref->iIPList = iIP;
+			return true;
+		}
+		else if (bFailOpen)
+			CandidateList.push_back(iIP);
 	}
-	__int64 liBadIPAge = (__int64)dwBadIPAddrAge * 10000;			// convert to FILETIME units
-	if (State.Ref->IPListLocal.empty())
+	if (CandidateList.empty())
 		return false;
-	// first see if any of the entries are too old to be in there
-	CSingleLock csBad(&csBadIPMap, true);
-
-	FILETIME ftNow;
-	GetSystemTimeAsFileTime(&ftNow);
-	for (std::map<BAD_IP_KEY, BAD_IP_ENTRY>::iterator itMap = BadIPMap.begin(); itMap != BadIPMap.end(); )
+	UINT iPick = CandidateList[0];
+	if ((NodeSelect != E_NODE_SELECT::RoundRobin) && (CandidateList.size() > 1))
 	{
-		if (ftNow > (itMap->second.ftError + liBadIPAge))
-			itMap = BadIPMap.erase(itMap);
+		// don't go back to an address that already failed this request if there is another choice
+		if (!IPUsed.empty())
+		{
+			std::vector<UINT> UnusedList;
+			for (std::vector<UINT>::const_iterator itCand = CandidateList.begin(); itCand != CandidateList.end(); ++itCand)
+			{
+				if (IPUsed.find(State.Ref->IPListLocal[*itCand]) == IPUsed.end())
+					UnusedList.push_back(*itCand);
+			}
+			if (!UnusedList.empty())
+				CandidateList.swap(UnusedList);
+		}
+		// the statistics are in the health entry of each candidate. they are read without a lock
+		UINT iBest = 0;
+		if (NodeSelect == E_NODE_SELECT::LeastOutstanding)
+		{
+			// fewest requests in progress. if that is a tie, lowest latency. if still a tie, the round robin order decides
+			for (UINT i = 1; i < CandidateList.size(); i++)
+			{
+				NODE_HEALTH *pBest = State.Ref->NodeHealthLocal[CandidateList[iBest]].get();
+				NODE_HEALTH *pThis = State.Ref->NodeHealthLocal[CandidateList[i]].get();
+				LONG lBest = InterlockedCompareExchange(&pBest->lOutstanding, 0, 0);
+				LONG lThis = InterlockedCompareExchange(&pThis->lOutstanding, 0, 0);
+				if ((lThis < lBest)
+					|| ((lThis == lBest) && (GetNodeCost(pThis) < GetNodeCost(pBest))))
+					iBest = i;
+			}
+		}
 		else
-			++itMap;
+		{
+			// power of two choices: compare two random candidates
+			static thread_local std::minstd_rand Random(GetCurrentThreadId() ^ GetTickCount());
+			UINT iFirst = (UINT)(Random() % CandidateList.size());
+			UINT iSecond = (UINT)(Random() % (CandidateList.size() - 1));
+			if (iSecond >= iFirst)
+				++iSecond;
+			iBest = (GetNodeCost(State.Ref->NodeHealthLocal[CandidateList[iSecond]].get())
+				< GetNodeCost(State.Ref->NodeHealthLocal[CandidateList[iFirst]].get())) ? iSecond : iFirst;
+		}
+		iPick = CandidateList[iBest];
 	}
+	State.Ref->iIPList = iPick;
+	return true;
+}
 
-	// insert new LoadBalMap record, or retrieve existing record
-	std::pair<std::map<CString, UINT>::iterator, bool> Ret = LoadBalMap.insert(std::make_pair(sHost, 0));
-	if (++Ret.first->second >= State.Ref->IPListLocal.size())
-		Ret.first->second = 0;
-	State.Ref->iIPList = Ret.first->second;
-
-	bool bBad;
-	UINT i;
-	for (i = 0; i<State.Ref->IPListLocal.size(); i++)
-	{
-		bBad = false;
-		if (State.Ref->iIPList >= State.Ref->IPListLocal.size())
-			State.Ref->iIPList = 0;
-		// check if this entry is BAD
-		if (BadIPMap.find(BAD_IP_KEY(sHost, State.Ref->IPListLocal[State.Ref->iIPList])) != BadIPMap.end())
-			bBad = true;					// bad - move to the next
-		// check if we've already tried this one
-	//	if (!bBad && (IPUsed.find(State.Ref->IPListLocal[State.Ref->iIPList]) != IPUsed.end()))
-	//		bBad = true;
-		if (!bBad)
-			break;
-		++State.Ref->iIPList;					// try the next
+const UINT HEDGE_LATENCY_SAMPLES_MIN = 32;			// don't hedge until there are this many
+const DWORD HEDGE_POOL_THREADS_MAX = 64;			// maximum number of hedge threads. these mostly wait for the hedge delay
+
+// GetNodeCost
+// relative cost of sending a request to a node: requests in progress (including this one),
+// scaled by the latency and the error rate. a node that hasn't been used yet is cheap so it gets tried
+double CECSConnection::GetNodeCost(NODE_HEALTH *pNode)
+{
+	if (InterlockedCompareExchange64(&pNode->llRequests, 0LL, 0LL) == 0LL)
+		return 0.0;
+	double dLatencyMs = (double)InterlockedCompareExchange64(&pNode->llLatencyUs, 0LL, 0LL) / 1000.0;
+	double dErrorRate = (double)InterlockedCompareExchange64(&pNode->llErrorRatePPM, 0LL, 0LL) / 1000000.0;
+	return (InterlockedCompareExchange(&pNode->lOutstanding, 0, 0) + 1) * (dLatencyMs + 1.0) * (1.0 + 4.0 * dErrorRate);
+}
+
+// UpdateAverage
+// move an exponentially weighted moving average towards a new sample, without a lock
+// if bSeed is set, the first sample (average still 0) is taken as is
+static void UpdateAverage(volatile LONGLONG *pllAverage, LONGLONG llSample, double dWeight, bool bSeed)
+{
+	for (;;)
+	{
+		LONGLONG llOld = InterlockedCompareExchange64(pllAverage, 0LL, 0LL);
+		LONGLONG llNew = (bSeed && (llOld == 0LL)) ? llSample : (llOld + (LONGLONG)(dWeight * (double)(llSample - llOld)));
+		if (InterlockedCompareExchange64(pllAverage, llNew, llOld) == llOld)
+			return;
 	}
-	// update the current IP pointer as it might have changed
-	Ret.first->second = State.Ref->iIPList;
-	return i < State.Ref->IPListLocal.size();
 }
 
-// TestAllIPBad
-// check if all IPs are marked bad for this host
-// if so, remove them all from the bad map so it can be retried
-void CECSConnection::TestAllIPBad()
+// NodeRequestStart
+// a request is about to be sent to sIP
+void CECSConnection::NodeRequestStart(const CString& sIP, LONGLONG& llStart)
 {
 	CStateRef State(this);
-	std::deque<CString> IPList = State.Ref->IPListLocal;
+	LARGE_INTEGER liNow;
+	(void)QueryPerformanceCounter(&liNow);
+	llStart = liNow.QuadPart;
+	State.Ref->llResponseTime = 0LL;
+	NODE_HEALTH *pNode = FindNodeHealth(sIP);
+	if (pNode == nullptr)
+		return;
+	ULARGE_INTEGER uliNow;
+	FILETIME ftNow;
+	GetSystemTimeAsFileTime(&ftNow);
+	uliNow.LowPart = ftNow.dwLowDateTime;
+	uliNow.HighPart = ftNow.dwHighDateTime;
+	(void)InterlockedIncrement(&pNode->lOutstanding);
+	(void)InterlockedIncrement64(&pNode->llRequests);
+	(void)InterlockedExchange64(&pNode->llLastUsed, (LONGLONG)uliNow.QuadPart);
+}
+
+// ReleaseProbe
+// the half open node picked as this request's probe didn't get an answer, or the request was never sent to it
+// put it back to open so the next request can probe it. otherwise it would stay half open and never be tried again
+void CECSConnection::ReleaseProbe(void)
+{
+	CStateRef State(this);
+	NODE_HEALTH *pNode = State.Ref->pProbeNode;
+	if (pNode == nullptr)
+		return;
+	State.Ref->pProbeNode = nullptr;
+	(void)InterlockedExchange64(&pNode->llRetryTime, 0LL);
+	(void)InterlockedCompareExchange(&pNode->lState, (LONG)E_NODE_STATE::Open, (LONG)E_NODE_STATE::HalfOpen);
+}
+
+// NodeRequestEnd
+// a request sent to sIP is done. update its statistics
+void CECSConnection::NodeRequestEnd(const CString& sIP, LONGLONG llStart, const S3_ERROR& Error, bool bGotServerResponse, bool bSampleLatency)
+{
+	const double NODE_LATENCY_WEIGHT = 0.2;			// weight of a new latency sample
+	const double NODE_ERROR_WEIGHT = 0.1;			// weight of a new error sample
+	CStateRef State(this);
+	bool bError = (Error.dwHttpError >= HTTP_STATUS_SERVER_ERROR)
+		|| (Error.IfError() && (Error.dwError != ERROR_OPERATION_ABORTED) && (!bGotServerResponse || IfMarkIPBad(Error.dwError)));
+	// circuit breaker: any answer from the node closes its circuit. a failed probe opens it again
+	NODE_HEALTH *pNode = FindNodeHealth(sIP);
+	if (pNode != nullptr)
 	{
-		// we need to test and reset a rare possibilty that all of the IPs for this host have been marked bad
-		// normally that shouldn't happen because an IP is only marked bad if another IP was successful
-		// but due to multiple overlapped requests, it is a possibility
-		// in this case, the failure that caused the bad IPs was likely intermittent, so reset them and try again
+		if (bGotServerResponse)
+			NodeClose(*pNode);
+		else if (State.Ref->pProbeNode == pNode)
 		{
-			CSingleLock csBad(&csBadIPMap, true);
-
-			// run through the map, for each entry for this host, delete any corresponding entry in IPList
-			// if, after going through the whole map, if IPList is empty that means that all of the IPs were marked bad
-			for (std::map<BAD_IP_KEY, BAD_IP_ENTRY>::iterator itMap = BadIPMap.begin(); itMap != BadIPMap.end(); ++itMap)
-			{
-				if (sHost == itMap->first.sHostName)
-				{
-					for (std::deque<CString>::iterator it = IPList.begin(); it != IPList.end(); )
-					{
-						if (*it == itMap->first.sIP)
-							it = IPList.erase(it);
-						else
-							++it;
-					}
-				}
-			}
-			// if IPList is now empty, all entries were marked bad. unmark them
-			if (IPList.empty())
+			if (IfMarkIPBad(Error.dwError))
 			{
-				for (std::map<BAD_IP_KEY, BAD_IP_ENTRY>::iterator itMap = BadIPMap.begin(); itMap != BadIPMap.end();)
-				{
-					if (sHost == itMap->first.sHostName)
-						itMap = BadIPMap.erase(itMap);
-					else
-						++itMap;
-				}
+				CS3ErrorInfo ErrorInfo(_T(__FILE__), __LINE__, Error);
+				NodeOpen(*pNode, &ErrorInfo);
 			}
+			else
+				ReleaseProbe();				// the probe didn't tell us anything (aborted...)
+		}
+	}
+	if (State.Ref->pProbeNode == pNode)
+		State.Ref->pProbeNode = nullptr;
+	double dLatencyMs = -1.0;
+	if (bSampleLatency && (State.Ref->llResponseTime != 0LL))
+	{
+		LARGE_INTEGER liFreq;
+		(void)QueryPerformanceFrequency(&liFreq);
+		dLatencyMs = (double)(State.Ref->llResponseTime - llStart) * 1000.0 / (double)liFreq.QuadPart;
+	}
+	if (pNode == nullptr)
+		return;
+	(void)InterlockedDecrement(&pNode->lOutstanding);
+	if (bError)
+		(void)InterlockedIncrement64(&pNode->llErrors);
+	if (Error.dwHttpError == HTTP_STATUS_SERVICE_UNAVAIL)
+		(void)InterlockedIncrement64(&pNode->ll503);
+	UpdateAverage(&pNode->llErrorRatePPM, bError ? 1000000LL : 0LL, NODE_ERROR_WEIGHT, false);
+	if (dLatencyMs >= 0.0)
+	{
+		LONGLONG llLatencyUs = (LONGLONG)(dLatencyMs * 1000.0);
+		UpdateAverage(&pNode->llLatencyUs, llLatencyUs, NODE_LATENCY_WEIGHT, true);
+		// keep the recent latencies of the host for the hedge delay
+		if (State.Ref->pHostHealth)
+		{
+			HOST_HEALTH& Host = *State.Ref->pHostHealth;
+			ULONG ulSlot = (ULONG)InterlockedIncrement(&Host.lLatencyCount) - 1;
+			(void)InterlockedExchange64(&Host.LatencyUs[ulSlot % HEDGE_LATENCY_SAMPLES], llLatencyUs);
+		}
+	}
+}
+
+// SetNodeSelect
+// set how the IP address is picked for each request (all hosts)
+void CECSConnection::SetNodeSelect(E_NODE_SELECT NodeSelectParam)
+{
+	NodeSelect = NodeSelectParam;
+}
+
+// GetNodeStats
+// get a snapshot of the per node statistics (nodes that have been used)
+void CECSConnection::GetNodeStats(std::list<NODE_STATS>& StatsList)
+{
+	StatsList.clear();
+	CSimpleRWLockAcquire lock(&rwlNodeHealth);			// read lock
+	for (std::map<CString, std::shared_ptr<HOST_HEALTH>>::const_iterator itHost = NodeHealthMap.begin(); itHost != NodeHealthMap.end(); ++itHost)
+	{
+		for (std::map<CString, std::shared_ptr<NODE_HEALTH>>::const_iterator itNode = itHost->second->NodeMap.begin(); itNode != itHost->second->NodeMap.end(); ++itNode)
+		{
+			NODE_HEALTH& Node = *itNode->second;
+			NODE_STATS Stats;
+			Stats.ullRequests = (ULONGLONG)InterlockedCompareExchange64(&Node.llRequests, 0LL, 0LL);
+			if (Stats.ullRequests == 0ULL)
+				continue;
+			Stats.sHost = Node.sHost;
+			Stats.sIP = Node.sIP;
+			Stats.lOutstanding = InterlockedCompareExchange(&Node.lOutstanding, 0, 0);
+			Stats.dLatencyMs = (double)InterlockedCompareExchange64(&Node.llLatencyUs, 0LL, 0LL) / 1000.0;
+			Stats.dErrorRate = (double)InterlockedCompareExchange64(&Node.llErrorRatePPM, 0LL, 0LL) / 1000000.0;
+			Stats.ullErrors = (ULONGLONG)InterlockedCompareExchange64(&Node.llErrors, 0LL, 0LL);
+			Stats.ull503 = (ULONGLONG)InterlockedCompareExchange64(&Node.ll503, 0LL, 0LL);
+			ULARGE_INTEGER uliLastUsed;
+			uliLastUsed.QuadPart = (ULONGLONG)InterlockedCompareExchange64(&Node.llLastUsed, 0LL, 0LL);
+			Stats.ftLastUsed.dwLowDateTime = uliLastUsed.LowPart;
+			Stats.ftLastUsed.dwHighDateTime = uliLastUsed.HighPart;
+			Stats.State = (E_NODE_STATE)InterlockedCompareExchange(&Node.lState, 0, 0);
+			Stats.lTrips = InterlockedCompareExchange(&Node.lTrips, 0, 0);
+			StatsList.push_back(Stats);
 		}
 	}
 }
 
 // LogBadIPAddr
-// log the list of addresses that were unsuccessful
+// open the circuits of the addresses that were unsuccessful
 // this is only called if it eventually did connect via one of the addresses
 // if all of the addresses failed, it calls the 'disconnect' callback and will try again later
 // there is no point in blaming the problem on each individual address
 void CECSConnection::LogBadIPAddr(const std::map<CString,BAD_IP_ENTRY>& IPUsed)
 {
-	CSingleLock csBad(&csBadIPMap, true);
-	FILETIME ftNow;
-
 	if (bTestConnection)				// only mark an IP bad if there is only 1 IP in the list
 		return;
-	BAD_IP_ENTRY Entry;
-	GetSystemTimeAsFileTime(&ftNow);
 	for (std::map<CString,BAD_IP_ENTRY>::const_iterator itUsed=IPUsed.begin() ; itUsed != IPUsed.end() ; ++itUsed)
 	{
-		Entry.ftError = ftNow;
-		Entry.ErrorInfo = itUsed->second.ErrorInfo;
-		std::pair<std::map<BAD_IP_KEY,BAD_IP_ENTRY>::iterator,bool> Ret = BadIPMap.insert(std::make_pair(BAD_IP_KEY(sHost, itUsed->first), Entry));
-		if (!Ret.second)				// already in the map
-			Ret.first->second = Entry;
-		else
-		{
-			LogMessage(itUsed->second.ErrorInfo.sFile, itUsed->second.ErrorInfo.dwLine, _T("Server (%1) error caused a failover to a different connection: %2\r\nConnection that failed: %3\r\nConnection that is now in use: %4"),
-					itUsed->second.ErrorInfo.Error.dwError, (LPCTSTR)GetHost(), (LPCTSTR)itUsed->second.ErrorInfo.Format(), (LPCTSTR)itUsed->first, GetCurrentServerIP());
-		}
+		NODE_HEALTH *pNode = FindNodeHealth(itUsed->first);
+		if (pNode != nullptr)
+			NodeOpen(*pNode, &itUsed->second.ErrorInfo);
 	}
-	TestAllIPBad();
 }
 
 // IfMarkIPBad
@@ -1497,6 +1677,296 @@ bool CECSConnection::IfMarkIPBad(DWORD dwError)
 	return false;
 }
 
+// hedged requests
+// the primary request runs on the calling thread. a task on the hedge pool waits for the hedge delay, and if
+// the primary still hasn't finished, it sends the same request to another node using a copy of the connection
+// the first to get a response from the server wins. the other one is aborted: its abort flag is set and its
+// WinHttp wait is woken up
+const LONG HEDGE_WINNER_NONE = 0;
+const LONG HEDGE_WINNER_PRIMARY = 1;
+const LONG HEDGE_WINNER_HEDGE = 2;
+
+struct CECSConnection::HEDGE_REQUEST
+{
+	// set up by the primary
+	CString sMethod;
+	CString sResource;
+	std::map<CString, HEADER_STRUCT> Headers;		// request headers (before signing)
+	bool bHeaderReq;								// the caller asked for response headers
+	DWORD dwReceivedDataHint;
+	DWORD dwBufOffset;
+	std::deque<CString> IPList;						// IP list of the primary request
+	CString sPrimaryIP;								// IP used by the primary
+	DWORD dwDelay;									// hedge delay (ms)
+	ULONGLONG ullStartTime;							// GetTickCount64 when the primary started
+	CEvent evPrimaryDone;							// set when the primary is done
+	// protected by csHedge
+	CCriticalSection csHedge;
+	CECSConnection *pPrimary;						// primary connection. nullptr once the primary is done
+	CEvent *pevPrimaryCmd;							// WinHttp wait event of the primary
+	CEvent *pevHedgeCmd;							// WinHttp wait event of the hedge, while it is running
+	// abort flags, registered with RegisterAbortPtr
+	bool bPrimaryAbort;
+	bool bHedgeAbort;
+	volatile LONG lWinner;							// HEDGE_WINNER_...
+	// hedge results. only looked at if the hedge wins
+	CString sHedgeIP;
+	S3_ERROR Error;
+	CBuffer RetData;
+	std::list<HEADER_REQ> HeaderReq;
+	bool bGotServerResponse;
+
+	HEDGE_REQUEST()
+		: bHeaderReq(false)
+		, dwReceivedDataHint(0)
+		, dwBufOffset(0)
+		, dwDelay(0)
+		, ullStartTime(0ULL)
+		, evPrimaryDone(FALSE, TRUE)
+		, pPrimary(nullptr)
+		, pevPrimaryCmd(nullptr)
+		, pevHedgeCmd(nullptr)
+		, bPrimaryAbort(false)
+		, bHedgeAbort(false)
+		, lWinner(HEDGE_WINNER_NONE)
+		, bGotServerResponse(false)
+	{}
+};
+
+class CECSConnection::CHedgePool : public CThreadPool<std::shared_ptr<HEDGE_REQUEST>>
+{
+public:
+	bool DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<HEDGE_REQUEST>& Hedge);
+	~CHedgePool()
+	{
+		CThreadPool<std::shared_ptr<HEDGE_REQUEST>>::Terminate();
+	}
+};
+
+CCriticalSection CECSConnection::csHedgePool;
+std::unique_ptr<CECSConnection::CHedgePool> CECSConnection::pHedgePool;
+
+bool CECSConnection::CHedgePool::DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<HEDGE_REQUEST>& Hedge)
+{
+	(void)pThread;
+	// wait out the rest of the hedge delay. nothing to do if the primary finishes first
+	ULONGLONG ullElapsed = GetTickCount64() - Hedge->ullStartTime;
+	DWORD dwWait = (ullElapsed >= Hedge->dwDelay) ? 0 : (DWORD)(Hedge->dwDelay - ullElapsed);
+	if (WaitForSingleObject(Hedge->evPrimaryDone.m_hObject, dwWait) != WAIT_TIMEOUT)
+		return true;
+	std::unique_ptr<CECSConnection> pConn;
+	{
+		CSingleLock lock(&Hedge->csHedge, true);
+		if (Hedge->pPrimary == nullptr)
+			return true;
+		Hedge->sHedgeIP = PickHedgeIP(Hedge->pPrimary->sHost, Hedge->IPList, Hedge->sPrimaryIP);
+		if (Hedge->sHedgeIP.IsEmpty())
+			return true;
+		pConn.reset(new CECSConnection(*Hedge->pPrimary));
+	}
+	pConn->SendHedge(*Hedge);
+	return true;
+}
+
+// SetHedge
+// hedge GET/HEAD requests that don't send or receive a stream (Read, ReadProperties, DirListing...)
+// if the response hasn't come in after uPercentile of the recent response times for the host (but at least
+// dwMinDelay ms), the request is sent to another node as well, and the first response is used
+void CECSConnection::SetHedge(bool bEnable, UINT uPercentile, DWORD dwMinDelay)
+{
+	bHedge = bEnable;
+	uHedgePercentile = __min(uPercentile, 100U);
+	dwHedgeMinDelay = dwMinDelay;
+}
+
+// TerminateHedge
+// shut down the hedge pool. called from ECSTermLib
+void CECSConnection::TerminateHedge(void)
+{
+	CSingleLock lock(&csHedgePool, true);
+	pHedgePool.reset();
+}
+
+// GetHedgeDelay
+// get the hedge delay for this host
+// returns false if there aren't enough latency samples yet
+bool CECSConnection::GetHedgeDelay(DWORD& dwDelay)
+{
+	CStateRef State(this);
+	if (!State.Ref->pHostHealth)
+		return false;
+	HOST_HEALTH& Host = *State.Ref->pHostHealth;
+	ULONG ulCount = (ULONG)InterlockedCompareExchange(&Host.lLatencyCount, 0, 0);
+	if (ulCount < HEDGE_LATENCY_SAMPLES_MIN)
+		return false;
+	std::vector<double> LatencyList;
+	LatencyList.reserve(HEDGE_LATENCY_SAMPLES);
+	for (UINT i = 0; (i < ulCount) && (i < HEDGE_LATENCY_SAMPLES); i++)
+		LatencyList.push_back((double)InterlockedCompareExchange64(&Host.LatencyUs[i], 0LL, 0LL) / 1000.0);
+	size_t uIndex = (LatencyList.size() - 1) * uHedgePercentile / 100;
+	std::nth_element(LatencyList.begin(), LatencyList.begin() + uIndex, LatencyList.end());
+	dwDelay = __max(dwHedgeMinDelay, (DWORD)LatencyList[uIndex] + 1);
+	return true;
+}
+
+// PickHedgeIP
+// pick the node for the hedge: the cheapest one with a closed circuit that isn't the one used by the primary
+// returns an empty string if there isn't one
+CString CECSConnection::PickHedgeIP(const CString& sHostParam, const std::deque<CString>& IPList, const CString& sPrimaryIP)
+{
+	CString sHedgeIP;
+	double dBestCost = 0.0;
+	CSimpleRWLockAcquire lock(&rwlNodeHealth);			// read lock
+	std::map<CString, std::shared_ptr<HOST_HEALTH>>::const_iterator itHost = NodeHealthMap.find(sHostParam);
+	for (std::deque<CString>::const_iterator itIP = IPList.begin(); itIP != IPList.end(); ++itIP)
+	{
+		if (*itIP == sPrimaryIP)
+			continue;
+		// a node without a health entry hasn't been used yet, so it is available and cheap
+		double dCost = 0.0;
+		if (itHost != NodeHealthMap.end())
+		{
+			std::map<CString, std::shared_ptr<NODE_HEALTH>>::const_iterator itNode = itHost->second->NodeMap.find(*itIP);
+			if (itNode != itHost->second->NodeMap.end())
+			{
+				if (InterlockedCompareExchange(&itNode->second->lState, 0, 0) != (LONG)E_NODE_STATE::Closed)
+					continue;
+				dCost = GetNodeCost(itNode->second.get());
+			}
+		}
+		if (sHedgeIP.IsEmpty() || (dCost < dBestCost))
+		{
+			sHedgeIP = *itIP;
+			dBestCost = dCost;
+		}
+	}
+	return sHedgeIP;
+}
+
+// SendRequestHedged
+// send a GET/HEAD on this thread, and let the hedge pool send it to another node if it takes too long
+// returns the result of whichever request won. the primary's own result is returned separately for the statistics of its node
+CECSConnection::S3_ERROR CECSConnection::SendRequestHedged(
+	LPCTSTR pszMethod,
+	LPCTSTR pszResource,
+	CBuffer& RetData,
+	std::list<HEADER_REQ> *pHeaderReq,
+	DWORD dwReceivedDataHint,
+	DWORD dwBufOffset,
+	bool *pbGotServerResponse,
+	DWORD dwDelay,
+	S3_ERROR& PrimaryError,					// out: result of the request to the primary node
+	bool& bPrimaryResponse)					// out: set if the primary node responded
+{
+	CStateRef State(this);
+	std::shared_ptr<HEDGE_REQUEST> Hedge(std::make_shared<HEDGE_REQUEST>());
+	Hedge->sMethod = pszMethod;
+	Hedge->sResource = pszResource;
+	Hedge->Headers = State.Ref->Headers;
+	Hedge->bHeaderReq = pHeaderReq != nullptr;
+	if (pHeaderReq != nullptr)
+		Hedge->HeaderReq = *pHeaderReq;
+	Hedge->dwReceivedDataHint = dwReceivedDataHint;
+	Hedge->dwBufOffset = dwBufOffset;
+	Hedge->IPList = State.Ref->IPListLocal;
+	Hedge->sPrimaryIP = GetCurrentServerIP();
+	Hedge->dwDelay = dwDelay;
+	Hedge->ullStartTime = GetTickCount64();
+	Hedge->pPrimary = this;
+	Hedge->pevPrimaryCmd = &State.Ref->CallbackContext.Event.evCmd;
+	{
+		CSingleLock lock(&csHedgePool, true);
+		if (!pHedgePool)
+		{
+			pHedgePool.reset(new CHedgePool);
+			pHedgePool->SetMinThreads(1);
+			pHedgePool->SetMaxThreads(HEDGE_POOL_THREADS_MAX);
+			CThreadPoolBase::SetPoolInitialized();
+		}
+		std::shared_ptr<std::shared_ptr<HEDGE_REQUEST>> AutoMsg;
+		AutoMsg.reset(new std::shared_ptr<HEDGE_REQUEST>(Hedge));
+		pHedgePool->SendMessageToPool(__LINE__, AutoMsg, 0, 0, nullptr);
+	}
+	RegisterAbortPtr(&Hedge->bPrimaryAbort);
+	bPrimaryResponse = false;
+	S3_ERROR Error = SendRequestInternal(pszMethod, pszResource, nullptr, 0, RetData, pHeaderReq, dwReceivedDataHint, dwBufOffset, &bPrimaryResponse, nullptr, nullptr, 0ULL);
+	UnregisterAbortPtr(&Hedge->bPrimaryAbort);
+	PrimaryError = Error;
+	if (pbGotServerResponse != nullptr)
+		*pbGotServerResponse = bPrimaryResponse;
+	bool bHedgeWon;
+	{
+		CSingleLock lock(&Hedge->csHedge, true);
+		Hedge->pPrimary = nullptr;
+		Hedge->pevPrimaryCmd = nullptr;
+		bHedgeWon = InterlockedCompareExchange(&Hedge->lWinner, HEDGE_WINNER_PRIMARY, HEDGE_WINNER_NONE) == HEDGE_WINNER_HEDGE;
+		if (!bHedgeWon)
+		{
+			// the primary finished first. stop the hedge if it is running
+			Hedge->bHedgeAbort = true;
+			if (Hedge->pevHedgeCmd != nullptr)
+				(void)Hedge->pevHedgeCmd->SetEvent();
+		}
+	}
+	(void)Hedge->evPrimaryDone.SetEvent();
+	if (bHedgeWon)
+	{
+		// the time so far goes into the statistics of the slow node
+		LARGE_INTEGER liNow;
+		(void)QueryPerformanceCounter(&liNow);
+		State.Ref->llResponseTime = liNow.QuadPart;
+		Error = Hedge->Error;
+		RetData = Hedge->RetData;
+		if (pHeaderReq != nullptr)
+			*pHeaderReq = Hedge->HeaderReq;
+		if (pbGotServerResponse != nullptr)
+			*pbGotServerResponse = Hedge->bGotServerResponse;
+	}
+	return Error;
+}
+
+// SendHedge
+// send the hedge request. runs on a hedge pool thread using a copy of the primary connection
+void CECSConnection::SendHedge(HEDGE_REQUEST& Hedge)
+{
+	CStateRef State(this);
+	State.Ref->Headers = Hedge.Headers;
+	State.Ref->IPListLocal.assign(1, Hedge.sHedgeIP);
+	GetNodeHealth();
+	State.Ref->iIPList = 0;
+	RegisterAbortPtr(&Hedge.bHedgeAbort);
+	{
+		CSingleLock lock(&Hedge.csHedge, true);
+		if (Hedge.pPrimary == nullptr)
+		{
+			UnregisterAbortPtr(&Hedge.bHedgeAbort);
+			return;
+		}
+		Hedge.pevHedgeCmd = &State.Ref->CallbackContext.Event.evCmd;
+	}
+	bool bGotServerResponse = false;
+	LONGLONG llNodeStart;
+	NodeRequestStart(Hedge.sHedgeIP, llNodeStart);
+	S3_ERROR Error = SendRequestInternal(Hedge.sMethod, Hedge.sResource, nullptr, 0, Hedge.RetData, Hedge.bHeaderReq ? &Hedge.HeaderReq : nullptr,
+		Hedge.dwReceivedDataHint, Hedge.dwBufOffset, &bGotServerResponse, nullptr, nullptr, 0ULL);
+	NodeRequestEnd(Hedge.sHedgeIP, llNodeStart, Error, bGotServerResponse, true);
+	UnregisterAbortPtr(&Hedge.bHedgeAbort);
+	Hedge.Error = Error;
+	Hedge.bGotServerResponse = bGotServerResponse;
+	// only a real answer from the server can win. otherwise leave it to the primary
+	bool bAnswer = bGotServerResponse && (Error.dwError != ERROR_OPERATION_ABORTED) && (Error.dwHttpError < HTTP_STATUS_SERVER_ERROR);
+	CSingleLock lock(&Hedge.csHedge, true);
+	Hedge.pevHedgeCmd = nullptr;
+	if (bAnswer && (InterlockedCompareExchange(&Hedge.lWinner, HEDGE_WINNER_HEDGE, HEDGE_WINNER_NONE) == HEDGE_WINNER_NONE))
+	{
+		Hedge.bPrimaryAbort = true;
+		if (Hedge.pevPrimaryCmd != nullptr)
+			(void)Hedge.pevPrimaryCmd->SetEvent();
+	}
+}
+
+const DWORD NODE_LATENCY_MAX_SEND = 0x10000;		// requests that send more than this don't add to the latency statistics
+
 // SendRequest
 // complete the request and send it, and get the response
 // adds the following headers:
@@ -1518,26 +1988,38 @@ CECSConnection::S3_ERROR CECSConnection::SendRequest(
 	bool bGotServerResponse = false;
 	S3_ERROR Error;
 	std::map<CString,BAD_IP_ENTRY> IPUsed;
+	bool bFailOpen = false;
 	CString sResource(pszResource);
 	std::list<HEADER_REQ> SaveHeaderReq;
 	try
 	{
 		if (pHeaderReq != nullptr)
 			SaveHeaderReq = *pHeaderReq;					// save in case of retries
+		if (pStreamSend != nullptr)
+			pStreamSend->ClearRewind();
 		// first get a local copy of the IPList for use by this request
 		{
 			CSimpleRWLockAcquire lock(&rwlIPListHost);			// read lock
 			State.Ref->IPListLocal = IPListHost;
 		}
+		GetNodeHealth();
 		if (!GetNextECSIP(IPUsed))
 		{
-			TestAllIPBad();					// if first time through and there are no IPs it could be that they are all marked bad
-			if (!GetNextECSIP(IPUsed))
+			// the circuits of all of the IPs are open. rather than fail, use them anyway
+			// it could have been an intermittent problem, and an answer from any of them closes its circuit
+			bFailOpen = true;
+			if (!GetNextECSIP(IPUsed, bFailOpen))
 				throw CS3ErrorInfo(_T(__FILE__), __LINE__, (DWORD)SEC_E_NO_IP_ADDRESSES);		// no IP addresses!
 		}
+		// dwMaxRetryCount is a hard limit on the tries. the retry policy decides when to stop before that
+		DWORD dwMaxTries = dwMaxRetryCount;
 		if (bTestConnection)
-			dwMaxRetryCount = __min(2UL, dwMaxRetryCount);
-		for (UINT i = 0; i < dwMaxRetryCount; i++)
+			dwMaxTries = __min(2UL, dwMaxTries);
+		// no shared_ptr copy: the connection holds its own policy, and the default policy is never released
+		CRetryPolicy *pPolicy = pRetryPolicy ? pRetryPolicy.get() : pDefaultRetryPolicy.get();
+		UINT RetryCount[(int)E_RETRY_CLASS::Count] = {};
+		pPolicy->RequestStart();
+		for (UINT i = 0; i < dwMaxTries; i++)
 		{
 			bGotServerResponse = false;
 			// update the date header in case retries have made this time too far in the past
@@ -1547,7 +2029,25 @@ CECSConnection::S3_ERROR CECSConnection::SendRequest(
 				AddHeader(_T("date"), GetCanonicalTime(&stNow));
 			if (State.Ref->Headers.find(_T("x-amz-date")) != State.Ref->Headers.end())
 				AddHeader(_T("x-amz-date"), FormatISO8601Date(stNow, false, false, true));
-			Error = SendRequestInternal(pszMethod, sResource, pData, dwDataLen, RetData, pHeaderReq, dwReceivedDataHint, dwBufOffset, &bGotServerResponse, pStreamSend, pStreamReceive, ullTotalLen);
+			CString sNodeIP(GetCurrentServerIP());
+			LONGLONG llNodeStart;
+			NodeRequestStart(sNodeIP, llNodeStart);
+			// the first try of a GET/HEAD can be hedged to another node. retries aren't
+			DWORD dwHedgeDelay = 0;
+			S3_ERROR NodeError;					// result of the request to sNodeIP. if a hedge won, it isn't the same as Error
+			bool bNodeResponse;
+			if (bHedge && (i == 0) && (pStreamSend == nullptr) && (pStreamReceive == nullptr) && (dwDataLen == 0)
+				&& ((_tcscmp(pszMethod, _T("GET")) == 0) || (_tcscmp(pszMethod, _T("HEAD")) == 0))
+				&& (State.Ref->IPListLocal.size() > 1) && GetHedgeDelay(dwHedgeDelay))
+				Error = SendRequestHedged(pszMethod, sResource, RetData, pHeaderReq, dwReceivedDataHint, dwBufOffset, &bGotServerResponse, dwHedgeDelay, NodeError, bNodeResponse);
+			else
+			{
+				Error = SendRequestInternal(pszMethod, sResource, pData, dwDataLen, RetData, pHeaderReq, dwReceivedDataHint, dwBufOffset, &bGotServerResponse, pStreamSend, pStreamReceive, ullTotalLen);
+				NodeError = Error;
+				bNodeResponse = bGotServerResponse;
+			}
+			// the time to the response only means something if there wasn't much to send first
+			NodeRequestEnd(sNodeIP, llNodeStart, NodeError, bNodeResponse, (pStreamSend == nullptr) && (dwDataLen <= NODE_LATENCY_MAX_SEND));
 			if (!Error.IfError())
 			{
 				// no error - but let's look a little closer
@@ -1565,10 +2065,18 @@ CECSConnection::S3_ERROR CECSConnection::SendRequest(
 				else
 					Error.dwError = (DWORD)HTTP_E_STATUS_UNEXPECTED;
 			}
-			// don't retry if this is a stream operation
-			// we can't retry because the data stream would need to be reset
-			if ((pStreamSend != nullptr) || (pStreamReceive != nullptr))
+			// a stream receive can't be retried here because the data has already been passed on. Read resumes it instead
+			// a stream send can only be retried if everything sent so far is still in its rewind buffer
+			if ((pStreamReceive != nullptr) || ((pStreamSend != nullptr) && !pStreamSend->IfRewindable()))
+			{
+				// make sure the resumed request goes to a different node
+				if ((pStreamReceive != nullptr) && IfMarkIPBad(Error.dwError))
+				{
+					(void)IPUsed.insert(std::make_pair(GetCurrentServerIP(), BAD_IP_ENTRY(Error)));
+					LogBadIPAddr(IPUsed);
+				}
 				throw CS3ErrorInfo(_T(__FILE__), __LINE__, Error);
+			}
 			if ((Error.dwHttpError < HTTP_STATUS_SERVER_ERROR)
 				&& (bGotServerResponse || (Error.dwError == ERROR_WINHTTP_SECURE_FAILURE)))
 			{
@@ -1587,19 +2095,41 @@ CECSConnection::S3_ERROR CECSConnection::SendRequest(
 				// save the error for the log message
 				std::pair<std::map<CString, BAD_IP_ENTRY>::iterator, bool> Ret = IPUsed.insert(std::make_pair(GetCurrentServerIP(), BAD_IP_ENTRY(Error)));
 			}
-			// try another IP address in the list
-			if (!GetNextECSIP(IPUsed))
+			if ((i + 1) >= dwMaxTries)
+				break;
+			// ask the retry policy if this is worth another try, and how long to back off
+			// moving on from a node that didn't respond to one this request hasn't tried yet is a failover, not a retry of the same work
+			E_RETRY_CLASS RetryClass = GetRetryClass(Error);
+			bool bFailover = false;
+			if (RetryClass == E_RETRY_CLASS::Network)
+			{
+				for (std::deque<CString>::const_iterator itIP = State.Ref->IPListLocal.begin(); itIP != State.Ref->IPListLocal.end(); ++itIP)
+				{
+					if ((*itIP != sNodeIP) && (IPUsed.find(*itIP) == IPUsed.end()))
+					{
+						bFailover = true;
+						break;
+					}
+				}
+			}
+			DWORD dwRetryDelay = 0;
+			if (!pPolicy->IfRetry(RetryClass, RetryCount[(int)RetryClass]++, dwRetryDelay, bFailover))
 				break;
 			// restore pHeaderReq in case it had changed with the failed request
 			if (pHeaderReq != nullptr)
 				*pHeaderReq = SaveHeaderReq;
-			if (Error.dwHttpError == HTTP_STATUS_SERVER_ERROR)
+			// put the data that was already sent back on the stream
+			if (pStreamSend != nullptr)
+				(void)pStreamSend->Rewind();
+			// if ECS is busy, wait a bit and try again. hopefully on a different node
+			if (!RetryPause(dwRetryDelay))
 			{
-				// if ECS is busy, wait a bit and try again. hopefully on a different node
-				Sleep(dwPauseAfter500Error);
+				Error.dwError = ERROR_OPERATION_ABORTED;
+				break;
 			}
-			else
-				Sleep(dwPauseBetweenRetries);
+			// try another IP address in the list. this is done last: if it picks a half open node to probe, the probe goes out right away
+			if (!GetNextECSIP(IPUsed, bFailOpen))
+				break;
 		}
 	}
 	catch (const CS3ErrorInfo& E)
@@ -1623,6 +2153,7 @@ CECSConnection::S3_ERROR CECSConnection::SendRequest(
 			}
 		}
 	}
+	ReleaseProbe();				// a probe that was picked but never sent (exception...)
 	if (!Error.IfError() && !IPUsed.empty())
 	{
 		// got through but had problems with at least one IP address
@@ -1766,6 +2297,155 @@ static bool TestAbortStatic(void *pContext)
 	return pHost->TestAbort();
 }
 
+// S3 V4 aws-chunked upload support
+// each chunk is hashed on a shared pool as soon as it is filled, while the send thread goes on to
+// fill the next one and send the one before it. the send thread only has to chain the chunk signatures
+// the chunk data isn't copied. a chunk is a list of slices of the stream entry buffers (CBuffer shares
+// the memory), and it is sent as the chunk metadata followed by each slice, using separate writes
+const UINT S3V4_CHUNK_PIPELINE = 2;				// number of filled chunks held before the oldest one is sent
+
+struct CS3V4Slice
+{
+	CBuffer Data;						// shares the stream entry buffer. only used through const methods so it is never copied
+	DWORD dwOffset;						// start of the slice in Data
+	DWORD dwLen;						// length of the slice
+	CS3V4Slice(const CBuffer& DataParam, DWORD dwOffsetParam, DWORD dwLenParam)
+		: Data(DataParam)
+		, dwOffset(dwOffsetParam)
+		, dwLen(dwLenParam)
+	{}
+};
+
+struct CS3V4Chunk
+{
+	CBuffer Prefix;						// CRLF ending the previous chunk (if any), then the chunk metadata
+	std::vector<CS3V4Slice> SliceList;	// the chunk data
+	UINT uDataLen;						// length of the data
+	CBuffer Hash;						// SHA256 of the data. set by the hash pool
+	DWORD dwError;						// error from the hash
+	CEvent evHashed;					// set when the hash pool is done with the chunk
+
+	CS3V4Chunk()
+		: uDataLen(0)
+		, dwError(ERROR_SUCCESS)
+		, evHashed(FALSE, TRUE)
+	{}
+	// number of writes needed to send the chunk: the prefix, then each slice
+	UINT GetPieceCount(void) const
+	{
+		return (UINT)SliceList.size() + 1;
+	}
+	// get the data for one write
+	void GetPiece(UINT uPiece, const BYTE *& pData, DWORD& dwLen) const
+	{
+		if (uPiece == 0)
+		{
+			pData = Prefix.GetData();
+			dwLen = Prefix.GetBufSize();
+		}
+		else
+		{
+			const CS3V4Slice& Slice = SliceList[uPiece - 1];
+			pData = Slice.Data.GetData() + Slice.dwOffset;
+			dwLen = Slice.dwLen;
+		}
+	}
+};
+
+class CS3V4ChunkHashPool : public CThreadPool<std::shared_ptr<CS3V4Chunk>>
+{
+public:
+	bool DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<CS3V4Chunk>& Chunk);
+	~CS3V4ChunkHashPool()
+	{
+		CThreadPool<std::shared_ptr<CS3V4Chunk>>::Terminate();
+	}
+};
+
+static CCriticalSection csS3V4ChunkHashPool;					// protects pS3V4ChunkHashPool
+static std::unique_ptr<CS3V4ChunkHashPool> pS3V4ChunkHashPool;	// created on first use
+
+bool CS3V4ChunkHashPool::DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<CS3V4Chunk>& Chunk)
+{
+	(void)pThread;
+	try
+	{
+		CCngAES_GCM Hash;
+		Hash.CreateHash(BCRYPT_SHA256_ALGORITHM);
+		for (std::vector<CS3V4Slice>::const_iterator itSlice = Chunk->SliceList.begin(); itSlice != Chunk->SliceList.end(); ++itSlice)
+			Hash.AddHashData(itSlice->Data.GetData() + itSlice->dwOffset, itSlice->dwLen);
+		Hash.GetHashData(Chunk->Hash);
+	}
+	catch (const CErrorInfo& E)
+	{
+		Chunk->dwError = E.dwError;
+	}
+	(void)Chunk->evHashed.SetEvent();
+	return true;
+}
+
+// GetS3V4Chunk
+// get an empty chunk, reusing one that has already been sent if possible
+static std::shared_ptr<CS3V4Chunk> GetS3V4Chunk(std::vector<std::shared_ptr<CS3V4Chunk>>& FreeList)
+{
+	std::shared_ptr<CS3V4Chunk> Chunk;
+	if (FreeList.empty())
+		Chunk = std::make_shared<CS3V4Chunk>();
+	else
+	{
+		Chunk = FreeList.back();
+		FreeList.pop_back();
+		Chunk->SliceList.clear();				// let go of the stream buffers
+		Chunk->Hash.Empty();
+		Chunk->dwError = ERROR_SUCCESS;
+		(void)Chunk->evHashed.ResetEvent();
+	}
+	Chunk->uDataLen = 0;
+	return Chunk;
+}
+
+// StartS3V4ChunkHash
+// send a filled chunk to the hash pool
+static void StartS3V4ChunkHash(const std::shared_ptr<CS3V4Chunk>& Chunk)
+{
+	{
+		CSingleLock lock(&csS3V4ChunkHashPool, true);
+		if (!pS3V4ChunkHashPool)
+		{
+			SYSTEM_INFO SysInfo;
+			GetSystemInfo(&SysInfo);
+			pS3V4ChunkHashPool.reset(new CS3V4ChunkHashPool);
+			pS3V4ChunkHashPool->SetMinThreads(1);
+			pS3V4ChunkHashPool->SetMaxThreads(__max(SysInfo.dwNumberOfProcessors, 1));
+			CThreadPoolBase::SetPoolInitialized();
+		}
+	}
+	std::shared_ptr<std::shared_ptr<CS3V4Chunk>> AutoMsg;
+	AutoMsg.reset(new std::shared_ptr<CS3V4Chunk>(Chunk));
+	pS3V4ChunkHashPool->SendMessageToPool(__LINE__, AutoMsg, 0, 0, nullptr);
+}
+
+// WaitS3V4ChunkHash
+// wait for the hash pool to finish a chunk. throws on error or abort
+static void WaitS3V4ChunkHash(CECSConnection *pConn, CS3V4Chunk& Chunk)
+{
+	while (WaitForSingleObject(Chunk.evHashed.m_hObject, SECONDS(1)) == WAIT_TIMEOUT)
+	{
+		if (pConn->TestAbort())
+			throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
+	}
+	if (Chunk.dwError != ERROR_SUCCESS)
+		throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, Chunk.dwError);
+}
+
+// TerminateS3V4ChunkHash
+// shut down the chunk hash pool. called from ECSTermLib
+void CECSConnection::TerminateS3V4ChunkHash(void)
+{
+	CSingleLock lock(&csS3V4ChunkHashPool, true);
+	pS3V4ChunkHashPool.reset();
+}
+
 CStringA CECSConnection::BuildV4ChunkMetadata(UINT uChunkLength, const CString& sSignature)
 {
 	CStateRef State(this);
@@ -1775,10 +2455,16 @@ CStringA CECSConnection::BuildV4ChunkMetadata(UINT uChunkLength, const CString&
 	return sChunkPrefix;
 }
 
+// CreateS3V4ChunkMetadata
+// sign the chunk and build the data that is sent ahead of it
+// the CRLF that ends a chunk is sent at the start of the next chunk's prefix. the final (empty) chunk
+// gets its own CRLF as well
 void CECSConnection::CreateS3V4ChunkMetadata(
 	CString& sPreviousSignature,
-	CBuffer& S3AuthV4SendBuf,
-	UINT& uS3AuthV4SendBufIndex,
+	CBuffer& ChunkPrefix,					// returned: chunk prefix
+	bool bEndPrevChunk,						// a chunk with data was sent before this one. end it first
+	UINT uChunkLen,							// length of the chunk data
+	const CBuffer& ChunkHash,				// SHA256 of the chunk data. empty if there is no data
 	const CString& sEmptySignature,
 	const CBuffer& S3SigningKey,
 	const SYSTEMTIME& stRequestTime)
@@ -1787,7 +2473,6 @@ void CECSConnection::CreateS3V4ChunkMetadata(
 	CCngAES_GCM Hash;
 	CString sSignature;
 
-	CBuffer CurrentHash;
 	CString sStringToSign(_T("AWS4-HMAC-SHA256-PAYLOAD\n")), sStr;
 	//		sStringToSign += GetCanonicalTime(&stRequestTime) + _T("\n");
 	sStringToSign += FormatISO8601Date(stRequestTime, false, false, true) + _T("\n");
@@ -1795,13 +2480,8 @@ void CECSConnection::CreateS3V4ChunkMetadata(
 	sStringToSign += sStr;
 	sStringToSign += sPreviousSignature + _T("\n");
 	sStringToSign += sEmptySignature + _T("\n");
-	if (uS3AuthV4SendBufIndex > 0)
-	{
-		Hash.CreateHash(BCRYPT_SHA256_ALGORITHM);
-		Hash.AddHashData(S3AuthV4SendBuf.GetData() + State.Ref->uS3AuthV4ChunkMetadataOffset, uS3AuthV4SendBufIndex);
-		Hash.GetHashData(CurrentHash);
-		sStringToSign += BinaryToHexString(CurrentHash);
-	}
+	if (!ChunkHash.IsEmpty())
+		sStringToSign += BinaryToHexString(ChunkHash);
 	else
 		sStringToSign += sEmptySignature;
 
@@ -1815,10 +2495,12 @@ void CECSConnection::CreateS3V4ChunkMetadata(
 	sSignature = BinaryToHexString(Signature);
 	sPreviousSignature = sSignature;
 
-	CStringA sChunkPrefix(BuildV4ChunkMetadata(uS3AuthV4SendBufIndex, sSignature));
-	CopyMemory((void *)S3AuthV4SendBuf.GetData(), (LPCSTR)sChunkPrefix, sChunkPrefix.GetLength());
-	S3AuthV4SendBuf.SetAt(State.Ref->uS3AuthV4ChunkMetadataOffset + uS3AuthV4SendBufIndex, '\r');
-	S3AuthV4SendBuf.SetAt(State.Ref->uS3AuthV4ChunkMetadataOffset + uS3AuthV4SendBufIndex + 1, '\n');
+	CStringA sChunkPrefix(BuildV4ChunkMetadata(uChunkLen, sSignature));
+	if (bEndPrevChunk)
+		sChunkPrefix.Insert(0, "\r\n");
+	if (uChunkLen == 0)
+		sChunkPrefix += "\r\n";
+	ChunkPrefix.Load((LPCSTR)sChunkPrefix, sChunkPrefix.GetLength());
 }
 
 // SendRequestInternal
@@ -1844,10 +2526,16 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 	// use const version of pStreamSend to use "read" locks instead of "write" locks when only reading is being done
 	const STREAM_CONTEXT *pConstStreamSend = (const STREAM_CONTEXT *)pStreamSend;
 	bool bS3AuthV4 = false;
+	bool bS3AuthV4UnsignedStream = false;		// V4 stream upload over HTTPS sent as UNSIGNED-PAYLOAD
+	bool bS3AuthV4Chunked = false;				// V4 stream upload sent as signed aws-chunked chunks
 	UINT uS3AuthV4ChunkSize(DefaultS3AuthV4ChunkSize);
 	ULONGLONG ullTotalPayloadLen(ullTotalLen);
-	CBuffer S3AuthV4SendBuf;
-	UINT uS3AuthV4SendBufIndex = 0;
+	std::shared_ptr<CS3V4Chunk> S3AuthV4FillChunk;						// chunk being filled
+	std::deque<std::shared_ptr<CS3V4Chunk>> S3AuthV4PendingList;		// filled chunks waiting to be sent, oldest first
+	std::vector<std::shared_ptr<CS3V4Chunk>> S3AuthV4FreeList;			// sent chunks, available for reuse
+	std::shared_ptr<CS3V4Chunk> S3AuthV4SendChunk;						// chunk being sent
+	UINT uS3AuthV4SendPiece = 0;										// next piece of S3AuthV4SendChunk to write
+	bool bS3AuthV4ChunkSent = false;									// a chunk with data has been sent
 	CString sPreviousSignature, sEmptySignature;
 	CBuffer S3SigningKey;
 	CCngAES_GCM Hash;
@@ -1873,7 +2561,9 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 			if (dwMaxStreamQueueSizeRecv == 0)
 				dwMaxStreamQueueSizeRecv = 1000;
 		}
-		bS3AuthV4 = IfS3v4(&uS3AuthV4ChunkSize);
+		bS3AuthV4 = IfS3v4(&uS3AuthV4ChunkSize, &bS3AuthV4UnsignedStream);
+		bS3AuthV4UnsignedStream = bS3AuthV4UnsignedStream && bS3AuthV4 && bSSL && (pConstStreamSend != nullptr);
+		bS3AuthV4Chunked = bS3AuthV4 && !bS3AuthV4UnsignedStream && (pConstStreamSend != nullptr);
 
 		// if V4, initialize the send buffer
 		if (bS3AuthV4)
@@ -1895,7 +2585,8 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 			CStringA sTestSig = BuildV4ChunkMetadata(uS3AuthV4ChunkSize, sEmptySignature);
 			State.Ref->uS3AuthV4ChunkMetadataOffset = sTestSig.GetLength();
 			State.Ref->uS3AuthV4ChunkMetadataSize = State.Ref->uS3AuthV4ChunkMetadataOffset + 2;
-			S3AuthV4SendBuf.SetBufSize(uS3AuthV4ChunkSize + State.Ref->uS3AuthV4ChunkMetadataSize);
+			if (bS3AuthV4Chunked)
+				S3AuthV4FillChunk = GetS3V4Chunk(S3AuthV4FreeList);
 		}
 
 		// fixup the host header line (if it exists)
@@ -1931,7 +2622,7 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 			*pbGotServerResponse = false;
 		if (pConstStreamSend != nullptr)
 		{
-			if (bS3AuthV4)
+			if (bS3AuthV4Chunked)
 			{
 				// if v4auth, gotta take the metadata into account
 				ULONGLONG ullChunks = ullTotalLen / uS3AuthV4ChunkSize;
@@ -1955,9 +2646,19 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 		if (!bS3AuthV4)
 			sSignature = signRequestS3v2(sSecret, sMethod, sResource, State.Ref->Headers);
 		else
+		{
+			E_S3_V4_PAYLOAD PayloadType = E_S3_V4_PAYLOAD::Signed;
+			if (bS3AuthV4Chunked)
+				PayloadType = E_S3_V4_PAYLOAD::Chunked;
+			else if (bS3AuthV4UnsignedStream)
+			{
+				PayloadType = E_S3_V4_PAYLOAD::Unsigned;
+				AddHeader(_T("x-amz-content-sha256"), _T("UNSIGNED-PAYLOAD"));
+			}
 			sSignature = signRequestS3v4(sSecret, sMethod, sResource,
-				State.Ref->Headers, pData, dwDataLen, pConstStreamSend != nullptr ? E_S3_V4_PAYLOAD::Chunked : E_S3_V4_PAYLOAD::Signed, ullTotalLen, ullTotalPayloadLen, S3SigningKey,
+				State.Ref->Headers, pData, dwDataLen, PayloadType, ullTotalLen, ullTotalPayloadLen, S3SigningKey,
 				sPreviousSignature, stRequestTime);
+		}
 
 		DWORD dwError = InitSession();
 		if (dwError != ERROR_SUCCESS)
@@ -1996,10 +2697,18 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 			sHeaders += _T("Authorization: ") + sSignature + _T("\r\n");
 		DWORD dwIndex;
 		CBuffer RetBuf;
-		bool bUploadThrottle;
-		bool bDownloadThrottle;
+		CThrottlePath UploadThrottle, DownloadThrottle;
 		bool bAuthFailure = false;
-		IfThrottle(&bDownloadThrottle, &bUploadThrottle);
+		GetThrottlePath(pszResource, UploadThrottle, DownloadThrottle);
+		{
+			DWORD dwWeight = dwThrottleWeight;
+			if ((pConstStreamSend != nullptr) && (pConstStreamSend->dwThrottleWeight != 0))
+				dwWeight = pConstStreamSend->dwThrottleWeight;
+			else if ((pStreamReceive != nullptr) && (pStreamReceive->dwThrottleWeight != 0))
+				dwWeight = pStreamReceive->dwThrottleWeight;
+			UploadThrottle.SetWeight(dwWeight);
+			DownloadThrottle.SetWeight(dwWeight);
+		}
 		// loop here in case the request needs to be resent because the proxy server needs authorization
 		for (UINT iRetryAuth=0 ; iRetryAuth<3 ; iRetryAuth++)
 		{
@@ -2030,7 +2739,7 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 				ULONGLONG ullCurDataSent = 0ULL;
 				if ((dwMaxWriteRequest > 0) && (dwDataPartLen > dwMaxWriteRequest))
 					dwDataPartLen = dwMaxWriteRequest;
-				if (bUploadThrottle && (pConstStreamSend == nullptr))
+				if (!UploadThrottle.IfEmpty() && (pConstStreamSend == nullptr))
 					dwDataPartLen = 0;							// just start the request but send the data below where it is controlled by the throttle
 				for (;;)
 				{
@@ -2102,6 +2811,15 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 						PrepareCmd();
 						bWriteDataSuccess = WinHttpWriteData(State.Ref->hRequest, (BYTE *)pData + (DWORD)ullCurDataSent, dwDataPartLen, nullptr) != FALSE;
 					}
+					else if (S3AuthV4SendChunk)
+					{
+						// in the middle of sending a V4 chunk. write the next piece
+						const BYTE *pPiece;
+						DWORD dwPieceLen;
+						S3AuthV4SendChunk->GetPiece(uS3AuthV4SendPiece, pPiece, dwPieceLen);
+						PrepareCmd();
+						bWriteDataSuccess = WinHttpWriteData(State.Ref->hRequest, pPiece, dwPieceLen, nullptr) != FALSE;
+					}
 					else
 					{
 						if (!bStreamBufAvailable)
@@ -2128,28 +2846,39 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 							else
 							{
 								dwDataPartLen = pConstStreamSend->StreamData.front().Data.GetBufSize() - (DWORD)ullCurDataSent;
-								if (bS3AuthV4)
+								if (bS3AuthV4Chunked)
 								{
-									UINT uFreeSpace = uS3AuthV4ChunkSize - uS3AuthV4SendBufIndex;
+									CS3V4Chunk& FillChunk = *S3AuthV4FillChunk;
+									UINT uFreeSpace = uS3AuthV4ChunkSize - FillChunk.uDataLen;
 									if (uFreeSpace < dwDataPartLen)
 										dwDataPartLen = uFreeSpace;
 									if (dwDataPartLen > 0)
 									{
-										memcpy_s(S3AuthV4SendBuf.GetData() + State.Ref->uS3AuthV4ChunkMetadataOffset + uS3AuthV4SendBufIndex,
-											S3AuthV4SendBuf.GetBufSize() - State.Ref->uS3AuthV4ChunkMetadataOffset - uS3AuthV4SendBufIndex,
-											pConstStreamSend->StreamData.front().Data.GetData() + ullCurDataSent,
-											dwDataPartLen);
-										uS3AuthV4SendBufIndex += dwDataPartLen;
+										// no copy. the slice shares the stream entry buffer
+										FillChunk.SliceList.emplace_back(CS3V4Slice(pConstStreamSend->StreamData.front().Data, (DWORD)ullCurDataSent, dwDataPartLen));
+										FillChunk.uDataLen += dwDataPartLen;
 										ullCurDataSent += dwDataPartLen;
 									}
-									if (uS3AuthV4ChunkSize == uS3AuthV4SendBufIndex)
+									if (uS3AuthV4ChunkSize == FillChunk.uDataLen)
+									{
+										// got a full buffer. get it hashed and start filling the next one
+										StartS3V4ChunkHash(S3AuthV4FillChunk);
+										S3AuthV4PendingList.push_back(S3AuthV4FillChunk);
+										S3AuthV4FillChunk = GetS3V4Chunk(S3AuthV4FreeList);
+									}
+									if (S3AuthV4PendingList.size() >= S3V4_CHUNK_PIPELINE)
 									{
-										// got a full buffer. time to send it
+										// time to send the oldest chunk. start with the prefix
 										// prepare string to sign
-										CreateS3V4ChunkMetadata(sPreviousSignature, S3AuthV4SendBuf, uS3AuthV4SendBufIndex, sEmptySignature, S3SigningKey, stRequestTime);
+										S3AuthV4SendChunk = S3AuthV4PendingList.front();
+										S3AuthV4PendingList.pop_front();
+										WaitS3V4ChunkHash(this, *S3AuthV4SendChunk);
+										CreateS3V4ChunkMetadata(sPreviousSignature, S3AuthV4SendChunk->Prefix, bS3AuthV4ChunkSent, S3AuthV4SendChunk->uDataLen, S3AuthV4SendChunk->Hash, sEmptySignature, S3SigningKey, stRequestTime);
+										bS3AuthV4ChunkSent = true;
+										uS3AuthV4SendPiece = 0;
 
 										PrepareCmd();
-										bWriteDataSuccess = WinHttpWriteData(State.Ref->hRequest, S3AuthV4SendBuf.GetData(), uS3AuthV4SendBufIndex + State.Ref->uS3AuthV4ChunkMetadataSize, nullptr) != FALSE;
+										bWriteDataSuccess = WinHttpWriteData(State.Ref->hRequest, S3AuthV4SendChunk->Prefix.GetData(), S3AuthV4SendChunk->Prefix.GetBufSize(), nullptr) != FALSE;
 										bDoWriteData = true;
 									}
 									else
@@ -2198,8 +2927,14 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 								(void)InterlockedExchangeAdd64((LONG64 *)pullPerfBytesSent, State.Ref->CallbackContext.dwBytesWritten);
 						}
 
-						if (bS3AuthV4)
-							uS3AuthV4SendBufIndex = 0;
+						if (bS3AuthV4Chunked)
+						{
+							if (++uS3AuthV4SendPiece >= S3AuthV4SendChunk->GetPieceCount())
+							{
+								S3AuthV4FreeList.push_back(S3AuthV4SendChunk);
+								S3AuthV4SendChunk.reset();
+							}
+						}
 						else
 							ullCurDataSent += (ULONGLONG)State.Ref->CallbackContext.dwBytesWritten;
 						iDataSent = (int)State.Ref->CallbackContext.dwBytesWritten;
@@ -2215,25 +2950,46 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 							pStreamSend->iAccProgress += iDataSent;
 							pConstStreamSend->UpdateProgressCB(iDataSent, pConstStreamSend->pContext);
 						}
-						if (ullCurDataSent >= (ULONGLONG)pConstStreamSend->StreamData.front().Data.GetBufSize())
+						if (bStreamBufAvailable && (ullCurDataSent >= (ULONGLONG)pConstStreamSend->StreamData.front().Data.GetBufSize()))
 						{
 							CRWLockAcquire lockQueue(&pConstStreamSend->StreamData.GetLock(), true);			// write lock
 							bLast = pConstStreamSend->StreamData.front().bLast;
+							pStreamSend->SaveRewind(pConstStreamSend->StreamData.front());
 							pStreamSend->StreamData.pop_front();
 							bStreamBufAvailable = false;
 						}
 					}
 					if (bLast)
 					{
-						if (bS3AuthV4)
+						if (bS3AuthV4Chunked)
 						{
 							// send any remaining data
-							if (uS3AuthV4SendBufIndex > 0)
+							if (S3AuthV4FillChunk->uDataLen > 0)
 							{
-								// prepare string to sign
-								CreateS3V4ChunkMetadata(sPreviousSignature, S3AuthV4SendBuf, uS3AuthV4SendBufIndex, sEmptySignature, S3SigningKey, stRequestTime);
+								StartS3V4ChunkHash(S3AuthV4FillChunk);
+								S3AuthV4PendingList.push_back(S3AuthV4FillChunk);
+								S3AuthV4FillChunk = GetS3V4Chunk(S3AuthV4FreeList);
+							}
+							// finish the chunk being sent, then send the rest of the chunks in order
+							for (;;)
+							{
+								if (!S3AuthV4SendChunk)
+								{
+									if (S3AuthV4PendingList.empty())
+										break;
+									// prepare string to sign
+									S3AuthV4SendChunk = S3AuthV4PendingList.front();
+									S3AuthV4PendingList.pop_front();
+									WaitS3V4ChunkHash(this, *S3AuthV4SendChunk);
+									CreateS3V4ChunkMetadata(sPreviousSignature, S3AuthV4SendChunk->Prefix, bS3AuthV4ChunkSent, S3AuthV4SendChunk->uDataLen, S3AuthV4SendChunk->Hash, sEmptySignature, S3SigningKey, stRequestTime);
+									bS3AuthV4ChunkSent = true;
+									uS3AuthV4SendPiece = 0;
+								}
+								const BYTE *pPiece;
+								DWORD dwPieceLen;
+								S3AuthV4SendChunk->GetPiece(uS3AuthV4SendPiece, pPiece, dwPieceLen);
 								PrepareCmd();
-								bWriteDataSuccess = WinHttpWriteData(State.Ref->hRequest, S3AuthV4SendBuf.GetData(), uS3AuthV4SendBufIndex + State.Ref->uS3AuthV4ChunkMetadataSize, nullptr) != FALSE;
+								bWriteDataSuccess = WinHttpWriteData(State.Ref->hRequest, pPiece, dwPieceLen, nullptr) != FALSE;
 								if (!bWriteDataSuccess)
 								{
 									dwError = GetLastError();
@@ -2244,16 +3000,21 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 									throw CS3ErrorInfo(_T(__FILE__), __LINE__, State.Ref->CallbackContext.Result.dwError);
 								if (pConstStreamSend->UpdateProgressCB != nullptr)
 								{
-									pStreamSend->iAccProgress += uS3AuthV4SendBufIndex + State.Ref->uS3AuthV4ChunkMetadataSize;
-									pConstStreamSend->UpdateProgressCB(uS3AuthV4SendBufIndex + State.Ref->uS3AuthV4ChunkMetadataSize, pConstStreamSend->pContext);
+									pStreamSend->iAccProgress += (int)State.Ref->CallbackContext.dwBytesWritten;
+									pConstStreamSend->UpdateProgressCB((int)State.Ref->CallbackContext.dwBytesWritten, pConstStreamSend->pContext);
 								}
 								ullTotalBytesSent += State.Ref->CallbackContext.dwBytesWritten;
+								if (++uS3AuthV4SendPiece >= S3AuthV4SendChunk->GetPieceCount())
+								{
+									S3AuthV4FreeList.push_back(S3AuthV4SendChunk);
+									S3AuthV4SendChunk.reset();
+								}
 							}
 							// now send the last packet
-							uS3AuthV4SendBufIndex = 0;
-							CreateS3V4ChunkMetadata(sPreviousSignature, S3AuthV4SendBuf, uS3AuthV4SendBufIndex, sEmptySignature, S3SigningKey, stRequestTime);
+							CS3V4Chunk& LastChunk = *S3AuthV4FillChunk;
+							CreateS3V4ChunkMetadata(sPreviousSignature, LastChunk.Prefix, bS3AuthV4ChunkSent, 0, CBuffer(), sEmptySignature, S3SigningKey, stRequestTime);
 							PrepareCmd();
-							bWriteDataSuccess = WinHttpWriteData(State.Ref->hRequest, S3AuthV4SendBuf.GetData(), uS3AuthV4SendBufIndex + State.Ref->uS3AuthV4ChunkMetadataSize, nullptr) != FALSE;
+							bWriteDataSuccess = WinHttpWriteData(State.Ref->hRequest, LastChunk.Prefix.GetData(), LastChunk.Prefix.GetBufSize(), nullptr) != FALSE;
 							if (!bWriteDataSuccess)
 							{
 								dwError = GetLastError();
@@ -2266,53 +3027,12 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 						}
 						break;
 					}
-					// process download throttle
-					// see if we've used up all of our quota for this interval
-					if (bUploadThrottle)
+					// process upload throttle
+					// charge what was just sent and wait until every limit allows more
+					if (!UploadThrottle.IfEmpty())
 					{
-						std::map<CString, THROTTLE_REC>::iterator itThrottle;
-						{
-							CSingleLock lock(&csThrottleMap, true);
-							itThrottle = ThrottleMap.find(sHost);
-							if ((itThrottle != ThrottleMap.end()) && (itThrottle->second.Upload.iBytesSec != 0))
-							{
-								// okay, we need to throttle
-								itThrottle->second.Upload.iBytesCurInterval -= (int)State.Ref->CallbackContext.dwBytesWritten;
-							}
-						}
-						for (;;)
-						{
-							if (TestAbort())
-								throw CS3ErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
-							// now check if the bytes for this interval is positive
-							{
-								CSingleLock lock(&csThrottleMap, true);
-								itThrottle = ThrottleMap.find(sHost);
-								if ((itThrottle == ThrottleMap.end()) || (itThrottle->second.Upload.iBytesSec == 0))
-								{
-									// the throttle disappeared! The user must have turned throttle off
-									break;					// just go full speed
-								}
-								// okay, we need to throttle
-								if (itThrottle->second.Upload.iBytesCurInterval >= 0)
-									break;
-							}
-							// wait for the next time slot where hopefully we can receive more bytes
-							dwError = WaitForSingleObject(State.Ref->evThrottle.m_hObject, SECONDS(2));
-							switch (dwError)
-							{
-							case WAIT_FAILED:
-								throw CS3ErrorInfo(_T(__FILE__), __LINE__, GetLastError());
-							case WAIT_ABANDONED:
-								throw CS3ErrorInfo(_T(__FILE__), __LINE__, dwError);
-							default:
-								ASSERT(false);
-								break;
-							case WAIT_TIMEOUT:
-							case WAIT_OBJECT_0:
-								break;
-							}
-						}
+						if (!UploadThrottle.Consume(State.Ref->CallbackContext.dwBytesWritten, ThrottleAbortCB, this))
+							throw CS3ErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
 					}
 				}
 			}
@@ -2332,6 +3052,11 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 					*pbGotServerResponse = true;
 				throw CS3ErrorInfo(_T(__FILE__), __LINE__, State.Ref->CallbackContext.Result.dwError);
 			}
+			{
+				LARGE_INTEGER liResponse;
+				(void)QueryPerformanceCounter(&liResponse);
+				State.Ref->llResponseTime = liResponse.QuadPart;
+			}
 			if (pbGotServerResponse != nullptr)
 				*pbGotServerResponse = true;
 			dwIndex = 0;
@@ -2475,7 +3200,7 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 						RcvBuf.Data.Empty();
 						RcvBuf.ullOffset = dwLen;
 						RcvBuf.bLast = true;
-						pStreamReceive->StreamData.push_back(RcvBuf,
+						pStreamReceive->PushReceive(RcvBuf,
 							dwMaxStreamQueueSizeRecv,
 							TestAbortStatic,
 							this);
@@ -2497,7 +3222,10 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 			}
 			else
 			{
-				RcvBuf.Data.SetBufSize(dwSize);
+				// release the buffer that was pushed on the queue on the last pass
+				// if it is still shared, SetBufSize would copy the old data into a new buffer
+				RcvBuf.Data.Empty();
+				RcvBuf.Data.SetBufSizeNoInit(dwSize);
 				RcvBuf.bLast = false;
 				bReadReturn = WinHttpReadData(State.Ref->hRequest, RcvBuf.Data.GetData(), dwSize, nullptr) != FALSE;
 			}
@@ -2530,7 +3258,9 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 					RcvBuf.ullOffset = dwLen;
 					pStreamReceive->ullTotalSize += (ULONGLONG)dwDownloaded;
 					State.Ref->ullReadBytes += (ULONGLONG)dwDownloaded;
-					pStreamReceive->StreamData.push_back(RcvBuf,
+					if (pStreamReceive->ReceiveCB != nullptr)
+						pStreamReceive->ReceiveCB(RcvBuf.Data, pStreamReceive->pReceiveContext);
+					pStreamReceive->PushReceive(RcvBuf,
 						dwMaxStreamQueueSizeRecv,
 						TestAbortStatic,
 						this);
@@ -2544,51 +3274,11 @@ CECSConnection::S3_ERROR CECSConnection::SendRequestInternal(
 			}
 			dwLen += dwDownloaded;
 			// process download throttle
-			// see if we've used up all of our quota for this interval
-			if (bDownloadThrottle)
+			// charge what was just received and wait until every limit allows more
+			if (!DownloadThrottle.IfEmpty())
 			{
-				std::map<CString,THROTTLE_REC>::iterator itThrottle;
-				{
-					CSingleLock lock(&csThrottleMap, true);
-					itThrottle = ThrottleMap.find(sHost);
-					if ((itThrottle != ThrottleMap.end()) && (itThrottle->second.Download.iBytesSec != 0))
-					{
-						itThrottle->second.Download.iBytesCurInterval -= (int)dwDownloaded;
-					}
-				}
-				for (;;)
-				{
-					if (TestAbort())
-						throw CS3ErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
-					// now check if the bytes for this interval has become positive
-					{
-						CSingleLock lock(&csThrottleMap, true);
-						itThrottle = ThrottleMap.find(sHost);
-						if ((itThrottle == ThrottleMap.end()) || (itThrottle->second.Download.iBytesSec == 0))
-						{
-							// throttle has been canceled during this download
-							// go full speed
-							break;
-						}
-						if (itThrottle->second.Download.iBytesCurInterval >= 0)
-							break;
-					}
-					// wait for the next time slot where hopefully we can receive more bytes
-					dwError = WaitForSingleObject(State.Ref->evThrottle.m_hObject, SECONDS(2));
-					switch (dwError)
-					{
-					case WAIT_FAILED:
-						throw CS3ErrorInfo(_T(__FILE__), __LINE__, GetLastError());
-					case WAIT_ABANDONED:
-						throw CS3ErrorInfo(_T(__FILE__), __LINE__, dwError);
-					default:
-						ASSERT(false);
-						break;
-					case WAIT_TIMEOUT:
-					case WAIT_OBJECT_0:
-						break;
-					}
-				}
+				if (!DownloadThrottle.Consume(dwDownloaded, ThrottleAbortCB, this))
+					throw CS3ErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
 			}
 		}
 		// verify that RetData is NUL terminated
@@ -2732,14 +3422,25 @@ void CECSConnection::SetHostAuth(bool bAuthV4, UINT uS3AuthV4ChunkSize)
 	uS3AuthV4ChunkSize = uS3AuthV4ChunkSize;
 }
 
-bool CECSConnection::IfS3v4(UINT *puChunkSize) const
+bool CECSConnection::IfS3v4(UINT *puChunkSize, bool *pbUnsignedPayload) const
 {
 	CSimpleRWLockAcquire lockRead(&lwrS3V4SigningKey, false);				// get read lock
 	if (puChunkSize != nullptr)
 		*puChunkSize = uS3AuthV4ChunkSize;
+	if (pbUnsignedPayload != nullptr)
+		*pbUnsignedPayload = bS3AuthV4UnsignedPayload;
 	return bS3AuthV4;
 }
 
+// SetS3V4UnsignedPayload
+// if set, V4 stream uploads over HTTPS use UNSIGNED-PAYLOAD and are sent as is, instead of
+// being broken up into signed aws-chunked chunks. TLS protects the data. ignored over HTTP
+void CECSConnection::SetS3V4UnsignedPayload(bool bUnsignedPayload)
+{
+	CSimpleRWLockAcquire lockWrite(&lwrS3V4SigningKey, true);		// write lock
+	bS3AuthV4UnsignedPayload = bUnsignedPayload;
+}
+
 void CECSConnection::SetRegion(LPCTSTR pszS3Region)
 {
 	sS3Region = pszS3Region;
@@ -3235,6 +3936,10 @@ void CECSConnection::DeleteS3Send()
 // if dwLen != 0, read 'dwLen' bytes starting from lwOffset
 // if lwOffset != 0 and dwLen == 0, read from lwOffset to the end of the file
 // dwBufOffset reserves that many bytes at the start of the buffer. The data is written starting at dwBufOffset
+// if pStreamReceive is set and the connection drops partway through, the read is resumed from the last byte
+// pushed on the stream, using a range request with if-match on the ETag so the object can't change underneath it
+// a resumed range GET doesn't return the x-amz-checksum-* headers for the whole object. pRcvHeaders gets the ones from the first response
+// if pIfMatch is set, the read fails with 412 if the object's ETag doesn't match
 CECSConnection::S3_ERROR CECSConnection::Read(
 	LPCTSTR pszPath,
 	ULONGLONG lwLen,
@@ -3243,7 +3948,8 @@ CECSConnection::S3_ERROR CECSConnection::Read(
 	DWORD dwBufOffset,
 	STREAM_CONTEXT *pStreamReceive,
 	std::list<HEADER_REQ> *pRcvHeaders,
-	ULONGLONG *pullReturnedLength)
+	ULONGLONG *pullReturnedLength,
+	LPCTSTR pIfMatch)
 {
 	const UINT READ_RETRY_MAX_TRIES = 5;
 	CStateRef State(this);
@@ -3252,23 +3958,100 @@ CECSConnection::S3_ERROR CECSConnection::Read(
 	{
 		std::list<HEADER_REQ> HeaderReq;
 		InitHeader();
+		if ((pStreamReceive != nullptr) && pStreamReceive->bChecksumMode)
+			AddHeader(_T("x-amz-checksum-mode"), _T("ENABLED"));
 		CString sRange;
+		ULONGLONG ullResumeBytes = 0ULL;			// stream receive: bytes already pushed on the stream by earlier attempts
+		CString sResumeETag(pIfMatch);				// ETag the object must have. stream receive: ETag of the object being resumed
+		ULONGLONG ullResumeEnd = 0ULL;				// stream receive: offset just past the last byte of the read, from the first response
+		std::list<HEADER_REQ> ChecksumHeaders;		// stream receive: x-amz-checksum-* headers from the first response
 		for (UINT iRetry = 0; iRetry < READ_RETRY_MAX_TRIES; iRetry++)
 		{
 			(void)State.Ref->Headers.erase(_T("range"));			// erase it in case of a retry
+			(void)State.Ref->Headers.erase(_T("if-match"));
 			HeaderReq.clear();
-			if ((lwOffset != 0) || (lwLen != 0))
+			ULONGLONG ullStartOffset = lwOffset + ullResumeBytes;
+			if ((ullStartOffset != 0) || (lwLen != 0))
 			{
-				sRange = _T("bytes=") + FmtNum(lwOffset) + _T("-");
+				sRange = _T("bytes=") + FmtNum(ullStartOffset) + _T("-");
 				if (lwLen != 0)
 					sRange += FmtNum(lwOffset + lwLen - 1);
 				AddHeader(_T("range"), sRange);
 			}
+			if (!sResumeETag.IsEmpty())
+				AddHeader(_T("if-match"), sResumeETag);
 			State.Ref->ullReadBytes = 0ULL;
 			Error = SendRequest(_T("GET"), (LPCTSTR)UriEncode(pszPath), nullptr, 0, RetData, &HeaderReq,
-				((pStreamReceive == nullptr) && (lwLen != 0)) ? ((DWORD)lwLen + 1024) : 0, dwBufOffset, nullptr, pStreamReceive, lwOffset);
+				((pStreamReceive == nullptr) && (lwLen != 0)) ? ((DWORD)lwLen + 1024) : 0, dwBufOffset, nullptr, pStreamReceive, ullStartOffset);
 			if (pRcvHeaders != nullptr)
+			{
 				*pRcvHeaders = HeaderReq;
+				if (ullResumeBytes != 0ULL)
+				{
+					for (std::list<HEADER_REQ>::iterator it = pRcvHeaders->begin(); it != pRcvHeaders->end();)
+					{
+						if (it->sHeader.Left(15).CompareNoCase(_T("x-amz-checksum-")) == 0)
+							it = pRcvHeaders->erase(it);
+						else
+							++it;
+					}
+					pRcvHeaders->insert(pRcvHeaders->end(), ChecksumHeaders.begin(), ChecksumHeaders.end());
+				}
+			}
+			if (Error.IfError() && (pStreamReceive != nullptr) && (iRetry < (READ_RETRY_MAX_TRIES - 1))
+				&& (IfMarkIPBad(Error.dwError) || (Error.dwHttpError >= HTTP_STATUS_SERVER_ERROR)) && !TestAbort())
+			{
+				// SendRequest can't retry a stream. pick up where it left off
+				if (sResumeETag.IsEmpty())
+				{
+					for (std::list<HEADER_REQ>::const_iterator it = HeaderReq.begin(); it != HeaderReq.end(); ++it)
+					{
+						if ((it->sHeader.CompareNoCase(_T("ETag")) == 0) && (it->ContentList.size() == 1))
+							sResumeETag = it->ContentList.front();
+					}
+				}
+				if ((ullResumeBytes == 0ULL) && (State.Ref->ullReadBytes != 0ULL))
+				{
+					// first response with data. hang on to what a range request won't give back
+					bool bGotRange = false;
+					for (std::list<HEADER_REQ>::const_iterator it = HeaderReq.begin(); it != HeaderReq.end(); ++it)
+					{
+						if (it->sHeader.Left(15).CompareNoCase(_T("x-amz-checksum-")) == 0)
+							ChecksumHeaders.push_back(*it);
+						else if ((it->sHeader.CompareNoCase(_T("Content-Range")) == 0) && (it->ContentList.size() == 1))
+						{
+							LONGLONG llStartRange, llEndRange, llTotalSize;
+							if (_stscanf_s(it->ContentList.front(), _T("bytes %I64d-%I64d/%I64d"), &llStartRange, &llEndRange, &llTotalSize) == 3)
+							{
+								ullResumeEnd = (ULONGLONG)llEndRange + 1;
+								bGotRange = true;
+							}
+						}
+						else if ((it->sHeader.CompareNoCase(_T("Content-Length")) == 0) && (it->ContentList.size() == 1) && !bGotRange)
+							ullResumeEnd = lwOffset + (ULONGLONG)_ttoi64(it->ContentList.front());
+					}
+				}
+				ullResumeBytes += State.Ref->ullReadBytes;
+				// if some data got through, it can only be resumed if we know it is the same object
+				if ((ullResumeBytes == 0ULL) || !sResumeETag.IsEmpty())
+				{
+					Sleep(dwPauseBetweenRetries);
+					continue;
+				}
+			}
+			if ((Error.dwHttpError == HTTP_STATUS_RANGE_NOT_SATISFIABLE) && (pStreamReceive != nullptr)
+				&& (ullResumeBytes != 0ULL) && (ullResumeEnd != 0ULL) && (ullStartOffset >= ullResumeEnd))
+			{
+				// the connection dropped after the last byte was pushed on the stream. there is nothing left to read
+				STREAM_DATA_ENTRY RcvBuf;
+				RcvBuf.ullOffset = dwBufOffset;
+				RcvBuf.bLast = true;
+				pStreamReceive->PushReceive(RcvBuf, dwMaxStreamQueueSizeRecv, TestAbortStatic, this);
+				Error = S3_ERROR();
+				if (pullReturnedLength != nullptr)
+					*pullReturnedLength = ullResumeBytes;
+				break;
+			}
 			if (!Error.IfError())
 			{
 				LONGLONG llStartRange, llExpectedLength, llTotalSize;
@@ -3280,7 +4063,7 @@ CECSConnection::S3_ERROR CECSConnection::Read(
 				else
 					ullTotalLength = State.Ref->ullReadBytes;
 				if (pullReturnedLength != nullptr)
-					*pullReturnedLength = ullTotalLength;
+					*pullReturnedLength = ullResumeBytes + ullTotalLength;
 				// make sure we have all the bytes we asked for
 				for (std::list<HEADER_REQ>::const_iterator it = HeaderReq.begin(); it != HeaderReq.end(); ++it)
 				{
@@ -4007,72 +4790,166 @@ CString CECSConnection::S3_ERROR_BASE::Format(bool bOneLine) const
 	return sMsg;
 }
 
+// SetThrottle
+// limit the bandwidth to a host (all CECSConnection objects using this host together)
 void CECSConnection::SetThrottle(
 	LPCTSTR pszHost,						// host name to apply throttle to
 	int iUploadThrottleRate,				// upload throttle rate in bytes/sec. set to 0 to remove throttle for this host
 	int iDownloadThrottleRate)				// download throttle
 {
-	CSingleLock lock(&csThrottleMap, true);
-
+	CSimpleRWLockAcquire lock(&rwlThrottleMap, true);			// write lock
+	std::map<CString, THROTTLE_REC>::iterator itMap = ThrottleMap.find(pszHost);
 	if ((iUploadThrottleRate == 0) && (iDownloadThrottleRate == 0))
 	{
-		(void)ThrottleMap.erase(pszHost);		// erase any entry for the specified host
-		if (ThrottleMap.empty())
+		if (itMap != ThrottleMap.end())
 		{
-			lock.Unlock();
-			TimerThread.KillThreadWait();
+			itMap->second.SetRate(0, 0);			// any transfer still holding the buckets goes full speed
+			(void)ThrottleMap.erase(itMap);
 		}
 	}
 	else
 	{
-		THROTTLE_REC Rec;
-		Rec.Upload.iBytesCurInterval = Rec.Upload.iBytesSec = iUploadThrottleRate;
-		Rec.Download.iBytesCurInterval = Rec.Download.iBytesSec = iDownloadThrottleRate;
-		std::pair<std::map<CString,THROTTLE_REC>::iterator, bool> ret = ThrottleMap.insert(std::make_pair(pszHost, Rec));
-		if (!ret.second)
+		if (itMap == ThrottleMap.end())
+		{
+			itMap = ThrottleMap.insert(std::make_pair(CString(pszHost), THROTTLE_REC())).first;
+			itMap->second.SetFairShare(bThrottleFairShare);
+		}
+		itMap->second.SetRate(iUploadThrottleRate, iDownloadThrottleRate);
+	}
+}
+
+// SetProcessThrottle
+// limit the bandwidth of all CECSConnection objects together
+void CECSConnection::SetProcessThrottle(
+	int iUploadThrottleRate,				// upload throttle rate in bytes/sec. 0 = no limit
+	int iDownloadThrottleRate)				// download throttle
+{
+	ProcessThrottle.SetRate(iUploadThrottleRate, iDownloadThrottleRate);
+}
+
+// SetBucketThrottle
+// limit the bandwidth to one bucket on a host
+void CECSConnection::SetBucketThrottle(
+	LPCTSTR pszHost,						// host name
+	LPCTSTR pszBucket,						// bucket name
+	int iUploadThrottleRate,				// upload throttle rate in bytes/sec. set to 0 to remove throttle for this bucket
+	int iDownloadThrottleRate)				// download throttle
+{
+	CString sKey(pszHost);
+	sKey += _T("/");
+	sKey += pszBucket;
+	CSimpleRWLockAcquire lock(&rwlThrottleMap, true);			// write lock
+	std::map<CString, THROTTLE_REC>::iterator itMap = BucketThrottleMap.find(sKey);
+	if ((iUploadThrottleRate == 0) && (iDownloadThrottleRate == 0))
+	{
+		if (itMap != BucketThrottleMap.end())
 		{
-			ret.first->second.Upload.iBytesCurInterval = ret.first->second.Upload.iBytesSec = iUploadThrottleRate;
-			ret.first->second.Download.iBytesCurInterval = ret.first->second.Download.iBytesSec = iDownloadThrottleRate;
+			itMap->second.SetRate(0, 0);
+			(void)BucketThrottleMap.erase(itMap);
 		}
-		if (!TimerThread.IfActive())
-			(void)TimerThread.CreateThread();
-		TimerThread.StartWork();
-		// wait for the thread to start, so we don't have another thread trying to start it during this period
-		// don't wait more than a couple seconds
-		for (UINT i = 0; i < 200; i++)
+	}
+	else
+	{
+		if (itMap == BucketThrottleMap.end())
 		{
-			if (TimerThread.GetThreadInitialized())
-				break;
-			Sleep(10);
+			itMap = BucketThrottleMap.insert(std::make_pair(sKey, THROTTLE_REC())).first;
+			itMap->second.SetFairShare(bThrottleFairShare);
 		}
+		itMap->second.SetRate(iUploadThrottleRate, iDownloadThrottleRate);
 	}
 }
 
+// SetTransferThrottle
+// limit the bandwidth of this object
+// copies made after this call (such as the threads of a multipart upload) share the same limit
+void CECSConnection::SetTransferThrottle(
+	int iUploadThrottleRate,				// upload throttle rate in bytes/sec. 0 = no limit
+	int iDownloadThrottleRate)				// download throttle
+{
+	TransferThrottle.SetRate(iUploadThrottleRate, iDownloadThrottleRate);
+}
+
+// SetThrottleFairShare
+// with fair sharing, the process, host and bucket limits are divided between the transfers using them in
+// proportion to their weight, so one big transfer can't starve the small requests sharing the limit
+// the transfer limit (SetTransferThrottle) is always first come, first served
+void CECSConnection::SetThrottleFairShare(bool bFairShare)
+{
+	CSimpleRWLockAcquire lock(&rwlThrottleMap, true);			// write lock
+	bThrottleFairShare = bFairShare;
+	ProcessThrottle.SetFairShare(bFairShare);
+	for (std::map<CString, THROTTLE_REC>::iterator itMap = ThrottleMap.begin(); itMap != ThrottleMap.end(); ++itMap)
+		itMap->second.SetFairShare(bFairShare);
+	for (std::map<CString, THROTTLE_REC>::iterator itMap = BucketThrottleMap.begin(); itMap != BucketThrottleMap.end(); ++itMap)
+		itMap->second.SetFairShare(bFairShare);
+}
+
+// SetThrottleWeight
+// weight of the requests from this object (and copies made of it after this call) under fair sharing
+// a STREAM_CONTEXT can override it for one transfer
+void CECSConnection::SetThrottleWeight(DWORD dwWeight)
+{
+	dwThrottleWeight = (dwWeight == 0) ? ThrottleWeightNormal : dwWeight;
+}
+
 void CECSConnection::TerminateThrottle(void)
 {
-	TimerThread.KillThreadWait();
-	CSingleLock lock(&csThrottleMap, true);
+	ProcessThrottle.SetRate(0, 0);
+	CSimpleRWLockAcquire lock(&rwlThrottleMap, true);			// write lock
+	for (std::map<CString, THROTTLE_REC>::iterator itMap = ThrottleMap.begin(); itMap != ThrottleMap.end(); ++itMap)
+		itMap->second.SetRate(0, 0);
+	for (std::map<CString, THROTTLE_REC>::iterator itMap = BucketThrottleMap.begin(); itMap != BucketThrottleMap.end(); ++itMap)
+		itMap->second.SetRate(0, 0);
 	ThrottleMap.clear();
+	BucketThrottleMap.clear();
 }
 
-void CECSConnection::IfThrottle(bool *pbDownloadThrottle, bool *pbUploadThrottle)
+// GetThrottlePath
+// get the buckets a request to pszResource (/bucket/key...) is charged to
+// only the levels that currently have a limit are included, so an empty path means no throttle
+void CECSConnection::GetThrottlePath(LPCTSTR pszResource, CThrottlePath& UploadPath, CThrottlePath& DownloadPath)
 {
-	bool bUploadThrottle = false;
-	bool bDownloadThrottle = false;
-	CSingleLock lock(&csThrottleMap, true);
-	std::map<CString, THROTTLE_REC>::iterator itMap;
-	itMap = ThrottleMap.find(sHost);
-	if (itMap != ThrottleMap.end())
+	UploadPath.Clear();
+	DownloadPath.Clear();
+	UploadPath.Add(ProcessThrottle.Upload);
+	DownloadPath.Add(ProcessThrottle.Download);
 	{
-		if (itMap->second.Upload.iBytesSec != 0)
-			bUploadThrottle = true;
-		if (itMap->second.Download.iBytesSec != 0)
-			bDownloadThrottle = true;
+		CSimpleRWLockAcquire lock(&rwlThrottleMap, false);			// read lock
+		std::map<CString, THROTTLE_REC>::const_iterator itMap = ThrottleMap.find(sHost);
+		if (itMap != ThrottleMap.end())
+		{
+			UploadPath.Add(itMap->second.Upload);
+			DownloadPath.Add(itMap->second.Download);
+		}
+		if (!BucketThrottleMap.empty() && (pszResource != nullptr) && (*pszResource == _T('/')))
+		{
+			CString sKey(pszResource + 1);
+			int iEnd = sKey.FindOneOf(_T("/?"));
+			if (iEnd >= 0)
+				sKey = sKey.Left(iEnd);
+			sKey = sHost + _T("/") + sKey;
+			itMap = BucketThrottleMap.find(sKey);
+			if (itMap != BucketThrottleMap.end())
+			{
+				UploadPath.Add(itMap->second.Upload);
+				DownloadPath.Add(itMap->second.Download);
+			}
+		}
 	}
+	UploadPath.Add(TransferThrottle.Upload);
+	DownloadPath.Add(TransferThrottle.Download);
+}
+
+// IfThrottle
+// check if there is a process, host or transfer limit for this object (bucket limits depend on the request)
+void CECSConnection::IfThrottle(bool *pbDownloadThrottle, bool *pbUploadThrottle)
+{
+	CThrottlePath UploadPath, DownloadPath;
+	GetThrottlePath(nullptr, UploadPath, DownloadPath);
 	if (pbDownloadThrottle != nullptr)
-		*pbDownloadThrottle = bDownloadThrottle;
+		*pbDownloadThrottle = !DownloadPath.IfEmpty();
 	if (pbUploadThrottle != nullptr)
-		*pbUploadThrottle = bUploadThrottle;
+		*pbUploadThrottle = !UploadPath.IfEmpty();
 }
 
 struct XML_S3_SERVICE_INFO_CONTEXT
@@ -4217,6 +5094,88 @@ void CECSConnection::WriteMetadataEntry(std::list<HEADER_STRUCT>& MDList, LPCTST
 	MDList.emplace_back(HEADER_STRUCT(pszTag, sStr));
 }
 
+// CopyS3 support: multipart copy parts are sent to this pool so they run at the same time
+const UINT COPY_PART_RETRIES = 3;							// number of times a failed copy part is retried
+const ULONGLONG COPY_PART_SIZE_MIN = MEGABYTES(256ULL);		// don't make copy parts any smaller than this
+const ULONGLONG COPY_PART_SIZE_MAX = GIGABYTES(5ULL);		// S3 limit on the size of a part
+const UINT COPY_PART_COUNT_MAX = 10000;						// S3 limit on the number of parts
+const UINT COPY_PARTS_PER_THREAD = 4;						// aim for this many parts per thread so the tail doesn't run on a single thread
+
+struct CCopyPartPoolMsg
+{
+	std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY> pPartEntry;
+};
+
+class CCopyPartPool : public CThreadPool<std::shared_ptr<CCopyPartPoolMsg>>
+{
+public:
+	CECSConnection *pConn;								// connection to S3 host
+	const CECSConnection::S3_UPLOAD_PART_INFO *pMultiPartInfo;	// info from multipart initiate
+	LPCTSTR pszSrcPath;									// S3 path of source object
+	LPCTSTR pszVersionId;								// nonNULL: version ID to copy
+	DWORD dwPauseBetweenRetries;						// pause before retrying a part (millisec)
+	bool bAbort;										// set on the first failed part. everything else is dropped
+	CCriticalSection csError;							// protects Error
+	CECSConnection::S3_ERROR Error;						// first error
+
+	bool DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<CCopyPartPoolMsg>& Msg);
+	static bool IfAbort(void *pContext);
+	CCopyPartPool()
+		: pConn(nullptr)
+		, pMultiPartInfo(nullptr)
+		, pszSrcPath(nullptr)
+		, pszVersionId(nullptr)
+		, dwPauseBetweenRetries(0)
+		, bAbort(false)
+	{}
+	~CCopyPartPool()
+	{
+		CThreadPool<std::shared_ptr<CCopyPartPoolMsg>>::Terminate();
+	}
+};
+
+// IfAbort
+// WaitForWorkFinished callback. runs on the thread that called CopyS3
+bool CCopyPartPool::IfAbort(void *pContext)
+{
+	CCopyPartPool *pPool = (CCopyPartPool *)pContext;
+	if (pPool->pConn->TestAbort())
+		pPool->bAbort = true;
+	return pPool->bAbort;
+}
+
+// DoProcess
+// copy one part. server errors and connection failures are retried a few times before the whole copy is failed
+bool CCopyPartPool::DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<CCopyPartPoolMsg>& Msg)
+{
+	(void)pThread;
+	if (bAbort)
+		return true;
+	CECSConnection::CStateReserve StateReserve(pConn);
+	pConn->RegisterAbortPtr(&bAbort);
+	CECSConnection::S3_UPLOAD_PART_ENTRY& PartEntry = *Msg->pPartEntry;
+	CECSConnection::S3_ERROR PartError;
+	for (UINT uTry = 0; ; ++uTry)
+	{
+		PartError = pConn->S3MultiPartUpload(*pMultiPartInfo, PartEntry, nullptr, PartEntry.ullPartSize, pszSrcPath, PartEntry.ullBaseOffset, pszVersionId);
+		if (!PartError.IfError() || bAbort || ((uTry + 1) >= COPY_PART_RETRIES))
+			break;
+		// 4xx errors won't get any better by trying again
+		if ((PartError.dwHttpError != 0) && (PartError.dwHttpError < HTTP_STATUS_SERVER_ERROR))
+			break;
+		Sleep(dwPauseBetweenRetries);
+	}
+	pConn->UnregisterAbortPtr(&bAbort);
+	if (PartError.IfError())
+	{
+		CSingleLock lockError(&csError, true);
+		if (!Error.IfError())
+			Error = PartError;
+		bAbort = true;
+	}
+	return true;
+}
+
 CECSConnection::S3_ERROR CECSConnection::CopyS3(
 	LPCTSTR pszSrcPath,			// S3 path of source object
 	LPCTSTR pszTargetPath,		// S3 path of target object
@@ -4225,8 +5184,6 @@ CECSConnection::S3_ERROR CECSConnection::CopyS3(
 	ULONGLONG ullObjSize,		// optional - if object size supplied it doesn't have to query it
 	const std::list<HEADER_STRUCT> *pMDList)	// list of metadata to apply to object
 {
-	const ULONGLONG MULTIPART_SIZE = GIGABYTES(1ULL);		// each part will be 1GB
-
 	CStateRef State(this);
 	S3_ERROR Error;
 	CBuffer RetData;
@@ -4263,24 +5220,54 @@ CECSConnection::S3_ERROR CECSConnection::CopyS3(
 		if (Error.IfError())
 			return Error;
 		bMultiPartInitiated = true;
-		// copy all parts
+		// pick the part size: enough parts to keep all the threads busy,
+		// but within the S3 limits on part size and part count
+		DWORD dwThreads = dwCopyPartThreads;
+		ULONGLONG ullPartSize = ullObjSize / ((ULONGLONG)dwThreads * COPY_PARTS_PER_THREAD);
+		if (ullPartSize < COPY_PART_SIZE_MIN)
+			ullPartSize = COPY_PART_SIZE_MIN;
+		if (ullPartSize < ((ullObjSize + COPY_PART_COUNT_MAX - 1) / COPY_PART_COUNT_MAX))
+			ullPartSize = (ullObjSize + COPY_PART_COUNT_MAX - 1) / COPY_PART_COUNT_MAX;
+		ullPartSize = ((ullPartSize + MEGABYTES(1ULL) - 1) / MEGABYTES(1ULL)) * MEGABYTES(1ULL);
+		if (ullPartSize > COPY_PART_SIZE_MAX)
+			ullPartSize = COPY_PART_SIZE_MAX;
+		// build the part list. it is already in part number order, which is what S3MultiPartComplete needs
 		ULONGLONG ullOffset = 0ULL;
-		for (UINT uPartNum = 1; ; ++uPartNum)
+		for (UINT uPartNum = 1; ullOffset < ullObjSize; ++uPartNum)
 		{
 			std::shared_ptr<S3_UPLOAD_PART_ENTRY> pPartEntry = std::make_shared<S3_UPLOAD_PART_ENTRY>();
 			pPartEntry->uPartNum = uPartNum;
 			pPartEntry->ullBaseOffset = ullOffset;
 			pPartEntry->Checksum.Empty();
 			pPartEntry->sETag.Empty();
-			pPartEntry->ullPartSize = ((ullObjSize - ullOffset) < (ULONGLONG)MULTIPART_SIZE) ? (ullObjSize - ullOffset) : MULTIPART_SIZE;
-			if ((pPartEntry->ullPartSize == 0) || (ullObjSize <= ullOffset))
-				break;
-			Error = S3MultiPartUpload(MultiPartInfo, *pPartEntry, nullptr, pPartEntry->ullPartSize, pszSrcPath, ullOffset, pszVersionId);
-			if (Error.IfError())
-				throw CS3ErrorInfo(_T(__FILE__), __LINE__, Error);
+			pPartEntry->ullPartSize = ((ullObjSize - ullOffset) < ullPartSize) ? (ullObjSize - ullOffset) : ullPartSize;
 			PartList.push_back(pPartEntry);
 			ullOffset += pPartEntry->ullPartSize;
 		}
+		// copy all parts
+		{
+			CCopyPartPool CopyPool;
+			CopyPool.pConn = this;
+			CopyPool.pMultiPartInfo = &MultiPartInfo;
+			CopyPool.pszSrcPath = pszSrcPath;
+			CopyPool.pszVersionId = pszVersionId;
+			CopyPool.dwPauseBetweenRetries = dwPauseAfter500Error;
+			CopyPool.SetMinThreads(1);
+			CopyPool.SetMaxThreads(__min(dwThreads, (DWORD)PartList.size()));
+			CThreadPoolBase::SetPoolInitialized();
+			for (std::list<std::shared_ptr<S3_UPLOAD_PART_ENTRY>>::const_iterator itPart = PartList.begin(); itPart != PartList.end(); ++itPart)
+			{
+				std::shared_ptr<std::shared_ptr<CCopyPartPoolMsg>> AutoMsg;
+				AutoMsg.reset(new std::shared_ptr<CCopyPartPoolMsg>(std::make_shared<CCopyPartPoolMsg>()));
+				(*AutoMsg)->pPartEntry = *itPart;
+				CopyPool.SendMessageToPool(__LINE__, AutoMsg, 0, 0, nullptr);
+			}
+			CopyPool.WaitForWorkFinished(&CCopyPartPool::IfAbort, &CopyPool);
+			if (CopyPool.Error.IfError())
+				throw CS3ErrorInfo(_T(__FILE__), __LINE__, CopyPool.Error);
+			if (CopyPool.bAbort)
+				throw CS3ErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
+		}
 		S3_MPU_COMPLETE_INFO MPUCompleteInfo;
 		Error = S3MultiPartComplete(MultiPartInfo, PartList, MPUCompleteInfo);
 		if (Error.IfError())
@@ -4716,6 +5703,13 @@ void CECSConnection::SetTimeouts(
 	dwBadIPAddrAge = dwBadIPAddrAgeParam;
 }
 
+// SetRetries
+// sets the rules of the default retry policy (see GetDefaultRetryPolicy)
+// dwMaxRetryCountParam is the limit on tries for each error class. timeouts are never retried more than twice
+// the pauses are not fixed: they are where the exponential backoff starts, and each delay is picked at random up to that limit
+// the default policy has no retry budget, so every error class gets its full count of retries, as before
+// a budget can be turned on with GetDefaultRetryPolicy()->SetBudget, but it is then shared by every connection in the
+// process that doesn't have its own policy. for a per connection budget, use SetRetryPolicy
 void CECSConnection::SetRetries(DWORD dwMaxRetryCountParam, DWORD dwPauseBetweenRetriesParam, DWORD dwPauseAfter500ErrorParam)
 {
 	if (dwMaxRetryCountParam == 0)
@@ -4724,11 +5718,81 @@ void CECSConnection::SetRetries(DWORD dwMaxRetryCountParam, DWORD dwPauseBetween
 		dwMaxRetryCount = dwMaxRetryCountParam;
 	dwPauseBetweenRetries = dwPauseBetweenRetriesParam;
 	dwPauseAfter500Error = dwPauseAfter500ErrorParam;
+	// the pauses become the starting backoff of the default retry policy
+	UINT uMaxRetries = (UINT)dwMaxRetryCount - 1;
+	pDefaultRetryPolicy->SetRule(E_RETRY_CLASS::Network, RETRY_RULE(uMaxRetries, dwPauseBetweenRetries, dwPauseBetweenRetries * 16));
+	pDefaultRetryPolicy->SetRule(E_RETRY_CLASS::Timeout, RETRY_RULE(__min(uMaxRetries, 2U), dwPauseBetweenRetries, dwPauseBetweenRetries * 16));
+	pDefaultRetryPolicy->SetRule(E_RETRY_CLASS::SlowDown, RETRY_RULE(uMaxRetries, dwPauseAfter500Error, dwPauseAfter500Error * 16));
+	pDefaultRetryPolicy->SetRule(E_RETRY_CLASS::ServerError, RETRY_RULE(uMaxRetries, dwPauseAfter500Error, dwPauseAfter500Error * 16));
+}
+
+// GetDefaultRetryPolicy
+// the retry policy used by all connections that don't have one of their own
+// its rules and budget can be changed, and its counters cover all of those connections
+std::shared_ptr<CBackoffRetryPolicy> CECSConnection::GetDefaultRetryPolicy(void)
+{
+	return pDefaultRetryPolicy;
+}
+
+// SetRetryPolicy
+// use a different retry policy for this connection and any copies made of it from now on
+void CECSConnection::SetRetryPolicy(const std::shared_ptr<CRetryPolicy>& pRetryPolicyParam)
+{
+	pRetryPolicy = pRetryPolicyParam;
+}
+
+void CECSConnection::GetRetryStats(RETRY_STATS& Stats) const
+{
+	if (pRetryPolicy)
+		pRetryPolicy->GetStats(Stats);
+	else
+		pDefaultRetryPolicy->GetStats(Stats);
+}
+
+// GetRetryClass
+// which retry rule applies to a failed request
+E_RETRY_CLASS CECSConnection::GetRetryClass(const S3_ERROR& Error)
+{
+	if (Error.dwHttpError == HTTP_STATUS_SERVICE_UNAVAIL)
+		return E_RETRY_CLASS::SlowDown;
+	if (Error.dwHttpError >= HTTP_STATUS_SERVER_ERROR)
+		return E_RETRY_CLASS::ServerError;
+	if (Error.dwError == ERROR_WINHTTP_TIMEOUT)
+		return E_RETRY_CLASS::Timeout;
+	return E_RETRY_CLASS::Network;
+}
+
+// RetryPause
+// wait before a retry. returns false if the request was aborted while waiting
+bool CECSConnection::RetryPause(DWORD dwDelay)
+{
+	const DWORD RETRY_PAUSE_SLICE = 250;
+	for (;;)
+	{
+		if (TestAbort())
+			return false;
+		if (dwDelay == 0)
+			return true;
+		DWORD dwSlice = __min(dwDelay, RETRY_PAUSE_SLICE);
+		Sleep(dwSlice);
+		dwDelay -= dwSlice;
+	}
+}
+
+// SetCopyPartThreads
+// set the number of parts of a multipart copy (CopyS3, RenameS3) that are copied at the same time
+// 0 = default
+void CECSConnection::SetCopyPartThreads(DWORD dwCopyPartThreadsParam)
+{
+	if (dwCopyPartThreadsParam == 0)
+		dwCopyPartThreads = DefaultCopyPartThreads;
+	else
+		dwCopyPartThreads = dwCopyPartThreadsParam;
 }
 
 void CECSConnection::SetMaxWriteRequest(DWORD dwMaxWriteRequestParam)
 {
-	CSingleLock lock(&csThrottleMap, true);
+	CSingleLock lock(&csECSConnectionList, true);
 	std::list<CECSConnection *>::iterator itList;
 	for (itList = ECSConnectionList.begin() ; itList != ECSConnectionList.end() ; ++itList)
 	{
@@ -4741,7 +5805,7 @@ void CECSConnection::SetMaxWriteRequest(DWORD dwMaxWriteRequestParam)
 
 void CECSConnection::SetMaxWriteRequestAll(DWORD dwMaxWriteRequestParam)
 {
-	CSingleLock lock(&csThrottleMap, true);
+	CSingleLock lock(&csECSConnectionList, true);
 	std::list<CECSConnection *>::iterator itList;
 	for (itList = ECSConnectionList.begin() ; itList != ECSConnectionList.end() ; ++itList)
 	{
@@ -5089,6 +6153,7 @@ void CECSConnection::GarbageCollect()
 {
 	FILETIME ftNow;
 	GetSystemTimeAsFileTime(&ftNow);
+	AgeNodeHealth();
 	{
 		FILETIME ftExpire = ftNow - FT_HOURS(1);
 		CSingleLock lock(&csSessionMap, true);
@@ -5105,7 +6170,7 @@ void CECSConnection::GarbageCollect()
 	}
 	{
 		FILETIME ftExpire = ftNow - FT_MINUTES(2);						// any entries not touched for a while are removed
-		CSingleLock lockThrottle(&csThrottleMap, true);
+		CSingleLock lockList(&csECSConnectionList, true);
 		for (std::list<CECSConnection*>::const_iterator itConn = ECSConnectionList.begin(); itConn != ECSConnectionList.end(); ++itConn)
 		{
 			CSimpleRWLockAcquire lockState(&(*itConn)->StateList.rwlStateMap, true);			// write lock
@@ -5438,7 +6503,8 @@ HRESULT XmlMPUCompleteCB(const CStringW& sXmlPath, void *pContext, IXmlReader *p
 CECSConnection::S3_ERROR CECSConnection::S3MultiPartComplete(
 	const S3_UPLOAD_PART_INFO& MultiPartInfo,
 	const std::list<std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY>>& PartList,
-	S3_MPU_COMPLETE_INFO& MPUCompleteInfo)
+	S3_MPU_COMPLETE_INFO& MPUCompleteInfo,
+	const std::list<HEADER_STRUCT> *pHeaderList)		// optional extra headers, such as a full object x-amz-checksum-*
 {
 	CStateRef State(this);
 	CECSConnection::S3_ERROR Error;
@@ -5503,6 +6569,11 @@ CECSConnection::S3_ERROR CECSConnection::S3MultiPartComplete(
 		XmlUTF8.SetBufSize((DWORD)strlen(XmlUTF8));
 
 		InitHeader();
+		if (pHeaderList != nullptr)
+		{
+			for (std::list<HEADER_STRUCT>::const_iterator itList = pHeaderList->begin(); itList != pHeaderList->end(); ++itList)
+				AddHeader(itList->sHeader, itList->sContents);
+		}
 		Error = SendRequest(_T("POST"), UriEncode(MultiPartInfo.sResource) + _T("?uploadId=") + MultiPartInfo.sUploadId, XmlUTF8.GetData(), XmlUTF8.GetBufSize(), RetData);
 		if (!Error.IfError() && !RetData.IsEmpty())
 		{
@@ -5661,6 +6732,104 @@ CECSConnection::S3_ERROR CECSConnection::S3MultiPartList(LPCTSTR pszBucketName,
 	return Error;
 }
 
+const WCHAR * const XML_S3_LIST_PARTS_NEXTPARTNUMBERMARKER =				L"//ListPartsResult/NextPartNumberMarker";
+const WCHAR * const XML_S3_LIST_PARTS_ISTRUNCATED =							L"//ListPartsResult/IsTruncated";
+const WCHAR * const XML_S3_LIST_PARTS_PART_ELEMENT =						L"//ListPartsResult/Part";
+const WCHAR * const XML_S3_LIST_PARTS_PART_PARTNUMBER =						L"//ListPartsResult/Part/PartNumber";
+const WCHAR * const XML_S3_LIST_PARTS_PART_LASTMODIFIED =					L"//ListPartsResult/Part/LastModified";
+const WCHAR * const XML_S3_LIST_PARTS_PART_ETAG =							L"//ListPartsResult/Part/ETag";
+const WCHAR * const XML_S3_LIST_PARTS_PART_SIZE =							L"//ListPartsResult/Part/Size";
+
+struct S3_LIST_PARTS_CONTEXT
+{
+	std::list<CECSConnection::S3_LIST_PARTS_ENTRY> *pPartList;
+	CECSConnection::S3_LIST_PARTS_ENTRY Rec;
+	CString sNextPartNumberMarker;
+	bool bIsTruncated;
+
+	S3_LIST_PARTS_CONTEXT()
+		: pPartList(nullptr)
+		, bIsTruncated(false)
+	{}
+};
+
+HRESULT XmlS3ListPartsCB(const CStringW& sXmlPath, void *pContext, IXmlReader *pReader, XmlNodeType NodeType, const std::list<XML_LITE_ATTRIB> *pAttrList, const CStringW *psValue)
+{
+	(void)pReader;
+	(void)pAttrList;
+	S3_LIST_PARTS_CONTEXT *pInfo = (S3_LIST_PARTS_CONTEXT *)pContext;
+	switch (NodeType)
+	{
+	case XmlNodeType_Text:
+		if ((psValue != nullptr) && !psValue->IsEmpty())
+		{
+			if (sXmlPath.CompareNoCase(XML_S3_LIST_PARTS_NEXTPARTNUMBERMARKER) == 0)
+				pInfo->sNextPartNumberMarker = FROM_UNICODE(*psValue);
+			else if (sXmlPath.CompareNoCase(XML_S3_LIST_PARTS_ISTRUNCATED) == 0)
+				pInfo->bIsTruncated = FROM_UNICODE(*psValue) == _T("true");
+			else if (sXmlPath.CompareNoCase(XML_S3_LIST_PARTS_PART_PARTNUMBER) == 0)
+				pInfo->Rec.uPartNum = (UINT)_ttoi(FROM_UNICODE(*psValue));
+			else if (sXmlPath.CompareNoCase(XML_S3_LIST_PARTS_PART_ETAG) == 0)
+				pInfo->Rec.sETag = FROM_UNICODE(*psValue);
+			else if (sXmlPath.CompareNoCase(XML_S3_LIST_PARTS_PART_SIZE) == 0)
+				pInfo->Rec.ullSize = (ULONGLONG)_ttoi64(FROM_UNICODE(*psValue));
+			else if (sXmlPath.CompareNoCase(XML_S3_LIST_PARTS_PART_LASTMODIFIED) == 0)
+			{
+				CECSConnection::S3_ERROR Error = CECSConnection::ParseISO8601Date(FROM_UNICODE(*psValue), pInfo->Rec.ftLastMod);
+				if (Error.IfError())
+					return Error.dwError;
+			}
+		}
+		break;
+
+	case XmlNodeType_EndElement:
+		if (sXmlPath.CompareNoCase(XML_S3_LIST_PARTS_PART_ELEMENT) == 0)
+		{
+			if (pInfo->Rec.uPartNum != 0)
+			{
+				pInfo->pPartList->push_back(pInfo->Rec);
+				pInfo->Rec.EmptyRec();
+			}
+		}
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+// get a list of all parts that have been uploaded so far for an active multipart upload
+CECSConnection::S3_ERROR CECSConnection::S3MultiPartListParts(const S3_UPLOAD_PART_INFO& MultiPartInfo, std::list<S3_LIST_PARTS_ENTRY>& PartList)
+{
+	CStateRef State(this);
+	CECSConnection::S3_ERROR Error;
+	S3_LIST_PARTS_CONTEXT Context;
+	CBuffer RetData;
+
+	PartList.clear();
+	Context.pPartList = &PartList;
+	InitHeader();
+	CString sResource(UriEncode(MultiPartInfo.sResource) + _T("?uploadId=") + MultiPartInfo.sUploadId);
+	for (;;)
+	{
+		CString sTempResource(sResource);
+		if (!Context.sNextPartNumberMarker.IsEmpty())
+			sTempResource += _T("&part-number-marker=") + Context.sNextPartNumberMarker;
+		Context.bIsTruncated = false;
+		Error = SendRequest(_T("GET"), sTempResource, nullptr, 0, RetData);
+		if (Error.IfError())
+			return Error;
+		// parse XML
+		HRESULT hr;
+		hr = ScanXml(&RetData, &Context, XmlS3ListPartsCB);
+		if (FAILED(hr))
+			return hr;
+		if (!Context.bIsTruncated || Context.sNextPartNumberMarker.IsEmpty())
+			break;
+	}
+	return Error;
+}
+
 struct XML_MULTIPART_COPY_CONTEXT
 {
 	CString sETag;
@@ -5708,7 +6877,7 @@ CECSConnection::S3_ERROR CECSConnection::S3MultiPartUpload(
 	InitHeader();
 	Req.emplace_back(_T("ETag"));
 	if (!PartEntry.Checksum.IsEmpty())
-		AddHeader(_T("Content-MD5"), PartEntry.Checksum.EncodeBase64());
+		AddHeader(PartEntry.sChecksumHeader.IsEmpty() ? _T("Content-MD5") : (LPCTSTR)PartEntry.sChecksumHeader, PartEntry.Checksum.EncodeBase64());
 	
 	// extract the bucket
 	CString sBucket;
@@ -7766,7 +8935,8 @@ CECSConnection::S3_ERROR CECSConnection::ReadProperties(
 	S3_SYSTEM_METADATA& Properties,			// (out) object properties
 	LPCTSTR pszVersionId,					// (in, optional) version ID
 	std::list<HEADER_STRUCT> *pMDList,		// (out, optional) metadata list
-	std::list<HEADER_REQ> *pReq)					// (out, optional) full header list
+	std::list<HEADER_REQ> *pReq,					// (out, optional) full header list
+	bool bChecksumMode)							// (in) return the stored x-amz-checksum-* headers in pReq
 {
 	CStateRef State(this);
 	std::list<HEADER_REQ> Req;
@@ -7778,6 +8948,8 @@ CECSConnection::S3_ERROR CECSConnection::ReadProperties(
 			pReq = &Req;
 		Properties.Empty();
 		InitHeader();
+		if (bChecksumMode)
+			AddHeader(_T("x-amz-checksum-mode"), _T("ENABLED"));
 		CString sPath(UriEncode(pszPath));
 		// first get the complete list of system metadata for this object
 		if ((pszVersionId != nullptr) && (*pszVersionId != NUL))
@@ -7951,19 +9123,57 @@ DWORD CECSConnection::RetrieveServerCertificate(ECS_CERT_INFO& CertInfo)
 	return ERROR_SUCCESS;
 }
 
+// DumpBadIPMap
+// list the nodes whose circuit isn't closed
 CString CECSConnection::DumpBadIPMap(void)
 {
-	CSingleLock csBad(&csBadIPMap, true);
+	CSimpleRWLockAcquire lock(&rwlNodeHealth);			// read lock
 	CString sEntry, sMsg;
+	ULONGLONG ullNow = GetTickCount64();
 
-	for (std::map<BAD_IP_KEY, BAD_IP_ENTRY>::iterator itMap = BadIPMap.begin(); itMap != BadIPMap.end(); ++itMap)
+	for (std::map<CString, std::shared_ptr<HOST_HEALTH>>::const_iterator itHost = NodeHealthMap.begin(); itHost != NodeHealthMap.end(); ++itHost)
 	{
-		sEntry = _T("Host: ") + itMap->first.sHostName;
-		sEntry.Format(_T("Host: %s\r\nIP: %s\r\nTime: %s\r\nError: %s\r\n\r\n"),
-			(LPCTSTR)itMap->first.sHostName,
-			(LPCTSTR)itMap->first.sIP,
-			(LPCTSTR)DateTimeStr(&itMap->second.ftError, true, true, true, false, true, true),
-			(LPCTSTR)itMap->second.ErrorInfo.Format());
+		for (std::map<CString, std::shared_ptr<NODE_HEALTH>>::const_iterator itNode = itHost->second->NodeMap.begin(); itNode != itHost->second->NodeMap.end(); ++itNode)
+		{
+			NODE_HEALTH& Node = *itNode->second;
+			LONG lState = InterlockedCompareExchange(&Node.lState, 0, 0);
+			if (lState == (LONG)E_NODE_STATE::Closed)
+				continue;
+			ULONGLONG ullRetryTime = (ULONGLONG)InterlockedCompareExchange64(&Node.llRetryTime, 0LL, 0LL);
+			CSingleLock lockError(&Node.csError, true);
+			sEntry.Format(_T("Host: %s\r\nIP: %s\r\nState: %s\r\nTrips: %d\r\nProbe in: %I64u sec\r\nTime: %s\r\nError: %s\r\n\r\n"),
+				(LPCTSTR)Node.sHost,
+				(LPCTSTR)Node.sIP,
+				(lState == (LONG)E_NODE_STATE::Open) ? _T("Open") : _T("Half Open"),
+				InterlockedCompareExchange(&Node.lTrips, 0, 0),
+				(ullRetryTime > ullNow) ? ((ullRetryTime - ullNow) / 1000ULL) : 0ULL,
+				(LPCTSTR)DateTimeStr(&Node.ftError, true, true, true, false, true, true),
+				(LPCTSTR)Node.ErrorInfo.Format());
+			sMsg += sEntry;
+		}
+	}
+	return sMsg;
+}
+
+CString CECSConnection::DumpNodeStats(void)
+{
+	std::list<NODE_STATS> StatsList;
+	CString sEntry, sMsg;
+
+	GetNodeStats(StatsList);
+	for (std::list<NODE_STATS>::const_iterator itStats = StatsList.begin(); itStats != StatsList.end(); ++itStats)
+	{
+		sEntry.Format(_T("Host: %s\r\nIP: %s\r\nCircuit: %s\r\nOutstanding: %d\r\nLatency: %.1f ms\r\nError rate: %.3f\r\nRequests: %I64u\r\nErrors: %I64u\r\n503: %I64u\r\nLast used: %s\r\n\r\n"),
+			(LPCTSTR)itStats->sHost,
+			(LPCTSTR)itStats->sIP,
+			(itStats->State == E_NODE_STATE::Closed) ? _T("Closed") : ((itStats->State == E_NODE_STATE::Open) ? _T("Open") : _T("Half Open")),
+			itStats->lOutstanding,
+			itStats->dLatencyMs,
+			itStats->dErrorRate,
+			itStats->ullRequests,
+			itStats->ullErrors,
+			itStats->ull503,
+			(LPCTSTR)DateTimeStr(&itStats->ftLastUsed, true, true, true, false, true, true));
 		sMsg += sEntry;
 	}
 	return sMsg;
@@ -23,6 +23,8 @@
 #include "CRWLock.h"
 #include "Logging.h"
 #include "fmtnum.h"
+#include "RetryPolicy.h"
+#include "TokenBucket.h"
 
 
 namespace ecs_sdk
@@ -36,6 +38,8 @@ const UINT MaxWriteRequestThrottle = 8192;
 const UINT MaxS3DeleteObjects = 1000;				// maximum number of objects to delete in one command (S3)
 const UINT DefaultMaxStreamQueueSizeRecv = 1024;	// maximum size of stream queue. if there is a mismatch between the queue feed and consumer, you don't want it to grow too big
 const UINT DefaultS3AuthV4ChunkSize = 0x200000;		// default chunk size when using v4 auth. this ends up being the buffer size when streaming writes
+const UINT DefaultCopyPartThreads = 8;				// default number of multipart copy parts (CopyS3) that run at the same time
+const UINT HEDGE_LATENCY_SAMPLES = 256;				// number of recent response latencies kept for each host (hedge delay)
 
 
 // ECS x-emc-mtime header shows the time as a number
@@ -518,6 +522,7 @@ public:
 
 	// stream support
 	typedef void(*UPDATE_PROGRESS_CB)(int iProgress, void *pContext);
+	typedef void(*STREAM_RECEIVE_CB)(const CBuffer& Data, void *pContext);
 
 	struct ECSUTIL_EXT_CLASS STREAM_DATA_ENTRY
 	{
@@ -543,13 +548,50 @@ public:
 		int iAccProgress;						// how much data has been read so far
 		bool bMultiPart;
 		ULONGLONG ullTotalSize;					// on receive, keep track of the total size of the transfer
+		ULONGLONG ullRewindMax;					// on send, if not 0, keep up to this many bytes of sent data so the request can be retried
+		std::deque<STREAM_DATA_ENTRY> RewindList;	// on send, entries already sent. shares the buffers with the entries that were queued
+		ULONGLONG ullRewindSize;				// on send, number of bytes in RewindList
+		bool bRewindOverflow;					// on send, more than ullRewindMax has been sent. the request can't be retried
+		volatile LONG lRewindEntries;			// on send, number of entries in RewindList. read by the thread filling StreamData
+		STREAM_RECEIVE_CB ReceiveCB;			// on receive, optional callback for each buffer as it is received (before it is queued)
+		void *pReceiveContext;					// context for ReceiveCB
+		bool bChecksumMode;						// on receive, ask for the stored x-amz-checksum-* headers (x-amz-checksum-mode)
+		DWORD dwThrottleWeight;					// fair sharing weight for this transfer (0 = use the connection's. see SetThrottleWeight)
+		CSharedRingQueue<STREAM_DATA_ENTRY> *pReceiveRing;	// on receive, optional: push the data here instead of StreamData
 		STREAM_CONTEXT()
 			: UpdateProgressCB(nullptr)
 			, pContext(nullptr)
 			, iAccProgress(0)
 			, bMultiPart(false)
 			, ullTotalSize(0ULL)
+			, ullRewindMax(0ULL)
+			, ullRewindSize(0ULL)
+			, bRewindOverflow(false)
+			, lRewindEntries(0)
+			, ReceiveCB(nullptr)
+			, pReceiveContext(nullptr)
+			, bChecksumMode(false)
+			, dwThrottleWeight(0)
+			, pReceiveRing(nullptr)
 		{}
+		bool IfRewindable(void) const
+		{
+			return (ullRewindMax != 0ULL) && !bRewindOverflow;
+		}
+		// the entries held for a rewind are still in memory, so they count against the send queue limit
+		unsigned int GetSendQueueLimit(unsigned int dwMaxQueueSize) const
+		{
+			if (dwMaxQueueSize == 0)
+				return 0;
+			LONG lRewind = InterlockedCompareExchange(const_cast<volatile LONG *>(&lRewindEntries), 0, 0);
+			if ((ULONG)lRewind >= dwMaxQueueSize)
+				return 1;
+			return dwMaxQueueSize - (unsigned int)lRewind;
+		}
+		void ClearRewind(void);
+		void SaveRewind(const STREAM_DATA_ENTRY& Entry);
+		bool Rewind(void);
+		void PushReceive(const STREAM_DATA_ENTRY& Entry, unsigned int dwMaxQueueSize, CSharedQueue<STREAM_DATA_ENTRY>::TEST_ABORT_CB pTestAbort, void *pContext);
 	};
 
 	// S3 structs
@@ -641,7 +683,8 @@ public:
 	{
 		UINT uPartNum;						// part number
 		CString sETag;						// ETag for part
-		CBuffer Checksum;					// if MD5, checksum for the current part
+		CBuffer Checksum;					// checksum of the current part: MD5, or a CRC if sChecksumHeader is set
+		CString sChecksumHeader;			// if set, Checksum is sent in this x-amz-checksum-* header. otherwise as Content-MD5
 		ULONGLONG ullPartSize;				// size of this part, in bytes. if not the last part, it can't be < 5MB
 		ULONGLONG ullBaseOffset;			// base offset of this part in the file
 		STREAM_CONTEXT StreamQueue;			// queue used to send data to the HTTP upload thread
@@ -670,6 +713,29 @@ public:
 		CString sUploadId;					// multipart upload ID
 	};
 
+	struct ECSUTIL_EXT_CLASS S3_LIST_PARTS_ENTRY
+	{
+		UINT uPartNum;						// part number
+		CString sETag;						// ETag for part
+		ULONGLONG ullSize;					// size of part, in bytes
+		FILETIME ftLastMod;					// time the part was uploaded
+
+		S3_LIST_PARTS_ENTRY()
+			: uPartNum(0)
+			, ullSize(0ULL)
+		{
+			ZeroFT(ftLastMod);
+		}
+
+		void EmptyRec()
+		{
+			uPartNum = 0;
+			sETag.Empty();
+			ullSize = 0ULL;
+			ZeroFT(ftLastMod);
+		}
+	};
+
 	struct ECSUTIL_EXT_CLASS S3_LIST_MULTIPART_UPLOADS_ENTRY
 	{
 		CString sKey;
@@ -1075,6 +1141,52 @@ public:
 		{}
 	};
 
+	// node selection: how the IP address for each request is picked from the IP list of the host
+	enum class E_NODE_SELECT : BYTE
+	{
+		RoundRobin,						// next address in the list
+		LeastOutstanding,				// fewest requests in progress, then lowest latency
+		PowerOfTwo						// pick two addresses at random and use the one with the lower load (default)
+	};
+
+	// circuit breaker state of a node (host/IP address)
+	enum class E_NODE_STATE : LONG
+	{
+		Closed,							// in rotation
+		Open,							// it failed, so it is out of rotation until its retry time. every time it opens again
+										// without staying healthy for a while, it stays open twice as long (up to 8 times dwBadIPAddrAge)
+		HalfOpen						// the open time is up and one request has been let through as a probe. if the probe
+										// gets a response the circuit closes, if it fails it opens again
+	};
+
+	// statistics kept for each node (host/IP address) and used by node selection
+	struct ECSUTIL_EXT_CLASS NODE_STATS
+	{
+		CString sHost;					// host entry name
+		CString sIP;					// IP address or FQDN
+		LONG lOutstanding;				// requests in progress
+		double dLatencyMs;				// EWMA of the time to the response headers (ms). only requests without much of a body are sampled
+		double dErrorRate;				// EWMA of the error rate (0-1). connection errors and 5xx responses count as errors
+		ULONGLONG ullRequests;			// total requests
+		ULONGLONG ullErrors;			// total errors
+		ULONGLONG ull503;				// total 503 responses (ECS is busy)
+		FILETIME ftLastUsed;			// time the last request was sent
+		E_NODE_STATE State;				// circuit breaker state
+		LONG lTrips;					// number of times the circuit opened without staying healthy in between
+		NODE_STATS()
+			: lOutstanding(0)
+			, dLatencyMs(0.0)
+			, dErrorRate(0.0)
+			, ullRequests(0ULL)
+			, ullErrors(0ULL)
+			, ull503(0ULL)
+			, State(E_NODE_STATE::Closed)
+			, lTrips(0)
+		{
+			ZeroFT(ftLastUsed);
+		}
+	};
+
 private:
 	struct HTTP_CALLBACK_EVENT
 	{
@@ -1255,6 +1367,61 @@ private:
 	static std::map<SESSION_MAP_KEY, SESSION_MAP_VALUE> SessionMap;			// protected by csSessionMap
 	static long lSessionKeyValue;											// used to make session key unique
 
+	// node health (circuit breaker, see E_NODE_STATE)
+	// entries are never removed, so a request looks up its nodes once and after that it checks and changes
+	// their state with interlocked operations only. the garbage collect thread does the aging
+	struct NODE_HEALTH
+	{
+		CString sHost;							// host entry name (doesn't change)
+		CString sIP;							// IP address or FQDN (doesn't change)
+		volatile LONG lState;					// E_NODE_STATE
+		volatile LONG lTrips;					// number of times the circuit opened without staying healthy in between
+		volatile LONGLONG llRetryTime;			// GetTickCount64 after which an open circuit can be probed
+		volatile LONGLONG llClosedTime;			// GetTickCount64 when the circuit last closed
+		// statistics for node selection (see NODE_STATS). updated with interlocked operations only
+		volatile LONG lOutstanding;				// requests in progress
+		volatile LONGLONG llLatencyUs;			// EWMA of the time to the response headers (microseconds)
+		volatile LONGLONG llErrorRatePPM;		// EWMA of the error rate (parts per million)
+		volatile LONGLONG llRequests;			// total requests
+		volatile LONGLONG llErrors;				// total errors
+		volatile LONGLONG ll503;				// total 503 responses
+		volatile LONGLONG llLastUsed;			// FILETIME the last request was sent
+		CCriticalSection csError;				// protects the fields below
+		FILETIME ftError;						// time of the last failure
+		CS3ErrorInfo ErrorInfo;					// last failure
+
+		NODE_HEALTH()
+			: lState((LONG)E_NODE_STATE::Closed)
+			, lTrips(0)
+			, llRetryTime(0LL)
+			, llClosedTime(0LL)
+			, lOutstanding(0)
+			, llLatencyUs(0LL)
+			, llErrorRatePPM(0LL)
+			, llRequests(0LL)
+			, llErrors(0LL)
+			, ll503(0LL)
+			, llLastUsed(0LL)
+		{
+			ZeroFT(ftError);
+		}
+	};
+	struct HOST_HEALTH
+	{
+		volatile LONG lRoundRobin;				// round robin position for this host entry, shared by all connections
+		std::map<CString, std::shared_ptr<NODE_HEALTH>> NodeMap;	// by IP. protected by rwlNodeHealth
+		volatile LONG lLatencyCount;			// number of latencies recorded. the next one goes in slot (lLatencyCount % HEDGE_LATENCY_SAMPLES)
+		volatile LONGLONG LatencyUs[HEDGE_LATENCY_SAMPLES];	// recent response latencies (microseconds), used for the hedge delay
+
+		HOST_HEALTH()
+			: lRoundRobin(0)
+			, lLatencyCount(0)
+		{
+			for (UINT i = 0; i < HEDGE_LATENCY_SAMPLES; i++)
+				LatencyUs[i] = 0LL;
+		}
+	};
+
 	// all state fields. These are not copied during assignment or copy constructor
 	struct CECSConnectionState
 	{
@@ -1269,7 +1436,9 @@ private:
 		std::map<CString,HEADER_STRUCT> Headers;
 		UINT iIPList;							// index into IPList showing currently used
 		std::deque<CString> IPListLocal;				// local copy of IPListHost to be used only for this request
-		CEvent evThrottle;						// triggered if throttling and throttle interval was refreshed
+		std::shared_ptr<HOST_HEALTH> pHostHealth;	// health of the host entry
+		std::vector<std::shared_ptr<NODE_HEALTH>> NodeHealthLocal;	// health of each entry in IPListLocal (same order)
+		NODE_HEALTH *pProbeNode;				// if set, the current try is the probe of a half open circuit
 		HTTP_CALLBACK_CONTEXT CallbackContext;
 		DWORD dwCurrentThread;
 		DWORD dwProxyAuthScheme;				// if non-zero, proxy requires authorization (WINHTTP_AUTH_SCHEME_...)
@@ -1292,6 +1461,8 @@ private:
 		UINT uS3AuthV4ChunkMetadataOffset;
 		CStringA sChunkMetadataFormatA;
 
+		LONGLONG llResponseTime;				// performance counter when the response headers came in (0 if they didn't)
+
 		CECSConnectionState()
 			: ulReferenceCount(0)
 			, pECSConnection(nullptr)
@@ -1300,6 +1471,7 @@ private:
 			, bS3Admin(false)
 			, bSaveCertInfo(false)
 			, iIPList(0)
+			, pProbeNode(nullptr)
 			, dwCurrentThread(0)
 			, dwProxyAuthScheme(0)
 			, dwAuthScheme(0)
@@ -1310,6 +1482,7 @@ private:
 			, dwSecurityFlagsSub(0)
 			, uS3AuthV4ChunkMetadataSize(0)
 			, uS3AuthV4ChunkMetadataOffset(0)
+			, llResponseTime(0LL)
 		{
 			ZeroFT(ftLastUsed);
 		}
@@ -1331,6 +1504,7 @@ private:
 			, bS3Admin(false)
 			, bSaveCertInfo(false)
 			, iIPList(0)
+			, pProbeNode(nullptr)
 			, dwCurrentThread(0)
 			, dwProxyAuthScheme(0)
 			, dwAuthScheme(0)
@@ -1341,6 +1515,7 @@ private:
 			, dwSecurityFlagsSub(0)
 			, uS3AuthV4ChunkMetadataSize(src.uS3AuthV4ChunkMetadataSize)
 			, uS3AuthV4ChunkMetadataOffset(src.uS3AuthV4ChunkMetadataOffset)
+			, llResponseTime(0LL)
 		{
 			(void)src;
 			ZeroFT(ftLastUsed);
@@ -1400,6 +1575,11 @@ private:
 	CString sS3Region = _T("us-east-1");						// S3 region (ie us-east-1)
 	bool bS3AuthV4 = true;							// true if S3 V4 authorization
 	UINT uS3AuthV4ChunkSize = DefaultS3AuthV4ChunkSize;				// if S3 V4 auth, the size of the chunks
+	bool bS3AuthV4UnsignedPayload = false;			// if S3 V4 auth and HTTPS, stream uploads using UNSIGNED-PAYLOAD instead of aws-chunked
+	std::shared_ptr<CRetryPolicy> pRetryPolicy;		// retry policy. shared with copies of the connection. nullptr = pDefaultRetryPolicy
+	bool bHedge = false;							// hedge GET/HEAD requests
+	UINT uHedgePercentile = 95;						// hedge after this percentile of the recent response latencies for the host
+	DWORD dwHedgeMinDelay = 10;						// never hedge sooner than this (ms)
 
 	mutable CSimpleRWLock lwrS3V4SigningKey;// critical section protecting GlobalS3V4SigningKey
 	CBuffer GlobalS3V4SigningKey;			// if S3 V4, calculated signing key (good for a week)
@@ -1424,41 +1604,40 @@ private:
 	DWORD* pSecurityInfoError = nullptr;					// error returned when trying to get security info
 
 	// throttle info
+	// the limits form a hierarchy: process, host, bucket and transfer. every byte is charged to each level that
+	// has a limit, and the sender waits for the slowest one (see CThrottlePath)
 
-	// CThrottleTimerThread
-	// controls the throttle thread
-	struct CThrottleTimerThread : public CSimpleWorkerThread
-	{
-		FILETIME ftLast;					// last activation - used to determine the exact time between calls
-		CThrottleTimerThread();
-		~CThrottleTimerThread();
-	protected:
-		void DoWork();
-	public:
-		bool InitInstance();
-	};
-
-	struct THROTTLE_INFO
+	// upload and download limits for one level
+	struct THROTTLE_REC
 	{
-		int iBytesSec;						// bytes/sec throttle rate for this URL
-		int iBytesCurInterval;				// how many bytes can be sent in the current interval
+		std::shared_ptr<CTokenBucket> Upload;
+		std::shared_ptr<CTokenBucket> Download;
 
-		THROTTLE_INFO()
+		THROTTLE_REC()
+			: Upload(std::make_shared<CTokenBucket>())
+			, Download(std::make_shared<CTokenBucket>())
+		{}
+		void SetRate(int iUploadThrottleRate, int iDownloadThrottleRate)
 		{
-			iBytesSec = 0;
-			iBytesCurInterval = 0;
+			Upload->SetRate(iUploadThrottleRate);
+			Download->SetRate(iDownloadThrottleRate);
+		}
+		void SetFairShare(bool bFairShare)
+		{
+			Upload->SetFairShare(bFairShare);
+			Download->SetFairShare(bFairShare);
 		}
-	};
-	struct THROTTLE_REC
-	{
-		THROTTLE_INFO Upload;
-		THROTTLE_INFO Download;
 	};
 	static bool bInitialized;							// starts out false. If false, timeouts are very short. must call SetInitialized to get regular timeouts
-	static CThrottleTimerThread TimerThread;			// throttle timer thread
+	static THROTTLE_REC ProcessThrottle;				// limit for all CECSConnection objects together
 	static std::map<CString,THROTTLE_REC> ThrottleMap;		// global map used by all CECSConnection objects, key is host name
-	static CCriticalSection csThrottleMap;				// critical section protecting ThrottleMap
-	static std::list<CECSConnection *> ECSConnectionList;	// list of all CECSConnection objects (protected by csThrottleMap)
+	static std::map<CString,THROTTLE_REC> BucketThrottleMap;	// key is host name/bucket
+	static CSimpleRWLock rwlThrottleMap;				// lock protecting ThrottleMap and BucketThrottleMap (the buckets themselves are lock free)
+	static bool bThrottleFairShare;						// process, host and bucket limits are shared by weight (see CTokenBucket)
+	THROTTLE_REC TransferThrottle;						// limit for this object and any copies made of it (such as the parts of a multipart upload)
+	DWORD dwThrottleWeight = ThrottleWeightNormal;		// fair sharing weight for requests from this object
+	static CCriticalSection csECSConnectionList;		// critical section protecting ECSConnectionList
+	static std::list<CECSConnection *> ECSConnectionList;	// list of all CECSConnection objects (protected by csECSConnectionList)
 	static std::list<XML_DIR_LISTING_CONTEXT *> DirListList;	// listing of current dir listing operations
 	static CCriticalSection csDirListList;				// critical section protecting DirListList
 	static DWORD dwGlobalHttpsProtocol;					// bit field of acceptable protocols
@@ -1467,6 +1646,8 @@ private:
 	static DWORD dwMaxRetryCount;						// max retries for HTTP command
 	static DWORD dwPauseBetweenRetries;					// pause between retries (millisec)
 	static DWORD dwPauseAfter500Error;					// pause between retries after HTTP 500 error (millisec)
+	static std::shared_ptr<CBackoffRetryPolicy> pDefaultRetryPolicy;	// retry policy for connections that don't have their own
+	static DWORD dwCopyPartThreads;						// max multipart copy parts (CopyS3) in flight at the same time
 
 public:
 	static std::set<CString> SystemMDSet;					// set of system metadata fields that can be indexed
@@ -1474,56 +1655,7 @@ public:
 
 private:
 
-	// BadIPMap
-	// holds any IP address that seems to be bad
-	// if an IP fails, it will be put into this map for a bit
-	// when it is in the map, it will not be used in any connection attempts
-	// when it times out it will be put into rotation. if it fails again - back on the map
-	struct BAD_IP_KEY
-	{
-		CString sHostName;				// host entry name
-		CString sIP;					// IP address or FQDN
-
-		BAD_IP_KEY()
-		{
-		}
-		BAD_IP_KEY(const CString& sHostParam, const CString& sIPParam)
-		{
-			sHostName = sHostParam;
-			sIP = sIPParam;
-		}
-		int Compare(const BAD_IP_KEY& Key) const
-		{
-			int iDiff = sHostName.Compare(Key.sHostName);
-			if (iDiff != 0)
-				return iDiff;
-			return sIP.Compare(Key.sIP);
-		}
-		bool operator < (const BAD_IP_KEY& Key) const
-		{
-			return Compare(Key) < 0;
-		}
-		bool operator > (const BAD_IP_KEY& Key) const
-		{
-			return Compare(Key) > 0;
-		}
-		bool operator <= (const BAD_IP_KEY& Key) const
-		{
-			return Compare(Key) <= 0;
-		}
-		bool operator >= (const BAD_IP_KEY& Key) const
-		{
-			return Compare(Key) >= 0;
-		}
-		bool operator == (const BAD_IP_KEY& Key) const
-		{
-			return Compare(Key) == 0;
-		}
-		bool operator != (const BAD_IP_KEY& Key) const
-		{
-			return Compare(Key) != 0;
-		}
-	};
+	// failure of an IP during a request. if the request gets through on another IP, the circuit of this one is opened
 	struct BAD_IP_ENTRY
 	{
 		FILETIME ftError;				// time that error occurred
@@ -1554,9 +1686,16 @@ private:
 		~CStateRef();
 	};
 
-	static CCriticalSection csBadIPMap;
-	static std::map<BAD_IP_KEY,BAD_IP_ENTRY> BadIPMap;
-	static std::map<CString,UINT> LoadBalMap;					// global IP selector for all entries
+	static CSimpleRWLock rwlNodeHealth;							// protects NodeHealthMap and the NodeMap of each host
+	static std::map<CString,std::shared_ptr<HOST_HEALTH>> NodeHealthMap;	// circuit breaker, statistics and latencies for each host entry and IP
+	static E_NODE_SELECT NodeSelect;							// how GetNextECSIP picks a node
+
+	// hedged requests
+	// if a GET/HEAD doesn't get its response in time, a copy of it is sent to another node on a pool thread
+	struct HEDGE_REQUEST;
+	class CHedgePool;
+	static CCriticalSection csHedgePool;						// protects pHedgePool
+	static std::unique_ptr<CHedgePool> pHedgePool;				// created on first use
 
 	// global performance counters
 	static CSimpleRWLock rwlGlobalPerf;
@@ -1581,8 +1720,10 @@ private:
 	CStringA BuildV4ChunkMetadata(UINT uChunkLength, const CString& sSignature);
 	void CreateS3V4ChunkMetadata(
 		CString& sPreviousSignature,
-		CBuffer& S3AuthV4SendBuf,
-		UINT& uS3AuthV4SendBufIndex,
+		CBuffer& ChunkPrefix,
+		bool bEndPrevChunk,
+		UINT uChunkLen,
+		const CBuffer& ChunkHash,
 		const CString& sEmptySignature,
 		const CBuffer& S3SigningKey,
 		const SYSTEMTIME& stRequestTime);
@@ -1595,8 +1736,23 @@ private:
 	void SetTimeouts(const CInternetHandle& hRequest);
 	S3_ERROR SendRequestInternal(LPCTSTR pszMethod, LPCTSTR pszResource, const void *pData, DWORD dwDataLen, CBuffer& RetData, std::list<HEADER_REQ> *pHeaderReq, DWORD dwReceivedDataHint, DWORD dwBufOffset, bool *pbGotServerResponse, STREAM_CONTEXT *pStreamSend, STREAM_CONTEXT *pStreamReceive, ULONGLONG ullTotalLen);
 	LPCTSTR GetCurrentServerIP(void);
-	void TestAllIPBad(void);
-	bool GetNextECSIP(std::map<CString, BAD_IP_ENTRY>& IPUsed);
+	void GetNodeHealth(void);
+	NODE_HEALTH *FindNodeHealth(const CString& sIP);
+	static bool IfNodeAvailable(const CString& sHostParam, const CString& sIP);
+	void NodeOpen(NODE_HEALTH& Node, const CS3ErrorInfo *pErrorInfo);
+	static void NodeClose(NODE_HEALTH& Node);
+	static void AgeNodeHealth(void);
+	bool GetNextECSIP(std::map<CString, BAD_IP_ENTRY>& IPUsed, bool bFailOpen = false);
+	void ReleaseProbe(void);
+	static double GetNodeCost(NODE_HEALTH *pNode);
+	void NodeRequestStart(const CString& sIP, LONGLONG& llStart);
+	void NodeRequestEnd(const CString& sIP, LONGLONG llStart, const S3_ERROR& Error, bool bGotServerResponse, bool bSampleLatency);
+	bool GetHedgeDelay(DWORD& dwDelay);
+	static CString PickHedgeIP(const CString& sHostParam, const std::deque<CString>& IPList, const CString& sPrimaryIP);
+	S3_ERROR SendRequestHedged(LPCTSTR pszMethod, LPCTSTR pszResource, CBuffer& RetData, std::list<HEADER_REQ> *pHeaderReq, DWORD dwReceivedDataHint, DWORD dwBufOffset, bool *pbGotServerResponse, DWORD dwDelay, S3_ERROR& PrimaryError, bool& bPrimaryResponse);
+	void SendHedge(HEDGE_REQUEST& Hedge);
+	static E_RETRY_CLASS GetRetryClass(const S3_ERROR& Error);
+	bool RetryPause(DWORD dwDelay);
 	void LogBadIPAddr(const std::map<CString,BAD_IP_ENTRY>& IPUsed);
 	bool IfMarkIPBad(DWORD dwError);
 	void PrepareCmd(void);
@@ -1623,6 +1779,8 @@ public:
 	static void SetGlobalHttpsProtocol(DWORD dwGlobalHttpsProtocolParam);
 	static void SetS3BucketListingMax(DWORD dwS3BucketListingMaxParam);
 	static void SetRetries(DWORD dwMaxRetryCountParam, DWORD dwPauseBetweenRetriesParam = 500, DWORD dwPauseAfter500ErrorParam = 500);
+	static std::shared_ptr<CBackoffRetryPolicy> GetDefaultRetryPolicy(void);
+	static void SetCopyPartThreads(DWORD dwCopyPartThreadsParam);
 	static DWORD SetRootCertificate(const ECS_CERT_INFO& CertInfo, DWORD dwCertOpenFlags = CERT_STORE_OPEN_EXISTING_FLAG | CERT_SYSTEM_STORE_LOCAL_MACHINE, LPCTSTR pszStoreName = _T("Root"));
 	static CString GetSecureErrorText(DWORD dwSecureError);
 	static CString FormatSecurityInfo(const WINHTTP_SECURITY_INFO& SecurityInfo);
@@ -1645,7 +1803,8 @@ public:
 	static void SetGlobalPerformanceCounters(const std::list<GLOBAL_PERF_POINTERS>& PerfListParam);
 	void SetPerformanceCounters(ULONGLONG *pullPerfBytesSentParam, ULONGLONG *pullPerfBytesRcvParam, ULONG *pulStateMapSizeParam, ULONG *pulMaxStateMapSizeParam);
 	void SetHostAuth(bool bAuthV4 = true, UINT uS3AuthV4ChunkSize = DefaultS3AuthV4ChunkSize);
-	bool IfS3v4(UINT *puChunkSize = nullptr) const;
+	bool IfS3v4(UINT *puChunkSize = nullptr, bool *pbUnsignedPayload = nullptr) const;
+	void SetS3V4UnsignedPayload(bool bUnsignedPayload);		// stream uploads over HTTPS aren't signed chunk by chunk (UNSIGNED-PAYLOAD)
 
 	void SetUserAgent(LPCTSTR pszUserAgent);					// typically app name/version. put in 'user agent' field in HTTP protocol
 	void SetPort(INTERNET_PORT PortParam);
@@ -1653,8 +1812,19 @@ public:
 	void SetTest(bool bTestParam);
 	void SetHttpsProtocol(DWORD dwHttpsProtocolParam);
 	static void SetThrottle(LPCTSTR pszHost, int iUploadThrottleRate, int iDownloadThrottleRate);
+	static void SetProcessThrottle(int iUploadThrottleRate, int iDownloadThrottleRate);
+	static void SetBucketThrottle(LPCTSTR pszHost, LPCTSTR pszBucket, int iUploadThrottleRate, int iDownloadThrottleRate);
+	void SetTransferThrottle(int iUploadThrottleRate, int iDownloadThrottleRate);	// limit for this object and copies made of it after this call
+	static void SetThrottleFairShare(bool bFairShare);		// share the process, host and bucket limits by weight instead of first come, first served
+	void SetThrottleWeight(DWORD dwWeight);					// fair sharing weight (ThrottleWeightBackground, ThrottleWeightNormal, ThrottleWeightInteractive...)
 	static void TerminateThrottle(void);
+	static void TerminateS3V4ChunkHash(void);
+	void SetRetryPolicy(const std::shared_ptr<CRetryPolicy>& pRetryPolicyParam);	// nullptr = use the default retry policy
+	void GetRetryStats(RETRY_STATS& Stats) const;
+	void SetHedge(bool bEnable, UINT uPercentile = 95, DWORD dwMinDelay = 10);	// hedge GET/HEAD requests (Read, ReadProperties, DirListing...)
+	static void TerminateHedge(void);
 	void IfThrottle(bool *pDownloadThrottle, bool *pUploadThrottle);
+	void GetThrottlePath(LPCTSTR pszResource, CThrottlePath& UploadPath, CThrottlePath& DownloadPath);
 	void RegisterShutdownCB(TEST_SHUTDOWN_CB ShutdownParamCB, void *pContext);
 	void UnregisterShutdownCB(TEST_SHUTDOWN_CB ShutdownParamCB, void *pContext);
 	void RegisterAbortPtr(const bool *pbAbort, bool bAbortTrue = true);
@@ -1683,20 +1853,23 @@ public:
 	void SetHTTPSecurityFlags(DWORD dwHTTPSecurityFlagsParam);
 	DWORD RetrieveServerCertificate(ECS_CERT_INFO& CertInfo);
 	static CString DumpBadIPMap(void);
+	static void SetNodeSelect(E_NODE_SELECT NodeSelectParam);
+	static void GetNodeStats(std::list<NODE_STATS>& StatsList);
+	static CString DumpNodeStats(void);
 
 	S3_ERROR SendRequest(LPCTSTR pszMethod, LPCTSTR pszResource, const void *pData, DWORD dwDataLen, CBuffer& RetData, std::list<HEADER_REQ> *pHeaderReq = nullptr, DWORD dwReceivedDataHint = 0, DWORD dwBufOffset = 0, STREAM_CONTEXT *pStreamSend = nullptr, STREAM_CONTEXT *pStreamReceive = nullptr, ULONGLONG ullTotalLen = 0ULL);
 
 	S3_ERROR Create(LPCTSTR pszPath, const void *pData = nullptr, DWORD dwLen = 0, const std::list<HEADER_STRUCT> *pMDList = nullptr, const CBuffer *pChecksum = nullptr, STREAM_CONTEXT *pStreamSend = nullptr, ULONGLONG ullTotalLen = 0ULL, LPCTSTR pIfNoneMatch = nullptr, std::list<HEADER_REQ> *pReq = nullptr);
 	S3_ERROR DeleteS3(LPCTSTR pszPath, LPCTSTR pszVersionId = nullptr);
 	S3_ERROR DeleteS3(const std::list<S3_DELETE_ENTRY>& PathList);
-	S3_ERROR Read(LPCTSTR pszPath, ULONGLONG lwLen, ULONGLONG lwOffset, CBuffer& RetData, DWORD dwBufOffset = 0, STREAM_CONTEXT *pStreamReceive = nullptr, std::list<HEADER_REQ> *pRcvHeaders = nullptr, ULONGLONG *pullReturnedLength = nullptr);
+	S3_ERROR Read(LPCTSTR pszPath, ULONGLONG lwLen, ULONGLONG lwOffset, CBuffer& RetData, DWORD dwBufOffset = 0, STREAM_CONTEXT *pStreamReceive = nullptr, std::list<HEADER_REQ> *pRcvHeaders = nullptr, ULONGLONG *pullReturnedLength = nullptr, LPCTSTR pIfMatch = nullptr);
 	S3_ERROR DirListing(LPCTSTR pszPath, DirEntryList_t& DirList, bool bSingle = false, LPCTSTR pszObjName = nullptr, LISTING_NEXT_MARKER_CONTEXT *pNextRequestMarker = nullptr, TCHAR cDelimiter = _T('/'));
 	S3_ERROR DirListingS3Versions(LPCTSTR pszPath, DirEntryList_t& DirList, LPCTSTR pszObjName = nullptr, LISTING_NEXT_MARKER_CONTEXT *pNextRequestMarker = nullptr, TCHAR cDelimiter = _T('/'));
 	S3_ERROR S3ServiceInformation(S3_SERVICE_INFO& ServiceInfo);
 	void WriteMetadataEntry(std::list<HEADER_STRUCT>& MDList, LPCTSTR pszTag, const CBuffer& Data);
 	void WriteMetadataEntry(std::list<HEADER_STRUCT>& MDList, LPCTSTR pszTag, const CString& sStr);
 	S3_ERROR UpdateMetadata(LPCTSTR pszPath, const std::list<HEADER_STRUCT>& MDList, const std::list<CString> *pDeleteTagParam = nullptr);
-	S3_ERROR ReadProperties(LPCTSTR pszPath, S3_SYSTEM_METADATA& Properties, LPCTSTR pszVersionId = nullptr, std::list<HEADER_STRUCT> *pMDList = nullptr, std::list<HEADER_REQ> *pReq = nullptr);
+	S3_ERROR ReadProperties(LPCTSTR pszPath, S3_SYSTEM_METADATA& Properties, LPCTSTR pszVersionId = nullptr, std::list<HEADER_STRUCT> *pMDList = nullptr, std::list<HEADER_REQ> *pReq = nullptr, bool bChecksumMode = false);
 	S3_ERROR ReadACL(LPCTSTR pszPath, std::deque<ACL_ENTRY>& Acls, LPCTSTR pszVersion = nullptr);
 	S3_ERROR WriteACL(LPCTSTR pszPath, const std::deque<ACL_ENTRY>& Acls, LPCTSTR pszVersion = nullptr);
 	CString GenerateShareableURL(LPCTSTR pszPath, SYSTEMTIME *pstExpire);
@@ -1715,9 +1888,10 @@ public:
 	// S3 multipart upload support
 	S3_ERROR S3MultiPartInitiate(LPCTSTR pszPath, S3_UPLOAD_PART_INFO& MultiPartInfo, const std::list<HEADER_STRUCT> *pMDList);
 	S3_ERROR S3MultiPartUpload(const S3_UPLOAD_PART_INFO& MultiPartInfo, S3_UPLOAD_PART_ENTRY& PartEntry, STREAM_CONTEXT *pStreamSend, ULONGLONG ullTotalLen, LPCTSTR pszCopySource, ULONGLONG ullStartRange, LPCTSTR pszVersionId);
-	S3_ERROR S3MultiPartComplete(const S3_UPLOAD_PART_INFO& MultiPartInfo, const std::list<std::shared_ptr<S3_UPLOAD_PART_ENTRY>>& PartList, S3_MPU_COMPLETE_INFO& MPUCompleteInfo);
+	S3_ERROR S3MultiPartComplete(const S3_UPLOAD_PART_INFO& MultiPartInfo, const std::list<std::shared_ptr<S3_UPLOAD_PART_ENTRY>>& PartList, S3_MPU_COMPLETE_INFO& MPUCompleteInfo, const std::list<HEADER_STRUCT> *pHeaderList = nullptr);
 	S3_ERROR S3MultiPartAbort(const S3_UPLOAD_PART_INFO& MultiPartInfo);
 	S3_ERROR S3MultiPartList(LPCTSTR pszBucketName, S3_LIST_MULTIPART_UPLOADS& MultiPartList);
+	S3_ERROR S3MultiPartListParts(const S3_UPLOAD_PART_INFO& MultiPartInfo, std::list<S3_LIST_PARTS_ENTRY>& PartList);
 
 	// ECS Admin functions
 	S3_ERROR ECSAdminLogin(LPCTSTR pszUser, LPCTSTR pszPassword);
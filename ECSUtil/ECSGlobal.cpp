@@ -31,6 +31,7 @@ protected:
 	{
 		CECSConnection::GarbageCollect();
 		CThreadPoolBase::GlobalGarbageCollect();
+		CBuffer::TrimBufferPool();
 	}
 };
 
@@ -56,6 +57,9 @@ void ECSTermLib()
 {
 	GarbageCollectThread.KillThreadWait();
 	CECSConnection::TerminateThrottle();
+	CECSConnection::TerminateS3V4ChunkHash();
+	CECSConnection::TerminateHedge();
+	CBuffer::TrimBufferPool(true);
 }
 
 } // end namespace ecs_sdk
@@ -24,6 +24,7 @@
 #include "SimpleWorkerThread.h"
 #include "ThreadPool.h"
 #include "CngAES_GCM.h"
+#include "CrcChecksum.h"
 #include "FileSupport.h"
 
 namespace ecs_sdk
@@ -42,13 +43,14 @@ CECSConnection::S3_ERROR S3Read(
 	std::list<CECSConnection::HEADER_REQ> *pRcvHeaders,			// optional return all headers
 	CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
 	void *pContext,											// context for UpdateProgressCB
-	ULONGLONG *pullReturnedLength)					// optional output returned size
+	ULONGLONG *pullReturnedLength,					// optional output returned size
+	S3_READ_VERIFY *pVerify)						// optional download verification
 {
 	CComPtr<IStream> pFileStream;
 	HRESULT hr;
 	if (FAILED(hr = SHCreateStreamOnFileEx(pszFile, grfMode, dwAttributes, bCreate, NULL, &pFileStream)))
 		return hr;
-	return S3Read(Conn, pszECSPath, pFileStream, lwLen, lwOffset, pRcvHeaders, UpdateProgressCB, pContext, pullReturnedLength);
+	return S3Read(Conn, pszECSPath, pFileStream, lwLen, lwOffset, pRcvHeaders, UpdateProgressCB, pContext, pullReturnedLength, pVerify);
 }
 
 CECSConnection::S3_ERROR S3Write(
@@ -58,17 +60,18 @@ CECSConnection::S3_ERROR S3Write(
 	CECSConnection& Conn,							// established connection to ECS
 	LPCTSTR pszECSPath,								// path to object in format: /bucket/dir1/dir2/object
 	const DWORD dwBufSize,							// size of buffer to use
-	bool bChecksum,									// if set, include content-MD5 header
+	bool bChecksum,									// if set, send a checksum header so the server verifies the data before it replaces the object
 	DWORD dwMaxQueueSize,								// how big the queue can grow that feeds the upload thread
 	const std::list<CECSConnection::HEADER_STRUCT> *pMDList,	// optional metadata to send to object
 	CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
-	void *pContext)											// context for UpdateProgressCB
+	void *pContext,											// context for UpdateProgressCB
+	E_CHECKSUM_TYPE ChecksumType)							// if bChecksum, the hash to use
 {
 	CComPtr<IStream> pFileStream;
 	HRESULT hr;
 	if (FAILED(hr = SHCreateStreamOnFileEx(pszFile, grfMode, dwAttributes, false, NULL, &pFileStream)))
 		return hr;
-	return S3Write(Conn, pszECSPath, pFileStream, dwBufSize, bChecksum, dwMaxQueueSize, pMDList, UpdateProgressCB, pContext);
+	return S3Write(Conn, pszECSPath, pFileStream, dwBufSize, bChecksum, dwMaxQueueSize, pMDList, UpdateProgressCB, pContext, ChecksumType);
 }
 
 bool DoS3MultiPartUpload(
@@ -80,13 +83,16 @@ bool DoS3MultiPartUpload(
 	const DWORD dwBufSize,							// size of buffer to use
 	const DWORD dwPartSize,							// part size (in MB)
 	const DWORD dwMaxThreads,						// maxiumum number of threads to spawn
-	bool bChecksum,									// if set, include content-MD5 header
+	bool bChecksum,									// if set, each part is hashed and sent with its checksum header so the server verifies it
 	const std::list<CECSConnection::HEADER_STRUCT> *pMDList,	// optional metadata to send to object
 	DWORD dwMaxQueueSize,								// how big the queue can grow that feeds the upload thread
 	DWORD dwMaxRetries,									// how many times to retry a part before giving up
 	CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
 	void *pContext,											// context for UpdateProgressCB
-	CECSConnection::S3_ERROR& Error)						// returned error
+	CECSConnection::S3_ERROR& Error,						// returned error
+	LPCWSTR pszJournalFile,									// optional journal file. if set, the upload can be resumed if interrupted
+	E_CHECKSUM_TYPE ChecksumType,							// if bChecksum, the hash to use
+	S3_MPU_CONCURRENCY *pConcurrency)						// optional adaptive concurrency
 {
 	CComPtr<IStream> pFileStream;
 	HRESULT hr;
@@ -96,7 +102,7 @@ bool DoS3MultiPartUpload(
 		return false;
 	}
 	return DoS3MultiPartUpload(Conn, pszECSPath, pFileStream, dwBufSize, dwPartSize, dwMaxThreads, bChecksum, pMDList, dwMaxQueueSize,
-		dwMaxRetries, UpdateProgressCB, pContext, Error);
+		dwMaxRetries, UpdateProgressCB, pContext, Error, pszJournalFile, ChecksumType, pConcurrency);
 }
 
 // TestShutdownThread
@@ -115,8 +121,8 @@ class CTestShutdown : public CECSConnectionAbortBase
 private:
 	const CSimpleWorkerThread *pThread;
 public:
-	CTestShutdown(const CSimpleWorkerThread *pThreadParam, CECSConnection *pHostParam = nullptr)
-		: CECSConnectionAbortBase(pHostParam)
+	CTestShutdown(const CSimpleWorkerThread *pThreadParam, CECSConnection *pHostParam = nullptr, const bool *pbAbortParam = nullptr)
+		: CECSConnectionAbortBase(pHostParam, pbAbortParam)
 		, pThread(pThreadParam)
 	{}
 
@@ -132,6 +138,127 @@ public:
 	}
 };
 
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////////// Hash Support /////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+// CStreamHash
+// integrity hash calculated as the data is sent or received
+// MD5 is checked against the ETag, CRC32C/CRC64NVME against the x-amz-checksum-* headers
+struct CStreamHash
+{
+	E_CHECKSUM_TYPE ChecksumType;		// which hash is used
+	CCngAES_GCM Md5;					// MD5 hash
+	CCrcChecksum Crc;					// CRC32C or CRC64NVME
+
+	CStreamHash(E_CHECKSUM_TYPE ChecksumTypeParam = E_CHECKSUM_TYPE::MD5)
+		: ChecksumType(ChecksumTypeParam)
+		, Crc((ChecksumTypeParam == E_CHECKSUM_TYPE::MD5) ? E_CHECKSUM_TYPE::CRC32C : ChecksumTypeParam)
+	{}
+	void Start(void)
+	{
+		if (ChecksumType == E_CHECKSUM_TYPE::MD5)
+			Md5.CreateHash(BCRYPT_MD5_ALGORITHM);
+		else
+			Crc.Reset();
+	}
+	void AddData(const BYTE *pData, DWORD dwLen)
+	{
+		if (ChecksumType == E_CHECKSUM_TYPE::MD5)
+			Md5.AddHashData(pData, dwLen);
+		else
+			Crc.AddData(pData, dwLen);
+	}
+	void GetHashData(CBuffer& HashData)
+	{
+		if (ChecksumType == E_CHECKSUM_TYPE::MD5)
+			Md5.GetHashData(HashData);
+		else
+			Crc.GetHashData(HashData);
+	}
+};
+
+// StreamHashReceiveCB
+// STREAM_CONTEXT receive callback. pContext must point to CStreamHash
+static void StreamHashReceiveCB(const CBuffer& Data, void *pContext)
+{
+	CStreamHash *pHash = (CStreamHash *)pContext;
+	if ((pHash != nullptr) && !Data.IsEmpty())
+		pHash->AddData(Data.GetData(), Data.GetBufSize());
+}
+
+// BadDigestError
+// error returned if the data that was sent or received doesn't match what the server has
+static CECSConnection::S3_ERROR BadDigestError(const CString& sDetails)
+{
+	CECSConnection::S3_ERROR Error(ERROR_CRC);
+	Error.S3Error = S3_ERROR_BadDigest;
+	Error.sS3Code = _T("BadDigest");
+	Error.sDetails = sDetails;
+	return Error;
+}
+
+// VerifyETag
+// finish the MD5 hash that was calculated as the data went by and check it against the ETag
+// if the ETag isn't a plain MD5 (multipart upload, server side encryption, etc) there is nothing to check it against
+static CECSConnection::S3_ERROR VerifyETag(
+	const CString& sETagParam,					// ETag returned by the request
+	CCngAES_GCM& Hash,							// MD5 hash of all data sent or received
+	CBuffer& HashData,							// out: MD5 hash
+	bool *pbVerified = nullptr)					// out, optional: set if the ETag could be checked
+{
+	if (pbVerified != nullptr)
+		*pbVerified = false;
+	Hash.GetHashData(HashData);
+	CString sETag(sETagParam);
+	(void)sETag.Trim(_T("\" "));
+	if ((sETag.GetLength() != (int)(HashData.GetBufSize() * 2))
+		|| (sETag.SpanIncluding(_T("0123456789abcdefABCDEF")).GetLength() != sETag.GetLength()))
+		return CECSConnection::S3_ERROR();
+	if (pbVerified != nullptr)
+		*pbVerified = true;
+	if (sETag.CompareNoCase(BinaryToHexString(HashData)) == 0)
+		return CECSConnection::S3_ERROR();
+	return BadDigestError(_T("ETag: ") + sETag + _T(", MD5: ") + BinaryToHexString(HashData));
+}
+
+// GetReturnedHeader
+// pull a header out of the headers returned by a request
+static CString GetReturnedHeader(const std::list<CECSConnection::HEADER_REQ>& Req, LPCTSTR pszHeader)
+{
+	for (std::list<CECSConnection::HEADER_REQ>::const_iterator it = Req.begin(); it != Req.end(); ++it)
+	{
+		if ((it->sHeader.CompareNoCase(pszHeader) == 0) && !it->ContentList.empty())
+			return it->ContentList.front();
+	}
+	return CString();
+}
+
+// VerifyStreamHash
+// check the hash calculated as the data went by against what the server returned
+// a CRC can only be checked if the server returns the x-amz-checksum-* header for the whole object
+// a composite checksum (CRC of the part CRCs, "<crc>-<parts>") can't be checked against the data
+static CECSConnection::S3_ERROR VerifyStreamHash(
+	const std::list<CECSConnection::HEADER_REQ>& Req,	// headers returned by the request
+	CStreamHash& Hash,							// hash of all data sent or received
+	CBuffer& HashData,							// out: hash
+	bool *pbVerified = nullptr)					// out, optional: set if the hash could be checked
+{
+	if (Hash.ChecksumType == E_CHECKSUM_TYPE::MD5)
+		return VerifyETag(GetReturnedHeader(Req, _T("ETag")), Hash.Md5, HashData, pbVerified);
+	if (pbVerified != nullptr)
+		*pbVerified = false;
+	Hash.Crc.GetHashData(HashData);
+	CString sServerCrc(GetReturnedHeader(Req, Hash.Crc.GetHeaderName()));
+	if (sServerCrc.IsEmpty() || (sServerCrc.Find(_T('-')) >= 0))
+		return CECSConnection::S3_ERROR();
+	if (pbVerified != nullptr)
+		*pbVerified = true;
+	if (sServerCrc == Hash.Crc.EncodeBase64())
+		return CECSConnection::S3_ERROR();
+	return BadDigestError(CString(Hash.Crc.GetHeaderName()) + _T(": ") + sServerCrc + _T(", calculated: ") + Hash.Crc.EncodeBase64());
+}
+
 //////////////////////////////////////////////////////////////////////////////
 /////////////////////////////// S3Read //////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
@@ -142,7 +269,7 @@ struct CS3ReadThread : public CSimpleWorkerThread
 	CECSConnection::STREAM_CONTEXT ReadContext;
 	CString sECSPath;					// path to ECS object to read
 	CECSConnection *pConn;				// ECS connection object
-	CSharedQueueEvent *pMsgEvent;		// event that the main thread will wait on
+	CSharedRingQueue<CECSConnection::STREAM_DATA_ENTRY> ReceiveRing;	// received data, passed to the main thread without locking
 	CECSConnection::S3_ERROR Error;		// returned status
 	ULONGLONG lwLen;								// if lwOffset == 0 and dwLen == 0, read entire file
 	ULONGLONG lwOffset;								// if dwLen != 0, read 'dwLen' bytes starting from lwOffset
@@ -153,7 +280,7 @@ struct CS3ReadThread : public CSimpleWorkerThread
 
 	CS3ReadThread()
 		: pConn(nullptr)
-		, pMsgEvent(nullptr)
+		, ReceiveRing(DefaultMaxStreamQueueSizeRecv + 1)
 		, lwLen(0ULL)
 		, lwOffset(0ULL)
 		, pRcvHeaders(nullptr)
@@ -163,7 +290,6 @@ struct CS3ReadThread : public CSimpleWorkerThread
 	~CS3ReadThread()
 	{
 		pConn = nullptr;
-		pMsgEvent = nullptr;
 		pRcvHeaders = nullptr;
 		KillThreadWait();
 	}
@@ -173,6 +299,7 @@ struct CS3ReadThread : public CSimpleWorkerThread
 // S3Read
 // Set up a worker thread that will read the data from ECS and fill a memory queue
 // the original thread will read the data off of the queue and write it to disk
+// if pVerify is set, the data is hashed on the worker thread as it is received (see S3_READ_VERIFY)
 CECSConnection::S3_ERROR S3Read(
 	CECSConnection& Conn,							// established connection to ECS
 	LPCTSTR pszECSPath,								// path to object in format: /bucket/dir1/dir2/object
@@ -183,26 +310,34 @@ CECSConnection::S3_ERROR S3Read(
 	std::list<CECSConnection::HEADER_REQ> *pRcvHeaders,			// optional return all headers
 	CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
 	void *pContext,											// context for UpdateProgressCB
-	ULONGLONG *pullReturnedLength)					// optional output returned size
+	ULONGLONG *pullReturnedLength,					// optional output returned size
+	S3_READ_VERIFY *pVerify)						// optional download verification
 {
 	CECSConnection::CStateReserve StateReserve(&Conn);
+	CStreamHash Hash((pVerify != nullptr) ? pVerify->ChecksumType : E_CHECKSUM_TYPE::MD5);	// must outlive ReadThread
+	std::list<CECSConnection::HEADER_REQ> VerifyHeaders;	// returned headers, if the caller didn't ask for them
 	CS3ReadThread ReadThread;						// thread object
-	CSharedQueueEvent MsgEvent;						// event that new data was pushed on the read queue
 	DWORD dwError;
 	DWORD dwMainThreadError = ERROR_SUCCESS;
+	const bool bWholeObject = (lwOffset == 0ULL) && (lwLen == 0ULL);	// only the whole object can be checked against the server
 
 	ReadThread.pConn = &Conn;
-	ReadThread.pMsgEvent = &MsgEvent;
+	ReadThread.ReadContext.pReceiveRing = &ReadThread.ReceiveRing;
 	ReadThread.sECSPath = pszECSPath;
 	ReadThread.lwLen = lwLen;
 	ReadThread.lwOffset = lwOffset;
 	ReadThread.pRcvHeaders = pRcvHeaders;
-
-	MsgEvent.Link(&ReadThread.ReadContext.StreamData);					// link the queue to the event
-	MsgEvent.DisableAllTriggerEvents();
-	MsgEvent.EnableTriggerEvents(TRIGGEREVENTS_PUSH | TRIGGEREVENTS_INSERTAT);
-	MsgEvent.SetAllEvents();
-	MsgEvent.Enable();
+	if (pVerify != nullptr)
+	{
+		pVerify->bVerified = false;
+		pVerify->Hash.Empty();
+		Hash.Start();
+		ReadThread.ReadContext.ReceiveCB = StreamHashReceiveCB;
+		ReadThread.ReadContext.pReceiveContext = &Hash;
+		ReadThread.ReadContext.bChecksumMode = bWholeObject && (Hash.ChecksumType != E_CHECKSUM_TYPE::MD5);
+		if (ReadThread.pRcvHeaders == nullptr)
+			ReadThread.pRcvHeaders = &VerifyHeaders;
+	}
 
 	// file is open and ready, now start up the worker thread so it starts reading from ECS
 	ReadThread.CreateThread();				// create the thread
@@ -211,32 +346,22 @@ CECSConnection::S3_ERROR S3Read(
 	bool bDone = false;
 	while (!bDone)
 	{
-		// wait then check if we are terminating
-		dwError = WaitForSingleObject(MsgEvent.Event.evQueue.m_hObject, SECONDS(2));
+		// once the worker is done, don't wait. just take whatever it left on the queue
+		bool bWorkerDone = ReadThread.bWorkerDone;
+		CECSConnection::STREAM_DATA_ENTRY StreamData;
+		bool bGotData = ReadThread.ReceiveRing.pop_front_wait(StreamData, bWorkerDone ? 0 : SECONDS(2));
 		// check for thread exit (but not if we are waiting for the handle to close)
 		if (Conn.TestAbort())
 		{
 			dwMainThreadError = ERROR_OPERATION_ABORTED;
 			break;
 		}
-		if (dwError == WAIT_FAILED)
+		if (bGotData)
 		{
-			dwMainThreadError = GetLastError();
-			break;
-		}
-			// got an event that something was pushed on the queue
-		while (!ReadThread.ReadContext.StreamData.empty())
-		{
-			CECSConnection::STREAM_DATA_ENTRY StreamData;
-			DWORD dwNumWritten;
-			{
-				CRWLockAcquire lockQueue(&ReadThread.ReadContext.StreamData.GetLock(), true);			// write lock
-				StreamData = ReadThread.ReadContext.StreamData.front();
-				ReadThread.ReadContext.StreamData.pop_front();
-			}
 			// write out the data
 			if (!StreamData.Data.IsEmpty())
 			{
+				DWORD dwNumWritten;
 				dwError = pStream->Write(StreamData.Data.GetData(), StreamData.Data.GetBufSize(), &dwNumWritten);
 				if (dwError != S_OK)
 				{
@@ -247,10 +372,8 @@ CECSConnection::S3_ERROR S3Read(
 					UpdateProgressCB(dwNumWritten, pContext);
 			}
 			if (StreamData.bLast)
-			{
-				bDone = true;
-				break;								// done!
-			}
+				bDone = true;						// done!
+			continue;
 		}
 		if (ReadThread.GetExitFlag())
 		{
@@ -258,9 +381,7 @@ CECSConnection::S3_ERROR S3Read(
 			dwMainThreadError = ERROR_OPERATION_ABORTED;
 			break;
 		}
-		if (dwMainThreadError != ERROR_SUCCESS)
-			break;
-		if (ReadThread.bWorkerDone)
+		if (bWorkerDone)
 			break;
 		// check if the background thread has ended with an error
 		if (!ReadThread.IfActive() && ReadThread.Error.IfError())
@@ -270,6 +391,13 @@ CECSConnection::S3_ERROR S3Read(
 	ReadThread.KillThreadWait();
 	if (pullReturnedLength != nullptr)
 		*pullReturnedLength = ReadThread.ullReturnedLength;
+	if ((pVerify != nullptr) && (dwMainThreadError == ERROR_SUCCESS) && !ReadThread.Error.IfError())
+	{
+		if (bWholeObject)
+			ReadThread.Error = VerifyStreamHash(*ReadThread.pRcvHeaders, Hash, pVerify->Hash, &pVerify->bVerified);
+		else
+			Hash.GetHashData(pVerify->Hash);
+	}
 	if ((dwMainThreadError == ERROR_SUCCESS) || ReadThread.Error.IfError())
 		return ReadThread.Error;
 	return dwMainThreadError;
@@ -299,15 +427,18 @@ struct CS3WriteThread : public CSimpleWorkerThread
 	CECSConnection *pConn;				// ECS connection object
 	CECSConnection::S3_ERROR Error;		// returned status
 	LARGE_INTEGER FileSize;
-	CCngAES_GCM Hash;					// optional MD5 hash
-	bool bGotHash;						// set if MD5 hash is complete
+	CStreamHash Hash;					// optional hash, calculated before the data is sent
+	bool bChecksum;						// set if the upload is verified against the hash
+	CBuffer ContentMD5;					// MD5 hash sent as Content-MD5
+	std::list<CECSConnection::HEADER_REQ> Req;	// headers returned by the PUT (x-amz-checksum-*)
 	bool bWorkerDone;					// set so it only runs once
 	const std::list<CECSConnection::HEADER_STRUCT> *pMDList;	// optional metadata to send to object
+	std::list<CECSConnection::HEADER_STRUCT> MDList;	// metadata plus the x-amz-checksum-* header
 	CEvent evWriteComplete;				// set when worker thread is finished writing to S3
 
 	CS3WriteThread()
 		: pConn(nullptr)
-		, bGotHash(false)
+		, bChecksum(false)
 		, bWorkerDone(false)
 		, pMDList(nullptr)
 		, evWriteComplete(FALSE, TRUE)
@@ -338,55 +469,42 @@ static bool TestShutdownWriteThread(void *pContext)
 	return false;
 }
 
-static DWORD CalcUploadChecksum(
-	IStream *pStream,							// open stream to file
-	ULONGLONG ullOffset,						// offset if reading a portion of the file
-	ULONGLONG ullLength,						// length (if reading a portion) if 0 && ullOffset == 0, read the whole file
-	CECSConnection& Conn,						// used for abort test
-	CBuffer& ReadBuf,							// buffer to use
-	CCngAES_GCM& Hash)							// out: return MD5 hash
+const ULONGLONG S3WRITE_REWIND_MAX = MEGABYTES(64ULL);		// keep up to this much sent data so S3Write can retry the PUT
+const ULONGLONG S3WRITE_PREREAD_MAX = MEGABYTES(64ULL);		// with bChecksum, files up to this size are read into memory once. larger files keep a queue's worth
+
+// ReadUploadEntry
+// read the next buffer of the upload directly into the queue entry
+static void ReadUploadEntry(IStream *pStream, DWORD dwBufSize, ULONGLONG ullOffset, CECSConnection::STREAM_DATA_ENTRY& WriteRec)
 {
-	try
-	{
-		Hash.CreateHash(BCRYPT_MD5_ALGORITHM);
-		DWORD dwNumRead;
-		DWORD dwError;
-		LARGE_INTEGER liOffset;
-		liOffset.QuadPart = ullOffset;
-		bool bPart = (ullOffset != 0ULL) || (ullLength != 0ULL);
-		dwError = pStream->Seek(liOffset, STREAM_SEEK_SET, nullptr);
-		if (dwError != S_OK)
-			throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
-		for (;;)
-		{
-			DWORD dwBytesToRead = ReadBuf.GetBufSize();
-			if (bPart)
-			{
-				if ((ULONGLONG)dwBytesToRead > ullLength)
-					dwBytesToRead = (DWORD)ullLength;
-			}
-			dwError = pStream->Read(ReadBuf.GetData(), dwBytesToRead, &dwNumRead);
-			if ((dwError != S_OK) && (dwError != S_FALSE))
-				throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
-			if (dwNumRead == 0)
-				break;						// didn't read anything
-			liOffset.QuadPart += dwNumRead;
-			Hash.AddHashData(ReadBuf.GetData(), dwNumRead);
-			if (bPart)
-			{
-				ullLength -= (ULONGLONG)dwNumRead;
-				if (ullLength == 0ULL)
-					break;
-			}
-			if (Conn.TestAbort())
-				throw CErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
-		}
-	}
-	catch (const CErrorInfo& E)
+	DWORD dwBytesRead;
+	// release the previous buffer first since it may still be shared with the queue
+	WriteRec.Data.Empty();
+	WriteRec.Data.SetBufSizeNoInit(dwBufSize);
+	HRESULT hr = pStream->Read(WriteRec.Data.GetData(), dwBufSize, &dwBytesRead);
+	if ((hr != S_OK) && (hr != S_FALSE))
+		throw CErrorInfo(_T(__FILE__), __LINE__, hr);
+	WriteRec.bLast = (hr == S_FALSE) || (dwBytesRead == 0);
+	WriteRec.Data.SetBufSize(dwBytesRead);
+	WriteRec.ullOffset = ullOffset;
+}
+
+// VerifyPutChecksum
+// the server checks the data against the checksum header before it replaces the object
+// Content-MD5 is always checked. a server that doesn't support x-amz-checksum-* ignores it and doesn't return it
+static CECSConnection::S3_ERROR VerifyPutChecksum(const std::list<CECSConnection::HEADER_REQ>& Req, const CStreamHash& Hash)
+{
+	if (Hash.ChecksumType == E_CHECKSUM_TYPE::MD5)
+		return CECSConnection::S3_ERROR();
+	CString sServerCrc(GetReturnedHeader(Req, Hash.Crc.GetHeaderName()));
+	if (sServerCrc == Hash.Crc.EncodeBase64())
+		return CECSConnection::S3_ERROR();
+	if (sServerCrc.IsEmpty())
 	{
-		return E.dwError;
+		CECSConnection::S3_ERROR Error(ERROR_NOT_SUPPORTED);
+		Error.sDetails = CString(Hash.Crc.GetHeaderName()) + _T(" was not returned by the server. The upload could not be verified, use MD5");
+		return Error;
 	}
-	return ERROR_SUCCESS;
+	return BadDigestError(CString(Hash.Crc.GetHeaderName()) + _T(": ") + sServerCrc + _T(", calculated: ") + Hash.Crc.EncodeBase64());
 }
 
 // S3Write
@@ -397,23 +515,23 @@ CECSConnection::S3_ERROR S3Write(
 	LPCTSTR pszECSPath,								// path to object in format: /bucket/dir1/dir2/object
 	IStream *pStream,								// open stream to file
 	const DWORD dwBufSize,							// size of buffer to use
-	bool bChecksum,									// if set, include content-MD5 header
+	bool bChecksum,									// if set, send a checksum header so the server verifies the data before it replaces the object
 	DWORD dwMaxQueueSize,								// how big the queue can grow that feeds the upload thread
 	const std::list<CECSConnection::HEADER_STRUCT> *pMDList,	// optional metadata to send to object
 	CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
-	void *pContext)											// context for UpdateProgressCB
+	void *pContext,											// context for UpdateProgressCB
+	E_CHECKSUM_TYPE ChecksumType)							// if bChecksum, the hash to use
 {
 	CECSConnection::CStateReserve StateReserve(&Conn);
 	CS3WriteThread WriteThread;						// thread object
 	CECSConnection::STREAM_DATA_ENTRY WriteRec;
-	CBuffer WriteBuf;
-	DWORD dwBytesRead;
+	std::deque<CECSConnection::STREAM_DATA_ENTRY> PreReadList;	// buffers kept from the checksum pass: the whole file, or the first dwMaxQueueSize buffers
+	bool bAllRead = false;							// PreReadList holds the whole file
 	DWORD dwError;
 	STATSTG FileStat;
 
 	try
 	{
-		WriteBuf.SetBufSize(dwBufSize);				// how much data to write at a time
 		WriteThread.pConn = &Conn;
 		WriteThread.sECSPath = pszECSPath;
 		WriteThread.pMDList = pMDList;
@@ -421,40 +539,89 @@ CECSConnection::S3_ERROR S3Write(
 		if (dwError != S_OK)
 			return dwError;
 		WriteThread.FileSize.QuadPart = FileStat.cbSize.QuadPart;
+		LARGE_INTEGER liOffset;
+		liOffset.QuadPart = 0LL;
+		dwError = pStream->Seek(liOffset, STREAM_SEEK_SET, nullptr);
+		if (dwError != S_OK)
+			throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
 		if (bChecksum)
 		{
-			dwError = CalcUploadChecksum(pStream, 0ULL, 0ULL, Conn, WriteBuf, WriteThread.Hash);
-			if (dwError != ERROR_SUCCESS)
-				return dwError;						// error creating the hash
-			WriteThread.bGotHash = true;
+			// the checksum is sent in the PUT headers so the server rejects bad data before it replaces the object
+			// that means it has to be calculated before the upload starts. a small file is read into memory and sent from there
+			// for a large file, the first dwMaxQueueSize buffers are kept and the rest of the file is read again for the upload
+			WriteThread.Hash.ChecksumType = ChecksumType;
+			if (ChecksumType != E_CHECKSUM_TYPE::MD5)
+				WriteThread.Hash.Crc.Reset(ChecksumType);
+			WriteThread.Hash.Start();
+			WriteThread.bChecksum = true;
+			bool bPreRead = (ULONGLONG)FileStat.cbSize.QuadPart <= S3WRITE_PREREAD_MAX;
+			do
+			{
+				if (Conn.TestAbort())
+					throw CErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
+				ReadUploadEntry(pStream, dwBufSize, liOffset.QuadPart, WriteRec);
+				if (!WriteRec.Data.IsEmpty())
+					WriteThread.Hash.AddData(WriteRec.Data.GetData(), WriteRec.Data.GetBufSize());
+				liOffset.QuadPart += WriteRec.Data.GetBufSize();
+				if (bPreRead || (PreReadList.size() < dwMaxQueueSize))
+					PreReadList.push_back(WriteRec);
+			} while (!WriteRec.bLast);
+			if (!PreReadList.empty() && PreReadList.back().bLast)
+				bAllRead = true;
+			else
+			{
+				// pick up the second read after the buffers that were kept
+				liOffset.QuadPart = PreReadList.empty() ? 0LL : (LONGLONG)(PreReadList.back().ullOffset + PreReadList.back().Data.GetBufSize());
+				dwError = pStream->Seek(liOffset, STREAM_SEEK_SET, nullptr);
+				if (dwError != S_OK)
+					throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
+			}
+			if (ChecksumType == E_CHECKSUM_TYPE::MD5)
+				WriteThread.Hash.GetHashData(WriteThread.ContentMD5);
+			else
+			{
+				if (pMDList != nullptr)
+					WriteThread.MDList = *pMDList;
+				WriteThread.MDList.push_back(CECSConnection::HEADER_STRUCT(WriteThread.Hash.Crc.GetHeaderName(), WriteThread.Hash.Crc.EncodeBase64()));
+				WriteThread.pMDList = &WriteThread.MDList;
+				WriteThread.Req.emplace_back(WriteThread.Hash.Crc.GetHeaderName());
+			}
 		}
 		WriteThread.WriteContext.UpdateProgressCB = UpdateProgressCB;
 		WriteThread.WriteContext.pContext = pContext;
+		WriteThread.WriteContext.ullRewindMax = S3WRITE_REWIND_MAX;		// small objects can be retried if the connection drops
+		if (!bAllRead && (dwMaxQueueSize != 0))
+		{
+			// the rewind entries are read from the file as it goes, so they come out of the queue's memory
+			// don't hold on to more than a full queue's worth of them
+			ULONGLONG ullQueueBytes = (ULONGLONG)dwMaxQueueSize * dwBufSize;
+			if (ullQueueBytes < WriteThread.WriteContext.ullRewindMax)
+				WriteThread.WriteContext.ullRewindMax = ullQueueBytes;
+		}
 		// file is open and ready, now start up the worker thread so it starts writing to ECS
 		WriteThread.CreateThread();				// create the thread
 		WriteThread.StartWork();					// kick it off
 
-		bool bDone = false;
-		LARGE_INTEGER liOffset;
-		liOffset.QuadPart = 0LL;
-		dwError = pStream->Seek(liOffset, STREAM_SEEK_SET, nullptr);
-		if (dwError != S_OK)
-			throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
+		bool bDone = bAllRead;					// if it was already read, liOffset is the size of the PUT
+		while (!PreReadList.empty())
+		{
+			if (WriteThread.bWorkerDone)
+				break;
+			if (Conn.TestAbort())
+				break;
+			WriteThread.WriteContext.StreamData.push_back(PreReadList.front(), dwMaxQueueSize, TestShutdownWriteThread, &WriteThread);
+			PreReadList.pop_front();
+		}
 		while (!bDone)
 		{
 			if (WriteThread.bWorkerDone)
 				break;
 			if (Conn.TestAbort())
 				break;
-			dwError = pStream->Read(WriteBuf.GetData(), WriteBuf.GetBufSize(), &dwBytesRead);
-			if ((dwError != S_OK) && (dwError != S_FALSE))
-				throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
-			if ((dwError == S_FALSE) || (dwBytesRead == 0))
-				bDone = WriteRec.bLast = true;
-			WriteRec.Data.Load(WriteBuf.GetData(), dwBytesRead);
-			WriteRec.ullOffset = liOffset.QuadPart;
-			liOffset.QuadPart += dwBytesRead;
-			WriteThread.WriteContext.StreamData.push_back(WriteRec, dwMaxQueueSize, TestShutdownWriteThread, &WriteThread);
+			ReadUploadEntry(pStream, dwBufSize, liOffset.QuadPart, WriteRec);
+			bDone = WriteRec.bLast;
+			liOffset.QuadPart += WriteRec.Data.GetBufSize();
+			WriteThread.WriteContext.StreamData.push_back(WriteRec, WriteThread.WriteContext.GetSendQueueLimit(dwMaxQueueSize), TestShutdownWriteThread, &WriteThread);
 		}
 		// wait for the worker thread to finish the S3 command
 		for (;;)
@@ -477,6 +644,8 @@ CECSConnection::S3_ERROR S3Write(
 		}
 		// now wait for the worker thread to terminate to get its error code
 		WriteThread.KillThreadWait();			// kill background thread
+		if (bChecksum && !WriteThread.Error.IfError())
+			WriteThread.Error = VerifyPutChecksum(WriteThread.Req, WriteThread.Hash);
 	}
 	catch (const CErrorInfo& E)
 	{
@@ -492,11 +661,8 @@ void CS3WriteThread::DoWork()
 {
 	if (!bWorkerDone && (dwEventRet == WAIT_OBJECT_0))
 	{
-		CBuffer HashData;
-		if (bGotHash)
-			Hash.GetHashData(HashData);
 		pConn->RegisterShutdownCB(TestShutdownWriteThread, this);
-		Error = pConn->Create(sECSPath, nullptr, 0UL, pMDList, bGotHash ? &HashData : nullptr, &WriteContext, FileSize.QuadPart);
+		Error = pConn->Create(sECSPath, nullptr, 0UL, pMDList, &ContentMD5, &WriteContext, FileSize.QuadPart, nullptr, bChecksum ? &Req : nullptr);
 		pConn->UnregisterShutdownCB(TestShutdownWriteThread, this);
 		VERIFY(evWriteComplete.SetEvent());							// notify parent thread that we're done here
 		bWorkerDone = true;
@@ -545,6 +711,8 @@ struct CMPUPoolMsg
 	CECSConnection::STREAM_CONTEXT *pStreamQueue;		// if stream send/receive, pointer to queue supplying the data
 	ULONGLONG ullTotalLen;				// total length of the file, used if bStreamSend/StreamSendQueue are being used
 	DWORD dwThreadId;					// used for debugging
+	ULONGLONG ullStartTime;				// tick count when the part upload started
+	ULONGLONG ullEndTime;				// tick count when the part upload finished
 										// S3 multipart upload
 	std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY> pUploadPartEntry;		// if non-empty, multipart upload
 	std::shared_ptr<CECSConnection::S3_UPLOAD_PART_INFO> MultiPartInfo;			// if non-empty, multipart upload
@@ -554,6 +722,8 @@ struct CMPUPoolMsg
 		, pStreamQueue(nullptr)
 		, ullTotalLen(0ULL)
 		, dwThreadId(GetCurrentThreadId())
+		, ullStartTime(0ULL)
+		, ullEndTime(0ULL)
 	{
 		(void)dwThreadId;
 	}
@@ -570,6 +740,8 @@ struct CMPUPoolMsg
 		, pStreamQueue(pStreamQueueParam)
 		, ullTotalLen(ullTotalLenParam)
 		, dwThreadId(GetCurrentThreadId())
+		, ullStartTime(0ULL)
+		, ullEndTime(0ULL)
 	{
 		Events.pMsgList = pMsgListParam;
 		Events.pevMsg = pevMsgParam;
@@ -583,7 +755,6 @@ public:
 	std::list<std::shared_ptr<CMPUPoolMsg>> PendingList;
 	CEvent evPendingList;
 	CCriticalSection csPendingList;
-	CCngAES_GCM MsgHash;
 
 	CMPUPoolList()
 	{}
@@ -614,6 +785,145 @@ public:
 	}
 };
 
+// CMPUConcurrency
+// AIMD control of the number of parts in flight (see S3_MPU_CONCURRENCY)
+// only used by the thread running DoS3MultiPartUpload. lConcurrency is also written to the caller's struct
+// so it can be read from other threads
+class CMPUConcurrency
+{
+private:
+	S3_MPU_CONCURRENCY *pOut;			// optional caller's struct
+	bool bAdaptive;						// if not set, only measure
+	LONG lMax;							// dwMaxThreads
+	LONG lConcurrency;					// parts allowed in flight
+	// current window
+	UINT uWindowParts;					// parts completed in this window
+	ULONGLONG ullWindowBytes;			// bytes uploaded in this window
+	ULONGLONG ullWindowLatency;			// sum of the part times (ms)
+	ULONGLONG ullWindowStart;			// tick count when the window started
+	bool bWindowCut;					// already cut in this window
+	// last window
+	double dLastThroughput;				// bytes/sec (0 = no baseline)
+	double dLastLatency;				// average part time (ms)
+
+	void StartWindow(ULONGLONG ullNow)
+	{
+		uWindowParts = 0;
+		ullWindowBytes = 0ULL;
+		ullWindowLatency = 0ULL;
+		ullWindowStart = ullNow;
+		bWindowCut = false;
+	}
+
+	void SetConcurrency(LONG lNew)
+	{
+		if (lNew < 1)
+			lNew = 1;
+		if (lNew > lMax)
+			lNew = lMax;
+		if (lNew == lConcurrency)
+			return;
+		if (pOut != nullptr)
+		{
+			if (lNew > lConcurrency)
+				pOut->uIncreases++;
+			else
+				pOut->uDecreases++;
+			(void)InterlockedExchange(&pOut->lConcurrency, lNew);
+			if (lNew > pOut->lPeak)
+				pOut->lPeak = lNew;
+		}
+		lConcurrency = lNew;
+	}
+
+	CMPUConcurrency(const CMPUConcurrency&);				// no implementation
+	CMPUConcurrency& operator = (const CMPUConcurrency&);	// no implementation
+
+public:
+	CMPUConcurrency(S3_MPU_CONCURRENCY *pOutParam, DWORD dwMaxThreads)
+		: pOut(pOutParam)
+		, bAdaptive((pOutParam != nullptr) && pOutParam->bAdaptive)
+		, lMax((LONG)dwMaxThreads)
+		, lConcurrency((LONG)dwMaxThreads)
+		, uWindowParts(0)
+		, ullWindowBytes(0ULL)
+		, ullWindowLatency(0ULL)
+		, ullWindowStart(GetTickCount64())
+		, bWindowCut(false)
+		, dLastThroughput(0.0)
+		, dLastLatency(0.0)
+	{
+		if (bAdaptive)
+		{
+			lConcurrency = (pOut->uStart == 0) ? 2 : (LONG)pOut->uStart;
+			if (lConcurrency > lMax)
+				lConcurrency = lMax;
+		}
+		if (pOut != nullptr)
+		{
+			pOut->uIncreases = 0;
+			pOut->uDecreases = 0;
+			pOut->dThroughput = 0.0;
+			pOut->lPeak = lConcurrency;
+			(void)InterlockedExchange(&pOut->lConcurrency, lConcurrency);
+		}
+	}
+
+	bool IfAdaptive(void) const
+	{
+		return bAdaptive;
+	}
+
+	LONG GetConcurrency(void) const
+	{
+		return lConcurrency;
+	}
+
+	// a part upload has finished (successfully or not)
+	void PartDone(ULONGLONG ullBytes, ULONGLONG ullStartTime, ULONGLONG ullEndTime, const CECSConnection::S3_ERROR& Error)
+	{
+		ULONGLONG ullNow = GetTickCount64();
+		if (Error.IfError())
+		{
+			// the server is pushing back. back off right away, but only once for all the parts that were in flight
+			if (bAdaptive && !bWindowCut
+				&& ((Error.dwHttpError == HTTP_STATUS_SERVICE_UNAVAIL) || (Error.dwError == ERROR_WINHTTP_TIMEOUT)))
+			{
+				SetConcurrency(lConcurrency / 2);
+				StartWindow(ullNow);
+				bWindowCut = true;
+				dLastThroughput = 0.0;
+				dLastLatency = 0.0;
+			}
+			return;
+		}
+		uWindowParts++;
+		ullWindowBytes += ullBytes;
+		if (ullEndTime > ullStartTime)
+			ullWindowLatency += ullEndTime - ullStartTime;
+		if (uWindowParts < (UINT)max(lConcurrency, 2L))
+			return;
+		// end of the window
+		ULONGLONG ullElapsed = ullNow - ullWindowStart;
+		if (ullElapsed == 0ULL)
+			ullElapsed = 1ULL;
+		double dThroughput = (double)ullWindowBytes * 1000.0 / (double)ullElapsed;
+		double dLatency = (double)ullWindowLatency / (double)uWindowParts;
+		if (pOut != nullptr)
+			pOut->dThroughput = dThroughput;
+		if (bAdaptive)
+		{
+			if ((dLastLatency > 0.0) && (dLatency > (dLastLatency * 1.5)) && (dThroughput <= dLastThroughput))
+				SetConcurrency(lConcurrency / 2);			// parts are getting slower and it isn't buying anything
+			else if (dThroughput >= (dLastThroughput * 0.95))
+				SetConcurrency(lConcurrency + 1);			// still scaling
+		}
+		dLastThroughput = dThroughput;
+		dLastLatency = dLatency;
+		StartWindow(ullNow);
+	}
+};
+
 // used where a class method can't be used
 static bool TestAbortStatic(void *pContext)
 {
@@ -621,6 +931,301 @@ static bool TestAbortStatic(void *pContext)
 	return pConn->TestAbort();
 }
 
+// MPU journal
+// text file (UTF-8) that records the state of a multipart upload so it can be resumed if interrupted
+// line 1: signature
+// followed by name=value lines:
+//   Resource, Bucket, Key, UploadId: from S3MultiPartInitiate
+//   FileSize, FileTime: used to verify that the source file hasn't changed since the journal was written
+//   Part: <part number> <base offset> <size> <ETag> <base64 checksum> (tab separated, ETag is empty if not complete)
+const LPCTSTR MPU_JOURNAL_SIGNATURE = _T("ECS MPU Journal V1");
+
+// WriteMPUJournal
+// write to a temp file then rename it so a crash during the update can't leave a partial journal
+static DWORD WriteMPUJournal(
+	LPCWSTR pszJournalFile,						// path to journal file
+	const CECSConnection::S3_UPLOAD_PART_INFO& MultiPartInfo,	// active multipart upload
+	const STATSTG& FileStat,					// source file info
+	const std::list<std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY>>& S3PartList)	// part layout
+{
+	CString sJournal;
+	sJournal = CString(MPU_JOURNAL_SIGNATURE) + _T("\r\n");
+	sJournal += _T("Resource=") + MultiPartInfo.sResource + _T("\r\n");
+	sJournal += _T("Bucket=") + MultiPartInfo.sBucket + _T("\r\n");
+	sJournal += _T("Key=") + MultiPartInfo.sKey + _T("\r\n");
+	sJournal += _T("UploadId=") + MultiPartInfo.sUploadId + _T("\r\n");
+	sJournal += _T("FileSize=") + FmtNum(FileStat.cbSize.QuadPart) + _T("\r\n");
+	sJournal += _T("FileTime=") + FmtNum(FTtoULarge(FileStat.mtime).QuadPart) + _T("\r\n");
+	for (std::list<std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY>>::const_iterator itList = S3PartList.begin(); itList != S3PartList.end(); ++itList)
+	{
+		CString sPart;
+		sPart.Format(_T("Part=%u\t%I64u\t%I64u\t%s\t%s\r\n"), (*itList)->uPartNum, (*itList)->ullBaseOffset, (*itList)->ullPartSize,
+			(*itList)->bComplete ? (LPCTSTR)(*itList)->sETag : _T(""),
+			((*itList)->bComplete && !(*itList)->Checksum.IsEmpty()) ? (LPCTSTR)(*itList)->Checksum.EncodeBase64() : _T(""));
+		sJournal += sPart;
+	}
+#ifdef _UNICODE
+	CAnsiString JournalUTF8(sJournal, CP_UTF8);
+#else
+	CAnsiString JournalUTF8(CWideString(sJournal), CP_UTF8);
+#endif
+	JournalUTF8.SetBufSize((DWORD)strlen(JournalUTF8));
+	CStringW sTempFile(pszJournalFile);
+	sTempFile += L".tmp";
+	{
+		CComPtr<IStream> pJournalStream;
+		HRESULT hr;
+		ULONG ulWritten;
+		if (FAILED(hr = SHCreateStreamOnFileEx(sTempFile, STGM_SHARE_EXCLUSIVE | STGM_CREATE | STGM_WRITE, FILE_ATTRIBUTE_NORMAL, TRUE, NULL, &pJournalStream)))
+			return hr;
+		if (FAILED(hr = pJournalStream->Write(JournalUTF8.GetData(), JournalUTF8.GetBufSize(), &ulWritten)))
+			return hr;
+		if (FAILED(hr = pJournalStream->Commit(STGC_DEFAULT)))
+			return hr;
+	}
+	if (!MoveFileExW(sTempFile, pszJournalFile, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		return GetLastError();
+	return ERROR_SUCCESS;
+}
+
+// ReadMPUJournal
+// returns ERROR_SUCCESS if the journal was read and matches the source file
+static DWORD ReadMPUJournal(
+	LPCWSTR pszJournalFile,						// path to journal file
+	const STATSTG& FileStat,					// source file info
+	CECSConnection::S3_UPLOAD_PART_INFO& MultiPartInfo,		// out: multipart upload recorded in the journal
+	std::list<std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY>>& S3PartList)	// out: part layout recorded in the journal
+{
+	CComPtr<IStream> pJournalStream;
+	STATSTG JournalStat;
+	CBuffer JournalBuf;
+	HRESULT hr;
+	ULONG ulRead;
+	bool bSizeMatch = false, bTimeMatch = false;
+
+	MultiPartInfo = CECSConnection::S3_UPLOAD_PART_INFO();
+	S3PartList.clear();
+	if (FAILED(hr = SHCreateStreamOnFileEx(pszJournalFile, STGM_READ | STGM_SHARE_DENY_WRITE, FILE_ATTRIBUTE_NORMAL, FALSE, NULL, &pJournalStream)))
+		return hr;
+	if (FAILED(hr = pJournalStream->Stat(&JournalStat, STATFLAG_NONAME)))
+		return hr;
+	if (JournalStat.cbSize.QuadPart > MEGABYTES(1ULL))
+		return ERROR_INVALID_DATA;						// can't be a valid journal
+	JournalBuf.SetBufSize((DWORD)JournalStat.cbSize.QuadPart);
+	if (FAILED(hr = pJournalStream->Read(JournalBuf.GetData(), JournalBuf.GetBufSize(), &ulRead)))
+		return hr;
+	CWideString JournalWide;
+	JournalWide.Set((LPCSTR)JournalBuf.GetData(), (int)ulRead, CP_UTF8);
+	CString sJournal(FROM_UNICODE((LPCWSTR)JournalWide));
+	int iPos = 0;
+	CString sLine = sJournal.Tokenize(_T("\r\n"), iPos);
+	if (sLine != MPU_JOURNAL_SIGNATURE)
+		return ERROR_INVALID_DATA;
+	for (sLine = sJournal.Tokenize(_T("\r\n"), iPos); iPos >= 0; sLine = sJournal.Tokenize(_T("\r\n"), iPos))
+	{
+		int iSep = sLine.Find(_T('='));
+		if (iSep < 0)
+			return ERROR_INVALID_DATA;
+		CString sName(sLine.Left(iSep)), sValue(sLine.Mid(iSep + 1));
+		if (sName == _T("Resource"))
+			MultiPartInfo.sResource = sValue;
+		else if (sName == _T("Bucket"))
+			MultiPartInfo.sBucket = sValue;
+		else if (sName == _T("Key"))
+			MultiPartInfo.sKey = sValue;
+		else if (sName == _T("UploadId"))
+			MultiPartInfo.sUploadId = sValue;
+		else if (sName == _T("FileSize"))
+			bSizeMatch = (ULONGLONG)_ttoi64(sValue) == FileStat.cbSize.QuadPart;
+		else if (sName == _T("FileTime"))
+			bTimeMatch = (ULONGLONG)_ttoi64(sValue) == FTtoULarge(FileStat.mtime).QuadPart;
+		else if (sName == _T("Part"))
+		{
+			std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY> Rec = std::make_shared<CECSConnection::S3_UPLOAD_PART_ENTRY>();
+			CString sField[5];
+			int iField = 0, iStart = 0;
+			for (; iField < (int)_countof(sField); iField++)
+			{
+				int iTab = sValue.Find(_T('\t'), iStart);
+				if (iTab < 0)
+				{
+					sField[iField] = sValue.Mid(iStart);
+					break;
+				}
+				sField[iField] = sValue.Mid(iStart, iTab - iStart);
+				iStart = iTab + 1;
+			}
+			if (iField < 3)
+				return ERROR_INVALID_DATA;
+			Rec->uPartNum = (UINT)_ttoi(sField[0]);
+			Rec->ullBaseOffset = (ULONGLONG)_ttoi64(sField[1]);
+			Rec->ullPartSize = (ULONGLONG)_ttoi64(sField[2]);
+			Rec->sETag = sField[3];
+			Rec->bComplete = !Rec->sETag.IsEmpty();
+			if (!sField[4].IsEmpty())
+				Rec->Checksum.LoadBase64(sField[4]);
+			S3PartList.push_back(Rec);
+		}
+	}
+	if (MultiPartInfo.sResource.IsEmpty() || MultiPartInfo.sUploadId.IsEmpty() || S3PartList.empty())
+		return ERROR_INVALID_DATA;
+	if (!bSizeMatch || !bTimeMatch)
+		return ERROR_FILE_CHECK_OUT;					// source file changed since the journal was written
+	return ERROR_SUCCESS;
+}
+
+// DiscardMPUJournal
+// the journal can't be used. abort the upload it recorded so its parts don't stay on the server, then delete it
+static void DiscardMPUJournal(
+	CECSConnection& Conn,							// established connection to ECS
+	LPCWSTR pszJournalFile,							// path to journal file
+	const CECSConnection::S3_UPLOAD_PART_INFO& JournalInfo)	// multipart upload recorded in the journal
+{
+	if (!JournalInfo.sResource.IsEmpty() && !JournalInfo.sUploadId.IsEmpty())
+		(void)Conn.S3MultiPartAbort(JournalInfo);
+	(void)DeleteFileW(pszJournalFile);
+}
+
+// ResumeMPUJournal
+// if the journal describes an upload of this file to this path, and the upload still exists on the server,
+// load the part layout and mark the parts that the server already has as complete
+// returns false if a new upload must be started
+static bool ResumeMPUJournal(
+	CECSConnection& Conn,							// established connection to ECS
+	LPCTSTR pszECSPath,								// path to object in format: /bucket/dir1/dir2/object
+	LPCWSTR pszJournalFile,							// path to journal file
+	const STATSTG& FileStat,						// source file info
+	CECSConnection::S3_UPLOAD_PART_INFO& MultiPartInfo,		// out: multipart upload to resume
+	std::list<std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY>>& S3PartList)	// in, out: part layout
+{
+	CECSConnection::S3_UPLOAD_PART_INFO JournalInfo;
+	std::list<std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY>> JournalPartList;
+	DWORD dwError = ReadMPUJournal(pszJournalFile, FileStat, JournalInfo, JournalPartList);
+	if (dwError == ERROR_FILE_CHECK_OUT)
+	{
+		// the source file changed. the old upload can't be used. get rid of it
+		DiscardMPUJournal(Conn, pszJournalFile, JournalInfo);
+		return false;
+	}
+	if (dwError != ERROR_SUCCESS)
+	{
+		// can't trust anything that was read from it
+		(void)DeleteFileW(pszJournalFile);
+		return false;
+	}
+	if (JournalInfo.sResource != pszECSPath)
+	{
+		// journal for some other object. nothing will resume that upload now
+		DiscardMPUJournal(Conn, pszJournalFile, JournalInfo);
+		return false;
+	}
+	// make sure the upload is still active
+	CECSConnection::S3_LIST_MULTIPART_UPLOADS MultiPartList;
+	CECSConnection::S3_ERROR Error = Conn.S3MultiPartList(JournalInfo.sBucket, MultiPartList);
+	if (Error.IfError())
+		return false;
+	std::list<CECSConnection::S3_LIST_MULTIPART_UPLOADS_ENTRY>::const_iterator itUpload;
+	for (itUpload = MultiPartList.ObjectList.begin(); itUpload != MultiPartList.ObjectList.end(); ++itUpload)
+		if ((itUpload->sKey == JournalInfo.sKey) && (itUpload->sUploadId == JournalInfo.sUploadId))
+			break;
+	if (itUpload == MultiPartList.ObjectList.end())
+	{
+		(void)DeleteFileW(pszJournalFile);
+		return false;
+	}
+	// now reconcile the journal with the parts the server actually has
+	std::list<CECSConnection::S3_LIST_PARTS_ENTRY> ServerPartList;
+	Error = Conn.S3MultiPartListParts(JournalInfo, ServerPartList);
+	if (Error.IfError())
+		return false;
+	std::map<UINT, const CECSConnection::S3_LIST_PARTS_ENTRY *> ServerPartMap;
+	for (std::list<CECSConnection::S3_LIST_PARTS_ENTRY>::const_iterator itServer = ServerPartList.begin(); itServer != ServerPartList.end(); ++itServer)
+		ServerPartMap[itServer->uPartNum] = &(*itServer);
+	for (std::list<std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY>>::iterator itList = JournalPartList.begin(); itList != JournalPartList.end(); ++itList)
+	{
+		if (!(*itList)->bComplete)
+			continue;
+		std::map<UINT, const CECSConnection::S3_LIST_PARTS_ENTRY *>::const_iterator itServer = ServerPartMap.find((*itList)->uPartNum);
+		if ((itServer == ServerPartMap.end())
+			|| (itServer->second->ullSize != (*itList)->ullPartSize)
+			|| (CString(itServer->second->sETag).Trim(_T("\"")) != CString((*itList)->sETag).Trim(_T("\""))))
+		{
+			// the server doesn't have this part. send it again
+			(*itList)->bComplete = false;
+			(*itList)->sETag.Empty();
+			(*itList)->Checksum.Empty();
+		}
+	}
+	MultiPartInfo = JournalInfo;
+	S3PartList.swap(JournalPartList);
+	return true;
+}
+
+// PrimePart
+// queue the first dwMaxQueueSize buffers of a part. the rest is queued as the upload consumes it
+// if bChecksum, the whole part is hashed first so the checksum can be sent with it (Content-MD5 or x-amz-checksum-*)
+// and the server rejects the part if the data it receives doesn't match. the buffers that fit in the queue are kept,
+// so only the rest of the part is read a second time. if the file changes between the reads, the part fails and is retried
+static void PrimePart(
+	CECSConnection& Conn,							// established connection to ECS
+	IStream *pStream,								// open stream to file
+	CBuffer& Buf,									// scratch buffer for the part of the hash pass that isn't kept
+	CECSConnection::S3_UPLOAD_PART_ENTRY& PartEntry,	// part to prime
+	DWORD dwMaxQueueSize,							// how many buffers to queue
+	bool bChecksum,									// if set, hash the whole part
+	E_CHECKSUM_TYPE ChecksumType)					// if bChecksum, the hash to use
+{
+	CStreamHash Hash(ChecksumType);
+	if (bChecksum)
+		Hash.Start();
+	PartEntry.StreamQueue.StreamData.clear();
+	PartEntry.ullCursor = 0ULL;
+	LARGE_INTEGER liOffset;
+	liOffset.QuadPart = PartEntry.ullBaseOffset;
+	HRESULT hr = pStream->Seek(liOffset, STREAM_SEEK_SET, nullptr);
+	if (hr != S_OK)
+		throw CErrorInfo(_T(__FILE__), __LINE__, hr);
+	DWORD dwRecCount = 0;
+	for (ULONGLONG ullRead = 0ULL; ullRead < PartEntry.ullPartSize; )
+	{
+		bool bQueue = dwRecCount < dwMaxQueueSize;
+		if (!bQueue && !bChecksum)
+			break;
+		ULONGLONG ullRemaining = PartEntry.ullPartSize - ullRead;
+		DWORD dwReadBufSize = ((ULONGLONG)Buf.GetBufSize() > ullRemaining) ? (DWORD)ullRemaining : Buf.GetBufSize();
+		CECSConnection::STREAM_DATA_ENTRY StreamMsg;
+		BYTE *pRead;
+		if (bQueue)
+		{
+			StreamMsg.Data.SetBufSizeNoInit(dwReadBufSize);		// read directly into the queue entry
+			pRead = StreamMsg.Data.GetData();
+		}
+		else
+			pRead = Buf.GetData();								// only hashed. it is read again when the upload gets to it
+		DWORD dwNumRead;
+		hr = pStream->Read(pRead, dwReadBufSize, &dwNumRead);
+		if ((hr != S_OK) && (hr != S_FALSE))
+			throw CErrorInfo(_T(__FILE__), __LINE__, hr);
+		if (dwNumRead == 0)
+			throw CErrorInfo(_T(__FILE__), __LINE__, ERROR_HANDLE_EOF);		// the file got shorter
+		if (bChecksum)
+			Hash.AddData(pRead, dwNumRead);
+		if (bQueue)
+		{
+			StreamMsg.Data.SetBufSize(dwNumRead);
+			StreamMsg.bLast = PartEntry.ullPartSize == (ullRead + dwNumRead);
+			PartEntry.StreamQueue.StreamData.push_back(StreamMsg, 0, TestAbortStatic, &Conn);
+			PartEntry.ullCursor += (ULONGLONG)dwNumRead;
+			dwRecCount++;
+		}
+		ullRead += (ULONGLONG)dwNumRead;
+	}
+	if (bChecksum)
+	{
+		Hash.GetHashData(PartEntry.Checksum);
+		PartEntry.sChecksumHeader = (ChecksumType == E_CHECKSUM_TYPE::MD5) ? CString() : CString(Hash.Crc.GetHeaderName());
+	}
+}
 
 // DoS3MultiPartUpload
 // manage a S3 multipart upload
@@ -628,6 +1233,8 @@ static bool TestAbortStatic(void *pContext)
 // "throw" any errors
 // this thread manages reading the file to feed the thread pool and the streaming write operations
 // returns 'false' if it didn't do the upload
+// if pszJournalFile is set, the state of the upload is kept in that file. if the upload fails, it isn't aborted
+// and calling this again with the same file and journal will only send the parts that the server doesn't already have
 bool DoS3MultiPartUpload(
 	CECSConnection& Conn,							// established connection to ECS
 	LPCTSTR pszECSPath,								// path to object in format: /bucket/dir1/dir2/object
@@ -635,14 +1242,18 @@ bool DoS3MultiPartUpload(
 	const DWORD dwBufSize,							// size of buffer to use
 	const DWORD dwPartSize,							// part size (in MB)
 	const DWORD dwMaxThreads,						// maxiumum number of threads to spawn
-	bool bChecksum,									// if set, include content-MD5 header
+	bool bChecksum,									// if set, each part is hashed and sent with its checksum header so the server verifies it
 	const std::list<CECSConnection::HEADER_STRUCT> *pMDList,	// optional metadata to send to object
 	DWORD dwMaxQueueSize,								// how big the queue can grow that feeds the upload thread
 	DWORD dwMaxRetries,									// how many times to retry a part before giving up
 	CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
 	void *pContext,											// context for UpdateProgressCB
-	CECSConnection::S3_ERROR& Error)						// returned error
+	CECSConnection::S3_ERROR& Error,						// returned error
+	LPCWSTR pszJournalFile,									// optional journal file. if set, the upload can be resumed if interrupted
+	E_CHECKSUM_TYPE ChecksumType,							// if bChecksum, the hash to use
+	S3_MPU_CONCURRENCY *pConcurrency)						// optional adaptive concurrency
 {
+	const bool bJournal = (pszJournalFile != nullptr) && (*pszJournalFile != L'\0');
 	CECSConnection::CStateReserve StateReserve(&Conn);
 	const DWORD dwMaxParts = 1000;							// don't go over 1000 parts
 	CSyncObject *EventArray[MAXIMUM_WAIT_OBJECTS];
@@ -652,6 +1263,7 @@ bool DoS3MultiPartUpload(
 	bool bStartedMultipartUpload = false;
 	std::list<std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY>> S3PartList;
 	CMPUPool MPUPool;
+	const bool bChecksumCrc = bChecksum && (ChecksumType != E_CHECKSUM_TYPE::MD5);	// CRC: full object checksum is sent with the complete
 	STATSTG FileStat;
 	DWORD dwError;
 
@@ -702,18 +1314,55 @@ bool DoS3MultiPartUpload(
 			throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, ERROR_INVALID_PARAMETER);
 		MPUPool.SetMaxThreads(dwMaxThreads);
 		CThreadPoolBase::SetPoolInitialized();
+		CMPUConcurrency Control(pConcurrency, dwMaxThreads);
 		MultiPartInfo.reset(new CECSConnection::S3_UPLOAD_PART_INFO);
-		// start up a multipart upload
-		Error = Conn.S3MultiPartInitiate(pszECSPath, *MultiPartInfo, ((pMDList != nullptr) && (!pMDList->empty())) ? pMDList : nullptr);
-		if (Error.IfError())
-			throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, Error);
+		// if there is a journal from a previous attempt, pick up where it left off
+		bool bResumed = false;
+		if (bJournal)
+			bResumed = ResumeMPUJournal(Conn, pszECSPath, pszJournalFile, FileStat, *MultiPartInfo, S3PartList);
+		if (!bResumed)
+		{
+			// start up a multipart upload
+			std::list<CECSConnection::HEADER_STRUCT> InitiateList;
+			if (pMDList != nullptr)
+				InitiateList = *pMDList;
+			if (bChecksumCrc)
+			{
+				// the part CRCs are combined into a CRC of the whole object which is checked by the server on complete
+				CCrcChecksum Crc(ChecksumType);
+				InitiateList.emplace_back(CECSConnection::HEADER_STRUCT(_T("x-amz-checksum-algorithm"), Crc.GetAlgorithmName()));
+				InitiateList.emplace_back(CECSConnection::HEADER_STRUCT(_T("x-amz-checksum-type"), _T("FULL_OBJECT")));
+			}
+			Error = Conn.S3MultiPartInitiate(pszECSPath, *MultiPartInfo, !InitiateList.empty() ? &InitiateList : nullptr);
+			if (Error.IfError())
+				throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, Error);
+		}
 		bStartedMultipartUpload = true;
+		if (bJournal)
+		{
+			dwError = WriteMPUJournal(pszJournalFile, *MultiPartInfo, FileStat, S3PartList);
+			if (dwError != ERROR_SUCCESS)
+				throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
+		}
 		for (std::list<std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY>>::iterator itList = S3PartList.begin(); itList != S3PartList.end(); ++itList)
 		{
 			CECSConnection::S3_UPLOAD_PART_ENTRY *pEntry = itList->get();
 			pEntry->bInProcess = false;
-			pEntry->bComplete = false;
 			pEntry->dwRetryNum = 0;
+			if (pEntry->bComplete)
+			{
+				// already uploaded in a previous attempt
+				if (UpdateProgressCB != nullptr)
+				{
+					for (ULONGLONG ullProgress = pEntry->ullPartSize; ullProgress > 0ULL; )
+					{
+						int iProgress = (ullProgress > (ULONGLONG)INT_MAX) ? INT_MAX : (int)ullProgress;
+						UpdateProgressCB(iProgress, pContext);
+						ullProgress -= (ULONGLONG)iProgress;
+					}
+				}
+				continue;
+			}
 			pEntry->Checksum.Empty();
 			pEntry->StreamQueue.StreamData.clear();
 			pEntry->ullCursor = 0ULL;
@@ -731,7 +1380,13 @@ bool DoS3MultiPartUpload(
 				bS3PartListEmpty = false;				// at least one non-complete entry exists
 				if ((*itList)->bInProcess)
 					continue;							// skip over in-process entries
-				if (MPUPool.GetMsgQueueCount() >= (dwMaxThreads + 4))
+				if (Control.IfAdaptive())
+				{
+					CSingleLock lock(&MPUPool.Pending.csPendingList, true);
+					if (MPUPool.Pending.PendingList.size() >= (size_t)Control.GetConcurrency())
+						break;												// as many parts in flight as currently allowed
+				}
+				else if (MPUPool.GetMsgQueueCount() >= (dwMaxThreads + 4))
 					break;													// we have enough for now
 				if (Conn.TestAbort())
 					throw CErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
@@ -749,50 +1404,8 @@ bool DoS3MultiPartUpload(
 					(*itList)->Event.QueueEvent.Enable();
 				}
 				(*itList)->bInProcess = true;											// mark the entry as being in-process
-																						// if checksum, calculate it now
-				{
-					(*itList)->StreamQueue.StreamData.clear();
-					if (bChecksum)
-						MPUPool.Pending.MsgHash.CreateHash(BCRYPT_MD5_ALGORITHM);			// make sure it is a clean slate
-					LARGE_INTEGER liChecksumOffset;
-					liChecksumOffset.QuadPart = (*itList)->ullBaseOffset;
-					ULONGLONG ullPartSize = (*itList)->ullPartSize;
-					DWORD dwNumRead, dwReadBufSize;
-					DWORD dwRecCount = 0;
-					dwError = pStream->Seek(liChecksumOffset, STREAM_SEEK_SET, nullptr);
-					if (dwError != S_OK)
-						throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
-					while (ullPartSize > 0ULL)
-					{
-						dwReadBufSize = Buf.GetBufSize();
-						if ((ULONGLONG)dwReadBufSize > ullPartSize)
-							dwReadBufSize = (DWORD)ullPartSize;
-						dwError = pStream->Read(Buf.GetData(), dwReadBufSize, &dwNumRead);
-						if ((dwError != S_OK) && (dwError != S_FALSE))
-							throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
-						if (bChecksum)
-							MPUPool.Pending.MsgHash.AddHashData(Buf.GetData(), dwNumRead);
-						// as long as we've read the data, might as well queue it to be uploaded
-						// save another read in a short while
-						if (dwRecCount < dwMaxQueueSize)
-						{
-							CECSConnection::STREAM_DATA_ENTRY StreamMsg;
-							StreamMsg.Data.Load(Buf.GetData(), dwNumRead);
-							StreamMsg.bLast = ullPartSize == (ULONGLONG)dwNumRead;
-							(*itList)->StreamQueue.StreamData.push_back(StreamMsg, 0, TestAbortStatic, &Conn);
-							(*itList)->ullCursor += (ULONGLONG)dwNumRead;
-							dwRecCount++;
-						}
-						liChecksumOffset.QuadPart += dwNumRead;
-						ullPartSize -= (ULONGLONG)dwNumRead;
-						if (!bChecksum && (dwRecCount >= dwMaxQueueSize))
-							break;									// if no checksum, we don't need to go through the whole segment
-					}
-					if (bChecksum)
-					{
-						MPUPool.Pending.MsgHash.GetHashData((*itList)->Checksum);
-					}
-				}
+				// queue the start of the part. if checksum, the part is hashed first so the checksum can be sent with it
+				PrimePart(Conn, pStream, Buf, **itList, dwMaxQueueSize, bChecksum, ChecksumType);
 				{
 					std::shared_ptr<std::shared_ptr<CMPUPoolMsg>> AutoMsg;
 					AutoMsg.reset(new std::shared_ptr<CMPUPoolMsg>(Msg));
@@ -850,6 +1463,9 @@ bool DoS3MultiPartUpload(
 						CECSConnection::S3_UPLOAD_PART_ENTRY *pPartEntry = (*itPending)->pUploadPartEntry.get();
 						if ((*itPending)->Events.bComplete)
 						{
+							Control.PartDone(pPartEntry->ullPartSize, (*itPending)->ullStartTime, (*itPending)->ullEndTime, (*itPending)->Error);
+							// the server has checked the part against its checksum. if CRC, the part CRC stays in
+							// pPartEntry->Checksum so it can be combined into the CRC of the whole object
 							// done! see if it was successful
 							if ((*itPending)->Error.IfError())
 							{
@@ -876,6 +1492,12 @@ bool DoS3MultiPartUpload(
 										break;
 									}
 								}
+								if (bJournal)
+								{
+									dwError = WriteMPUJournal(pszJournalFile, *MultiPartInfo, FileStat, S3PartList);
+									if (dwError != ERROR_SUCCESS)
+										throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
+								}
 							}
 							bDeleteEntry = true;
 							bDeletedAtLeastOneEntry = true;
@@ -898,11 +1520,12 @@ bool DoS3MultiPartUpload(
 								ullRemainingPart = pPartEntry->ullPartSize - pPartEntry->ullCursor;
 								if ((ULONGLONG)dwReadBufSize > ullRemainingPart)
 									dwReadBufSize = (DWORD)ullRemainingPart;
-								dwError = pStream->Read(Buf.GetData(), dwReadBufSize, &dwNumRead);
+								CECSConnection::STREAM_DATA_ENTRY StreamMsg;
+								StreamMsg.Data.SetBufSizeNoInit(dwReadBufSize);		// read directly into the queue entry
+								dwError = pStream->Read(StreamMsg.Data.GetData(), dwReadBufSize, &dwNumRead);
 								if ((dwError != S_OK) && (dwError != S_FALSE))
 									throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
-								CECSConnection::STREAM_DATA_ENTRY StreamMsg;
-								StreamMsg.Data.Load(Buf.GetData(), dwNumRead);
+								StreamMsg.Data.SetBufSize(dwNumRead);
 								StreamMsg.bLast = pPartEntry->ullPartSize <= (pPartEntry->ullCursor + dwNumRead);
 								pPartEntry->StreamQueue.StreamData.push_back(StreamMsg, 0, TestAbortStatic, &Conn);
 								pPartEntry->ullCursor += dwNumRead;
@@ -922,13 +1545,39 @@ bool DoS3MultiPartUpload(
 		// done!
 		// complete the upload. tell the server to reassemble all the parts
 		CECSConnection::S3_MPU_COMPLETE_INFO MPUCompleteInfo;
-		Error = Conn.S3MultiPartComplete(*MultiPartInfo, S3PartList, MPUCompleteInfo);
+		std::list<CECSConnection::HEADER_STRUCT> CompleteList;
+		if (bChecksumCrc)
+		{
+			// put the part CRCs together in part order to get the CRC of the whole object
+			// if a part was sent by an earlier attempt using a different checksum, the object CRC isn't known
+			CCrcChecksum ObjectCrc(ChecksumType);
+			bool bObjectCrc = true;
+			for (std::list<std::shared_ptr<CECSConnection::S3_UPLOAD_PART_ENTRY>>::const_iterator itList = S3PartList.begin(); itList != S3PartList.end(); ++itList)
+			{
+				CCrcChecksum PartCrc(ChecksumType);
+				if (!PartCrc.SetHashData((*itList)->Checksum, (*itList)->ullPartSize))
+				{
+					bObjectCrc = false;
+					break;
+				}
+				ObjectCrc.Combine(PartCrc);
+			}
+			if (bObjectCrc)
+			{
+				CompleteList.emplace_back(CECSConnection::HEADER_STRUCT(ObjectCrc.GetHeaderName(), ObjectCrc.EncodeBase64()));
+				CompleteList.emplace_back(CECSConnection::HEADER_STRUCT(_T("x-amz-checksum-type"), _T("FULL_OBJECT")));
+			}
+		}
+		Error = Conn.S3MultiPartComplete(*MultiPartInfo, S3PartList, MPUCompleteInfo, !CompleteList.empty() ? &CompleteList : nullptr);
 		if (Error.IfError())
 			throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, Error);
+		if (bJournal)
+			(void)DeleteFileW(pszJournalFile);
 	}
 	catch (const CECSConnection::CS3ErrorInfo& E)
 	{
-		if (bStartedMultipartUpload)
+		// if there is a journal, leave the upload in place so it can be resumed
+		if (bStartedMultipartUpload && !bJournal)
 		{
 			Conn.CheckShutdown(false);
 			Error = Conn.S3MultiPartAbort(*MultiPartInfo);
@@ -939,7 +1588,7 @@ bool DoS3MultiPartUpload(
 	}
 	catch (const CErrorInfo& E)
 	{
-		if (bStartedMultipartUpload)
+		if (bStartedMultipartUpload && !bJournal)
 		{
 			Conn.CheckShutdown(false);
 			Error = Conn.S3MultiPartAbort(*MultiPartInfo);
@@ -963,7 +1612,9 @@ bool CMPUPool::DoProcess(const CSimpleWorkerThread * pThread, const std::shared_
 	{
 		CTestShutdown Shutdown(pThread, &Msg->Conn);
 		// S3 multipart upload
+		Msg->ullStartTime = GetTickCount64();
 		Msg->Error = Msg->Conn.S3MultiPartUpload(*Msg->MultiPartInfo, *Msg->pUploadPartEntry, Msg->pStreamQueue, Msg->ullTotalLen, nullptr, 0ULL, nullptr);
+		Msg->ullEndTime = GetTickCount64();
 	}
 	{
 		CSingleLock lock(&Pending.csPendingList, true);
@@ -988,4 +1639,715 @@ bool CMPUPool::SearchEntry(const std::shared_ptr<CMPUPoolMsg>& Msg1, const std::
 	return false;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////////// S3ReadParallel ///////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+struct CS3ReadPoolMsg
+{
+	CECSConnection Conn;				// connection to S3 host
+	CString sECSPath;					// path to ECS object to read
+	CString sETag;						// ETag of the object. each range is read with if-match so they all come from the same version
+	CECSConnection::S3_ERROR Error;		// error code from range read
+	ULONGLONG ullRangeOffset;			// offset of this range within the object
+	ULONGLONG ullRangeLen;				// length of this range
+	ULONGLONG ullReturnedLength;		// returned length from Read
+	DWORD dwRetryNum;					// how many times this range has been retried
+	CBuffer Data;						// data for this range
+	bool bCrc;							// set if the CRC of the range is calculated
+	CCrcChecksum Crc;					// if bCrc, CRC of the range, calculated by the pool thread
+	CMPUPoolMsgEvents Events;			// completion event/flag (protected by csPendingList)
+
+	CS3ReadPoolMsg(
+		const CECSConnection& ConnParam,
+		LPCTSTR pszECSPathParam,
+		LPCTSTR pszETagParam,
+		CEvent *pevMsgParam,
+		ULONGLONG ullRangeOffsetParam,
+		ULONGLONG ullRangeLenParam,
+		const S3_READ_VERIFY *pVerify
+	)
+		: Conn(ConnParam)
+		, sECSPath(pszECSPathParam)
+		, sETag(pszETagParam)
+		, ullRangeOffset(ullRangeOffsetParam)
+		, ullRangeLen(ullRangeLenParam)
+		, ullReturnedLength(0ULL)
+		, dwRetryNum(0)
+		, bCrc((pVerify != nullptr) && (pVerify->ChecksumType != E_CHECKSUM_TYPE::MD5))
+		, Crc(((pVerify != nullptr) && (pVerify->ChecksumType != E_CHECKSUM_TYPE::MD5)) ? pVerify->ChecksumType : E_CHECKSUM_TYPE::CRC32C)
+	{
+		Events.pevMsg = pevMsgParam;
+		Events.bComplete = false;
+	}
+};
+
+class CS3ReadPool : public CThreadPool<std::shared_ptr<CS3ReadPoolMsg>>
+{
+public:
+	std::list<std::shared_ptr<CS3ReadPoolMsg>> PendingList;
+	CEvent evPendingList;
+	CCriticalSection csPendingList;
+
+	bool DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<CS3ReadPoolMsg>& Msg);
+	bool SearchEntry(const std::shared_ptr<CS3ReadPoolMsg>& Msg1, const std::shared_ptr<CS3ReadPoolMsg>& Msg2) const;
+	CS3ReadPool()
+	{}
+	~CS3ReadPool()
+	{
+		{
+			CSingleLock lock(&csPendingList, true);
+			for (std::list<std::shared_ptr<CS3ReadPoolMsg>>::iterator itPending = PendingList.begin(); itPending != PendingList.end(); ++itPending)
+				(*itPending)->Events.pevMsg = nullptr;
+		}
+		CThreadPool<std::shared_ptr<CS3ReadPoolMsg>>::Terminate();
+	}
+};
+
+// S3ReadParallel
+// download counterpart to DoS3MultiPartUpload
+// split the object into ranges and read them concurrently using a thread pool
+// each range is read into memory by a pool thread. this thread writes it to the stream at its offset
+// at most dwMaxThreads + 1 ranges are held in memory at once
+// if pVerify is a CRC, each range is checksummed by its pool thread and the range CRCs are combined in offset order
+// MD5 can't be calculated that way, so with more than one range an MD5 pVerify is left unverified
+// every range is read with if-match on the ETag from a HEAD at the start. if the object is replaced during the read, it fails with 412
+CECSConnection::S3_ERROR S3ReadParallel(
+	CECSConnection& Conn,							// established connection to ECS
+	LPCTSTR pszECSPath,								// path to object in format: /bucket/dir1/dir2/object
+	IStream *pStream,								// open stream to file (must be seekable)
+	ULONGLONG lwLen,								// if lwOffset == 0 and dwLen == 0, read entire file
+	ULONGLONG lwOffset,								// if dwLen != 0, read 'dwLen' bytes starting from lwOffset
+													// if lwOffset != 0 and dwLen == 0, read from lwOffset to the end of the file
+	const DWORD dwRangeSize,						// size of each range (in MB)
+	const DWORD dwMaxThreads,						// maximum number of concurrent range reads
+	DWORD dwMaxRetries,								// how many times to retry a range before giving up
+	CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
+	void *pContext,											// context for UpdateProgressCB
+	ULONGLONG *pullReturnedLength,					// optional output returned size
+	volatile LONG *plRangesInFlight,				// optional output: number of ranges currently being read
+	S3_READ_VERIFY *pVerify)						// optional download verification
+{
+	CECSConnection::CStateReserve StateReserve(&Conn);
+	CS3ReadPool ReadPool;
+	std::list<std::shared_ptr<CS3ReadPoolMsg>> RangeList;		// ranges not yet sent to the pool
+	std::map<ULONGLONG, CCrcChecksum> RangeCrcMap;				// if verifying with a CRC, CRC of each range written, by offset
+	std::list<CECSConnection::HEADER_REQ> PropReq;				// headers returned by ReadProperties
+	CString sETag;												// ETag of the object being read
+	const bool bWholeObject = (lwOffset == 0ULL) && (lwLen == 0ULL);
+	const bool bVerifyCrc = (pVerify != nullptr) && (pVerify->ChecksumType != E_CHECKSUM_TYPE::MD5);
+	ULONGLONG ullTotalWritten = 0ULL;
+	DWORD dwError;
+
+	if (pullReturnedLength != nullptr)
+		*pullReturnedLength = 0ULL;
+	if (plRangesInFlight != nullptr)
+		(void)InterlockedExchange(plRangesInFlight, 0);
+	if (pVerify != nullptr)
+	{
+		pVerify->bVerified = false;
+		pVerify->Hash.Empty();
+	}
+	try
+	{
+		if ((dwMaxThreads == 0) || (dwRangeSize == 0))
+			throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, ERROR_INVALID_PARAMETER);
+		// figure out the extent of the read
+		if (lwLen == 0ULL)
+		{
+			CECSConnection::S3_SYSTEM_METADATA Properties;
+			CECSConnection::S3_ERROR Error = Conn.ReadProperties(pszECSPath, Properties, nullptr, nullptr, &PropReq, bVerifyCrc && bWholeObject);
+			if (Error.IfError())
+				throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, Error);
+			if (Properties.llSize < lwOffset)
+				throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, ERROR_HANDLE_EOF);
+			lwLen = Properties.llSize - lwOffset;
+			sETag = Properties.sETag;
+		}
+		// if there is only a single range, don't bother with the thread pool
+		ULONGLONG ullRangeLength = MEGABYTES((ULONGLONG)dwRangeSize);
+		if ((lwLen <= ullRangeLength) || (dwMaxThreads == 1))
+		{
+			if (lwLen == 0ULL)
+				return CECSConnection::S3_ERROR();			// empty object. nothing to read
+			// read the whole object as such so S3Read can verify it
+			return S3Read(Conn, pszECSPath, pStream, bWholeObject ? 0ULL : lwLen, lwOffset, nullptr, UpdateProgressCB, pContext, pullReturnedLength, pVerify);
+		}
+		// Read into memory uses a DWORD length
+		if (ullRangeLength > MEGABYTES(1024ULL))
+			ullRangeLength = MEGABYTES(1024ULL);
+		if (sETag.IsEmpty())
+		{
+			// the length was given. still need the ETag to pin the ranges to one version of the object
+			CECSConnection::S3_SYSTEM_METADATA Properties;
+			CECSConnection::S3_ERROR Error = Conn.ReadProperties(pszECSPath, Properties);
+			if (Error.IfError())
+				throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, Error);
+			sETag = Properties.sETag;
+		}
+		for (ULONGLONG ullOffset = 0ULL; ullOffset < lwLen; ullOffset += ullRangeLength)
+		{
+			ULONGLONG ullThisLen = ((lwLen - ullOffset) < ullRangeLength) ? (lwLen - ullOffset) : ullRangeLength;
+			RangeList.push_back(std::make_shared<CS3ReadPoolMsg>(Conn, pszECSPath, sETag, &ReadPool.evPendingList, lwOffset + ullOffset, ullThisLen, pVerify));
+		}
+		ReadPool.SetMinThreads(1);
+		ReadPool.SetMaxThreads(dwMaxThreads);
+		CThreadPoolBase::SetPoolInitialized();
+		for (;;)
+		{
+			// keep the pool busy, but don't let the number of buffered ranges grow without bound
+			{
+				CSingleLock lock(&ReadPool.csPendingList, true);
+				while (!RangeList.empty() && (ReadPool.PendingList.size() < dwMaxThreads))
+				{
+					std::shared_ptr<CS3ReadPoolMsg> Msg = RangeList.front();
+					RangeList.pop_front();
+					Msg->Events.bComplete = false;
+					ReadPool.PendingList.push_back(Msg);
+					std::shared_ptr<std::shared_ptr<CS3ReadPoolMsg>> AutoMsg;
+					AutoMsg.reset(new std::shared_ptr<CS3ReadPoolMsg>(Msg));
+					ReadPool.SendMessageToPool(__LINE__, AutoMsg, 0, 0, nullptr);
+				}
+				if (plRangesInFlight != nullptr)
+					(void)InterlockedExchange(plRangesInFlight, (LONG)ReadPool.PendingList.size());
+				if (ReadPool.PendingList.empty() && RangeList.empty())
+					break;						// done!
+			}
+			(void)WaitForSingleObject(ReadPool.evPendingList.m_hObject, SECONDS(2));
+			if (Conn.TestAbort())
+				throw CErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
+			// collect any completed ranges
+			std::list<std::shared_ptr<CS3ReadPoolMsg>> CompleteList;
+			{
+				CSingleLock lock(&ReadPool.csPendingList, true);
+				for (std::list<std::shared_ptr<CS3ReadPoolMsg>>::iterator itPending = ReadPool.PendingList.begin(); itPending != ReadPool.PendingList.end(); )
+				{
+					if ((*itPending)->Events.bComplete)
+					{
+						CompleteList.push_back(*itPending);
+						itPending = ReadPool.PendingList.erase(itPending);
+					}
+					else
+						++itPending;
+				}
+			}
+			for (std::list<std::shared_ptr<CS3ReadPoolMsg>>::iterator itComplete = CompleteList.begin(); itComplete != CompleteList.end(); ++itComplete)
+			{
+				CS3ReadPoolMsg *pMsg = itComplete->get();
+				if (pMsg->Error.IfError() || (pMsg->ullReturnedLength != pMsg->ullRangeLen))
+				{
+					// the object was replaced since the read started. retrying would mix the two versions
+					if (pMsg->Error.dwHttpError == HTTP_STATUS_PRECON_FAILED)
+						throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, pMsg->Error);
+					if (pMsg->dwRetryNum >= dwMaxRetries)
+					{
+						if (pMsg->Error.IfError())
+							throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, pMsg->Error);
+						throw CErrorInfo(_T(__FILE__), __LINE__, ERROR_BAD_LENGTH);
+					}
+					// put it back at the front so it gets retried next
+					pMsg->dwRetryNum++;
+					pMsg->Error = CECSConnection::S3_ERROR();
+					pMsg->Data.Empty();
+					RangeList.push_front(*itComplete);
+					continue;
+				}
+				// write the range at its offset in the stream
+				LARGE_INTEGER liOffset;
+				DWORD dwNumWritten;
+				liOffset.QuadPart = pMsg->ullRangeOffset - lwOffset;
+				dwError = pStream->Seek(liOffset, STREAM_SEEK_SET, nullptr);
+				if (dwError != S_OK)
+					throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
+				dwError = pStream->Write(pMsg->Data.GetData(), pMsg->Data.GetBufSize(), &dwNumWritten);
+				if (dwError != S_OK)
+					throw CErrorInfo(_T(__FILE__), __LINE__, dwError);
+				ullTotalWritten += dwNumWritten;
+				pMsg->Data.Empty();					// free up the memory now
+				if (pMsg->bCrc)
+					RangeCrcMap[pMsg->ullRangeOffset] = pMsg->Crc;
+				if (UpdateProgressCB != nullptr)
+					UpdateProgressCB(dwNumWritten, pContext);
+			}
+		}
+		if (bVerifyCrc)
+		{
+			// put the range CRCs together in order to get the CRC of everything that was read
+			CStreamHash Hash(pVerify->ChecksumType);
+			Hash.Start();
+			for (std::map<ULONGLONG, CCrcChecksum>::const_iterator itCrc = RangeCrcMap.begin(); itCrc != RangeCrcMap.end(); ++itCrc)
+				Hash.Crc.Combine(itCrc->second);
+			if (bWholeObject)
+			{
+				CECSConnection::S3_ERROR Error = VerifyStreamHash(PropReq, Hash, pVerify->Hash, &pVerify->bVerified);
+				if (Error.IfError())
+					throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, Error);
+			}
+			else
+				Hash.GetHashData(pVerify->Hash);
+		}
+	}
+	catch (const CECSConnection::CS3ErrorInfo& E)
+	{
+		if (plRangesInFlight != nullptr)
+			(void)InterlockedExchange(plRangesInFlight, 0);
+		if (pullReturnedLength != nullptr)
+			*pullReturnedLength = ullTotalWritten;
+		return E.Error;
+	}
+	catch (const CErrorInfo& E)
+	{
+		if (plRangesInFlight != nullptr)
+			(void)InterlockedExchange(plRangesInFlight, 0);
+		if (pullReturnedLength != nullptr)
+			*pullReturnedLength = ullTotalWritten;
+		return E.dwError;
+	}
+	if (plRangesInFlight != nullptr)
+		(void)InterlockedExchange(plRangesInFlight, 0);
+	if (pullReturnedLength != nullptr)
+		*pullReturnedLength = ullTotalWritten;
+	return CECSConnection::S3_ERROR();
+}
+
+bool CS3ReadPool::DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<CS3ReadPoolMsg>& Msg)
+{
+	CECSConnection::CStateReserve StateReserve(&Msg->Conn);
+	{
+		CSingleLock lock(&csPendingList, true);
+		// check if this request has already been aborted
+		if (Msg->Events.pevMsg == nullptr)
+			return true;
+	}
+	{
+		CTestShutdown Shutdown(pThread, &Msg->Conn);
+		Msg->ullReturnedLength = 0ULL;
+		Msg->Error = Msg->Conn.Read(Msg->sECSPath, Msg->ullRangeLen, Msg->ullRangeOffset, Msg->Data, 0UL, nullptr, nullptr, &Msg->ullReturnedLength,
+			Msg->sETag.IsEmpty() ? nullptr : (LPCTSTR)Msg->sETag);
+	}
+	if (Msg->bCrc && !Msg->Error.IfError())
+	{
+		Msg->Crc.Reset();
+		Msg->Crc.AddData(Msg->Data);
+	}
+	{
+		CSingleLock lock(&csPendingList, true);
+		Msg->Events.bComplete = true;
+		if (Msg->Events.pevMsg != nullptr)
+			(void)Msg->Events.pevMsg->SetEvent();
+	}
+	return true;
+}
+
+bool CS3ReadPool::SearchEntry(const std::shared_ptr<CS3ReadPoolMsg>& Msg1, const std::shared_ptr<CS3ReadPoolMsg>& Msg2) const
+{
+	(void)Msg1;
+	(void)Msg2;
+	return false;
+}
+
+CECSConnection::S3_ERROR S3ReadParallel(
+	LPCWSTR pszFile,								// path to file
+	DWORD grfMode,									// examples: for read: STGM_READ | STGM_SHARE_DENY_WRITE, for write: STGM_SHARE_EXCLUSIVE | STGM_CREATE | STGM_WRITE
+	DWORD dwAttributes,								// attribute of file if created
+	bool bCreate,									// see SHCreateStreamOnFileEx on how to use
+	CECSConnection& Conn,							// established connection to ECS
+	LPCTSTR pszECSPath,								// path to object in format: /bucket/dir1/dir2/object
+	ULONGLONG lwLen,								// if lwOffset == 0 and dwLen == 0, read entire file
+	ULONGLONG lwOffset,								// if dwLen != 0, read 'dwLen' bytes starting from lwOffset
+													// if lwOffset != 0 and dwLen == 0, read from lwOffset to the end of the file
+	const DWORD dwRangeSize,						// size of each range (in MB)
+	const DWORD dwMaxThreads,						// maximum number of concurrent range reads
+	DWORD dwMaxRetries,								// how many times to retry a range before giving up
+	CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
+	void *pContext,											// context for UpdateProgressCB
+	ULONGLONG *pullReturnedLength,					// optional output returned size
+	volatile LONG *plRangesInFlight,				// optional output: number of ranges currently being read
+	S3_READ_VERIFY *pVerify)						// optional download verification
+{
+	CComPtr<IStream> pFileStream;
+	HRESULT hr;
+	if (FAILED(hr = SHCreateStreamOnFileEx(pszFile, grfMode, dwAttributes, bCreate, NULL, &pFileStream)))
+		return hr;
+	return S3ReadParallel(Conn, pszECSPath, pFileStream, lwLen, lwOffset, dwRangeSize, dwMaxThreads, dwMaxRetries,
+		UpdateProgressCB, pContext, pullReturnedLength, plRangesInFlight, pVerify);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////////// ReadPropertiesBatch //////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+const size_t BATCH_LISTING_MIN_ENTRIES = 100;		// a listing page has to replace at least this many HEADs (10% of a page)
+const UINT BATCH_LISTING_PAGE = 1000;				// entries in each listing page
+const DWORD BATCH_HEAD_WINDOW = 4;					// number of HEADs queued per thread. keeps memory flat for huge batches
+
+struct CHeadBatchPoolMsg
+{
+	S3_PROPERTIES_BATCH_ENTRY *pEntry;	// entry to look up. the result is stored here
+	CHeadBatchPoolMsg()
+		: pEntry(nullptr)
+	{}
+};
+
+class CHeadBatchPool : public CThreadPool<std::shared_ptr<CHeadBatchPoolMsg>>
+{
+public:
+	CECSConnection *pConn;				// connection to S3 host
+	bool bAbort;						// set if the batch is being abandoned. queued HEADs are dropped
+	CEvent evDone;						// set each time a HEAD is done
+	CCriticalSection csProgress;		// serializes UpdateProgressCB
+	CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB;
+	void *pContext;
+
+	bool DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<CHeadBatchPoolMsg>& Msg);
+	static bool IfAbort(void *pContext);
+	CHeadBatchPool()
+		: pConn(nullptr)
+		, bAbort(false)
+		, UpdateProgressCB(nullptr)
+		, pContext(nullptr)
+	{}
+	~CHeadBatchPool()
+	{
+		CThreadPool<std::shared_ptr<CHeadBatchPoolMsg>>::Terminate();
+	}
+};
+
+// IfAbort
+// WaitForWorkFinished callback. runs on the thread that called ReadPropertiesBatch
+bool CHeadBatchPool::IfAbort(void *pContext)
+{
+	CHeadBatchPool *pPool = (CHeadBatchPool *)pContext;
+	if (pPool->pConn->TestAbort())
+		pPool->bAbort = true;
+	return pPool->bAbort;
+}
+
+bool CHeadBatchPool::DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<CHeadBatchPoolMsg>& Msg)
+{
+	S3_PROPERTIES_BATCH_ENTRY& Entry = *Msg->pEntry;
+	if (bAbort)
+		Entry.Error = CECSConnection::S3_ERROR(ERROR_OPERATION_ABORTED);
+	else
+	{
+		CECSConnection::CStateReserve StateReserve(pConn);
+		CTestShutdown Shutdown(pThread, pConn, &bAbort);
+		Entry.Error = pConn->ReadProperties(Entry.sPath, Entry.Properties, nullptr, &Entry.MDList);
+	}
+	if (UpdateProgressCB != nullptr)
+	{
+		CSingleLock lock(&csProgress, true);
+		UpdateProgressCB(1, pContext);
+	}
+	VERIFY(evDone.SetEvent());
+	return true;
+}
+
+// ReadPropertiesBatch
+// get the properties of a list of objects
+// HEADs are run by a thread pool with at most dwMaxThreads in flight
+// if bUseListing is set, directories with at least BATCH_LISTING_MIN_ENTRIES entries are listed instead,
+// since a listing returns the size and ETag of up to 1000 objects in one request.
+// the listing only covers the prefix the requested names have in common, and is read a page at a time. it stops
+// as soon as a page has fewer than BATCH_LISTING_MIN_ENTRIES of the requested objects, so a few objects in a huge
+// directory don't cause the whole directory to be listed. anything not found in the listing gets a HEAD
+// errors for individual objects are returned in each entry. the return value is only set if the whole batch failed
+CECSConnection::S3_ERROR ReadPropertiesBatch(
+	CECSConnection& Conn,							// established connection to ECS
+	std::deque<S3_PROPERTIES_BATCH_ENTRY>& EntryList,	// objects to look up. results are returned in each entry
+	DWORD dwMaxThreads,								// maximum number of concurrent requests
+	bool bUseListing,								// if set, use a listing instead of a HEAD for directories with many entries. no user metadata is returned for those
+	CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback. called with 1 for each entry completed
+	void *pContext)											// context for UpdateProgressCB
+{
+	CECSConnection::CStateReserve StateReserve(&Conn);
+	std::deque<size_t> HeadList;					// entries that need a HEAD
+	CHeadBatchPool HeadPool;
+	try
+	{
+		if (dwMaxThreads == 0)
+			throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, ERROR_INVALID_PARAMETER);
+		for (std::deque<S3_PROPERTIES_BATCH_ENTRY>::iterator itEntry = EntryList.begin(); itEntry != EntryList.end(); ++itEntry)
+		{
+			itEntry->Error = CECSConnection::S3_ERROR();
+			itEntry->Properties.Empty();
+			itEntry->MDList.clear();
+			itEntry->bFromListing = false;
+		}
+		if (bUseListing)
+		{
+			// group the entries by directory
+			std::map<CString, std::list<size_t>> DirMap;
+			for (size_t i = 0; i < EntryList.size(); i++)
+			{
+				int iSlash = EntryList[i].sPath.ReverseFind(_T('/'));
+				if (iSlash > 0)
+					DirMap[EntryList[i].sPath.Left(iSlash + 1)].push_back(i);
+				else
+					HeadList.push_back(i);
+			}
+			for (std::map<CString, std::list<size_t>>::const_iterator itDir = DirMap.begin(); itDir != DirMap.end(); ++itDir)
+			{
+				if (itDir->second.size() < BATCH_LISTING_MIN_ENTRIES)
+				{
+					HeadList.insert(HeadList.end(), itDir->second.begin(), itDir->second.end());
+					continue;
+				}
+				// the names still to be found, in order
+				std::multimap<CString, size_t> NameMap;
+				for (std::list<size_t>::const_iterator itIndex = itDir->second.begin(); itIndex != itDir->second.end(); ++itIndex)
+					(void)NameMap.insert(std::make_pair(EntryList[*itIndex].sPath.Mid(itDir->first.GetLength()), *itIndex));
+				// only list the prefix they all have in common (the common prefix of the first and last name)
+				const CString& sFirst = NameMap.begin()->first;
+				const CString& sLast = NameMap.rbegin()->first;
+				int iCommon = 0;
+				while ((iCommon < sFirst.GetLength()) && (iCommon < sLast.GetLength()) && (sFirst[iCommon] == sLast[iCommon]))
+					iCommon++;
+				CString sCommon(sFirst.Left(iCommon));
+				CECSConnection::LISTING_NEXT_MARKER_CONTEXT Marker(BATCH_LISTING_PAGE);
+				for (;;)
+				{
+					CECSConnection::DirEntryList_t DirList;
+					if (Conn.DirListing(itDir->first, DirList, false, sCommon, &Marker).IfError())
+					{
+						if (Conn.TestAbort())
+							throw CErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
+						break;
+					}
+					size_t uHits = 0;
+					CString sLastListed;
+					for (CECSConnection::DirEntryList_t::const_iterator itList = DirList.begin(); itList != DirList.end(); ++itList)
+					{
+						if (itList->sName.Compare(sLastListed) > 0)
+							sLastListed = itList->sName;
+						if (itList->bDir)
+							continue;
+						std::multimap<CString, size_t>::iterator itName = NameMap.lower_bound(itList->sName);
+						while ((itName != NameMap.end()) && (itName->first == itList->sName))
+						{
+							S3_PROPERTIES_BATCH_ENTRY& Entry = EntryList[itName->second];
+							Entry.Properties = itList->Properties;
+							Entry.bFromListing = true;
+							if (UpdateProgressCB != nullptr)
+								UpdateProgressCB(1, pContext);
+							uHits++;
+							itName = NameMap.erase(itName);
+						}
+					}
+					// stop at the end of the listing, when the rest of it can't have any of the names that are left,
+					// or when this page didn't replace enough HEADs to be worth reading another one
+					if (!Marker.IsTruncated() || NameMap.empty() || (uHits < BATCH_LISTING_MIN_ENTRIES)
+						|| (NameMap.rbegin()->first.Compare(sLastListed) <= 0))
+						break;
+				}
+				for (std::multimap<CString, size_t>::const_iterator itName = NameMap.begin(); itName != NameMap.end(); ++itName)
+					HeadList.push_back(itName->second);
+			}
+		}
+		else
+		{
+			for (size_t i = 0; i < EntryList.size(); i++)
+				HeadList.push_back(i);
+		}
+		// now the HEADs. only keep a limited number queued so memory doesn't grow with the size of the batch
+		HeadPool.pConn = &Conn;
+		HeadPool.UpdateProgressCB = UpdateProgressCB;
+		HeadPool.pContext = pContext;
+		HeadPool.SetMinThreads(1);
+		HeadPool.SetMaxThreads(dwMaxThreads);
+		CThreadPoolBase::SetPoolInitialized();
+		for (std::deque<size_t>::const_iterator itHead = HeadList.begin(); itHead != HeadList.end(); ++itHead)
+		{
+			while (HeadPool.GetMsgQueueCount() >= dwMaxThreads * BATCH_HEAD_WINDOW)
+			{
+				if (CHeadBatchPool::IfAbort(&HeadPool))
+					throw CErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
+				(void)WaitForSingleObject(HeadPool.evDone.m_hObject, SECONDS(1));
+			}
+			if (CHeadBatchPool::IfAbort(&HeadPool))
+				throw CErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
+			std::shared_ptr<std::shared_ptr<CHeadBatchPoolMsg>> AutoMsg;
+			AutoMsg.reset(new std::shared_ptr<CHeadBatchPoolMsg>(std::make_shared<CHeadBatchPoolMsg>()));
+			(*AutoMsg)->pEntry = &EntryList[*itHead];
+			HeadPool.SendMessageToPool(__LINE__, AutoMsg, 0, 0, nullptr);
+		}
+		HeadPool.WaitForWorkFinished(&CHeadBatchPool::IfAbort, &HeadPool);
+		if (HeadPool.bAbort)
+			throw CErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
+	}
+	catch (const CECSConnection::CS3ErrorInfo& E)
+	{
+		HeadPool.bAbort = true;
+		return E.Error;
+	}
+	catch (const CErrorInfo& E)
+	{
+		HeadPool.bAbort = true;
+		return E.dwError;
+	}
+	return CECSConnection::S3_ERROR();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////////// DirListingParallel ///////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+struct CDirListingPoolMsg
+{
+	CString sObjName;					// prefix to list, relative to the path being listed. empty for the path itself
+};
+
+class CDirListingPool : public CThreadPool<std::shared_ptr<CDirListingPoolMsg>>
+{
+public:
+	CECSConnection *pConn;				// connection to S3 host
+	CString sPath;						// path being listed
+	CECSConnection::DirEntryList_t *pDirList;	// optional: collect all entries
+	DIR_LISTING_PAGE_CB PageCB;			// optional: stream the entries
+	void *pContext;						// context for PageCB
+	bool bAbort;						// set on the first error. everything else is dropped
+	CCriticalSection csResult;			// protects pDirList, PageCB and Error
+	CECSConnection::S3_ERROR Error;		// first error
+
+	bool DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<CDirListingPoolMsg>& Msg);
+	void QueuePrefix(LPCTSTR pszObjName);
+	static bool IfAbort(void *pContext);
+	CDirListingPool()
+		: pConn(nullptr)
+		, pDirList(nullptr)
+		, PageCB(nullptr)
+		, pContext(nullptr)
+		, bAbort(false)
+	{}
+	~CDirListingPool()
+	{
+		CThreadPool<std::shared_ptr<CDirListingPoolMsg>>::Terminate();
+	}
+};
+
+void CDirListingPool::QueuePrefix(LPCTSTR pszObjName)
+{
+	std::shared_ptr<std::shared_ptr<CDirListingPoolMsg>> AutoMsg;
+	AutoMsg.reset(new std::shared_ptr<CDirListingPoolMsg>(std::make_shared<CDirListingPoolMsg>()));
+	(*AutoMsg)->sObjName = pszObjName;
+	SendMessageToPool(__LINE__, AutoMsg, 0, 0, nullptr);
+}
+
+// IfAbort
+// WaitForWorkFinished callback. runs on the thread that called DirListingParallel
+bool CDirListingPool::IfAbort(void *pContext)
+{
+	CDirListingPool *pPool = (CDirListingPool *)pContext;
+	if (pPool->pConn->TestAbort())
+		pPool->bAbort = true;
+	return pPool->bAbort;
+}
+
+// DoProcess
+// page through one prefix using a delimiter listing
+// objects are passed on, and each common prefix is queued to be listed by another thread
+bool CDirListingPool::DoProcess(const CSimpleWorkerThread *pThread, const std::shared_ptr<CDirListingPoolMsg>& Msg)
+{
+	if (bAbort)
+		return true;
+	CECSConnection::CStateReserve StateReserve(pConn);
+	CTestShutdown Shutdown(pThread, pConn, &bAbort);
+	CECSConnection::LISTING_NEXT_MARKER_CONTEXT NextMarker;
+	CECSConnection::DirEntryList_t Page;
+	do
+	{
+		CECSConnection::S3_ERROR ListError = pConn->DirListing(sPath, Page, false, Msg->sObjName.IsEmpty() ? nullptr : (LPCTSTR)Msg->sObjName, &NextMarker);
+		if (ListError.IfError())
+		{
+			// the prefix may have gone away since it was found
+			if (!Msg->sObjName.IsEmpty() && (ListError.S3Error == S3_ERROR_NoSuchKey))
+				break;
+			CSingleLock lock(&csResult, true);
+			if (!Error.IfError())
+				Error = ListError;
+			bAbort = true;
+			break;
+		}
+		for (CECSConnection::DirEntryList_t::iterator itPage = Page.begin(); itPage != Page.end(); )
+		{
+			if (itPage->bDir)
+			{
+				// a folder object for the prefix itself also shows up as a dir. don't list it again
+				CString sObjName(itPage->sName + _T("/"));
+				if (sObjName != Msg->sObjName)
+					QueuePrefix(sObjName);
+				itPage = Page.erase(itPage);
+			}
+			else
+				++itPage;
+		}
+		if (!Page.empty())
+		{
+			CSingleLock lock(&csResult, true);
+			if (PageCB != nullptr)
+				PageCB(Page, pContext);
+			if (pDirList != nullptr)
+				pDirList->splice(pDirList->end(), Page);
+		}
+	} while (NextMarker.IsTruncated() && !bAbort);
+	return true;
+}
+
+// DirListingParallel
+// flat listing of everything under pszPath
+// instead of one marker chain over the whole key space, each prefix found with the delimiter listing
+// gets its own marker chain, and up to dwMaxThreads chains run at once
+// the entries are streamed to PageCB as they come in and/or returned in order in pDirList
+CECSConnection::S3_ERROR DirListingParallel(
+	CECSConnection& Conn,							// established connection to ECS
+	LPCTSTR pszPath,								// path to list in format: /bucket/dir1/. every object under it is returned
+	CECSConnection::DirEntryList_t *pDirList,		// optional output: all objects, sorted by name. names are relative to pszPath
+	DIR_LISTING_PAGE_CB PageCB,						// optional callback to stream the entries instead
+	void *pContext,									// context for PageCB
+	DWORD dwMaxThreads)								// maximum number of concurrent listing requests
+{
+	CECSConnection::CStateReserve StateReserve(&Conn);
+	CDirListingPool ListPool;
+	try
+	{
+		if ((dwMaxThreads == 0) || (pszPath == nullptr) || (*pszPath == _T('\0')))
+			throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, ERROR_INVALID_PARAMETER);
+		if (pDirList != nullptr)
+			pDirList->clear();
+		ListPool.pConn = &Conn;
+		ListPool.sPath = pszPath;
+		// the prefixes are passed as the object name, which DirListing only uses if there is a slash after the bucket
+		if (ListPool.sPath.Find(_T('/'), 1) < 0)
+			ListPool.sPath += _T("/");
+		ListPool.pDirList = pDirList;
+		ListPool.PageCB = PageCB;
+		ListPool.pContext = pContext;
+		ListPool.SetMinThreads(1);
+		ListPool.SetMaxThreads(dwMaxThreads);
+		CThreadPoolBase::SetPoolInitialized();
+		ListPool.QueuePrefix(_T(""));
+		ListPool.WaitForWorkFinished(&CDirListingPool::IfAbort, &ListPool);
+		{
+			CSingleLock lock(&ListPool.csResult, true);
+			if (ListPool.Error.IfError())
+				throw CECSConnection::CS3ErrorInfo(_T(__FILE__), __LINE__, ListPool.Error);
+		}
+		if (ListPool.bAbort)
+			throw CErrorInfo(_T(__FILE__), __LINE__, ERROR_OPERATION_ABORTED);
+		if (pDirList != nullptr)
+			pDirList->sort();
+	}
+	catch (const CECSConnection::CS3ErrorInfo& E)
+	{
+		ListPool.bAbort = true;
+		return E.Error;
+	}
+	catch (const CErrorInfo& E)
+	{
+		ListPool.bAbort = true;
+		return E.dwError;
+	}
+	return CECSConnection::S3_ERROR();
+}
+
 } // end namespace ecs_sdk
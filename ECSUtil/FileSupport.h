@@ -18,10 +18,58 @@
 #include "stdafx.h"
 #include "exportdef.h"
 #include "ECSConnection.h"
+#include "CrcChecksum.h"
 
 namespace ecs_sdk
 {
 
+	// S3_READ_VERIFY
+	// optional download verification for S3Read and S3ReadParallel
+	// the data is hashed as it is received and, when the whole object is read, checked against the ETag (MD5)
+	// or the stored x-amz-checksum-* header (CRC32C/CRC64NVME). a mismatch returns BadDigest (ERROR_CRC)
+	// by then the data has already been written to the stream, so the caller should discard it
+	// a multipart ETag or a composite checksum can't be checked, nor can MD5 over parallel ranges. bVerified is false for those
+	// a CRC of a ranged read is returned in Hash so it can be combined with the CRCs of the other ranges (CCrcChecksum::Combine)
+	struct ECSUTIL_EXT_CLASS S3_READ_VERIFY
+	{
+		E_CHECKSUM_TYPE ChecksumType;		// (in) hash to calculate
+		bool bVerified;						// (out) set if the hash was checked against what the server has
+		CBuffer Hash;						// (out) hash of the data read. CRC is in network byte order
+
+		S3_READ_VERIFY(E_CHECKSUM_TYPE ChecksumTypeParam = E_CHECKSUM_TYPE::MD5)
+			: ChecksumType(ChecksumTypeParam)
+			, bVerified(false)
+		{}
+	};
+
+	// S3_MPU_CONCURRENCY
+	// optional adaptive concurrency for DoS3MultiPartUpload
+	// instead of always keeping dwMaxThreads parts in flight, start at uStart and adjust it (AIMD):
+	// parts are measured in windows of as many parts as are in flight. after each window, if throughput held up
+	// (at least 95% of the last window), one more part is allowed in flight, up to dwMaxThreads
+	// a part that fails with 503 or a timeout, or a window where the part time went up by half without any gain
+	// in throughput, halves it (at most once a window, never below 1)
+	// lConcurrency can be read at any time, for instance from the progress callback
+	struct ECSUTIL_EXT_CLASS S3_MPU_CONCURRENCY
+	{
+		bool bAdaptive;						// (in) adjust the concurrency. if not set, dwMaxThreads parts are kept in flight
+		UINT uStart;						// (in) starting concurrency (0 = 2)
+		volatile LONG lConcurrency;			// (out) number of parts allowed in flight right now
+		LONG lPeak;							// (out) highest concurrency used
+		UINT uIncreases;					// (out) number of times the concurrency went up
+		UINT uDecreases;					// (out) number of times it was cut
+		double dThroughput;					// (out) throughput of the last window (bytes/sec)
+
+		S3_MPU_CONCURRENCY(bool bAdaptiveParam = true, UINT uStartParam = 0)
+			: bAdaptive(bAdaptiveParam)
+			, uStart(uStartParam)
+			, lConcurrency(0)
+			, lPeak(0)
+			, uIncreases(0)
+			, uDecreases(0)
+			, dThroughput(0.0)
+		{}
+	};
 
 	extern ECSUTIL_EXT_API CECSConnection::S3_ERROR S3Read(
 		CECSConnection& Conn,							// established connection to ECS
@@ -33,18 +81,20 @@ namespace ecs_sdk
 		std::list<CECSConnection::HEADER_REQ>* pRcvHeaders,			// optional return all headers
 		CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
 		void* pContext,											// context for UpdateProgressCB
-		ULONGLONG* pullReturnedLength);					// optional output returned size
+		ULONGLONG* pullReturnedLength,					// optional output returned size
+		S3_READ_VERIFY* pVerify = nullptr);				// optional download verification
 
 	extern ECSUTIL_EXT_API CECSConnection::S3_ERROR S3Write(
 		CECSConnection& Conn,							// established connection to ECS
 		LPCTSTR pszECSPath,								// path to object in format: /bucket/dir1/dir2/object
 		IStream* pStream,								// open stream to file
 		const DWORD dwBufSize,							// size of buffer to use
-		bool bChecksum,									// if set, include content-MD5 header
+		bool bChecksum,									// if set, send a checksum header so the server verifies the data before it replaces the object. a file over 64 MB is read twice, except for the first dwMaxQueueSize buffers
 		DWORD dwMaxQueueSize,								// how big the queue can grow that feeds the upload thread
 		const std::list<CECSConnection::HEADER_STRUCT>* pMDList,	// optional metadata to send to object
 		CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
-		void* pContext);											// context for UpdateProgressCB
+		void* pContext,											// context for UpdateProgressCB
+		E_CHECKSUM_TYPE ChecksumType = E_CHECKSUM_TYPE::MD5);	// if bChecksum, the hash to use
 
 	extern ECSUTIL_EXT_API bool DoS3MultiPartUpload(
 		CECSConnection& Conn,							// established connection to ECS
@@ -53,13 +103,32 @@ namespace ecs_sdk
 		const DWORD dwBufSize,							// size of buffer to use
 		const DWORD dwPartSize,							// part size (in MB)
 		const DWORD dwMaxThreads,						// maxiumum number of threads to spawn
-		bool bChecksum,									// if set, include content-MD5 header
+		bool bChecksum,									// if set, each part is hashed and sent with its checksum header so the server verifies it. the part is read twice, except for the first dwMaxQueueSize buffers
 		const std::list<CECSConnection::HEADER_STRUCT>* pMDList,	// optional metadata to send to object
 		DWORD dwMaxQueueSize,								// how big the queue can grow that feeds the upload thread
 		DWORD dwMaxRetries,									// how many times to retry a part before giving up
 		CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
 		void* pContext,											// context for UpdateProgressCB
-		CECSConnection::S3_ERROR& Error);						// returned error
+		CECSConnection::S3_ERROR& Error,						// returned error
+		LPCWSTR pszJournalFile = nullptr,						// optional journal file. if set, the upload can be resumed if interrupted
+		E_CHECKSUM_TYPE ChecksumType = E_CHECKSUM_TYPE::MD5,	// if bChecksum, the hash to use
+		S3_MPU_CONCURRENCY* pConcurrency = nullptr);			// optional adaptive concurrency
+
+	extern ECSUTIL_EXT_API CECSConnection::S3_ERROR S3ReadParallel(
+		CECSConnection& Conn,							// established connection to ECS
+		LPCTSTR pszECSPath,								// path to object in format: /bucket/dir1/dir2/object
+		IStream* pStream,								// open stream to file (must be seekable)
+		ULONGLONG lwLen,								// if lwOffset == 0 and dwLen == 0, read entire file
+		ULONGLONG lwOffset,								// if dwLen != 0, read 'dwLen' bytes starting from lwOffset
+														// if lwOffset != 0 and dwLen == 0, read from lwOffset to the end of the file
+		const DWORD dwRangeSize,						// size of each range (in MB)
+		const DWORD dwMaxThreads,						// maximum number of concurrent range reads
+		DWORD dwMaxRetries,								// how many times to retry a range before giving up
+		CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
+		void* pContext,											// context for UpdateProgressCB
+		ULONGLONG* pullReturnedLength,					// optional output returned size
+		volatile LONG* plRangesInFlight = nullptr,		// optional output: number of ranges currently being read
+		S3_READ_VERIFY* pVerify = nullptr);				// optional download verification
 
 	extern ECSUTIL_EXT_API CECSConnection::S3_ERROR S3Read(
 		LPCWSTR pszFile,								// path to file
@@ -74,7 +143,8 @@ namespace ecs_sdk
 		std::list<CECSConnection::HEADER_REQ>* pRcvHeaders,			// optional return all headers
 		CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
 		void* pContext,											// context for UpdateProgressCB
-		ULONGLONG* pullReturnedLength);					// optional output returned size
+		ULONGLONG* pullReturnedLength,					// optional output returned size
+		S3_READ_VERIFY* pVerify = nullptr);				// optional download verification
 
 	extern ECSUTIL_EXT_API CECSConnection::S3_ERROR S3Write(
 		LPCWSTR pszFile,								// path to file
@@ -83,11 +153,12 @@ namespace ecs_sdk
 		CECSConnection& Conn,							// established connection to ECS
 		LPCTSTR pszECSPath,								// path to object in format: /bucket/dir1/dir2/object
 		const DWORD dwBufSize,							// size of buffer to use
-		bool bChecksum,									// if set, include content-MD5 header
+		bool bChecksum,									// if set, send a checksum header so the server verifies the data before it replaces the object. a file over 64 MB is read twice, except for the first dwMaxQueueSize buffers
 		DWORD dwMaxQueueSize,								// how big the queue can grow that feeds the upload thread
 		const std::list<CECSConnection::HEADER_STRUCT>* pMDList,	// optional metadata to send to object
 		CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
-		void* pContext);										// context for UpdateProgressCB
+		void* pContext,											// context for UpdateProgressCB
+		E_CHECKSUM_TYPE ChecksumType = E_CHECKSUM_TYPE::MD5);	// if bChecksum, the hash to use
 
 	extern ECSUTIL_EXT_API bool DoS3MultiPartUpload(
 		LPCWSTR pszFile,								// path to file
@@ -98,12 +169,70 @@ namespace ecs_sdk
 		const DWORD dwBufSize,							// size of buffer to use
 		const DWORD dwPartSize,							// part size (in MB)
 		const DWORD dwMaxThreads,						// maxiumum number of threads to spawn
-		bool bChecksum,									// if set, include content-MD5 header
+		bool bChecksum,									// if set, each part is hashed and sent with its checksum header so the server verifies it. the part is read twice, except for the first dwMaxQueueSize buffers
 		const std::list<CECSConnection::HEADER_STRUCT>* pMDList,	// optional metadata to send to object
 		DWORD dwMaxQueueSize,								// how big the queue can grow that feeds the upload thread
 		DWORD dwMaxRetries,									// how many times to retry a part before giving up
 		CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
 		void* pContext,											// context for UpdateProgressCB
-		CECSConnection::S3_ERROR& Error);						// returned error
+		CECSConnection::S3_ERROR& Error,						// returned error
+		LPCWSTR pszJournalFile = nullptr,						// optional journal file. if set, the upload can be resumed if interrupted
+		E_CHECKSUM_TYPE ChecksumType = E_CHECKSUM_TYPE::MD5,	// if bChecksum, the hash to use
+		S3_MPU_CONCURRENCY* pConcurrency = nullptr);			// optional adaptive concurrency
+
+	extern ECSUTIL_EXT_API CECSConnection::S3_ERROR S3ReadParallel(
+		LPCWSTR pszFile,								// path to file
+		DWORD grfMode,									// examples: for read: STGM_READ | STGM_SHARE_DENY_WRITE, for write: STGM_SHARE_EXCLUSIVE | STGM_CREATE | STGM_WRITE
+		DWORD dwAttributes,								// attribute of file if created
+		bool bCreate,									// see SHCreateStreamOnFileEx on how to use
+		CECSConnection& Conn,							// established connection to ECS
+		LPCTSTR pszECSPath,								// path to object in format: /bucket/dir1/dir2/object
+		ULONGLONG lwLen,								// if lwOffset == 0 and dwLen == 0, read entire file
+		ULONGLONG lwOffset,								// if dwLen != 0, read 'dwLen' bytes starting from lwOffset
+														// if lwOffset != 0 and dwLen == 0, read from lwOffset to the end of the file
+		const DWORD dwRangeSize,						// size of each range (in MB)
+		const DWORD dwMaxThreads,						// maximum number of concurrent range reads
+		DWORD dwMaxRetries,								// how many times to retry a range before giving up
+		CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback
+		void* pContext,											// context for UpdateProgressCB
+		ULONGLONG* pullReturnedLength,					// optional output returned size
+		volatile LONG* plRangesInFlight = nullptr,		// optional output: number of ranges currently being read
+		S3_READ_VERIFY* pVerify = nullptr);				// optional download verification
+
+	// ReadPropertiesBatch
+	// one entry per object
+	struct ECSUTIL_EXT_CLASS S3_PROPERTIES_BATCH_ENTRY
+	{
+		CString sPath;									// path to object in format: /bucket/dir1/dir2/object
+		CECSConnection::S3_ERROR Error;					// returned error for this object
+		CECSConnection::S3_SYSTEM_METADATA Properties;	// returned properties
+		std::list<CECSConnection::HEADER_STRUCT> MDList;	// returned user metadata. not set if bFromListing
+		bool bFromListing;								// set if Properties came from a listing instead of a HEAD
+
+		S3_PROPERTIES_BATCH_ENTRY(LPCTSTR pszPath = nullptr)
+			: sPath(pszPath)
+			, bFromListing(false)
+		{}
+	};
+
+	extern ECSUTIL_EXT_API CECSConnection::S3_ERROR ReadPropertiesBatch(
+		CECSConnection& Conn,							// established connection to ECS
+		std::deque<S3_PROPERTIES_BATCH_ENTRY>& EntryList,	// objects to look up. results are returned in each entry
+		DWORD dwMaxThreads,								// maximum number of concurrent requests
+		bool bUseListing,								// if set, use a listing instead of a HEAD for directories with many entries. no user metadata is returned for those
+		CECSConnection::UPDATE_PROGRESS_CB UpdateProgressCB,	// optional progress callback. called with 1 for each entry completed
+		void* pContext);										// context for UpdateProgressCB
+
+	// DirListingParallel
+	// called with each page of entries as it comes in. calls are serialized, but the pages are not in any order
+	typedef void (*DIR_LISTING_PAGE_CB)(const CECSConnection::DirEntryList_t& Page, void *pContext);
+
+	extern ECSUTIL_EXT_API CECSConnection::S3_ERROR DirListingParallel(
+		CECSConnection& Conn,							// established connection to ECS
+		LPCTSTR pszPath,								// path to list in format: /bucket/dir1/. every object under it is returned
+		CECSConnection::DirEntryList_t* pDirList,		// optional output: all objects, sorted by name. names are relative to pszPath
+		DIR_LISTING_PAGE_CB PageCB,						// optional callback to stream the entries instead
+		void* pContext,									// context for PageCB
+		DWORD dwMaxThreads);							// maximum number of concurrent listing requests
 
 }
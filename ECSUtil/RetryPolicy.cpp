@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2017 - 2022, Dell Technologies, Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "stdafx.h"
+
+#include <random>
+#include "RetryPolicy.h"
+
+namespace ecs_sdk
+{
+
+	const LONGLONG RetryBudgetScale = 1000LL;		// budget units in one retry token
+
+	static LONGLONG RetryBudgetUnits(double dTokens)
+	{
+		if (dTokens <= 0.0)
+			return 0LL;
+		return (LONGLONG)(dTokens * (double)RetryBudgetScale + 0.5);
+	}
+
+	CBackoffRetryPolicy::CBackoffRetryPolicy(double dBudgetRatioParam, double dBudgetMaxParam)
+		: llBudgetRatio(RetryBudgetUnits(dBudgetRatioParam))
+		, llBudgetMax(RetryBudgetUnits(dBudgetMaxParam))
+		, llBudget(RetryBudgetUnits(dBudgetMaxParam))
+		, llRequests(0LL)
+		, llRetryLimit(0LL)
+		, llBudgetExhausted(0LL)
+		, llFailovers(0LL)
+		, llDelayMs(0LL)
+	{
+		for (UINT i = 0; i < _countof(llRetries); i++)
+			llRetries[i] = 0LL;
+		SetRule(E_RETRY_CLASS::Network, RETRY_RULE(4, 500, 8000));
+		SetRule(E_RETRY_CLASS::Timeout, RETRY_RULE(2, 500, 8000));
+		SetRule(E_RETRY_CLASS::SlowDown, RETRY_RULE(4, 500, 8000));
+		SetRule(E_RETRY_CLASS::ServerError, RETRY_RULE(4, 500, 8000));
+	}
+
+	void CBackoffRetryPolicy::SetRule(E_RETRY_CLASS RetryClass, const RETRY_RULE& Rule)
+	{
+		if ((int)RetryClass >= (int)E_RETRY_CLASS::Count)
+			return;
+		(void)InterlockedExchange(&lMaxRetries[(int)RetryClass], (LONG)Rule.uMaxRetries);
+		(void)InterlockedExchange(&lBaseDelay[(int)RetryClass], (LONG)Rule.dwBaseDelay);
+		(void)InterlockedExchange(&lMaxDelay[(int)RetryClass], (LONG)Rule.dwMaxDelay);
+	}
+
+	RETRY_RULE CBackoffRetryPolicy::GetRule(E_RETRY_CLASS RetryClass) const
+	{
+		if ((int)RetryClass >= (int)E_RETRY_CLASS::Count)
+			return RETRY_RULE();
+		return RETRY_RULE((UINT)lMaxRetries[(int)RetryClass], (DWORD)lBaseDelay[(int)RetryClass], (DWORD)lMaxDelay[(int)RetryClass]);
+	}
+
+	void CBackoffRetryPolicy::SetBudget(double dBudgetRatioParam, double dBudgetMaxParam)
+	{
+		LONGLONG llMax = RetryBudgetUnits(dBudgetMaxParam);
+		(void)InterlockedExchange64(&llBudgetMax, llMax);
+		(void)InterlockedExchange64(&llBudgetRatio, RetryBudgetUnits(dBudgetRatioParam));
+		for (;;)
+		{
+			LONGLONG llOld = InterlockedCompareExchange64(&llBudget, 0LL, 0LL);
+			if ((llOld <= llMax) || (InterlockedCompareExchange64(&llBudget, llMax, llOld) == llOld))
+				break;
+		}
+	}
+
+	void CBackoffRetryPolicy::RequestStart(void)
+	{
+		(void)InterlockedIncrement64(&llRequests);
+		LONGLONG llRatio = InterlockedCompareExchange64(&llBudgetRatio, 0LL, 0LL);
+		if (llRatio <= 0LL)
+			return;
+		LONGLONG llMax = InterlockedCompareExchange64(&llBudgetMax, 0LL, 0LL);
+		for (;;)
+		{
+			LONGLONG llOld = InterlockedCompareExchange64(&llBudget, 0LL, 0LL);
+			if (llOld >= llMax)
+				break;
+			LONGLONG llNew = __min(llOld + llRatio, llMax);
+			if (InterlockedCompareExchange64(&llBudget, llNew, llOld) == llOld)
+				break;
+		}
+	}
+
+	bool CBackoffRetryPolicy::IfRetry(E_RETRY_CLASS RetryClass, UINT uTry, DWORD& dwDelay, bool bFailover)
+	{
+		dwDelay = 0;
+		if ((int)RetryClass >= (int)E_RETRY_CLASS::Count)
+			return false;
+		RETRY_RULE Rule(GetRule(RetryClass));
+		if (uTry >= Rule.uMaxRetries)
+		{
+			(void)InterlockedIncrement64(&llRetryLimit);
+			return false;
+		}
+		if (bFailover && (RetryClass == E_RETRY_CLASS::Network))
+			(void)InterlockedIncrement64(&llFailovers);
+		else if (InterlockedCompareExchange64(&llBudgetRatio, 0LL, 0LL) > 0LL)
+		{
+			for (;;)
+			{
+				LONGLONG llOld = InterlockedCompareExchange64(&llBudget, 0LL, 0LL);
+				if (llOld < RetryBudgetScale)
+				{
+					(void)InterlockedIncrement64(&llBudgetExhausted);
+					return false;
+				}
+				if (InterlockedCompareExchange64(&llBudget, llOld - RetryBudgetScale, llOld) == llOld)
+					break;
+			}
+		}
+		// base * 2^uTry, without overflowing
+		ULONGLONG ullLimit = Rule.dwBaseDelay;
+		for (UINT i = 0; (i < uTry) && (ullLimit < Rule.dwMaxDelay); i++)
+			ullLimit *= 2;
+		DWORD dwDelayLimit = (DWORD)__min(ullLimit, (ULONGLONG)Rule.dwMaxDelay);
+		(void)InterlockedIncrement64(&llRetries[(int)RetryClass]);
+		// full jitter
+		static thread_local std::minstd_rand Random(GetCurrentThreadId() ^ GetTickCount());
+		dwDelay = (dwDelayLimit == 0) ? 0 : (DWORD)(Random() % ((ULONGLONG)dwDelayLimit + 1));
+		(void)InterlockedExchangeAdd64(&llDelayMs, (LONGLONG)dwDelay);
+		return true;
+	}
+
+	void CBackoffRetryPolicy::GetStats(RETRY_STATS& StatsParam) const
+	{
+		StatsParam.ullRequests = (ULONGLONG)InterlockedCompareExchange64(&llRequests, 0LL, 0LL);
+		for (UINT i = 0; i < _countof(llRetries); i++)
+			StatsParam.ullRetries[i] = (ULONGLONG)InterlockedCompareExchange64(&llRetries[i], 0LL, 0LL);
+		StatsParam.ullRetryLimit = (ULONGLONG)InterlockedCompareExchange64(&llRetryLimit, 0LL, 0LL);
+		StatsParam.ullBudgetExhausted = (ULONGLONG)InterlockedCompareExchange64(&llBudgetExhausted, 0LL, 0LL);
+		StatsParam.ullFailovers = (ULONGLONG)InterlockedCompareExchange64(&llFailovers, 0LL, 0LL);
+		StatsParam.ullDelayMs = (ULONGLONG)InterlockedCompareExchange64(&llDelayMs, 0LL, 0LL);
+		StatsParam.dBudget = (double)InterlockedCompareExchange64(&llBudget, 0LL, 0LL) / (double)RetryBudgetScale;
+	}
+
+	void CBackoffRetryPolicy::ResetStats(void)
+	{
+		(void)InterlockedExchange64(&llRequests, 0LL);
+		for (UINT i = 0; i < _countof(llRetries); i++)
+			(void)InterlockedExchange64(&llRetries[i], 0LL);
+		(void)InterlockedExchange64(&llRetryLimit, 0LL);
+		(void)InterlockedExchange64(&llBudgetExhausted, 0LL);
+		(void)InterlockedExchange64(&llFailovers, 0LL);
+		(void)InterlockedExchange64(&llDelayMs, 0LL);
+	}
+
+} // end namespace ecs_sdk
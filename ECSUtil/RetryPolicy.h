@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2017 - 2022, Dell Technologies, Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#pragma once
+
+#include "exportdef.h"
+
+namespace ecs_sdk
+{
+
+	// error classes that can each have their own retry rule
+	enum class E_RETRY_CLASS : BYTE
+	{
+		Network,				// no response from the node (connection refused/reset, name resolution...)
+		Timeout,				// WinHttp timeout
+		SlowDown,				// HTTP 503: the server is shedding load
+		ServerError,			// any other HTTP 5xx
+		Count
+	};
+
+	// retry rule for one error class
+	struct ECSUTIL_EXT_CLASS RETRY_RULE
+	{
+		UINT uMaxRetries;				// maximum number of retries (not counting the first try)
+		DWORD dwBaseDelay;				// upper limit of the delay before the first retry (ms). doubles with each retry
+		DWORD dwMaxDelay;				// the delay limit never goes over this (ms)
+
+		RETRY_RULE(UINT uMaxRetriesParam = 0, DWORD dwBaseDelayParam = 0, DWORD dwMaxDelayParam = 0)
+			: uMaxRetries(uMaxRetriesParam)
+			, dwBaseDelay(dwBaseDelayParam)
+			, dwMaxDelay(dwMaxDelayParam)
+		{}
+	};
+
+	// retry counters
+	struct ECSUTIL_EXT_CLASS RETRY_STATS
+	{
+		ULONGLONG ullRequests;								// requests started
+		ULONGLONG ullRetries[(int)E_RETRY_CLASS::Count];	// retries allowed, by error class
+		ULONGLONG ullRetryLimit;							// retries refused because the rule's maximum was reached
+		ULONGLONG ullBudgetExhausted;						// retries refused because the budget was empty
+		ULONGLONG ullFailovers;								// retries to an untried node that didn't take from the budget
+		ULONGLONG ullDelayMs;								// total of all retry delays handed out (ms)
+		double dBudget;										// retry tokens available right now
+
+		RETRY_STATS()
+			: ullRequests(0ULL)
+			, ullRetryLimit(0ULL)
+			, ullBudgetExhausted(0ULL)
+			, ullFailovers(0ULL)
+			, ullDelayMs(0ULL)
+			, dBudget(0.0)
+		{
+			for (UINT i = 0; i < _countof(ullRetries); i++)
+				ullRetries[i] = 0ULL;
+		}
+		ULONGLONG GetTotalRetries(void) const
+		{
+			ULONGLONG ullTotal = 0ULL;
+			for (UINT i = 0; i < _countof(ullRetries); i++)
+				ullTotal += ullRetries[i];
+			return ullTotal;
+		}
+	};
+
+	// CRetryPolicy
+	// decides whether a failed request is tried again and how long to wait first
+	// one policy can be shared by many connections and threads, so implementations must be thread safe
+	class ECSUTIL_EXT_CLASS CRetryPolicy
+	{
+	public:
+		virtual ~CRetryPolicy()
+		{}
+		// a request is being sent for the first time
+		virtual void RequestStart(void) = 0;
+		// try number uTry (0 = the first try) failed with an error of class RetryClass
+		// returns true if the request should be tried again after waiting dwDelay ms
+		// bFailover is set if the node didn't respond and the next try goes to a node this request hasn't tried yet
+		virtual bool IfRetry(E_RETRY_CLASS RetryClass, UINT uTry, DWORD& dwDelay, bool bFailover = false) = 0;
+		virtual void GetStats(RETRY_STATS& Stats) const = 0;
+	};
+
+	// CBackoffRetryPolicy
+	// capped exponential backoff with full jitter: the delay before retry n is picked at random between 0 and
+	// min(dwMaxDelay, dwBaseDelay * 2^n), so clients that failed at the same time don't all come back at the same time
+	// retries can also be limited by a budget (a token bucket): each request adds dBudgetRatio tokens, up to
+	// dBudgetMax, and each retry takes one token. while the servers are healthy the bucket stays full, but when
+	// most requests fail, retries are held to about dBudgetRatio of the requests instead of multiplying the load
+	// the budget is off unless dBudgetRatio is set. it covers everything using the policy object: give a connection
+	// its own policy for a per connection budget, or share one for a process wide budget
+	// failover of a network error to a node the request hasn't tried yet doesn't take from the budget. otherwise when
+	// one node dies, only the first few requests that hit it would get to move on to a healthy node
+	// RequestStart and IfRetry are called for every request, so nothing here takes a lock: the counters are
+	// interlocked and the budget is kept in thousandths of a token (budget units) so it can be updated with
+	// compare and exchange
+	class ECSUTIL_EXT_CLASS CBackoffRetryPolicy : public CRetryPolicy
+	{
+	private:
+		// rule for each error class. each field is read separately, so a retry that overlaps SetRule can see
+		// some of the old rule and some of the new
+		volatile LONG lMaxRetries[(int)E_RETRY_CLASS::Count];
+		volatile LONG lBaseDelay[(int)E_RETRY_CLASS::Count];
+		volatile LONG lMaxDelay[(int)E_RETRY_CLASS::Count];
+		// the 64 bit values are mutable because reading them on x86 takes InterlockedCompareExchange64
+		mutable volatile LONGLONG llBudgetRatio;			// budget units added for each request. 0 = no budget
+		mutable volatile LONGLONG llBudgetMax;				// most budget units that can be saved up
+		mutable volatile LONGLONG llBudget;					// budget units available
+		// counters (see RETRY_STATS)
+		mutable volatile LONGLONG llRequests;
+		mutable volatile LONGLONG llRetries[(int)E_RETRY_CLASS::Count];
+		mutable volatile LONGLONG llRetryLimit;
+		mutable volatile LONGLONG llBudgetExhausted;
+		mutable volatile LONGLONG llFailovers;
+		mutable volatile LONGLONG llDelayMs;
+
+		CBackoffRetryPolicy(const CBackoffRetryPolicy&);				// no implementation
+		CBackoffRetryPolicy& operator = (const CBackoffRetryPolicy&);	// no implementation
+
+	public:
+		CBackoffRetryPolicy(double dBudgetRatioParam = 0.0, double dBudgetMaxParam = 10.0);
+		~CBackoffRetryPolicy()
+		{}
+
+		void SetRule(E_RETRY_CLASS RetryClass, const RETRY_RULE& Rule);
+		RETRY_RULE GetRule(E_RETRY_CLASS RetryClass) const;
+		// dBudgetRatioParam <= 0 turns off the budget
+		void SetBudget(double dBudgetRatioParam, double dBudgetMaxParam);
+
+		void RequestStart(void);
+		bool IfRetry(E_RETRY_CLASS RetryClass, UINT uTry, DWORD& dwDelay, bool bFailover = false);
+		void GetStats(RETRY_STATS& StatsParam) const;
+		void ResetStats(void);
+	};
+
+} // end namespace ecs_sdk
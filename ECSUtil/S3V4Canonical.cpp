@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2017 - 2022, Dell Technologies, Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "stdafx.h"
+
+#include <algorithm>
+#include "S3V4Canonical.h"
+#pragma comment(lib, "Bcrypt.lib")
+
+namespace ecs_sdk
+{
+
+	const DWORD SHA256_HASH_LEN = 32;
+
+	void CS3V4Canonical::CScratch::Reserve(size_t uMore)
+	{
+		if ((uLen + uMore + 1) > Buf.size())
+		{
+			size_t uNewSize = Buf.size() * 2;
+			if (uNewSize < (uLen + uMore + 1))
+				uNewSize = uLen + uMore + 1;
+			if (uNewSize < 256)
+				uNewSize = 256;
+			Buf.resize(uNewSize);
+		}
+	}
+
+	// sort the query parameters by encoded key. only the key is compared so the sort can be stable
+	// and keep the first of any duplicate keys
+	struct CS3V4Canonical::QueryLess
+	{
+		const char *pBuf;
+		explicit QueryLess(const char *pBufParam)
+			: pBuf(pBufParam)
+		{}
+		bool operator()(const QUERY_ENTRY& Entry1, const QUERY_ENTRY& Entry2) const
+		{
+			size_t uLen = (Entry1.uKeyLen < Entry2.uKeyLen) ? Entry1.uKeyLen : Entry2.uKeyLen;
+			int iCmp = memcmp(pBuf + Entry1.uKey, pBuf + Entry2.uKey, uLen);
+			if (iCmp != 0)
+				return iCmp < 0;
+			return Entry1.uKeyLen < Entry2.uKeyLen;
+		}
+	};
+
+	CS3V4Canonical::CS3V4Canonical()
+		: hSha256Alg(nullptr)
+		, hHmacAlg(nullptr)
+	{
+		szPayloadHash[0] = '\0';
+		szSignature[0] = '\0';
+	}
+
+	CS3V4Canonical::~CS3V4Canonical()
+	{
+		if (hSha256Alg != nullptr)
+			(void)BCryptCloseAlgorithmProvider(hSha256Alg, 0);
+		if (hHmacAlg != nullptr)
+			(void)BCryptCloseAlgorithmProvider(hHmacAlg, 0);
+		hSha256Alg = nullptr;
+		hHmacAlg = nullptr;
+	}
+
+	// OpenProviders
+	// open the SHA256 and HMAC-SHA256 providers the first time they are needed
+	// the hash objects are kept in Sha256Object/HmacObject so creating a hash doesn't allocate
+	void CS3V4Canonical::OpenProviders(void)
+	{
+		NTSTATUS Status;
+		DWORD dwObjectLen, dwData;
+		if (hSha256Alg == nullptr)
+		{
+			if (!NT_SUCCESS(Status = BCryptOpenAlgorithmProvider(&hSha256Alg, BCRYPT_SHA256_ALGORITHM, nullptr, 0)))
+			{
+				hSha256Alg = nullptr;
+				throw CErrorInfo(_T(__FILE__), __LINE__, Status);
+			}
+			if (!NT_SUCCESS(Status = BCryptGetProperty(hSha256Alg, BCRYPT_OBJECT_LENGTH, (PBYTE)&dwObjectLen, sizeof(DWORD), &dwData, 0)))
+				throw CErrorInfo(_T(__FILE__), __LINE__, Status);
+			Sha256Object.resize(dwObjectLen);
+		}
+		if (hHmacAlg == nullptr)
+		{
+			if (!NT_SUCCESS(Status = BCryptOpenAlgorithmProvider(&hHmacAlg, BCRYPT_SHA256_ALGORITHM, nullptr, BCRYPT_ALG_HANDLE_HMAC_FLAG)))
+			{
+				hHmacAlg = nullptr;
+				throw CErrorInfo(_T(__FILE__), __LINE__, Status);
+			}
+			if (!NT_SUCCESS(Status = BCryptGetProperty(hHmacAlg, BCRYPT_OBJECT_LENGTH, (PBYTE)&dwObjectLen, sizeof(DWORD), &dwData, 0)))
+				throw CErrorInfo(_T(__FILE__), __LINE__, Status);
+			HmacObject.resize(dwObjectLen);
+		}
+	}
+
+	void CS3V4Canonical::Sha256(const BYTE *pData, DWORD dwDataLen, BYTE *pHash)
+	{
+		NTSTATUS Status;
+		BCRYPT_HASH_HANDLE hHash = nullptr;
+		OpenProviders();
+		if (!NT_SUCCESS(Status = BCryptCreateHash(hSha256Alg, &hHash, &Sha256Object[0], (ULONG)Sha256Object.size(), nullptr, 0, 0)))
+			throw CErrorInfo(_T(__FILE__), __LINE__, Status);
+		Status = BCryptHashData(hHash, (PUCHAR)pData, dwDataLen, 0);
+		if (NT_SUCCESS(Status))
+			Status = BCryptFinishHash(hHash, pHash, SHA256_HASH_LEN, 0);
+		(void)BCryptDestroyHash(hHash);
+		if (!NT_SUCCESS(Status))
+			throw CErrorInfo(_T(__FILE__), __LINE__, Status);
+	}
+
+	void CS3V4Canonical::HmacSha256(const BYTE *pKey, DWORD dwKeyLen, const BYTE *pData, DWORD dwDataLen, BYTE *pHash)
+	{
+		NTSTATUS Status;
+		BCRYPT_HASH_HANDLE hHash = nullptr;
+		OpenProviders();
+		if (!NT_SUCCESS(Status = BCryptCreateHash(hHmacAlg, &hHash, &HmacObject[0], (ULONG)HmacObject.size(), (PUCHAR)pKey, dwKeyLen, 0)))
+			throw CErrorInfo(_T(__FILE__), __LINE__, Status);
+		Status = BCryptHashData(hHash, (PUCHAR)pData, dwDataLen, 0);
+		if (NT_SUCCESS(Status))
+			Status = BCryptFinishHash(hHash, pHash, SHA256_HASH_LEN, 0);
+		(void)BCryptDestroyHash(hHash);
+		if (!NT_SUCCESS(Status))
+			throw CErrorInfo(_T(__FILE__), __LINE__, Status);
+	}
+
+	// AppendUtf8
+	// convert to UTF-8 without going through a temporary string
+	void CS3V4Canonical::AppendUtf8(CScratch& Out, LPCTSTR pszIn, size_t uInLen)
+	{
+#ifdef _UNICODE
+		Out.Reserve(uInLen * 3);
+		for (size_t i = 0; i < uInLen; i++)
+		{
+			UINT uChar = (UINT)pszIn[i];
+			if (uChar < 0x80)
+			{
+				Out.Buf[Out.uLen++] = (char)uChar;
+				continue;
+			}
+			// surrogate pair
+			if ((uChar >= 0xD800) && (uChar <= 0xDBFF) && ((i + 1) < uInLen)
+				&& ((UINT)pszIn[i + 1] >= 0xDC00) && ((UINT)pszIn[i + 1] <= 0xDFFF))
+			{
+				uChar = 0x10000 + ((uChar - 0xD800) << 10) + ((UINT)pszIn[i + 1] - 0xDC00);
+				i++;
+			}
+			if (uChar < 0x800)
+			{
+				Out.Buf[Out.uLen++] = (char)(0xC0 | (uChar >> 6));
+				Out.Buf[Out.uLen++] = (char)(0x80 | (uChar & 0x3F));
+			}
+			else if (uChar < 0x10000)
+			{
+				Out.Buf[Out.uLen++] = (char)(0xE0 | (uChar >> 12));
+				Out.Buf[Out.uLen++] = (char)(0x80 | ((uChar >> 6) & 0x3F));
+				Out.Buf[Out.uLen++] = (char)(0x80 | (uChar & 0x3F));
+			}
+			else
+			{
+				// 2 UTF-16 units become 4 bytes, so this still fits in what was reserved
+				Out.Buf[Out.uLen++] = (char)(0xF0 | (uChar >> 18));
+				Out.Buf[Out.uLen++] = (char)(0x80 | ((uChar >> 12) & 0x3F));
+				Out.Buf[Out.uLen++] = (char)(0x80 | ((uChar >> 6) & 0x3F));
+				Out.Buf[Out.uLen++] = (char)(0x80 | (uChar & 0x3F));
+			}
+		}
+#else
+		Out.Append(pszIn, uInLen);
+#endif
+	}
+
+	static int HexDigit(char ch)
+	{
+		if ((ch >= '0') && (ch <= '9'))
+			return ch - '0';
+		if ((ch >= 'a') && (ch <= 'f'))
+			return ch - 'a' + 10;
+		if ((ch >= 'A') && (ch <= 'F'))
+			return ch - 'A' + 10;
+		return -1;
+	}
+
+	// AppendUriEncoded
+	// same as UriEncode(UriDecode(psz), E_URI_ENCODE::V4Auth or V4AuthSlash), on UTF-8, in one pass
+	// any %XX is decoded, then everything but the unreserved characters (and '/' if !bEncodeSlash) is encoded
+	void CS3V4Canonical::AppendUriEncoded(CScratch& Out, const char *pIn, size_t uInLen, bool bEncodeSlash)
+	{
+		static const char DEC2HEX[16 + 1] = "0123456789ABCDEF";
+		Out.Reserve(uInLen * 3);
+		for (size_t i = 0; i < uInLen; i++)
+		{
+			BYTE ch = (BYTE)pIn[i];
+			if ((ch == '%') && ((i + 2) < uInLen))
+			{
+				int iHigh = HexDigit(pIn[i + 1]);
+				int iLow = HexDigit(pIn[i + 2]);
+				if ((iHigh >= 0) && (iLow >= 0))
+				{
+					ch = (BYTE)((iHigh << 4) | iLow);
+					i += 2;
+				}
+			}
+			if (((ch >= 'A') && (ch <= 'Z')) || ((ch >= 'a') && (ch <= 'z')) || ((ch >= '0') && (ch <= '9'))
+				|| (ch == '-') || (ch == '.') || (ch == '_') || (ch == '~') || ((ch == '/') && !bEncodeSlash))
+				Out.Buf[Out.uLen++] = (char)ch;
+			else
+			{
+				Out.Buf[Out.uLen++] = '%';
+				Out.Buf[Out.uLen++] = DEC2HEX[ch >> 4];
+				Out.Buf[Out.uLen++] = DEC2HEX[ch & 0x0F];
+			}
+		}
+	}
+
+	// AppendHex
+	// lowercase hex, same as BinaryToHexString. pszOut must hold dwDataLen * 2 + 1 characters
+	void CS3V4Canonical::AppendHex(char *pszOut, const BYTE *pData, DWORD dwDataLen)
+	{
+		static const char HEXDIGITS[16 + 1] = "0123456789abcdef";
+		for (DWORD i = 0; i < dwDataLen; i++)
+		{
+			*pszOut++ = HEXDIGITS[pData[i] >> 4];
+			*pszOut++ = HEXDIGITS[pData[i] & 0x0F];
+		}
+		*pszOut = '\0';
+	}
+
+	// AddQuery
+	// add a single query parameter (var=value or var) to QueryList
+	void CS3V4Canonical::AddQuery(const char *pQuery, size_t uQueryLen)
+	{
+		const char *pEquals = (const char *)memchr(pQuery, '=', uQueryLen);
+		size_t uKeyLen = (pEquals == nullptr) ? uQueryLen : (size_t)(pEquals - pQuery);
+		QUERY_ENTRY Entry;
+		Entry.uKey = QueryBuf.uLen;
+		AppendUriEncoded(QueryBuf, pQuery, uKeyLen, true);
+		Entry.uKeyLen = QueryBuf.uLen - Entry.uKey;
+		Entry.uValue = QueryBuf.uLen;
+		if (pEquals != nullptr)
+			AppendUriEncoded(QueryBuf, pEquals + 1, uQueryLen - uKeyLen - 1, true);
+		Entry.uValueLen = QueryBuf.uLen - Entry.uValue;
+		QueryList.push_back(Entry);
+	}
+
+	LPCSTR CS3V4Canonical::HashPayload(const void *pData, DWORD dwDataLen)
+	{
+		BYTE Hash[SHA256_HASH_LEN];
+		Sha256((pData == nullptr) ? (const BYTE *)"" : (const BYTE *)pData, (pData == nullptr) ? 0 : dwDataLen, Hash);
+		AppendHex(szPayloadHash, Hash, SHA256_HASH_LEN);
+		return szPayloadHash;
+	}
+
+	// Sign
+	//		<HTTPMethod>\n
+	//		<CanonicalURI>\n
+	//		<CanonicalQueryString>\n
+	//		<CanonicalHeaders>\n
+	//		<SignedHeaders>\n
+	//		<HashedPayload>
+	// then the string to sign:
+	//		"AWS4-HMAC-SHA256" + \n" +
+	//		timeStampISO8601Format + "\n" +
+	//		<Scope> +"\n" +
+	//		Hex(SHA256Hash(<CanonicalRequest>))
+	void CS3V4Canonical::Sign(
+		LPCTSTR pszMethod,
+		LPCTSTR pszResource,
+		const std::map<CString, CECSConnection::HEADER_STRUCT>& Headers,
+		LPCSTR pszPayloadHash,
+		const SYSTEMTIME& stRequestTime,
+		LPCTSTR pszRegion,
+		const BYTE *pSigningKey,
+		DWORD dwSigningKeyLen)
+	{
+		Canonical.Clear();
+		SignedHeaders.Clear();
+		szSignature[0] = '\0';
+
+		//		<HTTPMethod>\n
+		size_t uStart = Canonical.uLen;
+		AppendUtf8(Canonical, pszMethod, _tcslen(pszMethod));
+		for (size_t i = uStart; i < Canonical.uLen; i++)
+		{
+			if ((Canonical.Buf[i] >= 'a') && (Canonical.Buf[i] <= 'z'))
+				Canonical.Buf[i] = (char)(Canonical.Buf[i] - 'a' + 'A');
+		}
+		Canonical.AppendChar('\n');
+
+		// split out the query string before decoding because the resource may have a '?'
+		Utf8.Clear();
+		AppendUtf8(Utf8, pszResource, _tcslen(pszResource));
+		const char *pResource = Utf8.GetString();
+		const char *pQuery = (const char *)memchr(pResource, '?', Utf8.uLen);
+		size_t uPathLen = (pQuery == nullptr) ? Utf8.uLen : (size_t)(pQuery - pResource);
+
+		//		<CanonicalURI>\n
+		uStart = Canonical.uLen;
+		AppendUriEncoded(Canonical, pResource, uPathLen, false);
+		if (Canonical.uLen == uStart)
+			Canonical.AppendChar('/');
+		Canonical.AppendChar('\n');
+
+		//		<CanonicalQueryString>
+		// each query separated by '&'
+		// each query of form: var=value
+		if (pQuery != nullptr)
+		{
+			QueryBuf.Clear();
+			QueryList.clear();
+			const char *pEnd = pResource + Utf8.uLen;
+			for (const char *pParam = pQuery + 1; pParam < pEnd; )
+			{
+				const char *pAmp = (const char *)memchr(pParam, '&', (size_t)(pEnd - pParam));
+				if (pAmp == nullptr)
+					pAmp = pEnd;
+				if (pAmp != pParam)
+					AddQuery(pParam, (size_t)(pAmp - pParam));
+				pParam = pAmp + 1;
+			}
+			const char *pQueryBuf = QueryBuf.GetString();
+			std::stable_sort(QueryList.begin(), QueryList.end(), QueryLess(pQueryBuf));
+			for (size_t i = 0; i < QueryList.size(); i++)
+			{
+				const QUERY_ENTRY& Entry = QueryList[i];
+				// only the first of a duplicate key is used
+				if ((i != 0) && !QueryLess(pQueryBuf)(QueryList[i - 1], Entry))
+					continue;
+				if (i != 0)
+					Canonical.AppendChar('&');
+				Canonical.Append(pQueryBuf + Entry.uKey, Entry.uKeyLen);
+				Canonical.AppendChar('=');
+				Canonical.Append(pQueryBuf + Entry.uValue, Entry.uValueLen);
+			}
+		}
+		Canonical.AppendChar('\n');
+
+		//		<CanonicalHeaders>\n
+		// the label and value are trimmed and any run of spaces in the value is cut down to one
+		for (std::map<CString, CECSConnection::HEADER_STRUCT>::const_iterator itMap = Headers.begin(); itMap != Headers.end(); ++itMap)
+		{
+			LPCTSTR pszLabel = itMap->first;
+			size_t uLabelStart = 0, uLabelEnd = (size_t)itMap->first.GetLength();
+			while ((uLabelStart < uLabelEnd) && _istspace(pszLabel[uLabelStart]))
+				uLabelStart++;
+			while ((uLabelEnd > uLabelStart) && _istspace(pszLabel[uLabelEnd - 1]))
+				uLabelEnd--;
+			// the 'range' header seems to be very odd when using V4 auth
+			// on AWS it seems put just "range:" in the canoical list, instead of putting the byte range
+			// on ECS it just seems to always fail if it is included (range:bytes 0-43) for reading the IV in an encrypted object
+			if (((uLabelEnd - uLabelStart) == 5) && (_tcsncmp(pszLabel + uLabelStart, _T("range"), 5) == 0))
+				continue;
+			if (SignedHeaders.uLen != 0)
+				SignedHeaders.AppendChar(';');
+			uStart = Canonical.uLen;
+			AppendUtf8(Canonical, pszLabel + uLabelStart, uLabelEnd - uLabelStart);
+			SignedHeaders.Append(&Canonical.Buf[uStart], Canonical.uLen - uStart);
+			Canonical.AppendChar(':');
+			LPCTSTR pszValue = itMap->second.sContents;
+			size_t uValueStart = 0, uValueEnd = (size_t)itMap->second.sContents.GetLength();
+			while ((uValueStart < uValueEnd) && _istspace(pszValue[uValueStart]))
+				uValueStart++;
+			while ((uValueEnd > uValueStart) && _istspace(pszValue[uValueEnd - 1]))
+				uValueEnd--;
+			size_t uSegment = uValueStart;
+			for (size_t i = uValueStart + 1; i < uValueEnd; i++)
+			{
+				if ((pszValue[i] == _T(' ')) && (pszValue[i - 1] == _T(' ')))
+				{
+					AppendUtf8(Canonical, pszValue + uSegment, i - uSegment);
+					uSegment = i + 1;
+				}
+			}
+			if (uSegment < uValueEnd)
+				AppendUtf8(Canonical, pszValue + uSegment, uValueEnd - uSegment);
+			Canonical.AppendChar('\n');
+		}
+		//		<SignedHeaders>\n
+		Canonical.AppendChar('\n');
+		Canonical.Append(SignedHeaders.GetString(), SignedHeaders.uLen);
+		Canonical.AppendChar('\n');
+		//		<HashedPayload>
+		Canonical.Append(pszPayloadHash);
+
+		// create StringToSign
+		BYTE Hash[SHA256_HASH_LEN];
+		char szDate[64];
+		StringToSign.Clear();
+		StringToSign.Append("AWS4-HMAC-SHA256\n");
+		(void)sprintf_s(szDate, "%04u%02u%02uT%02u%02u%02uZ\n%04u%02u%02u/",
+			stRequestTime.wYear, stRequestTime.wMonth, stRequestTime.wDay,
+			stRequestTime.wHour, stRequestTime.wMinute, stRequestTime.wSecond,
+			stRequestTime.wYear, stRequestTime.wMonth, stRequestTime.wDay);
+		StringToSign.Append(szDate);
+		AppendUtf8(StringToSign, pszRegion, _tcslen(pszRegion));
+		StringToSign.Append("/s3/aws4_request\n");
+		Sha256((const BYTE *)Canonical.GetString(), (DWORD)Canonical.uLen, Hash);
+		StringToSign.Reserve(SHA256_HASH_LEN * 2);
+		AppendHex(&StringToSign.Buf[StringToSign.uLen], Hash, SHA256_HASH_LEN);
+		StringToSign.uLen += SHA256_HASH_LEN * 2;
+
+		// sign it
+		HmacSha256(pSigningKey, dwSigningKeyLen, (const BYTE *)StringToSign.GetString(), (DWORD)StringToSign.uLen, Hash);
+		AppendHex(szSignature, Hash, SHA256_HASH_LEN);
+	}
+
+} // end namespace ecs_sdk
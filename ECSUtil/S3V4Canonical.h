@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2017 - 2022, Dell Technologies, Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#pragma once
+
+#include <bcrypt.h>
+#include "exportdef.h"
+#include "ECSConnection.h"
+
+namespace ecs_sdk
+{
+
+	// CS3V4Canonical
+	// builds the S3 V4 canonical request and string to sign, and signs it
+	// everything is done in UTF-8 in scratch buffers that are kept from one call to the next, and the
+	// SHA256/HMAC objects live in the object as well, so once the buffers have grown to fit the largest
+	// request, signing doesn't touch the heap
+	// it is not thread safe. keep one per thread (CECSConnection uses a thread_local instance)
+	class ECSUTIL_EXT_CLASS CS3V4Canonical
+	{
+	private:
+		// growable UTF-8 buffer. Clear() keeps the memory
+		struct CScratch
+		{
+			std::vector<char> Buf;
+			size_t uLen;
+
+			CScratch()
+				: uLen(0)
+			{}
+			void Clear(void)
+			{
+				uLen = 0;
+			}
+			void Reserve(size_t uMore);
+			void Append(const char *pData, size_t uDataLen)
+			{
+				Reserve(uDataLen);
+				memcpy(&Buf[uLen], pData, uDataLen);
+				uLen += uDataLen;
+			}
+			void Append(const char *psz)
+			{
+				Append(psz, strlen(psz));
+			}
+			void AppendChar(char ch)
+			{
+				Reserve(1);
+				Buf[uLen++] = ch;
+			}
+			const char *GetString(void)			// null terminated
+			{
+				Reserve(1);
+				Buf[uLen] = '\0';
+				return &Buf[0];
+			}
+		};
+		// query parameter: offsets of the encoded key and value in QueryBuf
+		struct QUERY_ENTRY
+		{
+			size_t uKey;
+			size_t uKeyLen;
+			size_t uValue;
+			size_t uValueLen;
+		};
+		struct QueryLess;
+
+		CScratch Canonical;						// canonical request
+		CScratch StringToSign;					// string to sign
+		CScratch SignedHeaders;					// signed header list ("host;x-amz-date;...")
+		CScratch Utf8;							// input converted to UTF-8
+		CScratch QueryBuf;						// encoded query keys and values
+		std::vector<QUERY_ENTRY> QueryList;		// query parameters, sorted by key
+		char szPayloadHash[65];					// hex SHA256 of the payload
+		char szSignature[65];					// hex signature
+		// hash support
+		BCRYPT_ALG_HANDLE hSha256Alg;
+		BCRYPT_ALG_HANDLE hHmacAlg;
+		std::vector<BYTE> Sha256Object;
+		std::vector<BYTE> HmacObject;
+
+		void OpenProviders(void);
+		void Sha256(const BYTE *pData, DWORD dwDataLen, BYTE *pHash);
+		void HmacSha256(const BYTE *pKey, DWORD dwKeyLen, const BYTE *pData, DWORD dwDataLen, BYTE *pHash);
+		static void AppendUtf8(CScratch& Out, LPCTSTR pszIn, size_t uInLen);
+		static void AppendUriEncoded(CScratch& Out, const char *pIn, size_t uInLen, bool bEncodeSlash);
+		static void AppendHex(char *pszOut, const BYTE *pData, DWORD dwDataLen);
+		void AddQuery(const char *pQuery, size_t uQueryLen);
+
+		CS3V4Canonical(const CS3V4Canonical&);					// no implementation
+		CS3V4Canonical& operator = (const CS3V4Canonical&);		// no implementation
+
+	public:
+		CS3V4Canonical();
+		~CS3V4Canonical();
+
+		// SHA256 of the payload, in hex, for x-amz-content-sha256
+		LPCSTR HashPayload(const void *pData, DWORD dwDataLen);
+
+		// build the canonical request and the string to sign, then sign it with the V4 signing key
+		// pszResource is the path and query, which are normalized (decoded, then encoded using the V4 rules)
+		// throws CErrorInfo if the hash fails
+		void Sign(
+			LPCTSTR pszMethod,
+			LPCTSTR pszResource,
+			const std::map<CString, CECSConnection::HEADER_STRUCT>& Headers,
+			LPCSTR pszPayloadHash,
+			const SYSTEMTIME& stRequestTime,
+			LPCTSTR pszRegion,
+			const BYTE *pSigningKey,
+			DWORD dwSigningKeyLen);
+
+		// results of the last Sign
+		LPCSTR GetCanonicalRequest(void)
+		{
+			return Canonical.GetString();
+		}
+		LPCSTR GetStringToSign(void)
+		{
+			return StringToSign.GetString();
+		}
+		LPCSTR GetSignedHeaders(void)
+		{
+			return SignedHeaders.GetString();
+		}
+		LPCSTR GetSignature(void) const
+		{
+			return szSignature;
+		}
+	};
+
+} // end namespace ecs_sdk
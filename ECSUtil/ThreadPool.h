@@ -206,15 +206,21 @@ private:
 	DWORD dwMaxConcurrentThreads;
 	bool bDisable;					// disable is set when Terminate is called to prevent additional work items
 	CThreadPoolEvents Events;
-	CSharedQueue<CMsgEntry> MsgQueue;
-	std::list<CMsgEntry> FutureMsgQueue;				// use the lock in MsgQueue. both MsgQueue and FutureMsgQueue use the same lock
+	CSharedQueue<CMsgEntry> MsgQueue;					// entries waiting to be processed, highest priority first
+	std::list<CMsgEntry> InProcessQueue;				// entries currently being processed. uses the lock in MsgQueue
+	std::multimap<ULONGLONG, CMsgEntry> FutureMsgQueue;	// delayed entries ordered by due time. uses the lock in MsgQueue
+	std::map<UINT, typename std::list<CMsgEntry>::iterator, std::greater<UINT>> PriorityTail;	// last entry in MsgQueue for each priority. uses the lock in MsgQueue
+	std::map<UINT, DWORD> RunningGroups;				// number of threads processing each grouping. uses the lock in MsgQueue
 	CSharedQueue<CThreadWork<MsgT>> Pool;
 
 	DWORD StartNewThread(void);
 	bool IsMsgQueueEmpty() const
 	{
-		return MsgQueue.empty();
+		return GetMsgQueueCount() == 0;
 	}
+	void SpliceMsgEntry(std::list<CMsgEntry>& SrcList, typename std::list<CMsgEntry>::iterator itSrc, bool bRequeue);
+	void UnlinkPriorityTail(typename std::list<CMsgEntry>::iterator itMsg);
+	void RemoveRunningGroup(UINT uGrouping);
 	void UpdatePerf(UINT uLine, std::shared_ptr<MsgT> *pMsg, CThreadWork<MsgT> *pResetIdle, UINT uPriority, UINT uGrouping, DWORD dwDelay);
 	virtual bool CompareEntry(const MsgT& Msg1, const MsgT& Msg2, UINT uSearchType) const;
 	bool IfInGroup(UINT uGrouping) const;
@@ -277,9 +283,12 @@ bool CThreadWork<MsgT>::IsInUse(void) const
 	return bInUse;
 }
 
+// MUST HAVE MSG LOCK
 template <class MsgT>
 void CThreadWork<MsgT>::SetIdle(void)
 {
+	if (bInUse)
+		pThreadPool->RemoveRunningGroup(uGrouping);
 	bInUse = false;
 	GetSystemTimeAsFileTime(&ftIdleTime);
 }
@@ -291,6 +300,8 @@ void CThreadWork<MsgT>::SetInUse(void)
 	CRWLockAcquire lock(&pThreadPool->Pool.GetLock(), false);		// read lock
 	{
 		CRWLockAcquire lockMsg(&pThreadPool->MsgQueue.GetLock(), true);	// write lock
+		if (!bInUse)
+			++pThreadPool->RunningGroups[uGrouping];
 		bInUse = true;
 		DWORD dwWorkCount = 0;
 		for (typename CSharedQueue<CThreadWork<MsgT>>::iterator itPool = pThreadPool->Pool.begin(); itPool != pThreadPool->Pool.end(); ++itPool)
@@ -347,26 +358,22 @@ void CThreadWork<MsgT>::DoWork()
 	case WAIT_TIMEOUT:
 		while (!GetExitFlag() && !pThreadPool->bDisable)
 		{
-			typename CThreadPool<MsgT>::CMsgEntry *pMsg = nullptr;			// message currently being worked on
+			typename std::list<typename CThreadPool<MsgT>::CMsgEntry>::iterator itMsg;		// message currently being worked on
 			{
 				CRWLockAcquire lock(&pThreadPool->Pool.GetLock(), true);	// write lock
 				{
 					CRWLockAcquire lockMsg(&pThreadPool->MsgQueue.GetLock(), true);	// write lock
-					// find the latest that is not being processed
-					typename CSharedQueue<typename CThreadPool<MsgT>::CMsgEntry>::iterator itMsg;
-					for (itMsg = pThreadPool->MsgQueue.begin(); itMsg != pThreadPool->MsgQueue.end(); ++itMsg)
-						if (!itMsg->Control.bProcessing)
-							break;
-					if (itMsg == pThreadPool->MsgQueue.end())
+					// entries being processed are moved to InProcessQueue, so the next one to run is always at the head
+					if (pThreadPool->MsgQueue.empty())
 						break;
-					pMsg = &(*itMsg);
-					Msg = pMsg->Payload;
-					uGrouping = pMsg->Control.uGrouping;
-					if (!pThreadPool->IfInGroup(pMsg->Control.uGrouping))
+					itMsg = pThreadPool->MsgQueue.begin();
+					Msg = itMsg->Payload;
+					uGrouping = itMsg->Control.uGrouping;
+					if (!pThreadPool->IfInGroup(itMsg->Control.uGrouping))
 						break;
-					if (!IfFTZero(pMsg->Control.ftDueTime))
+					if (!IfFTZero(itMsg->Control.ftDueTime))
 					{
-						ULARGE_INTEGER DueTime = FTtoULarge(pMsg->Control.ftDueTime);
+						ULARGE_INTEGER DueTime = FTtoULarge(itMsg->Control.ftDueTime);
 						FILETIME ftNow;
 						GetSystemTimeAsFileTime(&ftNow);
 						// figure out how long to wait
@@ -377,7 +384,9 @@ void CThreadWork<MsgT>::DoWork()
 							break;
 						}
 					}
-					pMsg->Control.bProcessing = true;
+					itMsg->Control.bProcessing = true;
+					pThreadPool->UnlinkPriorityTail(itMsg);
+					pThreadPool->InProcessQueue.splice(pThreadPool->InProcessQueue.end(), pThreadPool->MsgQueue, itMsg);
 					SetInUse();
 					// no need to update perf counters since popping the message and then
 					// setting the entry in use cancel each other out
@@ -401,19 +410,18 @@ void CThreadWork<MsgT>::DoWork()
 					CRWLockAcquire lockMsg(&pThreadPool->MsgQueue.GetLock(), true);		// write lock
 					if (bProcessed)
 					{
-						typename CSharedQueue<typename CThreadPool<MsgT>::CMsgEntry>::iterator itMsg;
-						for (itMsg = pThreadPool->MsgQueue.begin(); itMsg != pThreadPool->MsgQueue.end(); ++itMsg)
-							if (&(*itMsg) == pMsg)
-							{
-								pThreadPool->MsgQueue.erase(itMsg);
-								pThreadPool->MsgQueue.TriggerEvent(pThreadPool->MsgQueue.GetCount(), TRIGGEREVENTS_DELETE);
-								if (pThreadPool->MsgQueue.empty())
-									VERIFY(pThreadPool->Events.evEmptyEvent.SetEvent());
-								break;
-							}
+						pThreadPool->InProcessQueue.erase(itMsg);
+						DWORD dwCount = pThreadPool->GetMsgQueueCount();
+						pThreadPool->MsgQueue.TriggerEvent(dwCount, TRIGGEREVENTS_DELETE);
+						if (dwCount == 0)
+							VERIFY(pThreadPool->Events.evEmptyEvent.SetEvent());
 					}
 					else
-						pMsg->Control.bProcessing = false;
+					{
+						// put it back at the head of its priority so it is the next one tried
+						itMsg->Control.bProcessing = false;
+						pThreadPool->SpliceMsgEntry(pThreadPool->InProcessQueue, itMsg, true);
+					}
 				}
 			}
 			// first set entry idle, then update counters
@@ -471,6 +479,11 @@ void CThreadWork<MsgT>::ExitInstance()
 		MsgEvent.Unlink(&pThreadPool->MsgQueue);
 	EventList.clear();
 	bInitialized = false;
+	if (pThreadPool != nullptr)
+	{
+		CRWLockAcquire lockMsg(&pThreadPool->MsgQueue.GetLock(), true);	// write lock
+		SetIdle();
+	}
 	bInUse = false;
 	CoUninitialize();
 	// update the count of active threads. make it ignore this thread as it is going down
@@ -520,26 +533,74 @@ CThreadPool<MsgT>::~CThreadPool()
 }
 
 // return true if new message can be run with the currently executing threads
-// MUST HAVE POOL CS
+// it can run if nothing is running, or if everything running is in the same grouping
+// (THREAD_POOL_MSG_GROUPING_DONT_CARE only runs with itself, ALONE groupings only run by themselves)
+// MUST HAVE MSG LOCK
 template <class MsgT>
 bool CThreadPool<MsgT>::IfInGroup(UINT uGrouping) const
 {
-	for (typename CSharedQueue<CThreadWork<MsgT>>::const_iterator itPool = Pool.begin(); itPool != Pool.end(); ++itPool)
+	if (RunningGroups.empty())
+		return true;
+	if (uGrouping >= THREAD_POOL_MSG_GROUPING_ALONE_BASE)
+		return false;
+	return (RunningGroups.size() == 1) && (RunningGroups.begin()->first == uGrouping);
+}
+
+// RemoveRunningGroup
+// a thread has finished processing a message in this grouping
+// MUST HAVE MSG LOCK
+template <class MsgT>
+void CThreadPool<MsgT>::RemoveRunningGroup(UINT uGrouping)
+{
+	std::map<UINT, DWORD>::iterator itGroup = RunningGroups.find(uGrouping);
+	if (itGroup == RunningGroups.end())
+		return;
+	if (--itGroup->second == 0)
+		(void)RunningGroups.erase(itGroup);
+}
+
+// SpliceMsgEntry
+// move an entry from SrcList into MsgQueue, after all entries of the same or higher priority
+// if bRequeue, put it before other entries of the same priority (it had been taken off the head of the queue)
+// and don't wake up the worker threads
+// MUST HAVE MSG LOCK
+template <class MsgT>
+void CThreadPool<MsgT>::SpliceMsgEntry(std::list<CMsgEntry>& SrcList, typename std::list<CMsgEntry>::iterator itSrc, bool bRequeue)
+{
+	UINT uPriority = itSrc->Control.uPriority;
+	// PriorityTail is sorted highest priority first. find the last entry of the lowest priority
+	// that still goes ahead of this one
+	typename std::map<UINT, typename std::list<CMsgEntry>::iterator, std::greater<UINT>>::iterator itTail
+		= bRequeue ? PriorityTail.lower_bound(uPriority) : PriorityTail.upper_bound(uPriority);
+	typename std::list<CMsgEntry>::iterator itPos = MsgQueue.begin();
+	if (itTail != PriorityTail.begin())
 	{
-		if (itPool->bInUse)
-		{
-			if ((uGrouping != THREAD_POOL_MSG_GROUPING_DONT_CARE)
-				|| (itPool->uGrouping != THREAD_POOL_MSG_GROUPING_DONT_CARE))
-			{
-				if ((uGrouping >= THREAD_POOL_MSG_GROUPING_ALONE_BASE)
-					|| (itPool->uGrouping >= THREAD_POOL_MSG_GROUPING_ALONE_BASE))
-					return false;
-				if (itPool->uGrouping != uGrouping)
-					return false;
-			}
-		}
+		--itTail;
+		itPos = std::next(itTail->second);
 	}
-	return true;
+	MsgQueue.splice(itPos, SrcList, itSrc);
+	if (bRequeue)
+		(void)PriorityTail.emplace(uPriority, itSrc);
+	else
+	{
+		PriorityTail[uPriority] = itSrc;
+		MsgQueue.TriggerEvent(MsgQueue.GetCount(), TRIGGEREVENTS_PUSH);
+	}
+}
+
+// UnlinkPriorityTail
+// call before an entry is removed from MsgQueue
+// MUST HAVE MSG LOCK
+template <class MsgT>
+void CThreadPool<MsgT>::UnlinkPriorityTail(typename std::list<CMsgEntry>::iterator itMsg)
+{
+	typename std::map<UINT, typename std::list<CMsgEntry>::iterator, std::greater<UINT>>::iterator itTail = PriorityTail.find(itMsg->Control.uPriority);
+	if ((itTail == PriorityTail.end()) || (itTail->second != itMsg))
+		return;
+	if ((itMsg != MsgQueue.begin()) && (std::prev(itMsg)->Control.uPriority == itMsg->Control.uPriority))
+		itTail->second = std::prev(itMsg);
+	else
+		(void)PriorityTail.erase(itTail);
 }
 
 template <class MsgT>
@@ -652,7 +713,7 @@ DWORD CThreadPool<MsgT>::GetNumThreadsInternal(
 	bool bExclusive) const							// if set, get exclusive lock to get an absolute accurate thread count
 {
 	CRWLockAcquire lock(&Pool.GetLock(), bExclusive);	// read lock or write lock if bExclusive is set
-	DWORD dwCount = MsgQueue.GetCount();			// get current length of queue
+	DWORD dwCount = GetMsgQueueCount();				// get current length of queue
 	DWORD dwThreads = 0;
 	for (typename CSharedQueue<CThreadWork<MsgT>>::const_iterator itPool = Pool.begin(); itPool != Pool.end(); ++itPool)
 	{
@@ -686,7 +747,8 @@ void CThreadPool<MsgT>::GetCurrentWorkItems(std::list<MsgT>& RetList) const
 template <class MsgT>
 DWORD CThreadPool<MsgT>::GetMsgQueueCount() const
 {
-	return MsgQueue.GetCount();
+	CRWLockAcquire lockMsg(&MsgQueue.GetLock(), false);		// read lock
+	return MsgQueue.GetCount() + (DWORD)InProcessQueue.size();
 }
 
 template <class MsgT>
@@ -748,7 +810,7 @@ void CThreadPool<MsgT>::SendMessageToPool(
 				dwMaxQueueSize = 0;
 		}
 	}
-	if ((dwMaxQueueSize != 0) && (MsgQueue.GetCount() > dwMaxQueueSize))
+	if ((dwMaxQueueSize != 0) && (GetMsgQueueCount() > dwMaxQueueSize))
 	{
 		if (pbNoBlock != nullptr)
 		{
@@ -760,7 +822,7 @@ void CThreadPool<MsgT>::SendMessageToPool(
 		QueueEvent.EnableTriggerEvents(TRIGGEREVENTS_DELETE);
 		QueueEvent.Enable();
 		QueueEvent.SetCount(dwMaxQueueSize);
-		while (MsgQueue.GetCount() > dwMaxQueueSize)
+		while (GetMsgQueueCount() > dwMaxQueueSize)
 		{
 			if (pThread != nullptr)					// check if we are supposed to shut down
 				if (pThread->GetExitFlag())
@@ -789,7 +851,7 @@ void CThreadPool<MsgT>::SendMessageToPoolDelayed(UINT uLine, DWORD dwDueTime, st
 	Rec.Control.ftDueTime = ftNow + dwDueTime * (FT_SECOND / SECONDS(1));
 	{
 		CRWLockAcquire lock(&MsgQueue.GetLock(), true);		// write lock
-		FutureMsgQueue.push_back(Rec);
+		(void)FutureMsgQueue.emplace(FTtoULarge(Rec.Control.ftDueTime).QuadPart, Rec);
 	}
 	AddThreads();
 }
@@ -827,7 +889,7 @@ void CThreadPool<MsgT>::AddThreads(DWORD *pdwRealMaxThreads)
 			// see if we'd benefit with more threads
 			DWORD dwActive = GetNumThreadsInternal();
 			CRWLockAcquire lockMsg(&MsgQueue.GetLock(), true);
-			if (((dwRealMaxThreads - dwActive) > 0) && (MsgQueue.GetCount() > dwActive))
+			if (((dwRealMaxThreads - dwActive) > 0) && !MsgQueue.empty() && (GetMsgQueueCount() > dwActive))
 			{
 				if (IfInGroup(MsgQueue.front().Control.uGrouping))
 				{
@@ -872,10 +934,13 @@ DWORD CThreadPool<MsgT>::SearchMessageBackModify(const MsgT& MsgFind, UINT uSear
 					}
 					if (bDelete)
 					{
-						MsgQueue.erase(--itMsg.base());
+						typename CSharedQueue<CMsgEntry>::iterator itErase = itMsg.base();
+						--itErase;
+						UnlinkPriorityTail(itErase);
+						MsgQueue.erase(itErase);
 						{
 							CSimpleRWLockAcquire lockSharedMem(prwlPerf);
-							DWORD dwCount = MsgQueue.GetCount();
+							DWORD dwCount = GetMsgQueueCount();
 							if (pdwPerfQueueSize != nullptr)
 								*pdwPerfQueueSize = dwCount;
 							if ((pdwPerfQueueMax != nullptr) && (dwCount > *pdwPerfQueueMax))
@@ -913,6 +978,18 @@ bool CThreadPool<MsgT>::SearchMessage(const MsgT& MsgFind, MsgT *pPayloadRet, UI
 				}
 			}
 		}
+		if (bInProcess)
+		{
+			for (typename std::list<CMsgEntry>::const_iterator itMsg = InProcessQueue.begin(); itMsg != InProcessQueue.end(); ++itMsg)
+			{
+				if (CompareEntry(MsgFind, *itMsg->Payload, uSearchType))
+				{
+					if (pPayloadRet != nullptr)
+						*pPayloadRet = *itMsg->Payload;
+					return true;
+				}
+			}
+		}
 	}
 	return false;
 }
@@ -934,13 +1011,14 @@ bool CThreadPool<MsgT>::SearchMessageKill(const MsgT& MsgFind, UINT uSearchType)
 				{
 					if (CompareEntry(MsgFind, *itMsg->Payload, uSearchType))
 					{
+						UnlinkPriorityTail(itMsg);
 						MsgQueue.erase(itMsg);
 						bFound = true;
 						bRetry = true;
 						if (pdwPerfQueueSize != nullptr)
 						{
 							CSimpleRWLockAcquire lockSharedMem(prwlPerf);
-							*pdwPerfQueueSize = MsgQueue.GetCount();
+							*pdwPerfQueueSize = GetMsgQueueCount();
 						}
 						break;
 					}
@@ -990,7 +1068,9 @@ void CThreadPool<MsgT>::DiscardPool() throw()
 		{
 			CRWLockAcquire lockMsg(&MsgQueue.GetLock(), true);	// write lock
 			MsgQueue.clear();
+			InProcessQueue.clear();
 			FutureMsgQueue.clear();
+			PriorityTail.clear();
 		}
 	}
 	{
@@ -1027,7 +1107,8 @@ void CThreadPool<MsgT>::UpdatePerf(UINT uLine, std::shared_ptr<MsgT> *pMsg, CThr
 					CSimpleRWLockAcquire lockSharedMem(prwlPerf);
 					InterlockedIncrement(pdwPerfQueueRateIn);
 				}
-				CMsgEntry Rec;
+				std::list<CMsgEntry> NewEntry(1);
+				CMsgEntry& Rec = NewEntry.front();
 				Rec.Control.uPriority = uPriority;
 				Rec.Control.uLineNo = uLine;
 				Rec.Payload = *pMsg;
@@ -1038,21 +1119,10 @@ void CThreadPool<MsgT>::UpdatePerf(UINT uLine, std::shared_ptr<MsgT> *pMsg, CThr
 					GetSystemTimeAsFileTime(&ftNow);
 					Rec.Control.ftDueTime = ftNow + ((ULONGLONG)dwDelay * (FT_SECONDS(1) / SECONDS(1)));
 				}
-				bool bInserted = false;
-				for (typename CSharedQueue<CMsgEntry>::reverse_iterator itMsg = MsgQueue.rbegin(); itMsg != MsgQueue.rend(); itMsg++)
-				{
-					if (itMsg->Control.uPriority >= uPriority)
-					{
-						// insert it AFTER element 'i'
-						MsgQueue.insert(itMsg.base(), Rec);
-						bInserted = true;
-						break;
-					}
-				}
-				if (!bInserted)
-					MsgQueue.push_front(Rec);			// put at the head of the queue
+				// goes after all entries of the same or higher priority
+				SpliceMsgEntry(NewEntry, NewEntry.begin(), false);
 			}
-			dwCount = MsgQueue.GetCount();			// get current length of queue
+			dwCount = GetMsgQueueCount();			// get current length of queue
 		}
 	}
 	{
@@ -1147,7 +1217,7 @@ CString CThreadPool<MsgT>::FormatEntry(void)
 {
 	CString sLine;
 	sLine.Format(_T("Thread Pool: %s, Queue:%u, Queue Max:%u, Threads:%u, WorkItems:%u, MinThreads:%u, MaxThreads:%u"),
-		(LPCTSTR)FROM_ANSI(typeid(*this).name()), MsgQueue.GetCount(), *pdwPerfQueueMax, *pdwPerfNumThreads, *pdwPerfWorkItems, dwMinNumThreads, dwMaxNumThreads);
+		(LPCTSTR)FROM_ANSI(typeid(*this).name()), GetMsgQueueCount(), *pdwPerfQueueMax, *pdwPerfNumThreads, *pdwPerfWorkItems, dwMinNumThreads, dwMaxNumThreads);
 	return sLine;
 }
 
@@ -1192,7 +1262,7 @@ DWORD CThreadPool<MsgT>::GetMinNumThreadsInternal(void)
 	CRWLockAcquire lock(&MsgQueue.GetLock(), false);		// read lock
 	if (dwMinNumThreads > 0)
 		return dwMinNumThreads;
-	if (FutureMsgQueue.empty() && MsgQueue.empty())			// if nothing to service, it's okay to return 0
+	if (FutureMsgQueue.empty() && (GetMsgQueueCount() == 0))	// if nothing to service, it's okay to return 0
 		return dwMinNumThreads;
 	return 1;
 }
@@ -1205,38 +1275,27 @@ void CThreadPool<MsgT>::TransferFutureQueue(bool bFlush)		// if bFlush == true,
 {
 	FILETIME ftNow;
 	GetSystemTimeAsFileTime(&ftNow);
-	typename CThreadPool<MsgT>::CMsgEntry DueMsg;
-	bool bFoundDueMsg;
-	for (;;)
+	ULONGLONG ullNow = FTtoULarge(ftNow).QuadPart;
+	bool bFoundDueMsg = false;
 	{
+		CRWLockAcquire lockPool(&Pool.GetLock(), false);		// always lock pool first, then msg if you need both locked
+		CRWLockAcquire lockMsg(&MsgQueue.GetLock(), true);		// write lock
+		// FutureMsgQueue is sorted by due time, so stop at the first one that isn't due
+		while (!FutureMsgQueue.empty() && (bFlush || (FutureMsgQueue.begin()->first <= ullNow)))
 		{
-			CRWLockAcquire lock(&MsgQueue.GetLock(), false);		// read lock
-			bFoundDueMsg = false;
-			for (typename CSharedQueue<typename CThreadPool<MsgT>::CMsgEntry>::iterator itFuture = FutureMsgQueue.begin(); itFuture != FutureMsgQueue.end(); ++itFuture)
-			{
-				if (bFlush || (ftNow >= itFuture->Control.ftDueTime))
-				{
-					DueMsg = *itFuture;
-					bFoundDueMsg = true;
-				}
-			}
-		}
-		if (!bFoundDueMsg)
-			break;
-		SendMessageToPool(DueMsg.Control.uLineNo, DueMsg.Payload, 0, DueMsg.Control.uPriority, nullptr, DueMsg.Control.uGrouping);
-		// now remove it from the FutureMsgQueue
-		{
-			CRWLockAcquire lock(&MsgQueue.GetLock(), true);		// write lock
-			for (typename CSharedQueue<typename CThreadPool<MsgT>::CMsgEntry>::iterator itFuture = FutureMsgQueue.begin(); itFuture != FutureMsgQueue.end(); ++itFuture)
-			{
-				if (DueMsg.Control.ullUniqueID == itFuture->Control.ullUniqueID)
-				{
-					FutureMsgQueue.erase(itFuture);
-					break;
-				}
-			}
+			std::list<CMsgEntry> DueEntry(1, FutureMsgQueue.begin()->second);
+			FutureMsgQueue.erase(FutureMsgQueue.begin());
+			ZeroFT(DueEntry.front().Control.ftDueTime);
+			SpliceMsgEntry(DueEntry, DueEntry.begin(), false);
+			bFoundDueMsg = true;
 		}
 	}
+	if (bFoundDueMsg)
+	{
+		UpdatePerf(__LINE__, nullptr, nullptr, 0, 0, 0);
+		if (!bDisable)
+			AddThreads();
+	}
 }
 
 template <class MsgT>
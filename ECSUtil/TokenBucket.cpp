@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2017 - 2022, Dell Technologies, Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include "stdafx.h"
+
+#include "TokenBucket.h"
+
+namespace ecs_sdk
+{
+
+	CTokenBucket::CTokenBucket(LONGLONG llRateParam, DWORD dwBurst)
+		: llRate(0LL)
+		, llBurst(0LL)
+		, llPaidTime(0LL)
+		, bFairShare(false)
+		, llVirtualTime(0LL)
+		, ullSequence(0ULL)
+	{
+		SetRate(llRateParam, dwBurst);
+	}
+
+	void CTokenBucket::SetRate(LONGLONG llRateParam, DWORD dwBurst)
+	{
+		if (llRateParam < 0LL)
+			llRateParam = 0LL;
+		(void)InterlockedExchange64(&llBurst, (LONGLONG)dwBurst * 1000LL);
+		// if it wasn't limited before, start with a full bucket
+		if (InterlockedExchange64(&llRate, llRateParam) == 0LL)
+			(void)InterlockedExchange64(&llPaidTime, 0LL);
+	}
+
+	LONGLONG CTokenBucket::Charge(DWORD dwBytes, LONGLONG llNow)
+	{
+		LONGLONG llRateNow = llRate;
+		if (llRateNow <= 0LL)
+			return 0LL;
+		LONGLONG llCost = ((LONGLONG)dwBytes * 1000000LL) / llRateNow;
+		LONGLONG llBurstNow = llBurst;
+		for (;;)
+		{
+			LONGLONG llOld = llPaidTime;
+			// an idle bucket can only save up the burst
+			LONGLONG llNew = ((llOld > (llNow - llBurstNow)) ? llOld : (llNow - llBurstNow)) + llCost;
+			if (InterlockedCompareExchange64(&llPaidTime, llNew, llOld) == llOld)
+				return (llNew > llNow) ? (llNew - llNow) : 0LL;
+		}
+	}
+
+	void CTokenBucket::SetFairShare(bool bFairShareParam)
+	{
+		CSingleLock lock(&csFairQueue, true);
+		bFairShare = bFairShareParam;
+		// anyone already waiting is let through by the normal rules
+	}
+
+	// remove a waiter that is giving up. if it was the head, the next one takes over
+	void CTokenBucket::RemoveWaiter(const FAIR_KEY& Key)
+	{
+		CSingleLock lock(&csFairQueue, true);
+		bool bHead = !FairQueue.empty() && (FairQueue.begin()->first == Key);
+		(void)FairQueue.erase(Key);
+		if (bHead && !FairQueue.empty())
+			VERIFY(FairQueue.begin()->second->evHead.SetEvent());
+	}
+
+	bool CTokenBucket::Acquire(DWORD dwBytes, DWORD dwWeight, LONGLONG& llFlowFinish, THROTTLE_ABORT_CB AbortCB, void *pContext)
+	{
+		// no limit: nothing to wait for, so don't queue up behind the lock
+		if (!IfLimited())
+			return true;
+		// a thread waits in one queue at a time, so each thread keeps one waiter instead of creating an event per call
+		static thread_local FAIR_WAITER Waiter;
+		FAIR_KEY Key;
+		if (dwWeight == 0)
+			dwWeight = ThrottleWeightNormal;
+		{
+			CSingleLock lock(&csFairQueue, true);
+			// clear a signal left over from the last time this thread waited (under the lock, so none can be lost)
+			VERIFY(Waiter.evHead.ResetEvent());
+			Key.first = (llFlowFinish > llVirtualTime) ? llFlowFinish : llVirtualTime;
+			Key.second = ullSequence++;
+			llFlowFinish = Key.first + (((LONGLONG)dwBytes << 10) / (LONGLONG)dwWeight);
+			(void)FairQueue.insert(std::make_pair(Key, &Waiter));
+		}
+		for (;;)
+		{
+			DWORD dwSleep = MaxThrottleSleep;
+			{
+				CSingleLock lock(&csFairQueue, true);
+				if (FairQueue.begin()->first == Key)
+				{
+					LONGLONG llNow = GetTimeMicro();
+					LONGLONG llWait = llPaidTime - llNow;
+					if ((llWait <= 0LL) || !IfLimited() || !bFairShare)
+					{
+						// our turn
+						(void)Charge(dwBytes, llNow);
+						llVirtualTime = Key.first;
+						FairQueue.erase(FairQueue.begin());
+						if (!FairQueue.empty())
+							VERIFY(FairQueue.begin()->second->evHead.SetEvent());
+						return true;
+					}
+					if (llWait < ((LONGLONG)MaxThrottleSleep * 1000LL))
+						dwSleep = (DWORD)((llWait + 999LL) / 1000LL);
+				}
+			}
+			if ((AbortCB != nullptr) && AbortCB(pContext))
+			{
+				RemoveWaiter(Key);
+				return false;
+			}
+			(void)WaitForSingleObject(Waiter.evHead.m_hObject, dwSleep);
+		}
+	}
+
+	LONGLONG CTokenBucket::GetTimeMicro(void)
+	{
+		static LONGLONG llFrequency = 0LL;
+		LARGE_INTEGER liCounter;
+		if (llFrequency == 0LL)
+		{
+			LARGE_INTEGER liFrequency;
+			(void)QueryPerformanceFrequency(&liFrequency);
+			llFrequency = liFrequency.QuadPart;
+		}
+		(void)QueryPerformanceCounter(&liCounter);
+		return ((liCounter.QuadPart / llFrequency) * 1000000LL) + (((liCounter.QuadPart % llFrequency) * 1000000LL) / llFrequency);
+	}
+
+	void CThrottlePath::Add(const std::shared_ptr<CTokenBucket>& Bucket)
+	{
+		if (Bucket && Bucket->IfLimited())
+		{
+			BucketList.push_back(Bucket);
+			FinishList.push_back(0LL);
+		}
+	}
+
+	bool CThrottlePath::IfLimited(void) const
+	{
+		for (std::vector<std::shared_ptr<CTokenBucket>>::const_iterator itList = BucketList.begin(); itList != BucketList.end(); ++itList)
+		{
+			if ((*itList)->IfLimited())
+				return true;
+		}
+		return false;
+	}
+
+	bool CThrottlePath::Consume(DWORD dwBytes, THROTTLE_ABORT_CB AbortCB, void *pContext)
+	{
+		if (BucketList.empty() || (dwBytes == 0))
+			return true;
+		// fair sharing buckets first. they let us through when it is our turn and charge at that point
+		for (UINT i = 0; i < BucketList.size(); i++)
+		{
+			if (BucketList[i]->IfFairShare())
+			{
+				if (!BucketList[i]->Acquire(dwBytes, dwWeight, FinishList[i], AbortCB, pContext))
+					return false;
+			}
+		}
+		LONGLONG llNow = CTokenBucket::GetTimeMicro();
+		LONGLONG llWait = 0LL;
+		for (std::vector<std::shared_ptr<CTokenBucket>>::const_iterator itList = BucketList.begin(); itList != BucketList.end(); ++itList)
+		{
+			if ((*itList)->IfFairShare())
+				continue;
+			LONGLONG llBucketWait = (*itList)->Charge(dwBytes, llNow);
+			if (llBucketWait > llWait)
+				llWait = llBucketWait;
+		}
+		const LONGLONG llDeadline = llNow + llWait;
+		while (llWait > 0LL)
+		{
+			if ((AbortCB != nullptr) && AbortCB(pContext))
+				return false;
+			if (!IfLimited())
+				break;								// the throttle was turned off. go full speed
+			DWORD dwSleep = (DWORD)((llWait + 999LL) / 1000LL);
+			if (dwSleep > MaxThrottleSleep)
+				dwSleep = MaxThrottleSleep;
+			Sleep(dwSleep);
+			llWait = llDeadline - CTokenBucket::GetTimeMicro();
+		}
+		return true;
+	}
+
+} // end namespace ecs_sdk
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2017 - 2022, Dell Technologies, Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#pragma once
+
+#include <vector>
+#include <map>
+#include <memory>
+#include "exportdef.h"
+
+namespace ecs_sdk
+{
+
+	const DWORD DefaultThrottleBurst = 50;			// default burst (ms of the rate) an idle bucket can send at once
+	const DWORD MaxThrottleSleep = 100;				// longest sleep between abort checks while waiting for a bucket (ms)
+
+	// fair sharing weights. under a fair sharing bucket, a transfer gets bandwidth in proportion to its weight
+	const DWORD ThrottleWeightBackground = 1;		// bulk transfers, such as backups
+	const DWORD ThrottleWeightNormal = 4;			// default
+	const DWORD ThrottleWeightInteractive = 16;		// latency sensitive transfers, such as restores
+
+	typedef bool (*THROTTLE_ABORT_CB)(void *pContext);
+
+	// CTokenBucket
+	// bandwidth limit for one level (process, host, bucket or transfer)
+	// instead of a token count that is refilled by a timer, the bucket keeps the time at which all the bytes
+	// charged so far will have been paid for (at the current rate). charging bytes moves that time forward with a
+	// compare-and-swap, so there is no lock and no refill thread, and the caller knows exactly how long it has
+	// to wait. an idle bucket saves up at most the burst
+	// all times are in microseconds
+	//
+	// fair sharing (optional): charging is first come, first served, so a transfer that sends big buffers back to back
+	// gets most of the bandwidth. with fair sharing on, senders queue up and are let through one at a time whenever
+	// the bucket is paid up, in start-time fair queuing order: each transfer (flow) tags its charges with a virtual
+	// time that advances by bytes/weight, and the lowest tag goes first. a new or idle flow starts at the current
+	// virtual time, so a small request only waits behind the charges that are already queued, not behind the whole
+	// backlog of a big transfer. only the head of the queue waits for the bucket; the others wait on their thread's
+	// event until the head before them signals it
+	class ECSUTIL_EXT_CLASS CTokenBucket
+	{
+	private:
+		struct FAIR_WAITER
+		{
+			CEvent evHead;						// set when this waiter becomes the head of the queue
+		};
+		typedef std::pair<LONGLONG, ULONGLONG> FAIR_KEY;	// start tag, arrival sequence
+
+		volatile LONGLONG llRate;				// bytes/sec (0 = no limit)
+		volatile LONGLONG llBurst;				// how much an idle bucket saves up (us)
+		volatile LONGLONG llPaidTime;			// time at which everything charged so far is paid for (us)
+		// fair sharing
+		volatile bool bFairShare;				// use Acquire instead of Charge
+		LONGLONG llVirtualTime;					// start tag of the last waiter let through
+		ULONGLONG ullSequence;					// breaks ties between equal tags
+		std::map<FAIR_KEY, FAIR_WAITER *> FairQueue;	// waiting senders, in the order they will be let through
+		CCriticalSection csFairQueue;			// critical section protecting the fair sharing fields
+
+		void RemoveWaiter(const FAIR_KEY& Key);
+
+		CTokenBucket(const CTokenBucket&);					// no implementation
+		CTokenBucket& operator = (const CTokenBucket&);		// no implementation
+
+	public:
+		CTokenBucket(LONGLONG llRateParam = 0LL, DWORD dwBurst = DefaultThrottleBurst);
+
+		// change the rate. transfers already using the bucket pick up the new rate with their next charge
+		void SetRate(LONGLONG llRateParam, DWORD dwBurst = DefaultThrottleBurst);
+		LONGLONG GetRate(void) const
+		{
+			return llRate;
+		}
+		bool IfLimited(void) const
+		{
+			return llRate > 0LL;
+		}
+		// charge dwBytes at time llNow
+		// returns how long the caller has to wait before sending any more (us). 0 = no wait
+		LONGLONG Charge(DWORD dwBytes, LONGLONG llNow);
+
+		void SetFairShare(bool bFairShareParam);
+		bool IfFairShare(void) const
+		{
+			return bFairShare;
+		}
+		// fair sharing: wait for this flow's turn and for the bucket to be paid up, then charge dwBytes
+		// llFlowFinish is the flow's virtual finish tag for this bucket (start at 0)
+		// returns false if AbortCB returned true
+		bool Acquire(DWORD dwBytes, DWORD dwWeight, LONGLONG& llFlowFinish, THROTTLE_ABORT_CB AbortCB, void *pContext);
+
+		// current time (us) from the performance counter
+		static LONGLONG GetTimeMicro(void);
+	};
+
+	// CThrottlePath
+	// the buckets one transfer direction is charged to (for instance process, host, bucket and transfer)
+	// bytes are charged to every bucket in the path, and the caller waits for the slowest one
+	// the path is also the flow for fair sharing buckets
+	class ECSUTIL_EXT_CLASS CThrottlePath
+	{
+	private:
+		std::vector<std::shared_ptr<CTokenBucket>> BucketList;
+		std::vector<LONGLONG> FinishList;		// fair sharing finish tag for each bucket in BucketList
+		DWORD dwWeight;							// fair sharing weight
+
+	public:
+		CThrottlePath()
+			: dwWeight(ThrottleWeightNormal)
+		{}
+		void Clear(void)
+		{
+			BucketList.clear();
+			FinishList.clear();
+		}
+		void SetWeight(DWORD dwWeightParam)
+		{
+			dwWeight = (dwWeightParam == 0) ? ThrottleWeightNormal : dwWeightParam;
+		}
+		// only buckets that are limiting are added
+		void Add(const std::shared_ptr<CTokenBucket>& Bucket);
+		bool IfEmpty(void) const
+		{
+			return BucketList.empty();
+		}
+		// true if any bucket in the path still has a limit (it may have been removed during the transfer)
+		bool IfLimited(void) const;
+		// charge dwBytes to all the buckets, then sleep until the slowest one is paid up
+		// AbortCB is called between sleeps. returns false if it returned true
+		bool Consume(DWORD dwBytes, THROTTLE_ABORT_CB AbortCB = nullptr, void *pContext = nullptr);
+	};
+
+} // end namespace ecs_sdk
@@ -30,13 +30,199 @@ namespace ecs_sdk
 
 
 	HANDLE CBuffer::hBufferHeap = nullptr;
+	volatile LONGLONG CBuffer::llBytesCopied = 0LL;
+
+	// CountBytesCopied
+	// keep track of how much data is copied from one buffer to another
+	static inline void CountBytesCopied(DWORD nLen)
+	{
+		(void)InterlockedExchangeAdd64(&CBuffer::llBytesCopied, (LONGLONG)nLen);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// buffer pool
+	// buffers up to 1MB (including the CBufferData header) are allocated in power of 2 size classes
+	// freed buffers go to a small per-thread cache first, then to a lock-free (SLIST) global list for the size class
+	// only when both are full, or the pool holds BUFFER_POOL_TOTAL_MAX_BYTES, is the memory returned to the heap
+	// TrimBufferPool (garbage collect thread) frees the global entries that weren't needed since the last trim
+	// CBufferData::m_dummy holds the size class + 1 for pooled buffers, 0 for buffers allocated directly from the heap
+	//////////////////////////////////////////////////////////////////////////////
+
+	const DWORD BUFFER_POOL_MIN_SHIFT = 8;							// smallest class: 256 bytes
+	const DWORD BUFFER_POOL_MAX_SHIFT = 20;							// largest class: 1MB
+	const DWORD BUFFER_POOL_CLASSES = BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1;
+	const SIZE_T BUFFER_POOL_GLOBAL_MAX_BYTES = 8 * 1024 * 1024;	// max bytes held in the global list for each class
+	const SIZE_T BUFFER_POOL_GLOBAL_MIN_COUNT = 4;					// but always allow at least this many
+	const SIZE_T BUFFER_POOL_THREAD_MAX_BYTES = 64 * 1024;			// max bytes held in each thread cache for each class (larger classes aren't cached)
+	const LONGLONG BUFFER_POOL_TOTAL_MAX_BYTES = 32 * 1024 * 1024;	// max bytes held in the whole pool
+
+	// a zero initialized SLIST_HEADER is an empty list
+	static SLIST_HEADER BufferPool[BUFFER_POOL_CLASSES];
+	static volatile LONG lPoolLowWater[BUFFER_POOL_CLASSES];		// lowest depth of each global list since the last trim
+	static bool bPoolEnabled = true;								// see EnableBufferPool
+
+	// statistics
+	static volatile LONGLONG llPoolHits = 0LL;						// allocations satisfied from the pool
+	static volatile LONGLONG llPoolMisses = 0LL;					// pool allocations that had to go to the heap
+	static volatile LONGLONG llPoolLarge = 0LL;						// allocations too big for the pool
+	static volatile LONGLONG llPoolBytesHeld = 0LL;					// bytes currently held in the pool (global + thread caches)
+
+	static inline SIZE_T BufferPoolClassSize(DWORD dwClass)
+	{
+		return (SIZE_T)1 << (dwClass + BUFFER_POOL_MIN_SHIFT);
+	}
+
+	// BufferPoolClass
+	// return the size class for an allocation of AllocLen bytes
+	// returns BUFFER_POOL_CLASSES if it is too big for the pool
+	static inline DWORD BufferPoolClass(SIZE_T AllocLen)
+	{
+		if (AllocLen <= BufferPoolClassSize(0))
+			return 0;
+		if (AllocLen > BufferPoolClassSize(BUFFER_POOL_CLASSES - 1))
+			return BUFFER_POOL_CLASSES;
+		unsigned long ulBit;
+		(void)_BitScanReverse(&ulBit, (DWORD)(AllocLen - 1));
+		return (DWORD)ulBit + 1 - BUFFER_POOL_MIN_SHIFT;
+	}
+
+	static inline USHORT BufferPoolGlobalMax(DWORD dwClass)
+	{
+		SIZE_T Count = BUFFER_POOL_GLOBAL_MAX_BYTES / BufferPoolClassSize(dwClass);
+		return (USHORT)__max(Count, BUFFER_POOL_GLOBAL_MIN_COUNT);
+	}
+
+	static inline DWORD BufferPoolThreadMax(DWORD dwClass)
+	{
+		return (DWORD)(BUFFER_POOL_THREAD_MAX_BYTES / BufferPoolClassSize(dwClass));
+	}
+
+	// BufferPoolRelease
+	// give a buffer back to the global list (or the heap if the list is full)
+	static void BufferPoolRelease(DWORD dwClass, PSLIST_ENTRY pEntry)
+	{
+		if (QueryDepthSList(&BufferPool[dwClass]) < BufferPoolGlobalMax(dwClass))
+		{
+			(void)InterlockedPushEntrySList(&BufferPool[dwClass], pEntry);
+			return;
+		}
+		(void)InterlockedExchangeAdd64(&llPoolBytesHeld, -(LONGLONG)BufferPoolClassSize(dwClass));
+		VERIFY(HeapFree(CBuffer::hBufferHeap, 0, pEntry));
+	}
+
+	// per-thread cache of free buffers
+	// the free buffers are linked through SLIST_ENTRY::Next, but only this thread touches them
+	// this has no constructor or destructor, so it is zero initialized and still usable after the thread's
+	// thread_local destructors have run (a static CBuffer freed during process exit). CBufferThreadCacheOwner
+	// empties it when the thread exits, and bClosed sends anything freed after that straight to the global lists
+	struct CBufferThreadCache
+	{
+		PSLIST_ENTRY pFree[BUFFER_POOL_CLASSES];
+		DWORD dwCount[BUFFER_POOL_CLASSES];
+		bool bOpen;							// CBufferThreadCacheOwner has been constructed for this thread
+		bool bClosed;						// CBufferThreadCacheOwner has been destroyed. don't cache anything
+	};
+	static thread_local CBufferThreadCache BufferThreadCache;
+
+	struct CBufferThreadCacheOwner
+	{
+		CBufferThreadCacheOwner()
+		{
+			BufferThreadCache.bOpen = true;
+		}
+		~CBufferThreadCacheOwner()
+		{
+			// thread is exiting. give everything back to the global lists
+			CBufferThreadCache& Cache = BufferThreadCache;
+			Cache.bClosed = true;
+			for (DWORD dwClass = 0; dwClass < BUFFER_POOL_CLASSES; dwClass++)
+			{
+				while (Cache.pFree[dwClass] != nullptr)
+				{
+					PSLIST_ENTRY pEntry = Cache.pFree[dwClass];
+					Cache.pFree[dwClass] = pEntry->Next;
+					BufferPoolRelease(dwClass, pEntry);
+				}
+				Cache.dwCount[dwClass] = 0;
+			}
+		}
+	};
+	static thread_local CBufferThreadCacheOwner BufferThreadCacheOwner;
+
+	// BufferPoolAlloc
+	// returns nullptr if there is nothing available in the pool
+	static void *BufferPoolAlloc(DWORD dwClass)
+	{
+		CBufferThreadCache& Cache = BufferThreadCache;
+		PSLIST_ENTRY pEntry = Cache.pFree[dwClass];
+		if (pEntry != nullptr)
+		{
+			Cache.pFree[dwClass] = pEntry->Next;
+			Cache.dwCount[dwClass]--;
+		}
+		else
+		{
+			pEntry = InterlockedPopEntrySList(&BufferPool[dwClass]);
+			// keep track of how far the list goes down, so the trim knows how many entries weren't needed
+			LONG lDepth = (LONG)QueryDepthSList(&BufferPool[dwClass]);
+			for (LONG lLow = lPoolLowWater[dwClass]; lDepth < lLow; lLow = lPoolLowWater[dwClass])
+			{
+				if (InterlockedCompareExchange(&lPoolLowWater[dwClass], lDepth, lLow) == lLow)
+					break;
+			}
+		}
+		if (pEntry == nullptr)
+		{
+			(void)InterlockedIncrement64(&llPoolMisses);
+			return nullptr;
+		}
+		(void)InterlockedIncrement64(&llPoolHits);
+		(void)InterlockedExchangeAdd64(&llPoolBytesHeld, -(LONGLONG)BufferPoolClassSize(dwClass));
+		return pEntry;
+	}
+
+	// BufferPoolFree
+	static void BufferPoolFree(DWORD dwClass, void *pBuf)
+	{
+		CBufferThreadCache& Cache = BufferThreadCache;
+		PSLIST_ENTRY pEntry = (PSLIST_ENTRY)pBuf;
+		LONGLONG llClassSize = (LONGLONG)BufferPoolClassSize(dwClass);
+		if ((InterlockedExchangeAdd64(&llPoolBytesHeld, llClassSize) + llClassSize) > BUFFER_POOL_TOTAL_MAX_BYTES)
+		{
+			(void)InterlockedExchangeAdd64(&llPoolBytesHeld, -llClassSize);
+			VERIFY(HeapFree(CBuffer::hBufferHeap, 0, pEntry));
+			return;
+		}
+		if (!Cache.bOpen && !Cache.bClosed)
+			(void)&BufferThreadCacheOwner;		// constructs it, so the cache is emptied when the thread exits
+		if (!Cache.bClosed && (Cache.dwCount[dwClass] < BufferPoolThreadMax(dwClass)))
+		{
+			pEntry->Next = Cache.pFree[dwClass];
+			Cache.pFree[dwClass] = pEntry;
+			Cache.dwCount[dwClass]++;
+			return;
+		}
+		BufferPoolRelease(dwClass, pEntry);
+	}
+
+	// FreeBuffer
+	// return the memory for a buffer to the pool or the heap
+	static void FreeBuffer(CBufferData *pInfo)
+	{
+		if ((pInfo->m_dummy != 0) && (pInfo->m_dummy <= BUFFER_POOL_CLASSES))
+			BufferPoolFree(pInfo->m_dummy - 1, pInfo);
+		else
+			VERIFY(HeapFree(CBuffer::hBufferHeap, 0, pInfo));
+	}
 
 	//
 	// CreateBuffer
 	// allocate and initialize a buffer
 	//
 	BYTE* CBuffer::CreateBuffer(
-		DWORD nNewSize)			// new size
+		DWORD nNewSize,			// new size
+		bool bZero,				// zero the memory
+		bool bExact)			// allocate exactly nNewSize (don't use the buffer pool)
 	{
 #ifdef SEPARATE_HEAPS
 		if (hBufferHeap == nullptr)
@@ -44,13 +230,35 @@ namespace ecs_sdk
 #endif
 		if (hBufferHeap == nullptr)
 			hBufferHeap = GetProcessHeap();
-		BYTE* pNewData = (BYTE*)HeapAlloc(hBufferHeap, HEAP_ZERO_MEMORY, nNewSize + sizeof(CBufferData));
+		SIZE_T AllocLen = nNewSize + sizeof(CBufferData);
+		DWORD dwClass = (bExact || !bPoolEnabled) ? BUFFER_POOL_CLASSES : BufferPoolClass(AllocLen);
+		BYTE* pNewData;
+		if (dwClass < BUFFER_POOL_CLASSES)
+		{
+			AllocLen = BufferPoolClassSize(dwClass);
+			pNewData = (BYTE*)BufferPoolAlloc(dwClass);
+			if (pNewData == nullptr)
+				pNewData = (BYTE*)HeapAlloc(hBufferHeap, 0, AllocLen);
+			// even if not zeroing, clear the unused part so growing it later gives zeros (same as HeapReAlloc)
+			if ((pNewData != nullptr) && bZero)
+				ZeroMemory(pNewData, AllocLen);
+			else if (pNewData != nullptr)
+				ZeroMemory(pNewData + sizeof(CBufferData) + nNewSize, AllocLen - sizeof(CBufferData) - nNewSize);
+		}
+		else
+		{
+			if (!bExact && bPoolEnabled)
+				(void)InterlockedIncrement64(&llPoolLarge);
+			pNewData = (BYTE*)HeapAlloc(hBufferHeap, bZero ? HEAP_ZERO_MEMORY : 0, AllocLen);
+		}
 		if (pNewData == nullptr)
 			AfxThrowMemoryException();
 		CBufferData* pNewInfo = (CBufferData*)pNewData;
 		pNewData += sizeof(CBufferData);
-		pNewInfo->m_nSize = pNewInfo->m_nAllocSize = nNewSize;
+		pNewInfo->m_nSize = nNewSize;
+		pNewInfo->m_nAllocSize = (DWORD)(AllocLen - sizeof(CBufferData));
 		pNewInfo->m_nRefs = 1;
+		pNewInfo->m_dummy = (dwClass < BUFFER_POOL_CLASSES) ? (dwClass + 1) : 0;
 		return pNewData;
 	}
 
@@ -63,7 +271,8 @@ namespace ecs_sdk
 	void CBuffer::Grow(
 		DWORD nNewSize,				// new size
 		bool bForce,		// allocate EXACTLY the specified amount
-		bool bEmpty)		// if true, deallocate everything
+		bool bEmpty,		// if true, deallocate everything
+		bool bZero)			// if false, newly allocated memory is not zeroed
 	{
 		// verify that the new size is valid
 		// if adding the header causes overflow, FORGET IT
@@ -80,15 +289,16 @@ namespace ecs_sdk
 				BYTE* pNewData;
 				if (!bEmpty)
 				{
-					pNewData = CreateBuffer(nNewSize);
+					pNewData = CreateBuffer(nNewSize, bZero);
 					memcpy(pNewData, m_pData, __min(pInfo->m_nSize, nNewSize));
+					CountBytesCopied(__min(pInfo->m_nSize, nNewSize));
 				}
 				else
 					pNewData = nullptr;
 				if (InterlockedDecrement(&pInfo->m_nRefs) <= 0)
 				{
 					// count has gone to zero, deallocate the buffer
-					VERIFY(HeapFree(hBufferHeap, 0, pInfo));
+					FreeBuffer(pInfo);
 				}
 				m_pData = pNewData;
 				return;
@@ -99,7 +309,7 @@ namespace ecs_sdk
 		{
 			if (m_pData != nullptr)
 			{
-				VERIFY(HeapFree(hBufferHeap, 0, pInfo));
+				FreeBuffer(pInfo);
 				m_pData = nullptr;
 			}
 			return;
@@ -110,7 +320,7 @@ namespace ecs_sdk
 		{
 			if (nNewSize == 0)
 				return;
-			m_pData = CreateBuffer(nNewSize);
+			m_pData = CreateBuffer(nNewSize, bZero, bForce);
 			return;
 		}
 		ASSERT(pInfo != nullptr);
@@ -125,20 +335,33 @@ namespace ecs_sdk
 		// the buffer must grow, allocate it and copy over any existing data
 		if (nNewSize == 0)
 			Empty();			// it can only get here if bForce is set
-		else
+		else if ((pInfo->m_dummy == 0) && (bForce || (BufferPoolClass(nNewSize + sizeof(CBufferData)) >= BUFFER_POOL_CLASSES)))
 		{
+			// heap buffer that stays out of the pool. let the heap grow it in place if it can
 #if defined(DEBUG) && !defined(BETA_BUILD)
 			if (HeapValidate(hBufferHeap, 0, nullptr) == 0)
 				DebugBreak();
 #endif
 			SIZE_T AllocLen = nNewSize + sizeof(CBufferData) + ALLOC_INCR_DEFAULT;
-			void* pTmp = HeapReAlloc(hBufferHeap, HEAP_ZERO_MEMORY, pInfo, AllocLen);
+			void* pTmp = HeapReAlloc(hBufferHeap, bZero ? HEAP_ZERO_MEMORY : 0, pInfo, AllocLen);
 			if (pTmp == nullptr)
 				AfxThrowMemoryException();
 			pInfo = (CBufferData*)pTmp;
 			pInfo->m_nSize = nNewSize;
 			pInfo->m_nAllocSize = nNewSize + ALLOC_INCR_DEFAULT;
 			m_pData = (BYTE*)(pInfo + 1);
+			if (!bZero)
+				ZeroMemory(m_pData + nNewSize, ALLOC_INCR_DEFAULT);
+		}
+		else
+		{
+			// pooled buffers can't be reallocated. get a new one and copy the data over
+			BYTE* pNewData = CreateBuffer(nNewSize, bZero, bForce);
+			DWORD nCopySize = __min(pInfo->m_nSize, nNewSize);
+			memcpy(pNewData, m_pData, nCopySize);
+			CountBytesCopied(nCopySize);
+			FreeBuffer(pInfo);
+			m_pData = pNewData;
 		}
 	}
 
@@ -179,6 +402,11 @@ namespace ecs_sdk
 		Grow(nNewSize);
 	}
 
+	void CBuffer::SetBufSizeNoInit(DWORD nNewSize)
+	{
+		Grow(nNewSize, false, false, false);
+	}
+
 	// Operations
 	// Clean up
 	void CBuffer::Empty()
@@ -217,6 +445,7 @@ namespace ecs_sdk
 		{
 			Grow(pSrcInfo->m_nSize);		// copy the data
 			memcpy(m_pData, b.m_pData, pSrcInfo->m_nSize);
+			CountBytesCopied(pSrcInfo->m_nSize);
 			return *this;
 		}
 		if (m_pData != b.m_pData)
@@ -228,6 +457,21 @@ namespace ecs_sdk
 		return *this;
 	};
 
+	//
+	// move assignment operator
+	// take over the data from another buffer. nothing is copied
+	//
+	CBuffer& CBuffer::operator =(
+		CBuffer&& b) noexcept         // take over the data from another CBuffer object (no copy)
+	{
+		if (&b == this)
+			return(*this);
+		Empty();
+		m_pData = b.m_pData;
+		b.m_pData = nullptr;
+		return *this;
+	}
+
 	//
 	// append operator
 	// append the contents of a buffer to the current buffer
@@ -243,6 +487,7 @@ namespace ecs_sdk
 			if (m_pData == nullptr)
 				AfxThrowMemoryException();
 			memcpy(&m_pData[OldSize], b.m_pData, b.GetBufSize());
+			CountBytesCopied(b.GetBufSize());
 		}
 		return(*this);
 	};
@@ -264,6 +509,7 @@ namespace ecs_sdk
 			if (m_pData == nullptr)
 				return;
 			memcpy(m_pData, b.m_pData, pSrcInfo->m_nSize);
+			CountBytesCopied(pSrcInfo->m_nSize);
 			return;
 		}
 		(void)InterlockedIncrement(&pSrcInfo->m_nRefs);
@@ -287,12 +533,19 @@ namespace ecs_sdk
 		const void* pSrc,				// pointer to data to copy into the buffer
 		DWORD nLen)					// number of bytes to copy
 	{
-		Grow(nLen);
+		// if the buffer is shared, don't bother copying the old data since it is all going to be overwritten
+		CBufferData* pInfo = GetInternalData();
+		if ((pInfo != nullptr) && (pInfo->m_nRefs > 1))
+			Empty();
+		Grow(nLen, false, false, false);
 		if (nLen > 0)
 		{
 			ASSERT(m_pData != nullptr);
 			if (m_pData != nullptr)
+			{
 				memcpy(m_pData, pSrc, nLen);
+				CountBytesCopied(nLen);
+			}
 		}
 	}
 
@@ -310,7 +563,10 @@ namespace ecs_sdk
 		{
 			ASSERT(m_pData != nullptr);
 			if (m_pData != nullptr)
+			{
 				memcpy(m_pData + nOrigSize, pSrc, nLen);
+				CountBytesCopied(nLen);
+			}
 		}
 	}
 
@@ -334,6 +590,69 @@ namespace ecs_sdk
 		return iDiff;
 	}
 
+	//
+	// TrimBufferPool
+	// give memory held by the buffer pool back to the heap
+	// normally called periodically (garbage collect thread): the entries of each global list that weren't
+	// needed since the last call are freed, so an idle pool drains. if bAll, the global lists are emptied
+	// the thread caches are small (BUFFER_POOL_THREAD_MAX_BYTES per class) and are emptied when their thread exits
+	//
+	void CBuffer::TrimBufferPool(bool bAll)
+	{
+		for (DWORD dwClass = 0; dwClass < BUFFER_POOL_CLASSES; dwClass++)
+		{
+			LONG lDepth = (LONG)QueryDepthSList(&BufferPool[dwClass]);
+			LONG lIdle = InterlockedExchange(&lPoolLowWater[dwClass], lDepth);
+			LONG lFree = bAll ? lDepth : __min(lIdle, lDepth);
+			for (LONG i = 0; i < lFree; i++)
+			{
+				PSLIST_ENTRY pEntry = InterlockedPopEntrySList(&BufferPool[dwClass]);
+				if (pEntry == nullptr)
+					break;
+				(void)InterlockedExchangeAdd64(&llPoolBytesHeld, -(LONGLONG)BufferPoolClassSize(dwClass));
+				VERIFY(HeapFree(hBufferHeap, 0, pEntry));
+			}
+		}
+	}
+
+	//
+	// EnableBufferPool
+	// turn the buffer pool on or off (on by default). when off, every buffer is allocated from the heap
+	// set this before any buffers are allocated. buffers already in the pool stay there until trimmed
+	//
+	void CBuffer::EnableBufferPool(bool bEnable)
+	{
+		bPoolEnabled = bEnable;
+	}
+
+	//
+	// DumpBuffers
+	// report buffer statistics
+	// if pDumpMsg is nullptr, send it to the debug output
+	//
+	void CBuffer::DumpBuffers(CString* pDumpMsg)
+	{
+		CString sMsg, sLine;
+		sMsg.Format(_T("CBuffer: bytes copied: %I64u\r\n"), GetBytesCopied());
+		sLine.Format(_T("CBuffer pool: hits: %I64d, misses: %I64d, too large: %I64d, bytes held: %I64d\r\n"),
+			InterlockedAdd64(&llPoolHits, 0LL), InterlockedAdd64(&llPoolMisses, 0LL),
+			InterlockedAdd64(&llPoolLarge, 0LL), InterlockedAdd64(&llPoolBytesHeld, 0LL));
+		sMsg += sLine;
+		for (DWORD dwClass = 0; dwClass < BUFFER_POOL_CLASSES; dwClass++)
+		{
+			USHORT uDepth = QueryDepthSList(&BufferPool[dwClass]);
+			if (uDepth != 0)
+			{
+				sLine.Format(_T("  class %Iu: %u free\r\n"), BufferPoolClassSize(dwClass), (UINT)uDepth);
+				sMsg += sLine;
+			}
+		}
+		if (pDumpMsg != nullptr)
+			*pDumpMsg += sMsg;
+		else
+			OutputDebugString(sMsg);
+	}
+
 	void CBuffer::LoadBase64(LPCTSTR pszBase64Input)
 	{
 		CAnsiString AnsiData;
@@ -36,7 +36,7 @@ namespace ecs_sdk
 		DWORD m_nSize;			// # of elements (upperBound - 1)
 		DWORD m_nAllocSize;	// number of bytes allocated
 		long m_nRefs;			// number of current references to this buffer
-		DWORD m_dummy;			// for 64bit alignment
+		DWORD m_dummy;			// for 64bit alignment. also holds the pool size class + 1 (0 if allocated directly from the heap)
 
 		CBufferData()			// this constructor is more for illustration, it will never have a chance to run
 		{
@@ -55,6 +55,7 @@ namespace ecs_sdk
 		BYTE* m_pData;			// the actual array of data
 	public:
 		static HANDLE hBufferHeap;
+		static volatile LONGLONG llBytesCopied;		// total bytes copied by memcpy between buffers (statistics)
 
 	private:
 		//
@@ -74,7 +75,9 @@ namespace ecs_sdk
 		// allocate and initialize a buffer
 		//
 		BYTE* CreateBuffer(
-			DWORD nNewSize);			// new size
+			DWORD nNewSize,				// new size
+			bool bZero = true,			// zero the memory
+			bool bExact = false);		// allocate exactly nNewSize (don't use the buffer pool)
 
 		//
 		// Grow
@@ -85,7 +88,8 @@ namespace ecs_sdk
 		void Grow(
 			DWORD nNewSize,				// new size
 			bool bForce = false,		// allocate EXACTLY the specified amount
-			bool bEmpty = false);		// if true, deallocate everything
+			bool bEmpty = false,		// if true, deallocate everything
+			bool bZero = true);			// if false, newly allocated memory is not zeroed
 
 	public:
 
@@ -131,6 +135,10 @@ namespace ecs_sdk
 			return pInfo->m_nSize == 0;
 		}
 		void SetBufSize(DWORD nNewSize);
+		// SetBufSizeNoInit
+		// same as SetBufSize, but any newly allocated memory is not zeroed
+		// use when the data will be overwritten right away
+		void SetBufSizeNoInit(DWORD nNewSize);
 		void Empty();
 
 		// Accessing elements
@@ -167,6 +175,14 @@ namespace ecs_sdk
 			const CBuffer& b);            // duplicate a CBuffer object
 		CBuffer(
 			const CBuffer& b);            // duplicate a CBuffer object
+		CBuffer(
+			CBuffer&& b) noexcept         // take over the data from another CBuffer object (no copy)
+		{
+			m_pData = b.m_pData;
+			b.m_pData = nullptr;
+		}
+		CBuffer& operator =(
+			CBuffer&& b) noexcept;        // take over the data from another CBuffer object (no copy)
 		void FreeExtra(void);
 		void Load(
 			const void* pSrc,				// pointer to data to copy into the buffer
@@ -206,6 +222,12 @@ namespace ecs_sdk
 			return Compare(Buf) >= 0;
 		}
 		static void DumpBuffers(CString* pDumpMsg = nullptr);
+		static void TrimBufferPool(bool bAll = false);
+		static void EnableBufferPool(bool bEnable);
+		static ULONGLONG GetBytesCopied(void)
+		{
+			return (ULONGLONG)InterlockedAdd64(&llBytesCopied, 0LL);
+		}
 		void LoadBase64(LPCTSTR pszBase64Input);
 		CString EncodeBase64(void) const;
 	};
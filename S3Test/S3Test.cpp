@@ -20,8 +20,15 @@
 #include <afxsock.h>
 #include <list>
 #include <deque>
+#include <vector>
+#include <algorithm>
+#include <queue>
+#include <functional>
+#include <cmath>
 #include "S3Test.h"
 #include "ECSGlobal.h"
+#include "S3V4Canonical.h"
+#include "CngAES_GCM.h"
 
 #ifdef _DEBUG
 #define new DEBUG_NEW
@@ -51,12 +58,25 @@ _T("   /delete <ECSpath>                   Delete ECS object\n")
 _T("   /read <localfile> <ECSpath>         Read ECS object into file\n")
 _T("   /write <localfile> <ECSpath>        Write ECS object from file\n")
 _T("   /mpu                                Used with /write to use multi-part update\n")
+_T("   /adaptive                           Used with /mpu to adjust the number of parts in flight (up to 16)\n")
 _T("   /readmeta <ECSpath>                 Read all metadata from object\n")
 _T("   /cert                               Display certificate even if connect successful\n")
 _T("   /setcert                            Prompt user to install certificate\n")
 _T("   /dtquery <namespace> <bucket> <object> DT Query for object\n")
 _T("   /createbucket <bucket>              Create ECS bucket\n")
 _T("   /retention <seconds>                Used with /createbucket to set bucket-level retention\n")
+_T("   /signbench <count>                  Time <count> V4 signatures (no endpoint needed)\n")
+_T("   /crcbench                           Check combining CRCs of large parts, compare MD5 and CRC throughput (no endpoint needed)\n")
+_T("   /retrysim <clients> <capacity>     Simulate retries against a server that takes <capacity> requests/sec (no endpoint needed)\n")
+_T("   /throttlebench <rate> <seconds>     Check the accuracy, smoothness and fairness of a <rate> bytes/sec throttle (no endpoint needed)\n")
+_T("   /queuebench <count>                 Compare list and ring queue contention with 1 to 64 threads, <count> push/pop pairs each (no endpoint needed)\n")
+_T("   /bufbench <count>                   Time CBuffer Load/Append/Grow with the buffer pool off and on, <count> rounds per thread (no endpoint needed)\n")
+_T("   /poolbench <depth>                  Time thread pool queueing and dispatch with 100 up to <depth> queued messages (no endpoint needed)\n")
+_T("   /copybench <MB>                     Count the bytes copied per byte moved through the upload and download stream queues (no endpoint needed)\n")
+_T("   /breakertest                        Check the circuit breaker opens, probes and closes, using a local server and an unreachable IP (no endpoint needed)\n")
+_T("   /hedge <percentile>                 Hedge GET/HEAD to another node after <percentile> of the recent latency\n")
+_T("   /latency <count> <ECSpath>          Read metadata <count> times and show the latency distribution\n")
+_T("   /readparallel <threads> <localfile> <ECSpath>  Time reading an object into a file with 1 up to <threads> range reads at once\n")
 _T("   /ignoresslerror <error>             Ignore specified error. Options are:\n")
 _T("                                          SECURITY_FLAG_IGNORE_UNKNOWN_CA\n")
 _T("                                          SECURITY_FLAG_IGNORE_CERT_DATE_INVALID\n")
@@ -82,6 +102,7 @@ const TCHAR * const CMD_OPTION_DELETE = _T("/delete");
 const TCHAR * const CMD_OPTION_READ = _T("/read");
 const TCHAR * const CMD_OPTION_WRITE = _T("/write");
 const TCHAR * const CMD_OPTION_MPU = _T("/mpu");
+const TCHAR * const CMD_OPTION_ADAPTIVE = _T("/adaptive");
 const TCHAR * const CMD_OPTION_READMETA = _T("/readmeta");
 const TCHAR * const CMD_OPTION_CERT = _T("/cert");
 const TCHAR * const CMD_OPTION_SETCERT = _T("/setcert");
@@ -92,6 +113,18 @@ const TCHAR * const CMD_OPTION_HELP1 = _T("--help");
 const TCHAR * const CMD_OPTION_HELP2 = _T("-h");
 const TCHAR * const CMD_OPTION_HELP3 = _T("/?");
 const TCHAR * const CMD_OPTION_IGNORE_SSL_ERROR = _T("/ignoresslerror");
+const TCHAR * const CMD_OPTION_SIGNBENCH = _T("/signbench");
+const TCHAR * const CMD_OPTION_CRCBENCH = _T("/crcbench");
+const TCHAR * const CMD_OPTION_RETRYSIM = _T("/retrysim");
+const TCHAR * const CMD_OPTION_THROTTLEBENCH = _T("/throttlebench");
+const TCHAR * const CMD_OPTION_QUEUEBENCH = _T("/queuebench");
+const TCHAR * const CMD_OPTION_BUFBENCH = _T("/bufbench");
+const TCHAR * const CMD_OPTION_POOLBENCH = _T("/poolbench");
+const TCHAR * const CMD_OPTION_COPYBENCH = _T("/copybench");
+const TCHAR * const CMD_OPTION_BREAKERTEST = _T("/breakertest");
+const TCHAR * const CMD_OPTION_HEDGE = _T("/hedge");
+const TCHAR * const CMD_OPTION_LATENCY = _T("/latency");
+const TCHAR * const CMD_OPTION_READPARALLEL = _T("/readparallel");
 
 WSADATA WsaData;
 
@@ -121,10 +154,28 @@ bool bHttps = true;
 bool bCert = false;
 bool bSetCert = false;
 bool bMPU = false;
+bool bMPUAdaptive = false;
 bool bListBuckets = false;
 bool bV4 = false;
 INTERNET_PORT wPort = 9021;
 DWORD dwRetention = 0;					// retention in seconds
+DWORD dwSignBench = 0;					// number of signatures to time
+bool bCrcBench = false;				// check CRC combining
+DWORD dwRetrySimClients = 0;			// number of clients to simulate
+DWORD dwRetrySimCapacity = 0;			// simulated server capacity (requests/sec)
+DWORD dwThrottleBenchRate = 0;			// throttle benchmark rate (bytes/sec)
+DWORD dwThrottleBenchSeconds = 0;		// throttle benchmark run time
+DWORD dwQueueBench = 0;				// queue benchmark push/pop pairs per thread
+DWORD dwBufBench = 0;				// buffer benchmark rounds per thread
+DWORD dwPoolBench = 0;				// pool benchmark maximum queue depth
+DWORD dwCopyBench = 0;				// copy benchmark megabytes per run
+bool bBreakerTest = false;			// check the circuit breaker states
+UINT uHedgePercentile = 0;				// hedge GET/HEAD requests (0 = off)
+DWORD dwLatencyCount = 0;				// number of ReadProperties to time
+CString sLatencyECSPath;
+DWORD dwReadParallelThreads = 0;		// parallel read benchmark maximum threads
+CString sReadParallelLocalPath;
+CString sReadParallelECSPath;
 
 bool bShuttingDown = false;
 
@@ -371,6 +422,10 @@ static bool ParseArguments(const std::list<CString>& CmdArgs, CString& sOutMessa
 		{
 			bMPU = true;
 		}
+		else if (itParam->CompareNoCase(CMD_OPTION_ADAPTIVE) == 0)
+		{
+			bMPUAdaptive = true;
+		}
 		else if (itParam->CompareNoCase(CMD_OPTION_LISTBUCKETS) == 0)
 		{
 			bListBuckets = true;
@@ -429,6 +484,149 @@ static bool ParseArguments(const std::list<CString>& CmdArgs, CString& sOutMessa
 			}
 			dwRetention = _wtol(*itParam);
 		}
+		else if (itParam->CompareNoCase(CMD_OPTION_SIGNBENCH) == 0)
+		{
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			dwSignBench = _wtol(*itParam);
+		}
+		else if (itParam->CompareNoCase(CMD_OPTION_CRCBENCH) == 0)
+		{
+			bCrcBench = true;
+		}
+		else if (itParam->CompareNoCase(CMD_OPTION_RETRYSIM) == 0)
+		{
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			dwRetrySimClients = _wtol(*itParam);
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			dwRetrySimCapacity = _wtol(*itParam);
+		}
+		else if (itParam->CompareNoCase(CMD_OPTION_THROTTLEBENCH) == 0)
+		{
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			dwThrottleBenchRate = _wtol(*itParam);
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			dwThrottleBenchSeconds = _wtol(*itParam);
+		}
+		else if (itParam->CompareNoCase(CMD_OPTION_QUEUEBENCH) == 0)
+		{
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			dwQueueBench = _wtol(*itParam);
+		}
+		else if (itParam->CompareNoCase(CMD_OPTION_BUFBENCH) == 0)
+		{
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			dwBufBench = _wtol(*itParam);
+		}
+		else if (itParam->CompareNoCase(CMD_OPTION_POOLBENCH) == 0)
+		{
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			dwPoolBench = _wtol(*itParam);
+		}
+		else if (itParam->CompareNoCase(CMD_OPTION_COPYBENCH) == 0)
+		{
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			dwCopyBench = _wtol(*itParam);
+		}
+		else if (itParam->CompareNoCase(CMD_OPTION_BREAKERTEST) == 0)
+		{
+			bBreakerTest = true;
+		}
+		else if (itParam->CompareNoCase(CMD_OPTION_HEDGE) == 0)
+		{
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			uHedgePercentile = _wtol(*itParam);
+		}
+		else if (itParam->CompareNoCase(CMD_OPTION_LATENCY) == 0)
+		{
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			dwLatencyCount = _wtol(*itParam);
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			sLatencyECSPath = *itParam;
+		}
+		else if (itParam->CompareNoCase(CMD_OPTION_READPARALLEL) == 0)
+		{
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			dwReadParallelThreads = _wtol(*itParam);
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			sReadParallelLocalPath = *itParam;
+			++itParam;
+			if (itParam == CmdArgs.end())
+			{
+				sOutMessage = USAGE;
+				return false;
+			}
+			sReadParallelECSPath = *itParam;
+		}
 		else if (itParam->CompareNoCase(CMD_OPTION_IGNORE_SSL_ERROR) == 0)
 		{
 			++itParam;
@@ -519,8 +717,10 @@ struct PROGRESS_CONTEXT
 {
 	CString sTitle;
 	ULONGLONG ullOffset;
+	const S3_MPU_CONCURRENCY *pConcurrency;		// if adaptive MPU, show the parts in flight
 	PROGRESS_CONTEXT()
 		: ullOffset(0ULL)
+		, pConcurrency(nullptr)
 	{}
 };
 
@@ -528,7 +728,1011 @@ static void ProgressCallBack(int iProgress, void *pContext)
 {
 	PROGRESS_CONTEXT *pProg = (PROGRESS_CONTEXT *)pContext;
 	pProg->ullOffset += iProgress;
-	_tprintf(L"%s: %20s\r", (LPCTSTR)pProg->sTitle, (LPCTSTR)FmtNum(pProg->ullOffset, 0, false, false, true));
+	if (pProg->pConcurrency != nullptr)
+		_tprintf(L"%s: %20s  parts in flight: %-3d\r", (LPCTSTR)pProg->sTitle, (LPCTSTR)FmtNum(pProg->ullOffset, 0, false, false, true), pProg->pConcurrency->lConcurrency);
+	else
+		_tprintf(L"%s: %20s\r", (LPCTSTR)pProg->sTitle, (LPCTSTR)FmtNum(pProg->ullOffset, 0, false, false, true));
+}
+
+// SignBenchmark
+// time the V4 canonical request and signature for a typical small object GET
+// the first signature is not timed so the scratch buffers are already sized
+static int SignBenchmark(DWORD dwCount, CString& sOutMessage)
+{
+	CS3V4Canonical V4Canonical;
+	std::map<CString, CECSConnection::HEADER_STRUCT> Headers;
+	Headers[_T("host")] = CECSConnection::HEADER_STRUCT(_T("host"), _T("object.ecstestdrive.com"));
+	Headers[_T("user-agent")] = CECSConnection::HEADER_STRUCT(_T("user-agent"), _T("TestApp/1.0"));
+	Headers[_T("x-amz-content-sha256")] = CECSConnection::HEADER_STRUCT(_T("x-amz-content-sha256"), _T("UNSIGNED-PAYLOAD"));
+	Headers[_T("x-amz-date")] = CECSConnection::HEADER_STRUCT(_T("x-amz-date"), _T("20220101T000000Z"));
+	Headers[_T("x-amz-meta-project")] = CECSConnection::HEADER_STRUCT(_T("x-amz-meta-project"), _T("signing  benchmark"));
+	BYTE SigningKey[32];
+	for (UINT i = 0; i < _countof(SigningKey); i++)
+		SigningKey[i] = (BYTE)i;
+	SYSTEMTIME stRequestTime;
+	GetSystemTime(&stRequestTime);
+	LPCTSTR pszResource = _T("/bucket/dir1/dir 2/object%20name.txt?versionId=1234&acl&prefix=dir1/");
+	LARGE_INTEGER liFreq, liStart, liEnd;
+	try
+	{
+		V4Canonical.Sign(_T("GET"), pszResource, Headers, "UNSIGNED-PAYLOAD", stRequestTime, _T("us-east-1"), SigningKey, _countof(SigningKey));
+		(void)QueryPerformanceFrequency(&liFreq);
+		(void)QueryPerformanceCounter(&liStart);
+		for (DWORD i = 0; i < dwCount; i++)
+			V4Canonical.Sign(_T("GET"), pszResource, Headers, "UNSIGNED-PAYLOAD", stRequestTime, _T("us-east-1"), SigningKey, _countof(SigningKey));
+		(void)QueryPerformanceCounter(&liEnd);
+	}
+	catch (const CErrorInfo& E)
+	{
+		sOutMessage = _T("Sign error: ") + GetNTErrorText(E.dwError);
+		return 1;
+	}
+	double dSeconds = (double)(liEnd.QuadPart - liStart.QuadPart) / (double)liFreq.QuadPart;
+	_tprintf(_T("Canonical request:\n%S\n\nSignature: %S\n\n"), V4Canonical.GetCanonicalRequest(), V4Canonical.GetSignature());
+	_tprintf(_T("%u signatures in %.3f seconds: %.0f signatures/sec, %.2f usec each\n"),
+		dwCount, dSeconds, (dSeconds > 0.0) ? ((double)dwCount / dSeconds) : 0.0, (dwCount != 0) ? ((dSeconds * 1000000.0) / (double)dwCount) : 0.0);
+	return 0;
+}
+
+// the retry behavior before CRetryPolicy: a fixed pause and no budget
+class CFixedRetryPolicy : public CRetryPolicy
+{
+private:
+	UINT uMaxRetries;
+	DWORD dwPause;
+	RETRY_STATS Stats;
+
+public:
+	CFixedRetryPolicy(UINT uMaxRetriesParam, DWORD dwPauseParam)
+		: uMaxRetries(uMaxRetriesParam)
+		, dwPause(dwPauseParam)
+	{}
+	void RequestStart(void)
+	{
+		Stats.ullRequests++;
+	}
+	bool IfRetry(E_RETRY_CLASS RetryClass, UINT uTry, DWORD& dwDelay, bool bFailover = false)
+	{
+		(void)bFailover;
+		dwDelay = dwPause;
+		if (uTry >= uMaxRetries)
+		{
+			Stats.ullRetryLimit++;
+			return false;
+		}
+		Stats.ullRetries[(int)RetryClass]++;
+		Stats.ullDelayMs += dwDelay;
+		return true;
+	}
+	void GetStats(RETRY_STATS& StatsParam) const
+	{
+		StatsParam = Stats;
+	}
+};
+
+struct RETRY_SIM_EVENT
+{
+	ULONGLONG ullTime;				// simulated time of the next try (ms)
+	UINT uClient;
+	bool operator > (const RETRY_SIM_EVENT& Rec) const
+	{
+		return ullTime > Rec.ullTime;
+	}
+};
+
+// RetrySimulate
+// simulate dwClients clients sending requests back to back to a server that can handle dwCapacity requests a second
+// and returns 503 for anything over that. every client starts at the same time
+static void RetrySimulate(LPCTSTR pszTitle, CRetryPolicy& Policy, DWORD dwClients, DWORD dwCapacity)
+{
+	const ULONGLONG SIM_DURATION = 60000;			// simulated run time (ms)
+	const ULONGLONG SIM_RESPONSE_TIME = 20;			// time to get a response, good or bad (ms)
+	const ULONGLONG SIM_WINDOW = 100;				// the server capacity is enforced over windows this long (ms)
+	const ULONGLONG ullWindowCapacity = __max(1ULL, (ULONGLONG)dwCapacity * SIM_WINDOW / 1000ULL);
+	std::priority_queue<RETRY_SIM_EVENT, std::vector<RETRY_SIM_EVENT>, std::greater<RETRY_SIM_EVENT>> EventQueue;
+	std::vector<UINT> TryList(dwClients, 0);
+	ULONGLONG ullWindow = 0ULL, ullWindowCount = 0ULL;
+	ULONGLONG ullTries = 0ULL, ullRejected = 0ULL, ullSucceeded = 0ULL, ullFailed = 0ULL;
+	for (UINT i = 0; i < dwClients; i++)
+	{
+		RETRY_SIM_EVENT Event;
+		Event.ullTime = 0ULL;
+		Event.uClient = i;
+		EventQueue.push(Event);
+		Policy.RequestStart();
+	}
+	while (!EventQueue.empty() && (EventQueue.top().ullTime < SIM_DURATION))
+	{
+		RETRY_SIM_EVENT Event(EventQueue.top());
+		EventQueue.pop();
+		if ((Event.ullTime / SIM_WINDOW) != ullWindow)
+		{
+			ullWindow = Event.ullTime / SIM_WINDOW;
+			ullWindowCount = 0ULL;
+		}
+		ullTries++;
+		bool bNewRequest = true;
+		Event.ullTime += SIM_RESPONSE_TIME;
+		if (++ullWindowCount <= ullWindowCapacity)
+			ullSucceeded++;
+		else
+		{
+			ullRejected++;
+			DWORD dwDelay;
+			if (Policy.IfRetry(E_RETRY_CLASS::SlowDown, TryList[Event.uClient]++, dwDelay))
+			{
+				Event.ullTime += dwDelay;
+				bNewRequest = false;
+			}
+			else
+				ullFailed++;
+		}
+		if (bNewRequest)
+		{
+			TryList[Event.uClient] = 0;
+			Policy.RequestStart();
+		}
+		EventQueue.push(Event);
+	}
+	RETRY_STATS Stats;
+	Policy.GetStats(Stats);
+	_tprintf(_T("%s:\n  tries: %I64u, succeeded: %I64u, failed: %I64u, 503s: %I64u (%.1f%%)\n  retries: %I64u, refused by limit: %I64u, refused by budget: %I64u, average delay: %.0f ms\n"),
+		pszTitle, ullTries, ullSucceeded, ullFailed, ullRejected, (ullTries == 0ULL) ? 0.0 : ((double)ullRejected * 100.0 / (double)ullTries),
+		Stats.GetTotalRetries(), Stats.ullRetryLimit, Stats.ullBudgetExhausted,
+		(Stats.GetTotalRetries() == 0ULL) ? 0.0 : ((double)Stats.ullDelayMs / (double)Stats.GetTotalRetries()));
+}
+
+// RetrySimulation
+// compare the old fixed pause retries with the default backoff policy against an overloaded server
+static int RetrySimulation(DWORD dwClients, DWORD dwCapacity)
+{
+	_tprintf(_T("%u clients, server capacity %u requests/sec, 60 simulated seconds\n"), dwClients, dwCapacity);
+	CFixedRetryPolicy FixedPolicy(MaxRetryCount - 1, 500);
+	RetrySimulate(_T("Fixed 500 ms pause"), FixedPolicy, dwClients, dwCapacity);
+	CBackoffRetryPolicy BackoffPolicy(0.1, 10.0);
+	RetrySimulate(_T("Exponential backoff with full jitter and retry budget"), BackoffPolicy, dwClients, dwCapacity);
+	return 0;
+}
+
+// one sender of the throttle benchmark
+struct THROTTLE_BENCH_SENDER
+{
+	CThrottlePath Path;						// buckets this sender is charged to
+	DWORD dwChunk;							// bytes charged at a time
+	volatile LONGLONG llBytes;				// bytes "sent" so far
+	LONGLONG llWait;						// total time spent in Consume (us)
+	DWORD dwCount;							// number of Consume calls
+	volatile bool *pbStop;
+
+	THROTTLE_BENCH_SENDER()
+		: dwChunk(MaxWriteRequestThrottle)
+		, llBytes(0LL)
+		, llWait(0LL)
+		, dwCount(0)
+		, pbStop(nullptr)
+	{}
+};
+
+static DWORD WINAPI ThrottleBenchThread(LPVOID pParam)
+{
+	THROTTLE_BENCH_SENDER *pSender = (THROTTLE_BENCH_SENDER *)pParam;
+	while (!*pSender->pbStop)
+	{
+		LONGLONG llStart = CTokenBucket::GetTimeMicro();
+		(void)pSender->Path.Consume(pSender->dwChunk);
+		pSender->llWait += CTokenBucket::GetTimeMicro() - llStart;
+		pSender->dwCount++;
+		(void)InterlockedExchangeAdd64(&pSender->llBytes, pSender->dwChunk);
+	}
+	return 0;
+}
+
+// FairShareRun
+// one background sender charging 16 times as much at a time as the 3 interactive senders, which charge MaxWriteRequestThrottle,
+// all sharing a limit of dwRate bytes/sec
+static void FairShareRun(LPCTSTR pszTitle, bool bFairShare, DWORD dwRate, DWORD dwSeconds)
+{
+	const UINT NUM_SENDERS = 4;
+	std::shared_ptr<CTokenBucket> HostBucket = std::make_shared<CTokenBucket>(dwRate);
+	HostBucket->SetFairShare(bFairShare);
+	THROTTLE_BENCH_SENDER SenderList[NUM_SENDERS];
+	volatile bool bStop = false;
+	HANDLE hThreadList[NUM_SENDERS];
+	for (UINT i = 0; i < NUM_SENDERS; i++)
+	{
+		SenderList[i].pbStop = &bStop;
+		SenderList[i].Path.Add(HostBucket);
+		SenderList[i].Path.SetWeight((i == 0) ? ThrottleWeightBackground : ThrottleWeightInteractive);
+		if (i == 0)
+			SenderList[i].dwChunk = MaxWriteRequestThrottle * 16;
+	}
+	LONGLONG llStart = CTokenBucket::GetTimeMicro();
+	for (UINT i = 0; i < NUM_SENDERS; i++)
+		hThreadList[i] = CreateThread(nullptr, 0, ThrottleBenchThread, &SenderList[i], 0, nullptr);
+	Sleep(SECONDS(dwSeconds));
+	bStop = true;
+	(void)WaitForMultipleObjects(NUM_SENDERS, hThreadList, TRUE, INFINITE);
+	for (UINT i = 0; i < NUM_SENDERS; i++)
+		(void)CloseHandle(hThreadList[i]);
+	double dSeconds = (double)(CTokenBucket::GetTimeMicro() - llStart) / 1000000.0;
+	_tprintf(_T("%s:\n"), pszTitle);
+	for (UINT i = 0; i < NUM_SENDERS; i++)
+		_tprintf(_T("  %s sender %u: %.0f bytes/sec, average wait %.1f ms\n"), (i == 0) ? _T("background") : _T("interactive"), i,
+			(double)SenderList[i].llBytes / dSeconds, (SenderList[i].dwCount == 0) ? 0.0 : ((double)SenderList[i].llWait / 1000.0 / (double)SenderList[i].dwCount));
+}
+
+// ThrottleBenchmark
+// 4 senders share a process limit of dwRate bytes/sec. the first one also has a transfer limit of 1/8 of that
+// each sender charges MaxWriteRequestThrottle bytes at a time, as fast as the throttle lets it
+// the total is sampled every 100 ms to see how smooth it is
+static int ThrottleBenchmark(DWORD dwRate, DWORD dwSeconds)
+{
+	const UINT NUM_SENDERS = 4;
+	const DWORD SAMPLE_INTERVAL = 100;		// ms
+	if ((dwRate == 0) || (dwSeconds == 0))
+	{
+		_tprintf(_T("rate and seconds must be non-zero\n"));
+		return 1;
+	}
+	std::shared_ptr<CTokenBucket> ProcessBucket = std::make_shared<CTokenBucket>(dwRate);
+	std::shared_ptr<CTokenBucket> TransferBucket = std::make_shared<CTokenBucket>(dwRate / 8);
+	THROTTLE_BENCH_SENDER SenderList[NUM_SENDERS];
+	volatile bool bStop = false;
+	HANDLE hThreadList[NUM_SENDERS];
+	for (UINT i = 0; i < NUM_SENDERS; i++)
+	{
+		SenderList[i].pbStop = &bStop;
+		SenderList[i].Path.Add(ProcessBucket);
+		if (i == 0)
+			SenderList[i].Path.Add(TransferBucket);
+	}
+	LONGLONG llStart = CTokenBucket::GetTimeMicro();
+	for (UINT i = 0; i < NUM_SENDERS; i++)
+		hThreadList[i] = CreateThread(nullptr, 0, ThrottleBenchThread, &SenderList[i], 0, nullptr);
+	std::vector<double> SampleList;
+	LONGLONG llLastTotal = 0LL, llLastTime = llStart;
+	while ((llLastTime - llStart) < ((LONGLONG)dwSeconds * 1000000LL))
+	{
+		Sleep(SAMPLE_INTERVAL);
+		LONGLONG llTotal = 0LL;
+		for (UINT i = 0; i < NUM_SENDERS; i++)
+			llTotal += InterlockedAdd64(&SenderList[i].llBytes, 0LL);
+		LONGLONG llNow = CTokenBucket::GetTimeMicro();
+		if (llNow > llLastTime)
+			SampleList.push_back((double)(llTotal - llLastTotal) * 1000000.0 / (double)(llNow - llLastTime));
+		llLastTotal = llTotal;
+		llLastTime = llNow;
+	}
+	bStop = true;
+	(void)WaitForMultipleObjects(NUM_SENDERS, hThreadList, TRUE, INFINITE);
+	for (UINT i = 0; i < NUM_SENDERS; i++)
+		(void)CloseHandle(hThreadList[i]);
+	double dSeconds = (double)(llLastTime - llStart) / 1000000.0;
+	double dMean = 0.0, dDev = 0.0, dMin = 0.0, dMax = 0.0;
+	for (std::vector<double>::const_iterator itSample = SampleList.begin(); itSample != SampleList.end(); ++itSample)
+	{
+		dMean += *itSample;
+		if ((itSample == SampleList.begin()) || (*itSample < dMin))
+			dMin = *itSample;
+		if (*itSample > dMax)
+			dMax = *itSample;
+	}
+	if (!SampleList.empty())
+		dMean /= (double)SampleList.size();
+	for (std::vector<double>::const_iterator itSample = SampleList.begin(); itSample != SampleList.end(); ++itSample)
+		dDev += (*itSample - dMean) * (*itSample - dMean);
+	if (!SampleList.empty())
+		dDev = sqrt(dDev / (double)SampleList.size());
+	_tprintf(_T("%u senders, process limit %u bytes/sec, first sender also limited to %u bytes/sec, %.1f seconds\n"),
+		NUM_SENDERS, dwRate, dwRate / 8, dSeconds);
+	_tprintf(_T("total: %.0f bytes/sec (%.1f%% of the limit)\n"), (double)llLastTotal / dSeconds, (double)llLastTotal * 100.0 / dSeconds / (double)dwRate);
+	for (UINT i = 0; i < NUM_SENDERS; i++)
+		_tprintf(_T("  sender %u: %.0f bytes/sec\n"), i, (double)SenderList[i].llBytes / dSeconds);
+	_tprintf(_T("%u ms samples: min %.0f, max %.0f, std dev %.0f bytes/sec (%.1f%% of the mean)\n"),
+		SAMPLE_INTERVAL, dMin, dMax, dDev, (dMean > 0.0) ? (dDev * 100.0 / dMean) : 0.0);
+	_tprintf(_T("\n"));
+	FairShareRun(_T("First come, first served"), false, dwRate, dwSeconds);
+	FairShareRun(_T("Fair sharing (background weight 1, interactive weight 16)"), true, dwRate, dwSeconds);
+	return 0;
+}
+
+// CrcCombineCheck
+// combine the CRC of a small part with the CRC of a 640 MB part and compare it with the CRC of all the data
+// combining a part of 512 MB or more is where the x^(2^n) table has to go past bit 31 of the length
+static bool CrcCombineCheck(E_CHECKSUM_TYPE CrcType)
+{
+	const DWORD BLOCK_SIZE = MEGABYTES(1);
+	const DWORD NEXT_BLOCKS = 640;
+	const DWORD FIRST_SIZE = 1000;
+	CBuffer Block;
+	Block.SetBufSize(BLOCK_SIZE);
+	for (DWORD i = 0; i < BLOCK_SIZE; i++)
+		Block.GetData()[i] = (BYTE)((i * 2654435761U) >> 24);
+	CCrcChecksum Whole(CrcType), First(CrcType), Next(CrcType);
+	Whole.AddData(Block.GetData(), FIRST_SIZE);
+	First.AddData(Block.GetData(), FIRST_SIZE);
+	for (DWORD i = 0; i < NEXT_BLOCKS; i++)
+	{
+		Block.GetData()[0] = (BYTE)i;			// so the blocks aren't all the same
+		Whole.AddData(Block);
+		Next.AddData(Block);
+	}
+	First.Combine(Next);
+	bool bMatch = (First.GetCrc() == Whole.GetCrc()) && (First.GetLength() == Whole.GetLength());
+	_tprintf(_T("%s combine of %u bytes + %I64u bytes: %s (combined %I64x, direct %I64x)\n"),
+		(CrcType == E_CHECKSUM_TYPE::CRC64NVME) ? _T("CRC64NVME") : _T("CRC32C"), FIRST_SIZE, Next.GetLength(),
+		bMatch ? _T("OK") : _T("MISMATCH"), First.GetCrc(), Whole.GetCrc());
+	return bMatch;
+}
+
+// ChecksumThroughput
+// hash 256 MB with MD5 (Content-MD5), CRC32C and CRC64NVME (x-amz-checksum-*). returns MB/sec
+static double ChecksumThroughput(E_CHECKSUM_TYPE ChecksumType, const CBuffer& Block)
+{
+	const DWORD BLOCKS = 256;
+	CCngAES_GCM Md5;
+	CCrcChecksum Crc((ChecksumType == E_CHECKSUM_TYPE::MD5) ? E_CHECKSUM_TYPE::CRC32C : ChecksumType);
+	CBuffer Hash;
+	LARGE_INTEGER liFreq, liStart, liEnd;
+	(void)QueryPerformanceFrequency(&liFreq);
+	(void)QueryPerformanceCounter(&liStart);
+	if (ChecksumType == E_CHECKSUM_TYPE::MD5)
+		Md5.CreateHash(BCRYPT_MD5_ALGORITHM);
+	for (DWORD i = 0; i < BLOCKS; i++)
+	{
+		if (ChecksumType == E_CHECKSUM_TYPE::MD5)
+			Md5.AddHashData(Block);
+		else
+			Crc.AddData(Block);
+	}
+	if (ChecksumType == E_CHECKSUM_TYPE::MD5)
+		Md5.GetHashData(Hash);
+	else
+		Crc.GetHashData(Hash);
+	(void)QueryPerformanceCounter(&liEnd);
+	double dSeconds = (double)(liEnd.QuadPart - liStart.QuadPart) / (double)liFreq.QuadPart;
+	return (dSeconds <= 0.0) ? 0.0 : ((double)BLOCKS * (double)Block.GetBufSize() / (double)MEGABYTES(1) / dSeconds);
+}
+
+// CrcBenchmark
+// check CRC combining on parts over 512 MB, then compare the throughput of the upload checksums
+static int CrcBenchmark(void)
+{
+	bool bOK = CrcCombineCheck(E_CHECKSUM_TYPE::CRC32C);
+	if (!CrcCombineCheck(E_CHECKSUM_TYPE::CRC64NVME))
+		bOK = false;
+	CBuffer Block;
+	Block.SetBufSize(MEGABYTES(1));
+	for (DWORD i = 0; i < Block.GetBufSize(); i++)
+		Block.GetData()[i] = (BYTE)((i * 2654435761U) >> 24);
+	double dMd5 = ChecksumThroughput(E_CHECKSUM_TYPE::MD5, Block);
+	double dCrc32C = ChecksumThroughput(E_CHECKSUM_TYPE::CRC32C, Block);
+	double dCrc64 = ChecksumThroughput(E_CHECKSUM_TYPE::CRC64NVME, Block);
+	_tprintf(_T("MD5:       %8.0f MB/sec\n"), dMd5);
+	_tprintf(_T("CRC32C:    %8.0f MB/sec (%.1fx MD5, %s)\n"), dCrc32C, (dMd5 > 0.0) ? (dCrc32C / dMd5) : 0.0,
+		CCrcChecksum::IfHardwareCRC32C() ? _T("CRC32 instruction") : _T("table"));
+	_tprintf(_T("CRC64NVME: %8.0f MB/sec (%.1fx MD5)\n"), dCrc64, (dMd5 > 0.0) ? (dCrc64 / dMd5) : 0.0);
+	return bOK ? 0 : 1;
+}
+
+// one thread of the queue benchmark
+struct QUEUE_BENCH_THREAD
+{
+	CSharedQueue<ULONGLONG> *pListQueue;		// queue to use. only one of these is set
+	CSharedRingQueue<ULONGLONG> *pRingQueue;
+	DWORD dwOps;								// push/pop pairs to do
+
+	QUEUE_BENCH_THREAD()
+		: pListQueue(nullptr)
+		, pRingQueue(nullptr)
+		, dwOps(0)
+	{}
+};
+
+// QueueBenchThread
+// push an entry, then pop one, dwOps times. the pop takes whatever entry is at the front, not necessarily this thread's
+static DWORD WINAPI QueueBenchThread(LPVOID pParam)
+{
+	QUEUE_BENCH_THREAD *pThread = (QUEUE_BENCH_THREAD *)pParam;
+	ULONGLONG ullValue;
+	for (DWORD i = 0; i < pThread->dwOps; i++)
+	{
+		if (pThread->pRingQueue != nullptr)
+		{
+			(void)pThread->pRingQueue->push_back((ULONGLONG)i);
+			while (!pThread->pRingQueue->pop_front(ullValue))
+				(void)SwitchToThread();
+		}
+		else
+		{
+			pThread->pListQueue->push_back((ULONGLONG)i);
+			for (bool bGot = false; !bGot; )
+			{
+				{
+					// the way entries are taken off of a CSharedQueue
+					CRWLockAcquire lockQueue(&pThread->pListQueue->GetLock(), true);			// write lock
+					if (!pThread->pListQueue->empty())
+					{
+						ullValue = pThread->pListQueue->front();
+						pThread->pListQueue->pop_front();
+						bGot = true;
+					}
+				}
+				if (!bGot)
+					(void)SwitchToThread();
+			}
+		}
+	}
+	return 0;
+}
+
+// QueueBenchRun
+// run dwThreads threads on one queue. returns push/pop pairs per second
+static double QueueBenchRun(bool bRing, DWORD dwThreads, DWORD dwOps)
+{
+	CSharedQueue<ULONGLONG> ListQueue;
+	CSharedRingQueue<ULONGLONG> RingQueue;
+	std::vector<QUEUE_BENCH_THREAD> ThreadList(dwThreads);
+	std::vector<HANDLE> hThreadList(dwThreads);
+	for (DWORD i = 0; i < dwThreads; i++)
+	{
+		ThreadList[i].dwOps = dwOps;
+		if (bRing)
+			ThreadList[i].pRingQueue = &RingQueue;
+		else
+			ThreadList[i].pListQueue = &ListQueue;
+	}
+	LARGE_INTEGER liFreq, liStart, liEnd;
+	(void)QueryPerformanceFrequency(&liFreq);
+	(void)QueryPerformanceCounter(&liStart);
+	for (DWORD i = 0; i < dwThreads; i++)
+		hThreadList[i] = CreateThread(nullptr, 0, QueueBenchThread, &ThreadList[i], 0, nullptr);
+	(void)WaitForMultipleObjects(dwThreads, &hThreadList[0], TRUE, INFINITE);
+	(void)QueryPerformanceCounter(&liEnd);
+	for (DWORD i = 0; i < dwThreads; i++)
+		(void)CloseHandle(hThreadList[i]);
+	double dSeconds = (double)(liEnd.QuadPart - liStart.QuadPart) / (double)liFreq.QuadPart;
+	return (dSeconds <= 0.0) ? 0.0 : ((double)dwThreads * (double)dwOps / dSeconds);
+}
+
+// QueueBenchmark
+// contention on CSharedQueue (list and lock) compared to CSharedRingQueue (lock free ring), with 1 to 64 threads
+static int QueueBenchmark(DWORD dwOps)
+{
+	_tprintf(_T("%u push/pop pairs per thread\n"), dwOps);
+	_tprintf(_T("threads      list queue (ops/sec)   ring queue (ops/sec)   ring/list\n"));
+	for (DWORD dwThreads = 1; dwThreads <= 64; dwThreads *= 2)
+	{
+		double dList = QueueBenchRun(false, dwThreads, dwOps);
+		double dRing = QueueBenchRun(true, dwThreads, dwOps);
+		_tprintf(_T("%7u %22.0f %22.0f %11.2f\n"), dwThreads, dList, dRing, (dList > 0.0) ? (dRing / dList) : 0.0);
+	}
+	return 0;
+}
+
+struct BUFFER_BENCH_THREAD
+{
+	DWORD dwSize;						// size loaded into the buffer
+	DWORD dwOps;						// number of Load/Append/Grow rounds
+	const BYTE *pSrc;					// source data (at least 2 * dwSize)
+
+	BUFFER_BENCH_THREAD()
+		: dwSize(0)
+		, dwOps(0)
+		, pSrc(nullptr)
+	{}
+};
+
+// BufferBenchThread
+// the way buffers are used when building a request or a response: load some data, append more,
+// grow it to make room for the rest, then free it
+static DWORD WINAPI BufferBenchThread(LPVOID pParam)
+{
+	BUFFER_BENCH_THREAD *pThread = (BUFFER_BENCH_THREAD *)pParam;
+	for (DWORD i = 0; i < pThread->dwOps; i++)
+	{
+		CBuffer Buf;
+		Buf.Load(pThread->pSrc, pThread->dwSize);
+		Buf.Append(pThread->pSrc, pThread->dwSize / 2);
+		Buf.SetBufSize(pThread->dwSize * 2);
+	}
+	return 0;
+}
+
+// BufferBenchRun
+// run dwThreads threads. returns microseconds per Load/Append/Grow round
+static double BufferBenchRun(DWORD dwThreads, DWORD dwSize, DWORD dwOps, const CBuffer& Src)
+{
+	std::vector<BUFFER_BENCH_THREAD> ThreadList(dwThreads);
+	std::vector<HANDLE> hThreadList(dwThreads);
+	for (DWORD i = 0; i < dwThreads; i++)
+	{
+		ThreadList[i].dwSize = dwSize;
+		ThreadList[i].dwOps = dwOps;
+		ThreadList[i].pSrc = Src.GetData();
+	}
+	LARGE_INTEGER liFreq, liStart, liEnd;
+	(void)QueryPerformanceFrequency(&liFreq);
+	(void)QueryPerformanceCounter(&liStart);
+	for (DWORD i = 0; i < dwThreads; i++)
+		hThreadList[i] = CreateThread(nullptr, 0, BufferBenchThread, &ThreadList[i], 0, nullptr);
+	(void)WaitForMultipleObjects(dwThreads, &hThreadList[0], TRUE, INFINITE);
+	(void)QueryPerformanceCounter(&liEnd);
+	for (DWORD i = 0; i < dwThreads; i++)
+		(void)CloseHandle(hThreadList[i]);
+	double dMicroSec = (double)(liEnd.QuadPart - liStart.QuadPart) * 1000000.0 / (double)liFreq.QuadPart;
+	return dMicroSec / ((double)dwThreads * (double)dwOps);
+}
+
+// BufferBenchmark
+// CBuffer Load/Append/Grow with the buffer pool turned off (heap) and on, for small to large buffers, 1 and 8 threads
+static int BufferBenchmark(DWORD dwOps)
+{
+	const DWORD SizeList[] = { 100, 4000, 60000, 900000, 4000000 };
+	const DWORD ThreadsList[] = { 1, 8 };
+	CBuffer Src;
+	Src.SetBufSize(SizeList[_countof(SizeList) - 1] * 2);
+	for (DWORD i = 0; i < Src.GetBufSize(); i++)
+		Src.SetAt(i, (BYTE)i);
+	_tprintf(_T("%u Load/Append/Grow rounds per thread\n"), dwOps);
+	_tprintf(_T("threads       size   heap (us/round)   pool (us/round)   heap/pool\n"));
+	for (UINT iThreads = 0; iThreads < _countof(ThreadsList); iThreads++)
+	{
+		for (UINT iSize = 0; iSize < _countof(SizeList); iSize++)
+		{
+			CBuffer::EnableBufferPool(false);
+			double dHeap = BufferBenchRun(ThreadsList[iThreads], SizeList[iSize], dwOps, Src);
+			CBuffer::EnableBufferPool(true);
+			double dPool = BufferBenchRun(ThreadsList[iThreads], SizeList[iSize], dwOps, Src);
+			_tprintf(_T("%7u %10u %17.2f %17.2f %11.2f\n"), ThreadsList[iThreads], SizeList[iSize], dHeap, dPool, (dPool > 0.0) ? (dHeap / dPool) : 0.0);
+		}
+	}
+	CString sDump;
+	CBuffer::DumpBuffers(&sDump);
+	_tprintf(_T("%s"), (LPCTSTR)sDump);
+	CBuffer::TrimBufferPool(true);
+	sDump.Empty();
+	CBuffer::DumpBuffers(&sDump);
+	_tprintf(_T("after trim:\n%s"), (LPCTSTR)sDump);
+	return 0;
+}
+
+// pool used by the pool benchmark
+// each message waits for the gate, so the queue fills up before anything is dispatched
+class CPoolBench : public CThreadPool<DWORD>
+{
+public:
+	CEvent evGate;						// set to let the threads process messages
+	CEvent evDone;						// set when lDone reaches lTotal
+	volatile LONG lDone;				// messages processed
+	LONG lTotal;						// messages sent
+
+	CPoolBench()
+		: evGate(FALSE, TRUE)
+		, evDone(FALSE, TRUE)
+		, lDone(0)
+		, lTotal(0)
+	{}
+	~CPoolBench()
+	{
+		CThreadPool<DWORD>::Terminate();
+	}
+	bool DoProcess(const CSimpleWorkerThread *pThread, const DWORD& dwMsg)
+	{
+		(void)pThread;
+		(void)dwMsg;
+		(void)WaitForSingleObject(evGate.m_hObject, INFINITE);
+		if (InterlockedIncrement(&lDone) == lTotal)
+			(void)evDone.SetEvent();
+		return true;
+	}
+};
+
+// PoolBenchmark
+// time CThreadPool message dispatch as the queue gets deeper
+// dwDepth messages are queued with 4 priorities (so they aren't all added at the tail) while the threads are held,
+// then the threads are let go and the queue is drained. the time per message should not grow with the depth
+static int PoolBenchmark(DWORD dwDepth)
+{
+	const DWORD POOL_THREADS = 4;
+	const UINT PRIORITIES = 4;
+	_tprintf(_T("%u threads, %u priorities\n"), POOL_THREADS, PRIORITIES);
+	_tprintf(_T("  depth   queue (us/msg)   dispatch (us/msg)\n"));
+	for (DWORD dwCount = 100; dwCount <= dwDepth; dwCount *= 10)
+	{
+		CPoolBench Pool;
+		Pool.SetMinThreads(1);
+		Pool.SetMaxThreads(POOL_THREADS);
+		CThreadPoolBase::SetPoolInitialized();
+		Pool.lTotal = (LONG)dwCount;
+		LARGE_INTEGER liFreq, liStart, liQueued, liEnd;
+		(void)QueryPerformanceFrequency(&liFreq);
+		(void)QueryPerformanceCounter(&liStart);
+		for (DWORD i = 0; i < dwCount; i++)
+		{
+			std::shared_ptr<DWORD> AutoMsg = std::make_shared<DWORD>(i);
+			Pool.SendMessageToPool(__LINE__, AutoMsg, 0, i % PRIORITIES, nullptr);
+		}
+		(void)QueryPerformanceCounter(&liQueued);
+		(void)Pool.evGate.SetEvent();
+		(void)WaitForSingleObject(Pool.evDone.m_hObject, INFINITE);
+		(void)QueryPerformanceCounter(&liEnd);
+		double dQueue = (double)(liQueued.QuadPart - liStart.QuadPart) * 1000000.0 / (double)liFreq.QuadPart / (double)dwCount;
+		double dDispatch = (double)(liEnd.QuadPart - liQueued.QuadPart) * 1000000.0 / (double)liFreq.QuadPart / (double)dwCount;
+		_tprintf(_T("%7u %16.3f %19.3f\n"), dwCount, dQueue, dDispatch);
+	}
+	return 0;
+}
+
+// one run of the copy benchmark
+// the producer thread fills buffers and queues them the way the streaming paths do, the main thread takes them off
+struct COPY_BENCH_RUN
+{
+	CECSConnection::STREAM_CONTEXT Stream;		// send: StreamData. receive: pReceiveRing
+	bool bSend;									// upload path (S3Write) instead of download path (S3Read)
+	DWORD dwChunkSize;							// size of each buffer
+	ULONGLONG ullChunks;						// buffers to send, not counting the empty last one
+
+	COPY_BENCH_RUN()
+		: bSend(false)
+		, dwChunkSize(0)
+		, ullChunks(0ULL)
+	{}
+};
+
+// CopyBenchProducer
+// send: fill the buffers the way ReadUploadEntry does and queue them like S3Write
+// receive: fill the buffers the way SendRequestInternal does with WinHttpReadData and push them like it does
+static DWORD WINAPI CopyBenchProducer(LPVOID pParam)
+{
+	const UINT SEND_QUEUE_SIZE = 32;				// dwMaxQueueSize for the upload path
+	COPY_BENCH_RUN *pRun = (COPY_BENCH_RUN *)pParam;
+	CECSConnection::STREAM_DATA_ENTRY Rec;
+	for (ULONGLONG ullChunk = 0ULL; ullChunk <= pRun->ullChunks; ullChunk++)
+	{
+		// release the previous buffer first since it may still be shared with the queue
+		Rec.Data.Empty();
+		Rec.bLast = ullChunk == pRun->ullChunks;
+		Rec.ullOffset = ullChunk * pRun->dwChunkSize;
+		if (!Rec.bLast)
+		{
+			Rec.Data.SetBufSizeNoInit(pRun->dwChunkSize);
+			memset(Rec.Data.GetData(), (int)ullChunk, pRun->dwChunkSize);
+		}
+		if (pRun->bSend)
+			pRun->Stream.StreamData.push_back(Rec, pRun->Stream.GetSendQueueLimit(SEND_QUEUE_SIZE));
+		else
+			pRun->Stream.PushReceive(Rec, DefaultMaxStreamQueueSizeRecv, nullptr, nullptr);
+	}
+	return 0;
+}
+
+// CopyBenchRun
+// move ullTotal bytes through a STREAM_CONTEXT in dwChunkSize buffers
+// returns MB/sec and the bytes copied between CBuffers per byte moved
+static void CopyBenchRun(bool bSend, DWORD dwChunkSize, ULONGLONG ullTotal, double& dMBPerSec, double& dCopied)
+{
+	COPY_BENCH_RUN Run;
+	CSharedRingQueue<CECSConnection::STREAM_DATA_ENTRY> ReceiveRing(DefaultMaxStreamQueueSizeRecv + 1);
+	Run.bSend = bSend;
+	Run.dwChunkSize = dwChunkSize;
+	Run.ullChunks = __max(ullTotal / dwChunkSize, 1ULL);
+	if (bSend)
+		Run.Stream.ullRewindMax = MEGABYTES(64ULL);		// same as S3Write
+	else
+		Run.Stream.pReceiveRing = &ReceiveRing;
+	ULONGLONG ullBytes = 0ULL;
+	ULONGLONG ullCopiedStart = CBuffer::GetBytesCopied();
+	LARGE_INTEGER liFreq, liStart, liEnd;
+	(void)QueryPerformanceFrequency(&liFreq);
+	(void)QueryPerformanceCounter(&liStart);
+	HANDLE hProducer = CreateThread(nullptr, 0, CopyBenchProducer, &Run, 0, nullptr);
+	for (bool bDone = false; !bDone; )
+	{
+		if (bSend)
+		{
+			// the way SendRequestInternal takes the data off of the queue once it is sent
+			bool bGot = false;
+			{
+				CRWLockAcquire lockQueue(&Run.Stream.StreamData.GetLock(), true);			// write lock
+				if (!Run.Stream.StreamData.empty())
+				{
+					ullBytes += Run.Stream.StreamData.front().Data.GetBufSize();
+					bDone = Run.Stream.StreamData.front().bLast;
+					Run.Stream.SaveRewind(Run.Stream.StreamData.front());
+					Run.Stream.StreamData.pop_front();
+					bGot = true;
+				}
+			}
+			if (!bGot)
+				(void)SwitchToThread();
+		}
+		else
+		{
+			// the way S3Read takes the data off of the ring
+			CECSConnection::STREAM_DATA_ENTRY Rec;
+			if (ReceiveRing.pop_front_wait(Rec, SECONDS(2)))
+			{
+				ullBytes += Rec.Data.GetBufSize();
+				bDone = Rec.bLast;
+			}
+		}
+	}
+	(void)WaitForSingleObject(hProducer, INFINITE);
+	(void)QueryPerformanceCounter(&liEnd);
+	(void)CloseHandle(hProducer);
+	Run.Stream.ClearRewind();
+	double dSeconds = (double)(liEnd.QuadPart - liStart.QuadPart) / (double)liFreq.QuadPart;
+	dMBPerSec = (dSeconds <= 0.0) ? 0.0 : ((double)ullBytes / (double)MEGABYTES(1) / dSeconds);
+	dCopied = (ullBytes == 0ULL) ? 0.0 : ((double)(CBuffer::GetBytesCopied() - ullCopiedStart) / (double)ullBytes);
+}
+
+// CopyBenchmark
+// bytes copied between CBuffers per byte moved through the upload and download stream queues
+// the data should move from the producer to the consumer without being copied, so this should stay at 0
+static int CopyBenchmark(DWORD dwMB)
+{
+	const DWORD ChunkList[] = { KILOBYTES(8), KILOBYTES(64), MEGABYTES(1) };
+	_tprintf(_T("%u MB per run. copied: bytes copied between buffers per byte moved\n"), dwMB);
+	_tprintf(_T("path         chunk      MB/sec    copied\n"));
+	for (UINT iSend = 0; iSend < 2; iSend++)
+	{
+		for (UINT iChunk = 0; iChunk < _countof(ChunkList); iChunk++)
+		{
+			double dMBPerSec, dCopied;
+			CopyBenchRun(iSend != 0, ChunkList[iChunk], MEGABYTES((ULONGLONG)dwMB), dMBPerSec, dCopied);
+			_tprintf(_T("%-8s %9u %11.1f %9.3f\n"), (iSend != 0) ? _T("send") : _T("receive"), ChunkList[iChunk], dMBPerSec, dCopied);
+		}
+	}
+	return 0;
+}
+
+// progress context for the parallel read benchmark
+struct READ_PARALLEL_BENCH_CONTEXT
+{
+	volatile LONG lRangesInFlight;		// set by S3ReadParallel
+	LONG lPeak;							// most ranges seen in flight
+
+	READ_PARALLEL_BENCH_CONTEXT()
+		: lRangesInFlight(0)
+		, lPeak(0)
+	{}
+};
+
+// ReadParallelProgress
+// progress is called from the thread that writes the ranges, so the peak doesn't need a lock
+static void ReadParallelProgress(int iProgress, void *pContext)
+{
+	(void)iProgress;
+	READ_PARALLEL_BENCH_CONTEXT *pBench = (READ_PARALLEL_BENCH_CONTEXT *)pContext;
+	LONG lInFlight = InterlockedCompareExchange(&pBench->lRangesInFlight, 0, 0);
+	if (lInFlight > pBench->lPeak)
+		pBench->lPeak = lInFlight;
+}
+
+// ReadParallelBenchmark
+// download an object with S3Read, then with S3ReadParallel using 2 threads and doubling up to dwMaxThreads
+static int ReadParallelBenchmark(CECSConnection& Conn, DWORD dwMaxThreads, LPCTSTR pszLocalPath, LPCTSTR pszECSPath)
+{
+	const DWORD RANGE_SIZE = 16;			// MB
+	_tprintf(_T("%s, %u MB ranges\n"), pszECSPath, RANGE_SIZE);
+	_tprintf(_T("threads      MB/sec   seconds   peak ranges\n"));
+	for (DWORD dwThreads = 1; (dwThreads <= dwMaxThreads) && !bShuttingDown; dwThreads *= 2)
+	{
+		READ_PARALLEL_BENCH_CONTEXT Bench;
+		ULONGLONG ullReturned = 0ULL;
+		CECSConnection::S3_ERROR Error;
+		LARGE_INTEGER liFreq, liStart, liEnd;
+		(void)QueryPerformanceFrequency(&liFreq);
+		(void)QueryPerformanceCounter(&liStart);
+		if (dwThreads == 1)
+			Error = S3Read(pszLocalPath, STGM_SHARE_EXCLUSIVE | STGM_CREATE | STGM_WRITE, FILE_ATTRIBUTE_NORMAL, true, Conn, pszECSPath, 0ULL, 0ULL,
+				nullptr, nullptr, nullptr, &ullReturned);
+		else
+			Error = S3ReadParallel(pszLocalPath, STGM_SHARE_EXCLUSIVE | STGM_CREATE | STGM_WRITE, FILE_ATTRIBUTE_NORMAL, true, Conn, pszECSPath, 0ULL, 0ULL,
+				RANGE_SIZE, dwThreads, 3, ReadParallelProgress, &Bench, &ullReturned, &Bench.lRangesInFlight);
+		(void)QueryPerformanceCounter(&liEnd);
+		if (Error.IfError())
+		{
+			_tprintf(_T("read error: %s\n"), (LPCTSTR)Error.Format());
+			return 1;
+		}
+		double dSeconds = (double)(liEnd.QuadPart - liStart.QuadPart) / (double)liFreq.QuadPart;
+		_tprintf(_T("%7u %11.1f %9.2f %13d\n"), dwThreads, (dSeconds <= 0.0) ? 0.0 : ((double)ullReturned / (double)MEGABYTES(1) / dSeconds),
+			dSeconds, (dwThreads == 1) ? 1 : Bench.lPeak);
+	}
+	return 0;
+}
+
+// local HTTP server for the circuit breaker test
+// answers every request with an empty 200 and closes the connection
+struct BREAKER_TEST_SERVER
+{
+	SOCKET sListen;
+	HANDLE hThread;
+
+	BREAKER_TEST_SERVER()
+		: sListen(INVALID_SOCKET)
+		, hThread(nullptr)
+	{}
+};
+
+// BreakerTestServe
+// runs until the listen socket is closed
+static DWORD WINAPI BreakerTestServe(LPVOID pParam)
+{
+	const char Response[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	BREAKER_TEST_SERVER *pServer = (BREAKER_TEST_SERVER *)pParam;
+	for (;;)
+	{
+		SOCKET sConn = accept(pServer->sListen, nullptr, nullptr);
+		if (sConn == INVALID_SOCKET)
+			return 0;
+		// read up to the end of the headers. there is never a body
+		CStringA sRequest;
+		char Buf[1024];
+		int iLen;
+		while ((sRequest.Find("\r\n\r\n") < 0) && ((iLen = recv(sConn, Buf, sizeof(Buf), 0)) > 0))
+			sRequest += CStringA(Buf, iLen);
+		(void)send(sConn, Response, (int)strlen(Response), 0);
+		(void)shutdown(sConn, SD_SEND);
+		(void)closesocket(sConn);
+	}
+}
+
+// BreakerTestStart
+// start a server on the loopback address dwAddr (host order)
+// if wPort is 0, a free port is picked and returned in wPort
+static bool BreakerTestStart(BREAKER_TEST_SERVER& Server, DWORD dwAddr, INTERNET_PORT& wPort)
+{
+	Server.sListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (Server.sListen == INVALID_SOCKET)
+		return false;
+	sockaddr_in Addr;
+	ZeroMemory(&Addr, sizeof(Addr));
+	Addr.sin_family = AF_INET;
+	Addr.sin_addr.s_addr = htonl(dwAddr);
+	Addr.sin_port = htons(wPort);
+	int iAddrLen = sizeof(Addr);
+	if ((bind(Server.sListen, (sockaddr *)&Addr, sizeof(Addr)) != 0)
+		|| (listen(Server.sListen, SOMAXCONN) != 0)
+		|| (getsockname(Server.sListen, (sockaddr *)&Addr, &iAddrLen) != 0))
+	{
+		(void)closesocket(Server.sListen);
+		Server.sListen = INVALID_SOCKET;
+		return false;
+	}
+	wPort = ntohs(Addr.sin_port);
+	Server.hThread = CreateThread(nullptr, 0, BreakerTestServe, &Server, 0, nullptr);
+	return Server.hThread != nullptr;
+}
+
+static void BreakerTestStop(BREAKER_TEST_SERVER& Server)
+{
+	if (Server.sListen != INVALID_SOCKET)
+		(void)closesocket(Server.sListen);
+	Server.sListen = INVALID_SOCKET;
+	if (Server.hThread != nullptr)
+	{
+		(void)WaitForSingleObject(Server.hThread, INFINITE);
+		(void)CloseHandle(Server.hThread);
+		Server.hThread = nullptr;
+	}
+}
+
+// BreakerTestNode
+// circuit breaker statistics of one node
+static CECSConnection::NODE_STATS BreakerTestNode(LPCTSTR pszHost, LPCTSTR pszIP)
+{
+	std::list<CECSConnection::NODE_STATS> StatsList;
+	CECSConnection::GetNodeStats(StatsList);
+	for (std::list<CECSConnection::NODE_STATS>::const_iterator itStats = StatsList.begin(); itStats != StatsList.end(); ++itStats)
+	{
+		if ((itStats->sHost == pszHost) && (itStats->sIP == pszIP))
+			return *itStats;
+	}
+	return CECSConnection::NODE_STATS();
+}
+
+static bool BreakerTestCheck(bool bPass, LPCTSTR pszStep)
+{
+	_tprintf(_T("%-6s%s\n"), bPass ? _T("ok") : _T("FAIL"), pszStep);
+	return bPass;
+}
+
+// BreakerTest
+// walk one node through the circuit breaker states, with a local server and no endpoint:
+// 127.0.0.1 always answers. 127.0.0.2 has nothing listening (connection refused), until the last step
+//   1. requests fail over from 127.0.0.2 to 127.0.0.1, which opens its circuit
+//   2. while it is open, requests don't try it
+//   3. once the open time is up, one request probes it. the probe fails, so it opens again for twice as long
+//   4. a server is started on 127.0.0.2. the next probe gets an answer and closes the circuit
+//   5. requests are sent to it again
+static int BreakerTest(void)
+{
+	const DWORD OpenTime = SECONDS(2);			// dwBadIPAddrAge for the test
+	const UINT RequestCount = 10;				// requests sent in each step
+	LPCTSTR const pszHost = _T("Breaker Test");
+	LPCTSTR const pszGoodIP = _T("127.0.0.1");
+	LPCTSTR const pszBadIP = _T("127.0.0.2");
+	BREAKER_TEST_SERVER GoodServer, BadServer;
+	INTERNET_PORT wTestPort = 0;
+	if (!BreakerTestStart(GoodServer, INADDR_LOOPBACK, wTestPort))
+	{
+		_tprintf(_T("Can't start the test server: %d\n"), WSAGetLastError());
+		return 1;
+	}
+	std::deque<CString> IPList;
+	IPList.push_back(pszBadIP);
+	IPList.push_back(pszGoodIP);
+	CECSConnection Conn;
+	Conn.RegisterAbortPtr(&bShuttingDown);
+	Conn.SetIPList(IPList);
+	Conn.SetS3KeyID(_T("user"));
+	Conn.SetSecret(_T("secret"));
+	Conn.SetSSL(false);
+	Conn.SetPort(wTestPort);
+	Conn.SetHost(pszHost);
+	Conn.SetUserAgent(_T("TestApp/1.0"));
+	Conn.SetTimeouts(1, SECONDS(5), SECONDS(5), SECONDS(5), SECONDS(5), OpenTime);
+	// round robin, so the first requests are sure to try 127.0.0.2
+	CECSConnection::SetNodeSelect(CECSConnection::E_NODE_SELECT::RoundRobin);
+	_tprintf(_T("server on %s port %u, nothing listening on %s\n"), pszGoodIP, wTestPort, pszBadIP);
+
+	bool bPass = true;
+	CECSConnection::S3_SYSTEM_METADATA Properties;
+	CECSConnection::S3_ERROR Error;
+	UINT uFailed = 0;
+	for (UINT i = 0; (i < RequestCount) && (BreakerTestNode(pszHost, pszBadIP).State != CECSConnection::E_NODE_STATE::Open); i++)
+	{
+		Error = Conn.ReadProperties(_T("/breaker/test"), Properties);
+		if (Error.IfError())
+			uFailed++;
+	}
+	CECSConnection::NODE_STATS BadNode(BreakerTestNode(pszHost, pszBadIP));
+	bPass &= BreakerTestCheck(uFailed == 0, _T("requests fail over to the node that answers"));
+	bPass &= BreakerTestCheck((BadNode.State == CECSConnection::E_NODE_STATE::Open) && (BadNode.lTrips == 1), _T("the circuit of the unreachable node opens"));
+
+	ULONGLONG ullBadRequests = BadNode.ullRequests;
+	for (UINT i = 0; i < RequestCount; i++)
+		(void)Conn.ReadProperties(_T("/breaker/test"), Properties);
+	BadNode = BreakerTestNode(pszHost, pszBadIP);
+	bPass &= BreakerTestCheck(BadNode.ullRequests == ullBadRequests, _T("while it is open, it isn't tried"));
+
+	Sleep(OpenTime + SECONDS(1));
+	ullBadRequests = BadNode.ullRequests;
+	for (UINT i = 0; i < RequestCount; i++)
+		(void)Conn.ReadProperties(_T("/breaker/test"), Properties);
+	BadNode = BreakerTestNode(pszHost, pszBadIP);
+	bPass &= BreakerTestCheck(BadNode.ullRequests == (ullBadRequests + 1), _T("once the open time is up, one request probes it (half open)"));
+	bPass &= BreakerTestCheck((BadNode.State == CECSConnection::E_NODE_STATE::Open) && (BadNode.lTrips == 2), _T("the probe fails, so it opens again"));
+
+	if (!BreakerTestStart(BadServer, INADDR_LOOPBACK + 1, wTestPort))
+	{
+		_tprintf(_T("Can't start the test server on %s: %d\n"), pszBadIP, WSAGetLastError());
+		BreakerTestStop(GoodServer);
+		return 1;
+	}
+	// the second open lasts twice as long
+	Sleep((OpenTime * 2) + SECONDS(1));
+	ullBadRequests = BadNode.ullRequests;
+	(void)Conn.ReadProperties(_T("/breaker/test"), Properties);
+	BadNode = BreakerTestNode(pszHost, pszBadIP);
+	bPass &= BreakerTestCheck((BadNode.ullRequests == (ullBadRequests + 1)) && (BadNode.State == CECSConnection::E_NODE_STATE::Closed),
+		_T("the node answers the next probe and its circuit closes"));
+
+	ullBadRequests = BadNode.ullRequests;
+	for (UINT i = 0; i < RequestCount; i++)
+		(void)Conn.ReadProperties(_T("/breaker/test"), Properties);
+	BadNode = BreakerTestNode(pszHost, pszBadIP);
+	bPass &= BreakerTestCheck(BadNode.ullRequests > ullBadRequests, _T("it is back in rotation"));
+
+	BreakerTestStop(BadServer);
+	BreakerTestStop(GoodServer);
+	CECSConnection::SetNodeSelect(CECSConnection::E_NODE_SELECT::PowerOfTwo);
+	_tprintf(_T("\nNode Statistics:\n%s\n"), (LPCTSTR)CECSConnection::DumpNodeStats());
+	_tprintf(bPass ? _T("circuit breaker test passed\n") : _T("circuit breaker test FAILED\n"));
+	return bPass ? 0 : 1;
 }
 
 static int DoTest(CString& sOutMessage)
@@ -536,6 +1740,25 @@ static int DoTest(CString& sOutMessage)
 //	AfxMessageBox(L"Attach Debugger");
 	(void)SetConsoleCtrlHandler(ConsoleShutdownHandler, TRUE);
 
+	if (dwSignBench != 0)
+		return SignBenchmark(dwSignBench, sOutMessage);
+	if (bCrcBench)
+		return CrcBenchmark();
+	if (dwRetrySimClients != 0)
+		return RetrySimulation(dwRetrySimClients, dwRetrySimCapacity);
+	if (dwThrottleBenchRate != 0)
+		return ThrottleBenchmark(dwThrottleBenchRate, dwThrottleBenchSeconds);
+	if (dwQueueBench != 0)
+		return QueueBenchmark(dwQueueBench);
+	if (dwBufBench != 0)
+		return BufferBenchmark(dwBufBench);
+	if (dwPoolBench != 0)
+		return PoolBenchmark(dwPoolBench);
+	if (dwCopyBench != 0)
+		return CopyBenchmark(dwCopyBench);
+	if (bBreakerTest)
+		return BreakerTest();
+
 	WINHTTP_SECURITY_INFO SecurityInfo;
 	DWORD dwSecurityInfoError;
 	CECSConnection Conn;
@@ -582,6 +1805,8 @@ static int DoTest(CString& sOutMessage)
 	if (!sProxyAddr.IsEmpty() && (wProxyPort != 0))
 		Conn.SetProxy(false, sProxyAddr, wProxyPort, nullptr, nullptr);
 	Conn.SetTimeouts(10, SECONDS(180), SECONDS(180), SECONDS(180), SECONDS(180), 10);
+	if (uHedgePercentile != 0)
+		Conn.SetHedge(true, uHedgePercentile);
 
 	// get the list of buckets
 	if (bCert || bSetCert)
@@ -762,6 +1987,9 @@ static int DoTest(CString& sOutMessage)
 		else
 		{
 			CECSConnection::S3_ERROR Error;
+			S3_MPU_CONCURRENCY Concurrency(bMPUAdaptive);
+			if (bMPUAdaptive)
+				Context.pConcurrency = &Concurrency;
 			_tprintf(L"\nMPU Upload:\n");
 			bool bMPUUpload = DoS3MultiPartUpload(
 				sWriteLocalPath,
@@ -771,15 +1999,22 @@ static int DoTest(CString& sOutMessage)
 				sWriteECSPath,				// path to object in format: /bucket/dir1/dir2/object
 				MEGABYTES(1),				// size of buffer to use
 				10,							// part size (in MB)
-				3,							// maxiumum number of threads to spawn
-				true,						// if set, include content-MD5 header
+				bMPUAdaptive ? 16 : 3,		// maxiumum number of threads to spawn
+				true,						// if set, verify the upload with an MD5 hash calculated as the data is sent
 				&MDList,					// optional metadata to send to object
 				4,							// how big the queue can grow that feeds the upload thread
 				5,							// how many times to retry a part before giving up
 				ProgressCallBack,			// optional progress callback
 				&Context,					// context for UpdateProgressCB
-				Error);						// returned error
+				Error,						// returned error
+				nullptr,					// optional journal file
+				E_CHECKSUM_TYPE::MD5,		// if bChecksum, the hash to use
+				&Concurrency);				// optional adaptive concurrency
 			_tprintf(L"\nMPU Upload: %s, %s\n", bMPUUpload ? L"success" : L"fail", (LPCTSTR)Error.Format(true));
+			if (bMPUAdaptive)
+				_tprintf(L"Parts in flight: final %d, peak %d, increases %u, decreases %u, last throughput %s/sec\n",
+					Concurrency.lConcurrency, Concurrency.lPeak, Concurrency.uIncreases, Concurrency.uDecreases,
+					(LPCTSTR)FmtNum((ULONGLONG)Concurrency.dThroughput, 0, false, false, true));
 			if (!bMPUUpload && !Error.IfError())
 			{
 				_tprintf(L"File too small for MPU upload\n");
@@ -843,6 +2078,34 @@ static int DoTest(CString& sOutMessage)
 			return 1;
 		}
 	}
+	if ((dwLatencyCount != 0) && !sLatencyECSPath.IsEmpty())
+	{
+		// hedging only starts once there are enough samples, so run this long enough to see the tail with and without /hedge
+		std::vector<double> LatencyList;
+		LARGE_INTEGER liFreq, liStart, liEnd;
+		(void)QueryPerformanceFrequency(&liFreq);
+		for (DWORD i = 0; (i < dwLatencyCount) && !bShuttingDown; i++)
+		{
+			CECSConnection::S3_SYSTEM_METADATA Properties;
+			(void)QueryPerformanceCounter(&liStart);
+			CECSConnection::S3_ERROR Error = Conn.ReadProperties(sLatencyECSPath, Properties);
+			(void)QueryPerformanceCounter(&liEnd);
+			if (Error.IfError())
+			{
+				_tprintf(_T("read metadata error: %s\n"), (LPCTSTR)Error.Format());
+				return 1;
+			}
+			LatencyList.push_back((double)(liEnd.QuadPart - liStart.QuadPart) * 1000.0 / (double)liFreq.QuadPart);
+		}
+		if (!LatencyList.empty())
+		{
+			std::sort(LatencyList.begin(), LatencyList.end());
+			_tprintf(_T("Latency for %s (%u requests): p50 %.2f ms, p99 %.2f ms, max %.2f ms\n"), (LPCTSTR)sLatencyECSPath, (UINT)LatencyList.size(),
+				LatencyList[(LatencyList.size() - 1) * 50 / 100], LatencyList[(LatencyList.size() - 1) * 99 / 100], LatencyList.back());
+		}
+	}
+	if ((dwReadParallelThreads != 0) && !sReadParallelECSPath.IsEmpty())
+		return ReadParallelBenchmark(Conn, dwReadParallelThreads, sReadParallelLocalPath, sReadParallelECSPath);
 	if (!sDTQueryNamespace.IsEmpty() && !sDTQueryBucket.IsEmpty() && !sDTQueryObject.IsEmpty())
 	{
 		CECSConnection::DT_QUERY_RESPONSE Response;
@@ -859,5 +2122,15 @@ static int DoTest(CString& sOutMessage)
 	CString sBadIPMap(Conn.DumpBadIPMap());
 	if (!sBadIPMap.IsEmpty())
 		_tprintf(_T("\nBad IP Map:\n%s\n"), (LPCTSTR)sBadIPMap);
+	CString sNodeStats(Conn.DumpNodeStats());
+	if (!sNodeStats.IsEmpty())
+		_tprintf(_T("\nNode Statistics:\n%s\n"), (LPCTSTR)sNodeStats);
+	RETRY_STATS RetryStats;
+	Conn.GetRetryStats(RetryStats);
+	if (RetryStats.GetTotalRetries() != 0ULL)
+		_tprintf(_T("\nRetries: %I64u (network %I64u, timeout %I64u, 503 %I64u, 5xx %I64u), refused by limit: %I64u, refused by budget: %I64u\n"),
+			RetryStats.GetTotalRetries(), RetryStats.ullRetries[(int)E_RETRY_CLASS::Network], RetryStats.ullRetries[(int)E_RETRY_CLASS::Timeout],
+			RetryStats.ullRetries[(int)E_RETRY_CLASS::SlowDown], RetryStats.ullRetries[(int)E_RETRY_CLASS::ServerError],
+			RetryStats.ullRetryLimit, RetryStats.ullBudgetExhausted);
 	return 0;
 }